@@ -1,50 +1,788 @@
+#define _POSIX_C_SOURCE 200809L   //clock_gettime, sysconf, mmap
+#define _DEFAULT_SOURCE           //MAP_ANONYMOUS
+
 #include <stdio.h>    
 #include <stdlib.h>  
 #include <string.h>   
 #include <stdbool.h>   
+#include <stdint.h>
+#include <stddef.h>    //offsetof
+#include <limits.h>
 #include <ctype.h>     //charcater manipulation
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sched.h>
+#include <signal.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/uio.h>
+#include <math.h>     //workload benchmark: Zipf sampling (link with -lm)
+#ifdef __GLIBC__
+#include <malloc.h>   //malloc_trim
+#endif
 
-#define INITIAL_MED_HISTORY_SIZE 1000   
+#define HISTORY_INLINE_SIZE 64          //short histories live inside the history column itself
+#define INITIAL_HISTORY_ENTRIES 4       //offset table slots reserved per new history
+#define SLAB_MIN_BLOCK 16               //smallest slab size class
+#define SLAB_CLASS_COUNT 9              //size classes 16 B .. 4 KB, larger blocks use malloc
+#define SLAB_PAGE_SIZE 65536            //memory carved into blocks of one size class
+#define SLAB_CACHE_BLOCKS 32            //free blocks a thread keeps per size class; half move to or from the slabs at a time
+#define HISTORY_DISPLAY_ENTRIES 10      //most recent entries shown when viewing a patient
 #define MAX_NAME_LENGTH 100             
 #define MAX_DIAGNOSIS_LENGTH 200        
 #define MAX_INPUT_LENGTH 500            
+#define INITIAL_DATABASE_CAPACITY 5     //patient rows allocated for a new database
+#define SHRINK_OCCUPANCY_DIVISOR 4      //columns are halved once fewer than 1/4 of their rows are used
+#define INDEX_MIN_CAPACITY 16           //smallest ID index table (power of two)
+#define INDEX_EMPTY SIZE_MAX            //marks an unused ID index slot
+#define NO_SLOT UINT32_MAX              //slot number of a handle that refers to nobody
+#define NO_STRING UINT32_MAX            //returned by internString when the pool cannot grow
+#define STRING_POOL_MIN_CAPACITY 4096   //initial bytes of the string pool
+#define DEFAULT_DATABASE_FILE "patients.db"  //loaded at startup and saved on exit
+#define PATIENT_FILE_MAGIC "PRSDB\0\0\0"   //first 8 bytes of a database file
+#define PATIENT_FILE_VERSION 2
+#define MAX_MAPPED_FILES 8              //database files that can be open at once
+#define WAL_COMMIT_DELAY_MICROS 2000    //longest a change waits for other changes to share its fsync
+#define WAL_GROUP_BYTES (1 << 20)       //buffered log bytes that trigger a commit without waiting
+#define WAL_CHECKPOINT_BYTES (64 << 20) //log size at which the database is checkpointed
+#define INGEST_FIELD_COUNT 5            //id,name,age,diagnosis,history; each further field is one more history entry
+#define INGEST_REPORTED_ERRORS 10       //rejected lines printed before only counting them
+#define INGEST_READ_CHUNK (1 << 20)     //bytes read at a time when the input is a pipe
+#define SEARCH_TERM_LENGTH 32           //indexed words are cut to one less than this
+#define SEARCH_MAX_QUERY_TERMS 16       //words ANDed together in one part of a query
+#define SEARCH_TOO_MANY_TERMS SIZE_MAX  //returned by searchPatients when a part has more words than that
+#define SEARCH_DISPLAY_RESULTS 20       //matches listed by the search menu option
+#define NO_TERM UINT32_MAX              //word that is not in the search index
+#define MAX_PATIENT_AGE 999
+#define NAME_INDEX_RECENT_LIMIT 1024    //new names kept aside before being merged into the sorted name index
+#define NAME_DISPLAY_RESULTS 20         //matches listed by the name search menu option
+#define AGE_BAND_WIDTH 10               //years per line of the age band report
+#define SERVER_DEFAULT_SHARDS 16        //independently locked parts of the database in server mode
+#define SERVER_DEFAULT_THREADS 8        //requests served at the same time
+#define SERVER_QUEUE_LENGTH 64          //connections waiting in listen() to be accepted
+#define SERVER_MAX_CONNECTIONS 1024     //clients connected at once; more wait to be accepted
+#define SERVER_LINE_LENGTH 2048         //longest request line
+#define SERVER_MAX_FIELDS 6             //tab separated fields of a request
+#define SERVER_POLL_MILLIS 200          //how often idle threads look for a shutdown
+#define SERVER_REPLY_FLUSH (64 << 10)   //reply bytes sent before a long listing continues
+#define SERVER_PAGE_LIMIT 1000          //most patients one PAGE request returns
+#define SNAPSHOT_CHUNK_ROWS 256         //record pointers per copy-on-write page of a shard snapshot
+#define LISTING_PAGE_SIZE 10            //patients per page of the View All menu option
+#define SLOT_BLOCK_SIZE 256             //handle slots per live count kept for page seeks
+#define EXPORT_BUFFER_SIZE (1 << 20)    //formatted export text collected before a write
+#define EXPORT_IOV_COUNT 512            //pieces handed to one writev
+#define EXPORT_COPY_BELOW 64            //shorter text is copied into the buffer instead of getting its own piece
+#define LZ_MIN_MATCH 4                  //shortest match the history codec encodes
+#define LZ_MAX_OFFSET 65535             //farthest back a match can reach (2-byte offsets)
+#define LZ_HASH_BITS 12                 //dictionary match table size
+#define LZ_LOCAL_HASH_BITS 10           //per-history match table size
+#define HISTORY_DICTIONARY_SIZE (16 << 10)   //frequent entries that compressed histories may refer to
+#define HISTORY_DICTIONARY_SAMPLE 4096       //patients read to pick the dictionary entries
+#define HISTORY_DICTIONARY_ENTRIES 32768     //distinct entries counted while picking
+#define LATENCY_SUB_BITS 4              //latency histogram buckets per power of two: 1 << LATENCY_SUB_BITS
+#define LATENCY_BUCKETS ((64 - LATENCY_SUB_BITS + 1) << LATENCY_SUB_BITS)
+#define WORKLOAD_DEFAULT_OPERATIONS 1000000
+#define STATS_TIMING_INTERVAL 64        //hot operations time one call in this many and publish their call count as often
 
 typedef struct {
-    char* details;
+    char* details;          //slab block holding the text, NULL while it fits in inlineText
     size_t capacity;
     size_t length;
+    uint32_t* entryOffsets; //start of each entry within the text (slab block)
+    size_t entryCount;
+    size_t entryCapacity;
+    uint32_t packedLength;  //when not 0, details holds this many bytes of compressed text (length stays the plain size)
+    uint32_t lastUsed;      //historyClock() of the last read or append, for tiering
+    char inlineText[HISTORY_INLINE_SIZE];  //entries back to back, newline separated, NUL terminated
 } MedicalHistory;  //medical_history_structure
 
+typedef struct SlabPage {
+    struct SlabPage* next;
+} SlabPage;  //header of a page carved into equal blocks
+
+typedef struct {
+    void* freeList;          //released blocks, linked through their first bytes
+    char* bump;              //next never-used block in the newest page
+    char* bumpEnd;
+    SlabPage* pages;
+    size_t blocksInUse;
+} SlabClass;  //one size class
+
+typedef struct {
+    SlabClass classes[SLAB_CLASS_COUNT];
+    size_t pageBytes;        //memory held in slab pages
+    _Atomic size_t largeBytes;  //blocks above the largest class, served by malloc
+} SlabAllocator;  //size-class allocator for medical history storage
+
+SlabAllocator historySlabs;  //shared by every MedicalHistory
+
+typedef struct {
+    void* freeList[SLAB_CLASS_COUNT];  //linked through their first bytes, like SlabClass
+    unsigned count[SLAB_CLASS_COUNT];
+    uint64_t generation;     //slabGeneration when the blocks were taken
+} SlabCache;  //one thread's free blocks, used without historySlabLock; the slabs count them as in use
+
+typedef struct {
+    char* text;              //frequent history entries, newline separated
+    size_t length;
+    uint16_t table[1 << LZ_HASH_BITS];  //last dictionary position + 1 for each 4-byte hash
+} HistoryDictionary;  //shared context for compressed histories; built once and never changed
+
+typedef struct {
+    const char* text;
+    uint32_t length;
+    uint32_t count;
+} DictionaryCandidate;  //a history entry and how often it was seen
+
+typedef struct {
+    size_t compressions;
+    size_t incompressible;   //cold histories left alone because they would not shrink a size class
+    size_t decompressions;
+    uint64_t decompressNanos;
+    uint64_t maxDecompressNanos;
+} HistoryTieringStats;
+
+typedef enum {
+    WORKLOAD_FIND,
+    WORKLOAD_APPEND,
+    WORKLOAD_ADD,
+    WORKLOAD_REMOVE,
+    WORKLOAD_OP_COUNT
+} WorkloadOp;  //operations the workload benchmark mixes
+
+typedef struct {
+    uint64_t counts[LATENCY_BUCKETS];
+    uint64_t samples;
+    uint64_t totalNanos;
+    uint64_t maxNanos;
+} LatencyHistogram;  //log-linear, so any percentile is read back within 1/16 of its value
+
+typedef struct {
+    double exponent;         //0 picks uniformly
+    size_t n;
+    double hIntegralX1;
+    double hIntegralN;
+    double threshold;
+} ZipfGenerator;  //ranks 0..n-1, rank 0 the most frequent; rejection-inversion sampling, O(1) per pick
+
+typedef struct {
+    size_t patients;
+    size_t operations;
+    unsigned mix[WORKLOAD_OP_COUNT];  //percent of the operations of each kind
+    double zipfExponent;
+    size_t historyEntries;   //entries preloaded into each history
+    size_t entryBytes;       //length of each history entry
+    uint64_t seed;
+} WorkloadConfig;  //synthetic workload for --bench-workload
+
+typedef enum {
+    STAT_ADD,
+    STAT_FIND,
+    STAT_APPEND,
+    STAT_REMOVE,
+    STAT_SEARCH,
+    STAT_NAME_QUERY,
+    STAT_SAVE,
+    STAT_OPERATION_COUNT
+} StatOperation;  //operations with a call count and a latency histogram
+
+typedef enum {
+    STAT_HISTORY_MOVES,       //history text copied into a larger block
+    STAT_HISTORY_BYTES_MOVED,
+    STAT_OFFSET_MOVES,        //entry offset tables copied into a larger block
+    STAT_OFFSET_BYTES_MOVED,
+    STAT_COLUMN_RESIZES,      //patient column reallocations, growing or shrinking
+    STAT_COLUMN_BYTES_MOVED,  //at most; realloc may resize in place
+    STAT_INDEX_REBUILDS,
+    STAT_INDEX_ENTRIES_MOVED,
+    STAT_ROWS_MOVED,          //last row moved into the row of a removed patient
+    STAT_COUNTER_COUNT
+} StatCounter;
+
+typedef struct {
+    _Atomic uint64_t calls;
+    _Atomic uint64_t timed;
+    _Atomic uint64_t timedNanos;
+    _Atomic uint64_t maxNanos;
+    _Atomic uint64_t buckets[LATENCY_BUCKETS];  //timed calls, bucketed like LatencyHistogram
+} OperationStats;
+
+typedef struct PatientStats {
+    OperationStats operations[STAT_OPERATION_COUNT];
+    _Atomic uint64_t counters[STAT_COUNTER_COUNT];
+    struct PatientStats* next;
+} PatientStats;  //counters of one thread; only that thread writes them, so updates need no locked instruction
+
+typedef struct {
+    uint64_t calls[STAT_OPERATION_COUNT];
+    LatencyHistogram latencies[STAT_OPERATION_COUNT];  //timed calls only
+    uint64_t counters[STAT_COUNTER_COUNT];
+} StatsSummary;  //every thread's counters added up
+
+unsigned historyColdSeconds;  //histories idle this long are compressed; 0 turns tiering off
+HistoryDictionary historyDictionary;
+HistoryTieringStats tieringStats;
+char* packBuffer;             //compressor output before it is copied into a right-sized block
+size_t packBufferCapacity;
+_Thread_local char* peekBuffer;  //decompressed text for peekPatientHistory
+_Thread_local size_t peekBufferCapacity;
+pthread_mutex_t historySlabLock = PTHREAD_MUTEX_INITIALIZER;  //guards historySlabs; threads take it only to refill or drain their cache
+_Thread_local SlabCache slabCache;  //this thread's blocks, so appends in different shards do not queue on the lock
+_Atomic uint64_t slabGeneration = 1;  //advanced by releaseHistorySlabs, which frees the pages cached blocks point into
+PatientStats fallbackStats;  //shared by threads that could not allocate their own counters
+PatientStats* statsThreads = &fallbackStats;  //every thread's counters, newest first
+pthread_mutex_t statsLock = PTHREAD_MUTEX_INITIALIZER;  //guards statsThreads
+_Thread_local PatientStats* threadStats;  //this thread's entry in statsThreads
+_Thread_local uint32_t pendingCalls[STAT_OPERATION_COUNT];  //calls not yet added to threadStats
+const char* const statOperationNames[STAT_OPERATION_COUNT] = { "add", "find", "append", "remove", "search", "name", "save" };
+const char* const statCounterNames[STAT_COUNTER_COUNT] = {
+    "history_moves", "history_bytes_moved", "offset_moves", "offset_bytes_moved",
+    "column_resizes", "column_bytes_moved", "index_rebuilds", "index_entries_moved", "rows_moved",
+};
+
 typedef struct {
     int id;
-    char name[MAX_NAME_LENGTH];
+    const char* name;
     int age;
-    char diagnosis[MAX_DIAGNOSIS_LENGTH];
-    MedicalHistory medicalHistory;
-} Patient;  //patientstructure
+    const char* diagnosis;
+    const MedicalHistory* medicalHistory;
+} Patient;  //patientstructure: a view of one row assembled from the database columns
+
+typedef struct {
+    char* data;              //NUL-terminated strings back to back; offset 0 is ""
+    size_t length;
+    size_t capacity;
+    uint32_t* table;         //open-addressing set of string offsets, 0 marks an empty slot
+    size_t tableCapacity;    //always a power of two
+    size_t count;
+} StringPool;  //interned, variable length storage for names and diagnoses
+
+typedef struct {
+    int id;
+    size_t row;       //row in the database columns, INDEX_EMPTY when unused
+} IndexEntry;  //one slot of the ID index
+
+typedef struct {
+    uint32_t slot;
+    uint32_t generation;
+} PatientHandle;  //stable reference to a patient; goes stale when the patient is removed
+
+typedef struct {
+    size_t row;              //row in the database columns, or next free slot when unused
+    uint32_t generation;     //bumped every time the slot is released
+} PatientSlot;  //handle -> row indirection
+
+enum {
+    SECTION_IDS,
+    SECTION_AGES,
+    SECTION_NAME_REFS,
+    SECTION_DIAGNOSIS_REFS,
+    SECTION_ROW_SLOTS,
+    SECTION_SLOTS,
+    SECTION_INDEX,
+    SECTION_STRINGS,
+    SECTION_STRING_TABLE,
+    SECTION_HISTORIES,
+    SECTION_HISTORY_TEXT,
+    SECTION_HISTORY_OFFSETS,
+    SECTION_COUNT
+};  //sections of a database file, in file order
+
+typedef struct {
+    uint64_t offset;         //from the start of the file, 8-byte aligned
+    uint64_t bytes;
+} FileSection;
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t headerSize;
+    uint64_t count;
+    uint64_t slotCount;
+    uint64_t freeSlot;
+    uint64_t indexCapacity;
+    uint64_t stringCount;
+    uint64_t appliedLsn;     //last write-ahead log record included in this file
+    FileSection sections[SECTION_COUNT];
+} PatientFileHeader;  //start of a database file; all values in native byte order
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t headerSize;
+    uint64_t count;
+    uint64_t slotCount;
+    uint64_t freeSlot;
+    uint64_t indexCapacity;
+    uint64_t stringCount;
+    FileSection sections[SECTION_COUNT];
+} PatientFileHeaderV1;  //version 1 files, written before the write-ahead log; the sections are laid out the same
+
+typedef struct {
+    uint64_t textOffset;     //into the history text section, text is NUL terminated
+    uint64_t offsetsOffset;  //into the history offsets section
+    uint32_t length;
+    uint32_t entryCount;
+} HistoryRecord;  //where one row's medical history lives in the file
+
+typedef struct {
+    char* base;              //start of the mapping, NULL when the database lives only in memory
+    size_t size;
+    const HistoryRecord* histories;
+    size_t rows;             //rows the file was saved with
+    const char* text;
+    size_t textBytes;
+    const char* offsets;
+    size_t offsetsBytes;
+    char* views;             //anonymous mapping that holds the history column until it is reallocated
+    size_t viewsSize;
+} PatientFile;  //mapped database file the columns may still point into
+
+enum {
+    WAL_ADD_PATIENT = 1,
+    WAL_APPEND_HISTORY = 2,
+    WAL_REMOVE_PATIENT = 3
+};  //mutations recorded in the write-ahead log
+
+typedef struct {
+    uint32_t size;           //payload bytes following the header
+    uint32_t crc;            //CRC-32 of lsn and payload, detects torn writes
+    uint64_t lsn;            //log sequence number, keeps increasing across checkpoints
+} WalRecordHeader;
+
+typedef struct {
+    int fd;
+    char path[4096];         //kept so a checkpoint can replace the file
+    char* buffer;            //records waiting for the next group commit
+    size_t length;
+    size_t capacity;
+    char* spare;             //batch currently being written by the flusher
+    size_t spareCapacity;
+    uint64_t nextLsn;
+    uint64_t durableLsn;     //every record up to this one is on disk
+    uint64_t batchStart;     //when the oldest buffered record arrived (ns)
+    uint64_t commitDelay;    //latency bound of a group commit (ns)
+    size_t fileBytes;
+    size_t inFlight;         //bytes of the batch the flusher is writing outside the lock, 0 when idle
+    size_t commits;          //fsyncs issued
+    size_t records;
+    bool flushNow;
+    bool stopping;
+    bool failed;
+    bool running;
+    pthread_mutex_t lock;
+    pthread_cond_t work;     //records arrived or a flush was requested
+    pthread_cond_t done;     //a group commit finished
+    pthread_t flusher;
+} WriteAheadLog;  //append-only log of patient mutations, fsync'ed in groups
+
+typedef struct {
+    uint32_t slot;           //handle slot of the patient
+    uint32_t generation;     //stale once the slot's generation moves on
+    uint32_t entry;          //0 = diagnosis, n = medical history entry n - 1
+} Posting;
+
+typedef struct {
+    char text[SEARCH_TERM_LENGTH];
+    Posting* postings;
+    uint32_t count;
+    uint32_t capacity;
+    uint32_t sorted;         //postings before this are ordered by slot, the rest were appended since
+} SearchTerm;  //one word and every patient it occurs in
+
+typedef struct {
+    SearchTerm* terms;
+    size_t termCount;
+    size_t termCapacity;
+    uint32_t* table;         //term number + 1 by word hash, 0 = empty
+    size_t tableCapacity;    //always a power of two
+    size_t removals;         //patients erased since stale postings were last swept
+    bool built;              //built by the first search, then kept up to date
+} SearchIndex;  //inverted index over diagnoses and medical histories
+
+typedef struct {
+    uint32_t nameRef;
+    PatientHandle patient;
+} NameEntry;
+
+typedef struct {
+    NameEntry* entries;      //ordered by name, ignoring case
+    size_t count;
+    size_t capacity;
+    NameEntry* recent;       //ordered by name too; merged into entries when full
+    size_t recentCount;
+    size_t stale;            //entries of removed patients still in the arrays
+    bool built;              //built by the first name query, then kept up to date
+} NameIndex;  //name prefix lookups without scanning the name column
+
+typedef struct {
+    PatientHandle* patients; //in admission order, may include removed patients
+    uint32_t count;
+    uint32_t capacity;
+    uint32_t live;           //patients of this age still in the database
+} AgeBucket;
+
+typedef struct {
+    AgeBucket* buckets;      //one per age, 0 .. MAX_PATIENT_AGE
+    bool built;              //built by the first age query, then kept up to date
+} AgeIndex;
+
+typedef struct {
+    uint32_t* live;          //live patients in each run of SLOT_BLOCK_SIZE handle slots
+    size_t blocks;
+    bool built;              //built by the first page seek, then kept up to date
+} SlotCounts;  //lets a listing jump to page N without visiting every slot before it
 
 typedef struct {
-    Patient* patients;
+    int* ids;                //hot columns: scans over IDs and ages touch only these
+    int* ages;
+    uint32_t* nameRefs;      //cold columns: offsets into strings
+    uint32_t* diagnosisRefs;
+    MedicalHistory* histories;
+    StringPool strings;
     size_t count;
     size_t capacity;
+    IndexEntry* index;       //open-addressing ID -> row table
+    size_t indexCapacity;    //always a power of two
+    PatientSlot* slots;      //handle slots, survive moves of the patient rows
+    uint32_t* rowSlots;      //slot owning each row, parallel to the columns
+    size_t slotCount;
+    size_t slotCapacity;
+    size_t freeSlot;         //head of the free slot list, INDEX_EMPTY when empty
+    PatientFile file;        //on-disk copy the database was opened from
+    WriteAheadLog* wal;      //mutations are logged here when not NULL
+    uint64_t appliedLsn;     //last logged mutation reflected in the columns
+    SearchIndex search;      //word -> patients, not stored in the file
+    NameIndex names;         //secondary indexes, also rebuilt on demand
+    AgeIndex byAge;
+    SlotCounts slotCounts;
 } PatientDatabase;  //patientdatabase
 
+typedef struct {
+    const char* base;
+    size_t size;
+} MappedRange;
+
+MappedRange mappedFiles[MAX_MAPPED_FILES];  //blocks inside these ranges belong to a mapping, not malloc
+_Thread_local const StringPool* nameSortPool;  //pool the name index comparator reads names from (qsort has no context argument)
+
+typedef struct {
+    const char* start;      //points into the input buffer, not NUL terminated
+    size_t length;
+    bool escaped;           //quoted field containing "" pairs that still have to be collapsed
+} CsvField;  //one field of an ingest line
+
+typedef struct {
+    int id;
+    int age;
+    size_t diagnosis;        //offsets into text; the name starts at 0
+    size_t history;          //entries newline separated, as in MedicalHistory
+    size_t historyLength;
+    size_t entryCount;
+    char text[];             //name, diagnosis and history, each NUL terminated
+} SnapshotRecord;  //one published version of a patient, never changed once a listing can see it
+
+typedef struct {
+    const SnapshotRecord* rows[SNAPSHOT_CHUNK_ROWS];
+} SnapshotChunk;  //page of record pointers; a change copies the page it touches
+
+typedef struct {
+    size_t count;
+    size_t chunkCount;
+    SnapshotChunk* chunks[]; //row r of the shard is chunks[r / SNAPSHOT_CHUNK_ROWS]->rows[r % SNAPSHOT_CHUNK_ROWS]
+} ShardSnapshot;  //one shard's published rows, in the shard's row order
+
+typedef struct {
+    size_t count;            //patients in all shards
+    ShardSnapshot* shards[]; //NULL until a listing first asks for that shard
+} PatientSnapshot;  //root a listing reads everything from; replaced whole by every publish
+
+typedef struct RetiredBlocks {
+    uint64_t epoch;          //epoch in which the blocks were unlinked
+    struct RetiredBlocks* next;
+    size_t count;
+    void* blocks[];
+} RetiredBlocks;  //records, chunks and roots replaced by one publish, freed once no listing can see them
+
+typedef struct {
+    PatientDatabase db;      //patients whose ID hashes to this shard, with their own indexes and strings
+    pthread_rwlock_t lock;   //readers share it; adds, removes and resizes only block this shard
+    pthread_mutex_t indexLock;  //searches hold it with the read lock, since they build and sweep the search index
+    ShardSnapshot* published;  //this shard's part of the latest root, NULL until a listing asks for it
+    bool stale;                //a change could not be published, so the shard is copied again by the next listing
+} PatientShard;  //published and stale change under the write lock, or under the read lock plus snapshotLock
+
+typedef struct {
+    int fd;
+    char buffer[SERVER_LINE_LENGTH];  //a request whose newline has not arrived yet
+    size_t length;
+    bool busy;               //queued for or held by a worker, so the poller leaves it alone
+    bool closed;             //hung up, sent QUIT or failed; the poller closes it
+} ServerConnection;  //one client; a worker takes it for one batch of requests at a time
+
+typedef struct {
+    PatientShard* shards;
+    size_t shardCount;
+    WriteAheadLog* wal;      //one log shared by all shards, so group commit spans them
+    const char* path;        //snapshot written by checkpoints
+    int listenFd;
+    int wakeFds[2];          //a byte here makes the polling worker look at its connections again
+    ServerConnection* connections[SERVER_MAX_CONNECTIONS];  //every open connection; only the polling worker changes the list
+    size_t connectionCount;
+    ServerConnection* ready[SERVER_MAX_CONNECTIONS];  //connections with input, waiting for a worker
+    size_t readyHead;
+    size_t readyCount;
+    bool polling;            //one worker at a time polls for the others
+    bool stopping;
+    pthread_mutex_t queueLock;            //guards the ready queue, polling, stopping, and busy and closed of every connection
+    pthread_cond_t queueReady;
+    pthread_mutex_t checkpointLock;
+    pthread_cond_t checkpointReady;       //a write found the log past WAL_CHECKPOINT_BYTES
+    bool checkpointWanted;
+    bool checkpointStop;
+    bool checkpointerRunning;
+    pthread_t checkpointer;
+    pthread_t* workers;
+    size_t workerCount;
+    size_t readerCount;                   //workers plus the checkpointer
+    _Atomic uint64_t epoch;               //advanced whenever snapshot blocks are retired
+    _Atomic uint64_t* readerEpochs;       //epoch each listing or checkpoint started in, 0 for none
+    pthread_mutex_t snapshotLock;         //one thread copies whole shards into the snapshot at a time
+    pthread_mutex_t rootLock;             //orders publishes of the root and guards the retired queue
+    PatientSnapshot* _Atomic snapshot;    //latest published root
+    RetiredBlocks* retiredHead;           //oldest first; freed from the head as listings finish
+    RetiredBlocks* retiredTail;
+} PatientServer;  //patient database served over a Unix domain socket
+
+typedef struct {
+    char* data;
+    size_t length;
+    size_t capacity;
+} ServerReply;  //replies buffered until a connection's pending requests are done
+
+typedef enum {
+    EXPORT_CSV,
+    EXPORT_JSON
+} ExportFormat;
+
+typedef struct {
+    int minAge;
+    int maxAge;
+    const char* namePrefix;  //NULL or empty for every name
+} ExportFilter;
+
+typedef struct {
+    int fd;
+    char* buffer;            //formatted and escaped text, reused after every flush
+    size_t used;
+    struct iovec pieces[EXPORT_IOV_COUNT];  //buffer ranges and long fields referenced in place
+    int pieceCount;
+    bool copyText;           //text passed by reference must be copied anyway (it will not stay put)
+    bool failed;
+} ExportWriter;  //gathers an export into few large writev calls
+
+volatile sig_atomic_t serverSignalled;  //set by SIGINT/SIGTERM in server mode
+
 //functions
 void initMedicalHistory(MedicalHistory* history);  //prepares memory to store medical history for a new patient
 bool expandMedicalHistory(MedicalHistory* history, size_t requiredLength);  //expand memory allocation when history becomes too large
 bool addToMedicalHistory(MedicalHistory* history, const char* entry);  //appends new history to a patients history
+bool addMedicalHistoryEntry(MedicalHistory* history, const char* entry, size_t entryLength);  //same, for an entry that is not NUL terminated
 void freeMedicalHistory(MedicalHistory* history);   //release memory used by medical history(clean up space when a patient is removed)
+const char* getMedicalHistoryText(const MedicalHistory* history);  //the whole history, wherever it is stored
+const char* getMedicalHistoryEntry(const MedicalHistory* history, size_t index, size_t* length);  //one entry by position, without scanning
+void displayRecentHistory(const MedicalHistory* history, size_t lastEntries);  //prints only the newest entries
+uint32_t historyClock(void);
+size_t lzCompress(const HistoryDictionary* dict, const char* src, size_t length, char* dst, size_t capacity);  //LZ77 block, 0 if it does not fit
+bool lzDecompress(const HistoryDictionary* dict, const char* src, size_t packedLength, char* dst, size_t length);
+bool packMedicalHistory(MedicalHistory* history);  //compresses the text in place
+bool unpackMedicalHistory(MedicalHistory* history);  //restores plain text
+void* slabAlloc(size_t size, size_t* blockSize);  //block of at least size bytes; blockSize receives its real size
+void slabFree(void* block, size_t blockSize);  //returns a block obtained from slabAlloc
+SlabCache* currentSlabCache(void);  //this thread's cache, emptied if the slabs were released since it was filled
+void* takeSlabBlock(int c);  //block of class c from the shared slabs; caller holds historySlabLock
+void giveSlabBlocks(SlabCache* cache, int c, unsigned count);  //moves cached blocks back to the slabs; caller holds historySlabLock
+void flushSlabCache(void);  //gives every block this thread has cached back to the slabs
+void releaseHistorySlabs(void);  //gives every slab page back to the system
+void releaseHistoryBlock(void* block, size_t blockSize);  //slabFree for history storage that may live in a mapped file
+PatientStats* localStats(void);  //this thread's counters
+PatientStats* registerThreadStats(void);
+void addStat(StatCounter counter, uint64_t amount);
+void measureIndexProbes(const PatientDatabase* db, double* hitProbes, double* missProbes, size_t* longest);  //scan lengths of the ID index
+uint64_t beginOperation(StatOperation op);  //counts a call; start time if it is one of the timed ones, else 0
+uint64_t startTimedCall(StatOperation op);  //publishes the batched calls and reads the clock
+void endOperation(StatOperation op, uint64_t start);
+void publishPendingCalls(void);  //adds this thread's batched call counts to its counters
+void collectPatientStats(StatsSummary* summary);  //adds up every thread's counters
+void releasePatientStats(void);  //frees the per-thread counters once the other threads are gone
+size_t trimHistorySlabs(void);  //frees slab pages with no block in use, returns the bytes released
+void detachSlabFreeLists(void* detached[SLAB_CLASS_COUNT]);  //makes new blocks come from fresh pages
+void reattachSlabFreeLists(void* detached[SLAB_CLASS_COUNT]);
+void initStringPool(StringPool* pool);
+uint32_t internString(StringPool* pool, const char* text, size_t length);  //offset of an equal string, adding it if new
+const char* poolString(const StringPool* pool, uint32_t ref);
+void freeStringPool(StringPool* pool);
+bool inMappedFile(const void* block);  //true for memory that belongs to an open database file
+void* resizeBlock(void* block, size_t oldSize, size_t newSize);  //realloc that also copies blocks out of a mapped file
+void releaseBlock(void* block);  //free that leaves mapped blocks alone
 void initPatientDatabase(PatientDatabase* db, size_t initialCapacity); //initializes an empty patient database(prepares memory to store patients)
+bool validatePatientFile(const PatientFileHeader* header, void* const sections[SECTION_COUNT]);  //header limits only; stored references are checked when followed
+bool openPatientDatabase(PatientDatabase* db, const char* path);  //maps a saved database; records are read lazily from the file
+bool savePatientDatabase(PatientDatabase* db, const char* path);  //writes the database to a new file and swaps it in atomically
+bool syncParentDirectory(const char* path);  //makes a rename of path durable
+void closePatientFile(PatientFile* file);  //unmaps a database file
+bool openWriteAheadLog(WriteAheadLog* wal, const char* path, unsigned commitDelayMicros);
+bool walLogRecord(WriteAheadLog* wal, int type, int id, int age, const char* const texts[], const size_t lengths[], int textCount, uint64_t* lsn);  //buffers a record and sets lsn to its LSN; false leaves lsn alone
+bool walWaitDurable(WriteAheadLog* wal, uint64_t lsn);  //blocks until the record's group commit is on disk
+bool walSync(WriteAheadLog* wal);  //commits everything buffered right away
+bool walTruncate(WriteAheadLog* wal);  //empties the log after a checkpoint
+size_t walLogBytes(WriteAheadLog* wal);  //log size including records not yet written
+uint64_t walPosition(WriteAheadLog* wal, size_t* offset);  //last LSN logged and where the next record goes
+bool copyFileBytes(int in, int out, size_t from, size_t to);
+bool walDropPrefix(WriteAheadLog* wal, size_t offset);  //keeps only the records from offset on
+void closeWriteAheadLog(WriteAheadLog* wal);
+bool replayWriteAheadLog(PatientDatabase* db, WriteAheadLog* wal, size_t* applied);  //re-applies records newer than the snapshot
+bool commitPatientChanges(PatientDatabase* db);  //waits until the latest change is durable
+bool checkpointPatientDatabase(PatientDatabase* db, const char* path);  //saves a snapshot and truncates the log
+bool openPatientStore(PatientDatabase* db, WriteAheadLog* wal, const char* path, unsigned commitDelayMicros);  //snapshot + log recovery
+bool closePatientStore(PatientDatabase* db, const char* path);  //final checkpoint, then frees everything
+MedicalHistory* resolvePatientHistory(const PatientDatabase* db, size_t row);  //history of a row, pointed at the file on first use
+MedicalHistory* patientHistory(const PatientDatabase* db, size_t row);  //same, decompressed and marked as used
+const MedicalHistory* peekPatientHistory(const PatientDatabase* db, size_t row, MedicalHistory* scratch);  //readable without warming it
+bool trainHistoryDictionary(const PatientDatabase* db);
+size_t compressColdHistories(PatientDatabase* db);  //compresses histories idle for historyColdSeconds
+void displayHistoryTiering(const PatientDatabase* db);
+bool reservePatientDatabase(PatientDatabase* db, size_t capacity);  //grows every column, the handle slots and the ID index to hold at least capacity patients
+bool initPatientIndex(PatientDatabase* db, size_t capacity);  //(re)builds the ID index with room for at least capacity slots
+size_t lookupPatientRow(const PatientDatabase* db, int id);  //row of the patient with this ID, INDEX_EMPTY if none
+bool indexPatient(PatientDatabase* db, int id, size_t row);  //adds or moves an ID in the index, growing the table if needed
+void unindexPatient(PatientDatabase* db, int id);  //drops an ID from the index
 bool addPatient(PatientDatabase* db); 
-Patient* findPatient(PatientDatabase* db, int id); 
+bool insertPatient(PatientDatabase* db, int id, const char* name, int age, const char* diagnosis, const char* historyEntry);  //non-interactive core of addPatient
+bool insertPatientFields(PatientDatabase* db, int id, const char* name, size_t nameLength, int age,
+                         const char* diagnosis, size_t diagnosisLength, const char* historyEntry, size_t historyLength);  //insertPatient for text that is not NUL terminated
+PatientHandle findPatient(PatientDatabase* db, int id);  //handle of the patient with this ID, NO_SLOT handle if none
+PatientHandle timeFindPatient(PatientDatabase* db, int id);  //findPatient for the one call in STATS_TIMING_INTERVAL that is timed
+PatientHandle rowHandle(const PatientDatabase* db, size_t row);  //handle of a row, NO_SLOT handle if its slot reference is out of range
+size_t getPatientRow(const PatientDatabase* db, PatientHandle handle);  //current row of a patient, INDEX_EMPTY if the handle is stale
+bool getPatient(const PatientDatabase* db, PatientHandle handle, Patient* out);  //fills a view of the patient, false if the handle is stale
+void loadPatientRow(const PatientDatabase* db, size_t row, Patient* out);
+bool appendPatientHistory(PatientDatabase* db, PatientHandle handle, const char* entry);  //adds an entry to a patient's medical history
+size_t countPatientsByAge(PatientDatabase* db, int minAge, int maxAge);  //sums the age buckets
+size_t findPatientsByAge(PatientDatabase* db, int minAge, int maxAge, PatientHandle* results, size_t maxResults);  //youngest first
+size_t findPatientsByNamePrefix(PatientDatabase* db, const char* prefix, PatientHandle* results, size_t maxResults);  //alphabetical, ignoring case
+bool buildNameIndex(PatientDatabase* db);
+bool addNameEntry(PatientDatabase* db, size_t row);  //keeps a built name index current
+bool addAgeEntry(PatientDatabase* db, size_t row);  //keeps a built age index current
+bool buildAgeIndex(PatientDatabase* db);
+void freeNameIndex(NameIndex* index);
+void freeAgeIndex(AgeIndex* index);
+void findPatientsByName(PatientDatabase* db);
+void displayAgeBands(PatientDatabase* db);
+bool nextSearchWord(const char** p, const char* end, char* word, size_t* length);  //next lowercase word of a text
+uint32_t findSearchTerm(SearchIndex* index, const char* word, size_t length, bool create);  //term number of a word, NO_TERM if absent
+bool indexSearchText(PatientDatabase* db, size_t row, uint32_t entry, const char* text, size_t length);  //adds postings for every word of a text
+bool indexPatientRecord(PatientDatabase* db, size_t row);  //adds a patient's diagnosis and history to the search index
+bool buildSearchIndex(PatientDatabase* db);
+void freeSearchIndex(SearchIndex* index);
+size_t searchPatients(PatientDatabase* db, const char* query, PatientHandle* results, size_t maxResults);  //words are ANDed, OR separates alternatives; returns the match count or SEARCH_TOO_MANY_TERMS
+void searchRecords(PatientDatabase* db);
 bool updateMedicalHistory(PatientDatabase* db);  
 bool removePatient(PatientDatabase* db, int id); 
-void displayAllPatients(const PatientDatabase* db);
+bool erasePatient(PatientDatabase* db, int id);  //non-interactive core of removePatient
+bool shrinkPatientDatabase(PatientDatabase* db, size_t capacity);  //reallocates the columns and ID index down to capacity rows
+void maybeShrinkPatientDatabase(PatientDatabase* db);  //halves the columns once occupancy is below a quarter
+size_t moveMedicalHistory(MedicalHistory* history, void* retired[2], size_t retiredSizes[2]);  //copies a history into right-sized blocks
+bool rebuildStringPool(PatientDatabase* db);  //drops strings no patient refers to any more
+void compactPatientDatabase(PatientDatabase* db);  //shrinks everything to fit the current patients
+void compactStorage(PatientDatabase* db);  //menu option: compacts and reports resident memory
+void displayAllPatients(PatientDatabase* db);  //one page at a time
+void displayPatientStats(const PatientDatabase* db);  //menu option: runtime statistics
+size_t listPatientPage(const PatientDatabase* db, size_t* cursor, PatientHandle* results, size_t pageSize);  //next patients in handle order; *cursor starts at 0
+size_t seekPatientPage(PatientDatabase* db, size_t page, size_t pageSize);  //cursor of page N, found without formatting anything
+bool buildSlotCounts(PatientDatabase* db);
+void countSlot(PatientDatabase* db, size_t slot, bool live);  //follows a slot being taken or released
+void freeSlotCounts(SlotCounts* counts);
 void displayPatient(const Patient* p);  
 void freePatientDatabase(PatientDatabase* db); //prevent memory leaks
+bool readIngestInput(const char* path, const char** data, size_t* size, bool* mapped);  //maps a file, or reads a pipe such as stdin ("-") into memory
+const char* nextCsvRecord(const char* p, const char* end, CsvField fields[], int maxFields, int* fieldCount);  //splits one line into fields, returns the next line
+bool parseIntField(const CsvField* field, int* value);
+const char* csvFieldText(const CsvField* field, char* scratch, size_t scratchSize, size_t* length);  //field text, unescaped into scratch only when needed
+bool ingestPatients(PatientDatabase* db, const char* path, size_t* added, size_t* rejected);  //loads id,name,age,diagnosis[,history] lines without prompts
+const char* checkPatientFields(int age, size_t nameLength, size_t diagnosisLength, size_t historyLength);  //why a record would be refused, NULL if it is fine
+bool writeFully(int fd, const char* data, size_t length);
+bool writevFully(int fd, struct iovec* pieces, int count);  //writev until every piece is written
+void initExportWriter(ExportWriter* writer, int fd);
+bool flushExportWriter(ExportWriter* writer);
+void freeExportWriter(ExportWriter* writer);
+void exportCopy(ExportWriter* writer, const char* data, size_t length);  //bytes copied into the buffer
+void exportReference(ExportWriter* writer, const char* data, size_t length);  //bytes written from where they are
+bool exportPatients(const PatientDatabase* db, int fd, ExportFormat format, const ExportFilter* filter, size_t* exported);  //CSV or JSON, optionally filtered
+int openExportFile(const char* path);  //"-" for standard output
+void exportRecords(PatientDatabase* db);
+size_t shardFor(const PatientServer* server, int id);  //shard owning a patient ID
+bool copyPatientRow(PatientDatabase* to, PatientDatabase* from, size_t row);  //copies a patient and its history without logging
+bool mergePatientShards(PatientServer* server, PatientDatabase* merged);  //one database holding every shard's patients
+bool checkpointPatientServer(PatientServer* server);  //saves the published snapshot, then drops the log records it holds
+void requestServerCheckpoint(PatientServer* server);
+void* serverCheckpointer(void* arg);
+bool copySnapshotPatients(PatientDatabase* to, const PatientSnapshot* root, size_t shardCount);  //a database holding every published patient
+SnapshotRecord* copySnapshotRecord(const PatientDatabase* db, size_t row);  //read-only copy of one patient
+ShardSnapshot* copyShardSnapshot(const PatientDatabase* db);  //read-only copy of a shard's patients
+void freeShardSnapshot(ShardSnapshot* snapshot);  //with its chunks and records; only for copies no listing can see
+size_t enterSnapshotEpoch(PatientServer* server);  //protects snapshots from reclamation until leaveSnapshotEpoch
+void leaveSnapshotEpoch(PatientServer* server, size_t reader);
+void retireSnapshotBlocks(PatientServer* server, RetiredBlocks* batch);  //frees them once no listing can still see them
+void publishShardSnapshot(PatientServer* server, size_t shard, ShardSnapshot* fresh, PatientSnapshot* root, RetiredBlocks* batch);  //swaps in a new root
+PatientSnapshot* allocPatientSnapshot(const PatientServer* server);  //root with every shard NULL
+RetiredBlocks* allocRetiredBlocks(size_t count);  //empty batch with room for count blocks
+void publishPatientRow(PatientServer* server, size_t shard, size_t row);  //after an add or history update, under the shard's write lock
+void publishPatientRemoval(PatientServer* server, size_t shard, size_t row);  //after the last row moved into row
+bool refreshPatientSnapshot(PatientServer* server);  //copies shards that were never published or went stale
+bool listPatients(PatientServer* server, ServerReply* reply, int fd);  //streams every patient from a snapshot
+void handleRequest(PatientServer* server, char* line, ServerReply* reply, int fd);  //runs one protocol request
+void replyPatientStats(ServerReply* reply);  //STATS: every thread's counters added up
+bool serveConnection(PatientServer* server, ServerConnection* connection, ServerReply* reply);  //false once the connection should close
+void pollServerConnections(PatientServer* server, struct pollfd polled[], ServerConnection* waiting[]);  //queues connections with input
+void* serverWorker(void* arg);
+bool startPatientServer(PatientServer* server, PatientDatabase* db, const char* dbPath, const char* socketPath,
+                        size_t shardCount, size_t workerCount);  //splits db into shards and starts the workers; db is emptied
+void waitPatientServer(PatientServer* server);  //returns on SIGINT/SIGTERM or once the server is stopping
+bool stopPatientServer(PatientServer* server, PatientDatabase* db, const char* socketPath);  //joins the threads and merges the shards back into db
+int runPatientServer(PatientDatabase* db, const char* dbPath, const char* socketPath, size_t shardCount, size_t workerCount);
 void flushInputBuffer();
 int getIntInput(const char* prompt);
 void getStringInput(const char* prompt, char* buffer, size_t maxLength);
+uint64_t nowNanoseconds(void);
+void startBenchmarkThread(pthread_t* thread, void* (*run)(void*), void* arg);  //exits when the thread cannot be created
+size_t residentBytes(void);  //resident set size of this process, 0 when unavailable
+int runLookupBenchmark(void);  //times findPatient and erasePatient at growing database sizes
+int runMemoryBenchmark(size_t patients);  //resident memory per patient for a synthetic census
+int runStoreBenchmark(size_t patients, const char* path);  //save and reopen time for a synthetic census
+int runWalBenchmark(size_t operations, const char* path);  //durable operations per second with concurrent writers
+int runSearchBenchmark(size_t patients);  //search, name prefix and age query latency over a synthetic census
+int runServerBenchmark(size_t patients, const char* socketPath);  //socket requests per second by worker and shard count
+int runSnapshotBenchmark(size_t patients, const char* socketPath);  //admission latency while full listings run
+int runTieringBenchmark(size_t patients);  //memory saved by history compression and cold read latency
+size_t historyBytesInUse(void);  //bytes of slab blocks and large blocks handed out to histories
+int runShrinkBenchmark(size_t patients);  //resident memory after discharging 90% of a census, before and after compaction
+size_t latencyBucket(uint64_t nanos);
+void recordLatency(LatencyHistogram* histogram, uint64_t nanos);
+uint64_t latencyPercentile(const LatencyHistogram* histogram, double fraction);  //upper edge of the bucket holding that fraction
+void initZipfGenerator(ZipfGenerator* zipf, double exponent, size_t n);
+void resizeZipfGenerator(ZipfGenerator* zipf, size_t n);  //O(1); keeps the exponent
+size_t nextZipfRank(const ZipfGenerator* zipf, uint64_t* seed);
+bool runWorkload(const WorkloadConfig* config);  //preloads, runs the mix and prints throughput and latency percentiles
+int runWorkloadBenchmark(int argc, char* argv[]);  //--bench-workload [--patients N] [--ops N] [--mix F,A,D,R] ...
 
 // Main menu
 void displayMainMenu() {
@@ -54,18 +792,167 @@ void displayMainMenu() {
     printf("3. Remove Discharged Patient\n");
     printf("4. View All Patients\n");
     printf("5. View Specific Patient\n");
-    printf("6. Exit\n");
+    printf("6. Search Diagnoses and Histories\n");
+    printf("7. Find Patients by Name\n");
+    printf("8. Age Band Report\n");
+    printf("9. Export Records (CSV/JSON)\n");
+    printf("10. Compact Storage\n");
+    printf("11. Runtime Statistics\n");
+    printf("12. Exit\n");
     printf("====================================\n");
 }
 
-int main() {
+int main(int argc, char* argv[]) {
+    if (argc > 1 && strcmp(argv[1], "--bench") == 0) {
+        return runLookupBenchmark();
+    }
+    if (argc > 1 && strcmp(argv[1], "--bench-memory") == 0) {
+        return runMemoryBenchmark(argc > 2 ? strtoul(argv[2], NULL, 10) : 1000000);
+    }
+    if (argc > 1 && strcmp(argv[1], "--bench-store") == 0) {
+        return runStoreBenchmark(argc > 2 ? strtoul(argv[2], NULL, 10) : 1000000, "bench_patients.db");
+    }
+    if (argc > 1 && strcmp(argv[1], "--bench-search") == 0) {
+        return runSearchBenchmark(argc > 2 ? strtoul(argv[2], NULL, 10) : 1000000);
+    }
+    if (argc > 1 && strcmp(argv[1], "--bench-wal") == 0) {
+        return runWalBenchmark(argc > 2 ? strtoul(argv[2], NULL, 10) : 20000, "bench_patients.wal");
+    }
+    if (argc > 1 && strcmp(argv[1], "--bench-server") == 0) {
+        return runServerBenchmark(argc > 2 ? strtoul(argv[2], NULL, 10) : 100000, "bench_patients.sock");
+    }
+    if (argc > 1 && strcmp(argv[1], "--bench-tiering") == 0) {
+        return runTieringBenchmark(argc > 2 ? strtoul(argv[2], NULL, 10) : 200000);
+    }
+    if (argc > 1 && strcmp(argv[1], "--bench-snapshot") == 0) {
+        return runSnapshotBenchmark(argc > 2 ? strtoul(argv[2], NULL, 10) : 100000, "bench_patients.sock");
+    }
+    if (argc > 1 && strcmp(argv[1], "--bench-workload") == 0) {
+        return runWorkloadBenchmark(argc, argv);
+    }
+    if (argc > 1 && strcmp(argv[1], "--bench-shrink") == 0) {
+        return runShrinkBenchmark(argc > 2 ? strtoul(argv[2], NULL, 10) : 1000000);
+    }
+
+    const char* dbPath = DEFAULT_DATABASE_FILE;
+    const char* ingestPath = NULL;
+    const char* socketPath = NULL;
+    const char* exportPath = NULL;
+    ExportFormat exportFormat = EXPORT_CSV;
+    ExportFilter exportFilter = { 1, MAX_PATIENT_AGE, NULL };
+    size_t shardCount = SERVER_DEFAULT_SHARDS;
+    size_t threadCount = SERVER_DEFAULT_THREADS;
+    unsigned commitDelay = WAL_COMMIT_DELAY_MICROS;
+    for (int i = 1; i + 1 < argc; i += 2) {
+        if (strcmp(argv[i], "--db") == 0) {
+            dbPath = argv[i + 1];
+        } else if (strcmp(argv[i], "--commit-delay") == 0) {
+            commitDelay = (unsigned)strtoul(argv[i + 1], NULL, 10);
+        } else if (strcmp(argv[i], "--ingest") == 0) {
+            ingestPath = argv[i + 1];
+        } else if (strcmp(argv[i], "--serve") == 0) {
+            socketPath = argv[i + 1];
+        } else if (strcmp(argv[i], "--shards") == 0) {
+            shardCount = strtoul(argv[i + 1], NULL, 10);
+        } else if (strcmp(argv[i], "--threads") == 0) {
+            threadCount = strtoul(argv[i + 1], NULL, 10);
+        } else if (strcmp(argv[i], "--export") == 0) {
+            exportPath = argv[i + 1];
+        } else if (strcmp(argv[i], "--format") == 0) {
+            exportFormat = strcmp(argv[i + 1], "json") == 0 ? EXPORT_JSON : EXPORT_CSV;
+        } else if (strcmp(argv[i], "--min-age") == 0) {
+            exportFilter.minAge = atoi(argv[i + 1]);
+        } else if (strcmp(argv[i], "--max-age") == 0) {
+            exportFilter.maxAge = atoi(argv[i + 1]);
+        } else if (strcmp(argv[i], "--name-prefix") == 0) {
+            exportFilter.namePrefix = argv[i + 1];
+        } else if (strcmp(argv[i], "--compress-after") == 0) {
+            historyColdSeconds = (unsigned)strtoul(argv[i + 1], NULL, 10);
+        }
+    }
+
+    // Exporting to standard output: keep status messages out of the data by sending them to stderr
+    int exportFd = -1;
+    if (exportPath != NULL && strcmp(exportPath, "-") == 0) {
+        exportFd = dup(STDOUT_FILENO);
+        dup2(STDERR_FILENO, STDOUT_FILENO);
+    }
+
     PatientDatabase db;
-    initPatientDatabase(&db, 5);
+    WriteAheadLog wal;
+    if (!openPatientStore(&db, &wal, dbPath, commitDelay)) {
+        return EXIT_FAILURE;
+    }
+
+    // Batch mode: load the feed, checkpoint once, no menu
+    if (ingestPath != NULL) {
+        size_t added, rejected;
+        uint64_t start = nowNanoseconds();
+        bool ok = ingestPatients(&db, ingestPath, &added, &rejected);
+        double seconds = (nowNanoseconds() - start) / 1e9;
+        printf("Ingested %zu patients, rejected %zu lines in %.3f s (%.0f records/sec)\n",
+               added, rejected, seconds, seconds > 0 ? (added + rejected) / seconds : 0.0);
+
+        size_t saved = db.count;
+        start = nowNanoseconds();
+        if (closePatientStore(&db, dbPath)) {
+            printf("Saved %zu patients to %s in %.3f s\n", saved, dbPath, (nowNanoseconds() - start) / 1e9);
+        } else {
+            ok = false;
+        }
+        releaseHistorySlabs();
+        releasePatientStats();
+        return ok ? 0 : EXIT_FAILURE;
+    }
+
+    // Export mode: write the (filtered) database as CSV or JSON and exit without the menu
+    if (exportPath != NULL) {
+        if (exportFd < 0) {
+            exportFd = openExportFile(exportPath);
+        }
+        size_t exported = 0;
+        uint64_t start = nowNanoseconds();
+        bool ok = exportFd >= 0 && exportPatients(&db, exportFd, exportFormat, &exportFilter, &exported);
+        if (exportFd >= 0 && close(exportFd) != 0) {
+            ok = false;
+        }
+        double seconds = (nowNanoseconds() - start) / 1e9;
+        printf("Exported %zu patients in %.3f s (%.0f records/sec)\n", exported, seconds, seconds > 0 ? exported / seconds : 0.0);
+        closeWriteAheadLog(db.wal);
+        db.wal = NULL;
+        freePatientDatabase(&db);
+        releaseHistorySlabs();
+        releasePatientStats();
+        return ok ? 0 : EXIT_FAILURE;
+    }
+
+    // Server mode: clients talk to the database over a Unix socket until SIGINT/SIGTERM
+    if (socketPath != NULL) {
+        historyColdSeconds = 0;  // reads under a shared shard lock must not decompress in place
+        int status = runPatientServer(&db, dbPath, socketPath, shardCount, threadCount);
+        if (status == 0) {
+            size_t saved = db.count;
+            if (closePatientStore(&db, dbPath)) {
+                printf("Saved %zu patients to %s\n", saved, dbPath);
+            } else {
+                status = EXIT_FAILURE;
+            }
+        } else if (db.wal != NULL) {
+            // Leave the snapshot alone; the log still holds every acknowledged change
+            closeWriteAheadLog(db.wal);
+            db.wal = NULL;
+            freePatientDatabase(&db);
+        }
+        releaseHistorySlabs();
+        releasePatientStats();
+        return status;
+    }
 
     int choice;
+    uint32_t lastSweep = historyClock();
     do {
         displayMainMenu();
-        choice = getIntInput("Enter your choice (1-6): ");
+        choice = getIntInput("Enter your choice (1-12): ");
 
         switch (choice) {
             case 1:
@@ -84,23 +971,61 @@ int main() {
                 break;
             case 5: {
                 int id = getIntInput("Enter patient ID to view: ");
-                Patient* p = findPatient(&db, id);
-                if (p) {
-                    displayPatient(p);
+                Patient p;
+                if (getPatient(&db, findPatient(&db, id), &p)) {
+                    displayPatient(&p);
                 } else {
                     printf("Patient with ID %d not found.\n", id);
                 }
                 break;
             }
             case 6:
+                searchRecords(&db);
+                break;
+            case 7:
+                findPatientsByName(&db);
+                break;
+            case 8:
+                displayAgeBands(&db);
+                break;
+            case 9:
+                exportRecords(&db);
+                break;
+            case 10:
+                compactStorage(&db);
+                break;
+            case 11:
+                displayPatientStats(&db);
+                break;
+            case 12:
                 printf("Exiting system...\n");
                 break;
             default:
                 printf("Invalid choice. Please try again.\n");
         }
-    } while (choice != 6);
 
-    freePatientDatabase(&db);
+        // Keep the log bounded
+        if (db.wal != NULL && walLogBytes(db.wal) > WAL_CHECKPOINT_BYTES) {
+            checkpointPatientDatabase(&db, dbPath);
+        }
+
+        // Tiering: compress the histories that went cold, at most twice per window
+        if (historyColdSeconds != 0 && historyClock() - lastSweep >= (historyColdSeconds + 1) / 2) {
+            compressColdHistories(&db);
+            lastSweep = historyClock();
+        }
+    } while (choice != 12);
+
+    if (historyColdSeconds != 0) {
+        displayHistoryTiering(&db);
+    }
+
+    size_t saved = db.count;
+    if (closePatientStore(&db, dbPath)) {
+        printf("Saved %zu patients to %s\n", saved, dbPath);
+    }
+    releaseHistorySlabs();
+    releasePatientStats();
     return 0;
 }
 
@@ -150,228 +1075,6367 @@ void getStringInput(const char* prompt, char* buffer, size_t maxLength) {
     }
 }
 
-// Initialize a new medical history
-void initMedicalHistory(MedicalHistory* history) {
-    history->details = (char*)malloc(INITIAL_MED_HISTORY_SIZE);
-    if (history->details == NULL) {
-        fprintf(stderr, "Failed to allocate memory for medical history\n");
-        exit(EXIT_FAILURE);
-    }
-    history->details[0] = '\0';
-    history->capacity = INITIAL_MED_HISTORY_SIZE;
-    history->length = 0;
-} //dynamically allocates memory for a new patient and initializes the length to 0.
+// Counters of the calling thread
+PatientStats* localStats(void) {
+    return threadStats != NULL ? threadStats : registerThreadStats();
+}
 
-// Expand medical history 
-bool expandMedicalHistory(MedicalHistory* history, size_t requiredLength) {
-    if (history->length + requiredLength + 1 <= history->capacity) {
-        return true; // No need to expand
+// First use on this thread: allocate its counters and add them to statsThreads
+PatientStats* registerThreadStats(void) {
+    PatientStats* stats = (PatientStats*)calloc(1, sizeof(PatientStats));
+    if (stats == NULL) {
+        threadStats = &fallbackStats;  // shared, so a few counts may be lost, but nothing breaks
+        return threadStats;
     }
+    pthread_mutex_lock(&statsLock);
+    stats->next = statsThreads;
+    statsThreads = stats;
+    pthread_mutex_unlock(&statsLock);
+    threadStats = stats;
+    return stats;
+}
 
-    size_t newCapacity = history->capacity * 2;
-    while (newCapacity < history->length + requiredLength + 1) {
-        newCapacity *= 2;
-    }
+// Add to a counter owned by this thread: a plain load and store, readers may see it a little late
+void bumpCounter(_Atomic uint64_t* counter, uint64_t amount) {
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + amount, memory_order_relaxed);
+}
 
-    char* newDetails = (char*)realloc(history->details, newCapacity);
-    if (newDetails == NULL) {
-        fprintf(stderr, "Failed to expand medical history\n");
-        return false;
+void addStat(StatCounter counter, uint64_t amount) {
+    bumpCounter(&localStats()->counters[counter], amount);
+}
+
+// Count a call; returns its start time if this call is timed, else 0
+uint64_t beginOperation(StatOperation op) {
+    // Per-patient operations are too quick to time every call, or even to publish each count:
+    // they only bump a thread-local tally, handed over with every timed call. Searches and saves always are
+    if (++pendingCalls[op] < STATS_TIMING_INTERVAL && op <= STAT_REMOVE) {
+        return 0;
     }
+    return startTimedCall(op);
+}
 
-    history->details = newDetails;
-    history->capacity = newCapacity;
-    return true;
+// Slow path of beginOperation, kept out of it so the untimed path stays small enough to inline
+uint64_t startTimedCall(StatOperation op) {
+    OperationStats* stats = &localStats()->operations[op];
+    bumpCounter(&stats->calls, pendingCalls[op]);
+    pendingCalls[op] = 0;
+    return nowNanoseconds();
 }
 
-// Add to medical history
-bool addToMedicalHistory(MedicalHistory* history, const char* entry) {
-    size_t entryLength = strlen(entry);
-    if (!expandMedicalHistory(history, entryLength)) {
-        return false;
+// Hand over the calls counted since the last timed one, so a report from this thread is exact
+void publishPendingCalls(void) {
+    PatientStats* stats = localStats();
+    for (int op = 0; op < STAT_OPERATION_COUNT; op++) {
+        bumpCounter(&stats->operations[op].calls, pendingCalls[op]);
+        pendingCalls[op] = 0;
     }
+}
 
-    if (history->length > 0) {
-        strcat(history->details, "\n"); // Add newline between entries
-        history->length++;
+// Record the latency of a timed call
+void endOperation(StatOperation op, uint64_t start) {
+    if (start == 0) {
+        return;
+    }
+    uint64_t nanos = nowNanoseconds() - start;
+    OperationStats* stats = &localStats()->operations[op];
+    bumpCounter(&stats->timed, 1);
+    bumpCounter(&stats->timedNanos, nanos);
+    bumpCounter(&stats->buckets[latencyBucket(nanos)], 1);
+    if (nanos > atomic_load_explicit(&stats->maxNanos, memory_order_relaxed)) {
+        atomic_store_explicit(&stats->maxNanos, nanos, memory_order_relaxed);
     }
-    
-    strcat(history->details, entry);
-    history->length += entryLength;
-    return true;
 }
 
-// Free medical history memory
-void freeMedicalHistory(MedicalHistory* history) {
-    free(history->details);
-    history->details = NULL;
-    history->capacity = 0;
-    history->length = 0;
+// Add up the counters of every thread; other threads' per-patient calls may be up to one batch behind
+void collectPatientStats(StatsSummary* summary) {
+    memset(summary, 0, sizeof(*summary));
+    publishPendingCalls();
+    pthread_mutex_lock(&statsLock);
+    for (PatientStats* stats = statsThreads; stats != NULL; stats = stats->next) {
+        for (int op = 0; op < STAT_OPERATION_COUNT; op++) {
+            const OperationStats* from = &stats->operations[op];
+            LatencyHistogram* into = &summary->latencies[op];
+            summary->calls[op] += atomic_load_explicit(&from->calls, memory_order_relaxed);
+            into->samples += atomic_load_explicit(&from->timed, memory_order_relaxed);
+            into->totalNanos += atomic_load_explicit(&from->timedNanos, memory_order_relaxed);
+            uint64_t maxNanos = atomic_load_explicit(&from->maxNanos, memory_order_relaxed);
+            if (maxNanos > into->maxNanos) {
+                into->maxNanos = maxNanos;
+            }
+            for (size_t b = 0; b < LATENCY_BUCKETS; b++) {
+                into->counts[b] += atomic_load_explicit(&from->buckets[b], memory_order_relaxed);
+            }
+        }
+        for (int k = 0; k < STAT_COUNTER_COUNT; k++) {
+            summary->counters[k] += atomic_load_explicit(&stats->counters[k], memory_order_relaxed);
+        }
+    }
+    pthread_mutex_unlock(&statsLock);
 }
 
-// Initialize patient database
-void initPatientDatabase(PatientDatabase* db, size_t initialCapacity) {
-    db->patients = (Patient*)malloc(initialCapacity * sizeof(Patient));
-    if (db->patients == NULL) {
-        fprintf(stderr, "Failed to allocate memory for patient database\n");
-        exit(EXIT_FAILURE);
+// Free the counters of threads that have finished; only safe when no other thread is running
+void releasePatientStats(void) {
+    pthread_mutex_lock(&statsLock);
+    PatientStats* stats = statsThreads;
+    while (stats != &fallbackStats) {
+        PatientStats* next = stats->next;
+        free(stats);
+        stats = next;
     }
-    db->count = 0;
-    db->capacity = initialCapacity;
+    statsThreads = &fallbackStats;
+    pthread_mutex_unlock(&statsLock);
+    threadStats = NULL;
+    memset(pendingCalls, 0, sizeof(pendingCalls));
 }
 
-// Add a new patient 
-bool addPatient(PatientDatabase* db) {
-    printf("\n*** Add New Patient ***\n");
-    
-    // Get patient details from user
-    int id;
-    while (1) {
-        id = getIntInput("Enter patient ID: ");
-        if (findPatient(db, id) == NULL) {
-            break;
+// Pick the size class for a request, -1 if it is too large for the slabs
+int slabClassFor(size_t size) {
+    size_t block = SLAB_MIN_BLOCK;
+    for (int c = 0; c < SLAB_CLASS_COUNT; c++) {
+        if (size <= block) {
+            return c;
         }
-        printf("Patient ID %d already exists. Please enter a different ID.\n", id);
+        block *= 2;
     }
-    
-    char name[MAX_NAME_LENGTH];
-    getStringInput("Enter patient name: ", name, sizeof(name));
-    
-    int age;
-    while (1) {
-        age = getIntInput("Enter patient age: ");
-        if (age > 0 && age < 1000) {
-            break;
-        }
-        printf("Invalid age. Please enter a value between 1 and 999.\n");
+    return -1;
+}
+
+// This thread's block cache; blocks cached before releaseHistorySlabs pointed into freed pages and are forgotten
+SlabCache* currentSlabCache(void) {
+    uint64_t generation = atomic_load_explicit(&slabGeneration, memory_order_relaxed);
+    if (slabCache.generation != generation) {
+        memset(&slabCache, 0, sizeof(slabCache));
+        slabCache.generation = generation;
     }
-    
-    char diagnosis[MAX_DIAGNOSIS_LENGTH];
-    getStringInput("Enter primary diagnosis: ", diagnosis, sizeof(diagnosis));
-    
-    // Resize database 
-    if (db->count >= db->capacity) {
-        size_t newCapacity = db->capacity * 2;
-        Patient* newPatients = (Patient*)realloc(db->patients, newCapacity * sizeof(Patient));
-        if (newPatients == NULL) {
-            fprintf(stderr, "Failed to expand patient database\n");
-            return false;
+    return &slabCache;
+}
+
+// Pop a free block of one size class, carving a new page when it runs dry
+void* takeSlabBlock(int c) {
+    SlabClass* sc = &historySlabs.classes[c];
+    size_t classSize = (size_t)SLAB_MIN_BLOCK << c;
+    void* block = sc->freeList;
+    if (block != NULL) {
+        sc->freeList = *(void**)block;
+    } else {
+        if (sc->bump == NULL || sc->bump + classSize > sc->bumpEnd) {
+            SlabPage* page = (SlabPage*)malloc(SLAB_PAGE_SIZE);
+            if (page == NULL) {
+                return NULL;
+            }
+            page->next = sc->pages;
+            sc->pages = page;
+            historySlabs.pageBytes += SLAB_PAGE_SIZE;
+            sc->bump = (char*)page + SLAB_MIN_BLOCK; // header padded to keep blocks aligned
+            sc->bumpEnd = (char*)page + SLAB_PAGE_SIZE;
         }
-        db->patients = newPatients;
-        db->capacity = newCapacity;
+        block = sc->bump;
+        sc->bump += classSize;
     }
+    sc->blocksInUse++;
+    return block;
+}
 
-    // Add the new patient
-    Patient* p = &db->patients[db->count];
-    p->id = id;
-    strncpy(p->name, name, MAX_NAME_LENGTH - 1);
-    p->name[MAX_NAME_LENGTH - 1] = '\0';
-    p->age = age;
-    strncpy(p->diagnosis, diagnosis, MAX_DIAGNOSIS_LENGTH - 1);
-    p->diagnosis[MAX_DIAGNOSIS_LENGTH - 1] = '\0';
-    initMedicalHistory(&p->medicalHistory);
-    
-    // Get initial medical history
-    char historyEntry[MAX_INPUT_LENGTH];
-    getStringInput("Enter initial medical history notes: ", historyEntry, sizeof(historyEntry));
-    addToMedicalHistory(&p->medicalHistory, historyEntry);
-    
-    db->count++;
-    printf("Patient added successfully.\n");
-    return true;
+// Move blocks from the front of a cached class onto the shared free list
+void giveSlabBlocks(SlabCache* cache, int c, unsigned count) {
+    SlabClass* sc = &historySlabs.classes[c];
+    for (unsigned i = 0; i < count; i++) {
+        void* block = cache->freeList[c];
+        cache->freeList[c] = *(void**)block;
+        *(void**)block = sc->freeList;
+        sc->freeList = block;
+    }
+    cache->count[c] -= count;
+    sc->blocksInUse -= count;
 }
 
-// Find a patient by ID
-Patient* findPatient(PatientDatabase* db, int id) {
-    for (size_t i = 0; i < db->count; i++) {
-        if (db->patients[i].id == id) {
-            return &db->patients[i];
+// Allocate from this thread's cache of the matching size class, refilling half of it from the slabs when empty
+void* slabAlloc(size_t size, size_t* blockSize) {
+    int c = slabClassFor(size);
+    if (c < 0) {
+        void* block = malloc(size);
+        if (block != NULL) {
+            atomic_fetch_add_explicit(&historySlabs.largeBytes, size, memory_order_relaxed);
+            *blockSize = size;
         }
+        return block;
     }
-    return NULL;
-}
 
-// Update patient medical history
-bool updateMedicalHistory(PatientDatabase* db) {
-    printf("\n*** Update Medical History ***\n");
-    int id = getIntInput("Enter patient ID to update: ");
-    
-    Patient* p = findPatient(db, id);
-    if (p == NULL) {
-        printf("Patient with ID %d not found.\n", id);
+    SlabCache* cache = currentSlabCache();
+    if (cache->count[c] == 0) {
+        pthread_mutex_lock(&historySlabLock);
+        while (cache->count[c] < SLAB_CACHE_BLOCKS / 2) {
+            void* block = takeSlabBlock(c);
+            if (block == NULL) {
+                break;
+            }
+            *(void**)block = cache->freeList[c];
+            cache->freeList[c] = block;
+            cache->count[c]++;
+        }
+        pthread_mutex_unlock(&historySlabLock);
+        if (cache->count[c] == 0) {
+            return NULL;
+        }
+    }
+    void* block = cache->freeList[c];
+    cache->freeList[c] = *(void**)block;
+    cache->count[c]--;
+    *blockSize = (size_t)SLAB_MIN_BLOCK << c;
+    return block;
+}
+
+// Push a block on this thread's cache, handing half of the cache back to the slabs once it is full
+void slabFree(void* block, size_t blockSize) {
+    if (block == NULL) {
+        return;
+    }
+    int c = slabClassFor(blockSize);
+    if (c < 0) {
+        atomic_fetch_sub_explicit(&historySlabs.largeBytes, blockSize, memory_order_relaxed);
+        free(block);
+        return;
+    }
+    SlabCache* cache = currentSlabCache();
+    if (cache->count[c] == SLAB_CACHE_BLOCKS) {
+        pthread_mutex_lock(&historySlabLock);
+        giveSlabBlocks(cache, c, SLAB_CACHE_BLOCKS / 2);
+        pthread_mutex_unlock(&historySlabLock);
+    }
+    *(void**)block = cache->freeList[c];
+    cache->freeList[c] = block;
+    cache->count[c]++;
+}
+
+// Empty this thread's cache into the slabs, before the thread exits or the slabs are trimmed or compacted
+void flushSlabCache(void) {
+    SlabCache* cache = currentSlabCache();
+    pthread_mutex_lock(&historySlabLock);
+    for (int c = 0; c < SLAB_CLASS_COUNT; c++) {
+        giveSlabBlocks(cache, c, cache->count[c]);
+    }
+    pthread_mutex_unlock(&historySlabLock);
+}
+
+// Free every slab page; only safe once no history uses them
+void releaseHistorySlabs(void) {
+    for (int c = 0; c < SLAB_CLASS_COUNT; c++) {
+        SlabPage* page = historySlabs.classes[c].pages;
+        while (page != NULL) {
+            SlabPage* next = page->next;
+            free(page);
+            page = next;
+        }
+    }
+    memset(&historySlabs, 0, sizeof(historySlabs));
+    atomic_fetch_add_explicit(&slabGeneration, 1, memory_order_relaxed);
+
+    // Compression buffers and the dictionary go too; no compressed history can outlive the slabs
+    free(packBuffer);
+    free(peekBuffer);
+    free(historyDictionary.text);
+    packBuffer = peekBuffer = historyDictionary.text = NULL;
+    packBufferCapacity = peekBufferCapacity = 0;
+    historyDictionary.length = 0;
+}
+
+// Return history storage to the slabs unless it is still read from a mapped file
+void releaseHistoryBlock(void* block, size_t blockSize) {
+    if (block != NULL && !inMappedFile(block)) {
+        slabFree(block, blockSize);
+    }
+}
+
+// Take every free block away from the allocator, so the next blocks are carved from fresh pages
+void detachSlabFreeLists(void* detached[SLAB_CLASS_COUNT]) {
+    flushSlabCache();
+    pthread_mutex_lock(&historySlabLock);
+    for (int c = 0; c < SLAB_CLASS_COUNT; c++) {
+        SlabClass* sc = &historySlabs.classes[c];
+        size_t classSize = (size_t)SLAB_MIN_BLOCK << c;
+        // The uncarved rest of the newest page goes with them, leaving that page fully carved
+        while (sc->bump != NULL && sc->bump + classSize <= sc->bumpEnd) {
+            *(void**)sc->bump = sc->freeList;
+            sc->freeList = sc->bump;
+            sc->bump += classSize;
+        }
+        sc->bump = sc->bumpEnd = NULL;
+        detached[c] = sc->freeList;
+        sc->freeList = NULL;
+    }
+    pthread_mutex_unlock(&historySlabLock);
+}
+
+// Give blocks taken by detachSlabFreeLists back to their classes
+void reattachSlabFreeLists(void* detached[SLAB_CLASS_COUNT]) {
+    pthread_mutex_lock(&historySlabLock);
+    for (int c = 0; c < SLAB_CLASS_COUNT; c++) {
+        if (detached[c] == NULL) {
+            continue;
+        }
+        void* tail = detached[c];
+        while (*(void**)tail != NULL) {
+            tail = *(void**)tail;
+        }
+        *(void**)tail = historySlabs.classes[c].freeList;
+        historySlabs.classes[c].freeList = detached[c];
+    }
+    pthread_mutex_unlock(&historySlabLock);
+}
+
+// Order pointers by address for qsort
+int compareAddresses(const void* a, const void* b) {
+    uintptr_t x = (uintptr_t)*(void* const*)a;
+    uintptr_t y = (uintptr_t)*(void* const*)b;
+    return (x > y) - (x < y);
+}
+
+// Page holding a block: the last page starting at or before it
+size_t findSlabPage(SlabPage* const* pages, size_t count, const void* block) {
+    size_t low = 0, high = count;
+    while (high - low > 1) {
+        size_t mid = (low + high) / 2;
+        if ((uintptr_t)pages[mid] <= (uintptr_t)block) {
+            low = mid;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+// Return slab pages whose blocks are all free to the system; returns the bytes released
+size_t trimHistorySlabs(void) {
+    size_t released = 0;
+    flushSlabCache();
+    pthread_mutex_lock(&historySlabLock);
+    for (int c = 0; c < SLAB_CLASS_COUNT; c++) {
+        SlabClass* sc = &historySlabs.classes[c];
+        size_t classSize = (size_t)SLAB_MIN_BLOCK << c;
+        size_t pageCount = 0;
+        for (SlabPage* page = sc->pages; page != NULL; page = page->next) {
+            pageCount++;
+        }
+        if (pageCount == 0) {
+            continue;
+        }
+        SlabPage** pages = (SlabPage**)malloc(pageCount * sizeof(SlabPage*));
+        size_t* freeBlocks = (size_t*)calloc(pageCount, sizeof(size_t));
+        if (pages == NULL || freeBlocks == NULL) {
+            free(pages);
+            free(freeBlocks);
+            break;
+        }
+        size_t n = 0;
+        for (SlabPage* page = sc->pages; page != NULL; page = page->next) {
+            pages[n++] = page;
+        }
+        qsort(pages, pageCount, sizeof(SlabPage*), compareAddresses);
+        for (void* block = sc->freeList; block != NULL; block = *(void**)block) {
+            freeBlocks[findSlabPage(pages, pageCount, block)]++;
+        }
+
+        // A page is empty when every block carved from it is on the free list; past bump nothing was carved
+        SlabPage* bumpPage = sc->bump != NULL ? pages[findSlabPage(pages, pageCount, sc->bump - 1)] : NULL;
+        bool bumpReleased = false;
+        sc->pages = NULL;
+        for (size_t i = 0; i < pageCount; i++) {
+            char* first = (char*)pages[i] + SLAB_MIN_BLOCK;
+            size_t carved = pages[i] == bumpPage
+                ? (size_t)(sc->bump - first) / classSize
+                : (SLAB_PAGE_SIZE - SLAB_MIN_BLOCK) / classSize;
+            if (freeBlocks[i] == carved) {
+                freeBlocks[i] = SIZE_MAX;  // marks the page for release
+                bumpReleased |= pages[i] == bumpPage;
+            } else {
+                pages[i]->next = sc->pages;
+                sc->pages = pages[i];
+            }
+        }
+        void** link = &sc->freeList;
+        while (*link != NULL) {
+            if (freeBlocks[findSlabPage(pages, pageCount, *link)] == SIZE_MAX) {
+                *link = *(void**)*link;
+            } else {
+                link = (void**)*link;
+            }
+        }
+        for (size_t i = 0; i < pageCount; i++) {
+            if (freeBlocks[i] == SIZE_MAX) {
+                free(pages[i]);
+                released += SLAB_PAGE_SIZE;
+            }
+        }
+        if (bumpReleased) {
+            sc->bump = sc->bumpEnd = NULL;
+        }
+        free(pages);
+        free(freeBlocks);
+    }
+    historySlabs.pageBytes -= released;
+    pthread_mutex_unlock(&historySlabLock);
+    return released;
+}
+
+
+// Initialize a new medical history
+void initMedicalHistory(MedicalHistory* history) {
+    history->details = NULL;
+    history->inlineText[0] = '\0';
+    history->capacity = HISTORY_INLINE_SIZE;
+    history->length = 0;
+    history->entryOffsets = NULL;
+    history->entryCount = 0;
+    history->entryCapacity = 0;
+    history->packedLength = 0;
+    history->lastUsed = historyColdSeconds != 0 ? historyClock() : 0;
+} //starts out in the inline buffer; nothing is allocated until the history outgrows it
+
+// Text of a medical history, inline or in its slab block
+const char* getMedicalHistoryText(const MedicalHistory* history) {
+    return history->details != NULL ? history->details : history->inlineText;
+}
+
+// Expand medical history 
+bool expandMedicalHistory(MedicalHistory* history, size_t requiredLength) {
+    if (history->entryCount >= history->entryCapacity) {
+        size_t newEntryCapacity = history->entryCapacity ? history->entryCapacity * 2 : INITIAL_HISTORY_ENTRIES;
+        size_t granted;
+        uint32_t* newOffsets = (uint32_t*)slabAlloc(newEntryCapacity * sizeof(uint32_t), &granted);
+        if (newOffsets == NULL) {
+            fprintf(stderr, "Failed to expand medical history\n");
+            return false;
+        }
+        if (history->entryCount > 0) {
+            memcpy(newOffsets, history->entryOffsets, history->entryCount * sizeof(uint32_t));
+            addStat(STAT_OFFSET_MOVES, 1);
+            addStat(STAT_OFFSET_BYTES_MOVED, history->entryCount * sizeof(uint32_t));
+        }
+        releaseHistoryBlock(history->entryOffsets, history->entryCapacity * sizeof(uint32_t));
+        history->entryOffsets = newOffsets;
+        history->entryCapacity = granted / sizeof(uint32_t);
+    }
+
+    if (history->length + requiredLength + 1 <= history->capacity) {
+        return true; // No need to expand
+    }
+    if (history->length + requiredLength + 1 > UINT32_MAX) {
+        fprintf(stderr, "Medical history too large\n");
         return false;
     }
-    
-    printf("\nCurrent medical history for %s (ID: %d):\n", p->name, p->id);
-    printf("%s\n", p->medicalHistory.details);
-    
-    char newEntry[MAX_INPUT_LENGTH];
-    getStringInput("Enter new medical history entry: ", newEntry, sizeof(newEntry));
-    
-    if (addToMedicalHistory(&p->medicalHistory, newEntry)) {
-        printf("Medical history updated successfully.\n");
+
+    size_t newCapacity = history->capacity * 2;
+    while (newCapacity < history->length + requiredLength + 1) {
+        newCapacity *= 2;
+    }
+
+    // Moving between size classes is a copy into a fresh block
+    char* newDetails = (char*)slabAlloc(newCapacity, &newCapacity);
+    if (newDetails == NULL) {
+        fprintf(stderr, "Failed to expand medical history\n");
+        return false;
+    }
+    memcpy(newDetails, getMedicalHistoryText(history), history->length + 1);
+    releaseHistoryBlock(history->details, history->capacity);
+    addStat(STAT_HISTORY_MOVES, 1);
+    addStat(STAT_HISTORY_BYTES_MOVED, history->length + 1);
+
+    history->details = newDetails;
+    history->capacity = newCapacity;
+    return true;
+}
+
+// Add to medical history
+bool addToMedicalHistory(MedicalHistory* history, const char* entry) {
+    return addMedicalHistoryEntry(history, entry, strlen(entry));
+}
+
+// Add an entry given as a pointer and length, e.g. a field of an input line
+bool addMedicalHistoryEntry(MedicalHistory* history, const char* entry, size_t entryLength) {
+    if (!expandMedicalHistory(history, entryLength + 1)) {
+        return false;
+    }
+
+    // Append at the tracked end instead of rescanning the buffer
+    char* text = history->details != NULL ? history->details : history->inlineText;
+    char* end = text + history->length;
+    if (history->entryCount > 0) {
+        *end++ = '\n'; // Add newline between entries
+        history->length++;
+    }
+    memcpy(end, entry, entryLength);
+    end[entryLength] = '\0';
+    history->entryOffsets[history->entryCount++] = (uint32_t)history->length;
+    history->length += entryLength;
+    return true;
+}
+
+// Get a single entry; entries are not NUL terminated individually
+const char* getMedicalHistoryEntry(const MedicalHistory* history, size_t index, size_t* length) {
+    if (index >= history->entryCount) {
+        return NULL;
+    }
+    size_t start = history->entryOffsets[index];
+    size_t end = index + 1 < history->entryCount ? history->entryOffsets[index + 1] - 1 : history->length;
+    *length = end - start;
+    return getMedicalHistoryText(history) + start;
+}
+
+// Print the newest entries; they are contiguous so one write covers them
+void displayRecentHistory(const MedicalHistory* history, size_t lastEntries) {
+    size_t first = 0;
+    if (history->entryCount > lastEntries) {
+        first = history->entryCount - lastEntries;
+        printf("(%zu earlier entries not shown)\n", first);
+    }
+    if (history->entryCount > 0) {
+        size_t start = history->entryOffsets[first];
+        fwrite(getMedicalHistoryText(history) + start, 1, history->length - start, stdout);
+    }
+    putchar('\n');
+}
+
+// Free medical history memory
+void freeMedicalHistory(MedicalHistory* history) {
+    releaseHistoryBlock(history->details, history->capacity);
+    releaseHistoryBlock(history->entryOffsets, history->entryCapacity * sizeof(uint32_t));
+    history->details = NULL;
+    history->entryOffsets = NULL;
+    history->capacity = 0;
+    history->length = 0;
+    history->entryCount = 0;
+    history->entryCapacity = 0;
+    history->packedLength = 0;
+}
+
+// Monotonic seconds for history tiering
+uint32_t historyClock(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint32_t)now.tv_sec;
+}
+
+// Hash of the 4 bytes at p, bits wide
+uint32_t lzHash(const unsigned char* p, int bits) {
+    uint32_t sequence;
+    memcpy(&sequence, p, sizeof(sequence));
+    return (sequence * 2654435761U) >> (32 - bits);
+}
+
+// Equal leading bytes of a and b, at most limit
+size_t lzMatchLength(const unsigned char* a, const unsigned char* b, size_t limit) {
+    size_t n = 0;
+    while (n < limit && a[n] == b[n]) {
+        n++;
+    }
+    return n;
+}
+
+// Length continuation: 255 bytes until the last, smaller one
+unsigned char* lzWriteLength(unsigned char* out, size_t extra) {
+    while (extra >= 255) {
+        *out++ = 255;
+        extra -= 255;
+    }
+    *out++ = (unsigned char)extra;
+    return out;
+}
+
+bool lzReadLength(const unsigned char** in, const unsigned char* end, size_t* value) {
+    unsigned char byte;
+    do {
+        if (*in >= end) {
+            return false;
+        }
+        byte = *(*in)++;
+        *value += byte;
+    } while (byte == 255);
+    return true;
+}
+
+// One sequence: token (literal and match length nibbles), literals, then a 2-byte offset unless it is the last
+bool lzEmitSequence(unsigned char** out, const unsigned char* end, const unsigned char* literals, size_t literalLength,
+                    size_t offset, size_t matchLength) {
+    size_t worst = 1 + literalLength + literalLength / 255 + 1 + (matchLength ? 2 + matchLength / 255 + 1 : 0);
+    if (worst > (size_t)(end - *out)) {
+        return false;
+    }
+    unsigned char* p = *out;
+    unsigned char* token = p++;
+    *token = (unsigned char)((literalLength < 15 ? literalLength : 15) << 4);
+    if (literalLength >= 15) {
+        p = lzWriteLength(p, literalLength - 15);
+    }
+    memcpy(p, literals, literalLength);
+    p += literalLength;
+    if (matchLength > 0) {
+        size_t code = matchLength - LZ_MIN_MATCH;
+        *token |= (unsigned char)(code < 15 ? code : 15);
+        *p++ = (unsigned char)(offset & 0xFF);
+        *p++ = (unsigned char)(offset >> 8);
+        if (code >= 15) {
+            p = lzWriteLength(p, code - 15);
+        }
+    }
+    *out = p;
+    return true;
+}
+
+// LZ77 with an optional shared dictionary that matches may reach back into; 0 if the result exceeds capacity
+size_t lzCompress(const HistoryDictionary* dict, const char* src, size_t length, char* dst, size_t capacity) {
+    uint32_t table[1 << LZ_LOCAL_HASH_BITS];  // position + 1 of the last occurrence, 0 for none
+    memset(table, 0, sizeof(table));
+    const unsigned char* in = (const unsigned char*)src;
+    const unsigned char* dictText = (const unsigned char*)dict->text;
+    size_t dictLength = dict->length;
+    unsigned char* out = (unsigned char*)dst;
+    const unsigned char* end = out + capacity;
+
+    size_t anchor = 0;
+    size_t pos = 0;
+    while (pos + LZ_MIN_MATCH <= length) {
+        size_t bestLength = 0;
+        size_t bestOffset = 0;
+        uint32_t* local = &table[lzHash(in + pos, LZ_LOCAL_HASH_BITS)];
+        if (*local != 0 && pos - (*local - 1) <= LZ_MAX_OFFSET) {
+            size_t from = *local - 1;
+            bestLength = lzMatchLength(in + from, in + pos, length - pos);
+            bestOffset = pos - from;
+        }
+        *local = (uint32_t)pos + 1;
+        if (dictLength > 0 && pos + dictLength <= LZ_MAX_OFFSET) {
+            // Dictionary matches stop at its end, so the decoder never has to stitch the two together
+            uint16_t entry = dict->table[lzHash(in + pos, LZ_HASH_BITS)];
+            if (entry != 0) {
+                size_t from = entry - 1;
+                size_t limit = length - pos < dictLength - from ? length - pos : dictLength - from;
+                size_t n = lzMatchLength(dictText + from, in + pos, limit);
+                if (n > bestLength) {
+                    bestLength = n;
+                    bestOffset = dictLength - from + pos;
+                }
+            }
+        }
+        if (bestLength < LZ_MIN_MATCH) {
+            pos++;
+            continue;
+        }
+        if (!lzEmitSequence(&out, end, in + anchor, pos - anchor, bestOffset, bestLength)) {
+            return 0;
+        }
+        pos += bestLength;
+        anchor = pos;
+    }
+    if (!lzEmitSequence(&out, end, in + anchor, length - anchor, 0, 0)) {
+        return 0;
+    }
+    return (size_t)(out - (unsigned char*)dst);
+}
+
+// Inverse of lzCompress; false if the input is corrupt or does not decode to exactly length bytes
+bool lzDecompress(const HistoryDictionary* dict, const char* src, size_t packedLength, char* dst, size_t length) {
+    const unsigned char* in = (const unsigned char*)src;
+    const unsigned char* end = in + packedLength;
+    unsigned char* out = (unsigned char*)dst;
+    size_t dictLength = dict->length;
+    size_t o = 0;
+    while (in < end) {
+        unsigned token = *in++;
+        size_t literalLength = token >> 4;
+        if (literalLength == 15 && !lzReadLength(&in, end, &literalLength)) {
+            return false;
+        }
+        if (literalLength > (size_t)(end - in) || literalLength > length - o) {
+            return false;
+        }
+        memcpy(out + o, in, literalLength);
+        in += literalLength;
+        o += literalLength;
+        if (in == end) {
+            break;
+        }
+
+        if (end - in < 2) {
+            return false;
+        }
+        size_t offset = (size_t)in[0] | ((size_t)in[1] << 8);
+        in += 2;
+        size_t matchLength = token & 15;
+        if (matchLength == 15 && !lzReadLength(&in, end, &matchLength)) {
+            return false;
+        }
+        matchLength += LZ_MIN_MATCH;
+        if (offset == 0 || matchLength > length - o) {
+            return false;
+        }
+        if (offset > o) {
+            size_t back = offset - o;
+            if (back > dictLength || matchLength > back) {
+                return false;
+            }
+            memcpy(out + o, dict->text + dictLength - back, matchLength);
+        } else if (offset >= matchLength) {
+            memcpy(out + o, out + o - offset, matchLength);
+        } else {
+            for (size_t i = 0; i < matchLength; i++) {  // overlapping run
+                out[o + i] = out[o + i - offset];
+            }
+        }
+        o += matchLength;
+    }
+    return o == length;
+}
+
+// Replace a history's text with its compressed form in a right-sized slab block; false if that saves too little
+bool packMedicalHistory(MedicalHistory* history) {
+    if (history->details == NULL || history->packedLength != 0 || history->length < HISTORY_INLINE_SIZE ||
+        inMappedFile(history->details)) {
+        return false;
+    }
+    if (packBufferCapacity < history->capacity) {
+        char* grown = (char*)realloc(packBuffer, history->capacity);
+        if (grown == NULL) {
+            return false;
+        }
+        packBuffer = grown;
+        packBufferCapacity = history->capacity;
+    }
+    // Must land in a smaller size class, or the slab block would not shrink
+    size_t packed = lzCompress(&historyDictionary, history->details, history->length, packBuffer, history->capacity / 2);
+    if (packed == 0) {
+        tieringStats.incompressible++;
+        return false;
+    }
+    size_t granted;
+    char* block = (char*)slabAlloc(packed, &granted);
+    if (block == NULL) {
+        return false;
+    }
+    memcpy(block, packBuffer, packed);
+    releaseHistoryBlock(history->details, history->capacity);
+    history->details = block;
+    history->capacity = granted;
+    history->packedLength = (uint32_t)packed;
+    tieringStats.compressions++;
+    return true;
+}
+
+// Bring a compressed history back into plain text before it is read or appended to
+bool unpackMedicalHistory(MedicalHistory* history) {
+    if (history->packedLength == 0) {
         return true;
-    } else {
-        printf("Failed to update medical history.\n");
+    }
+    uint64_t start = nowNanoseconds();
+    size_t granted;
+    char* block = (char*)slabAlloc(history->length + 1, &granted);
+    if (block == NULL) {
+        fprintf(stderr, "Failed to decompress medical history\n");
+        return false;
+    }
+    if (!lzDecompress(&historyDictionary, history->details, history->packedLength, block, history->length)) {
+        fprintf(stderr, "Corrupt compressed medical history\n");
+        slabFree(block, granted);
         return false;
     }
+    block[history->length] = '\0';
+    releaseHistoryBlock(history->details, history->capacity);
+    history->details = block;
+    history->capacity = granted;
+    history->packedLength = 0;
+    uint64_t elapsed = nowNanoseconds() - start;
+    tieringStats.decompressions++;
+    tieringStats.decompressNanos += elapsed;
+    if (elapsed > tieringStats.maxDecompressNanos) {
+        tieringStats.maxDecompressNanos = elapsed;
+    }
+    return true;
 }
 
-// Remove a patient from the database 
-bool removePatient(PatientDatabase* db, int id) {
-    printf("\n*** Remove Discharged Patient ***\n");
-    int id = getIntInput("Enter patient ID to remove: ");
+// Hash the bytes of a string (FNV-1a)
+size_t hashString(const char* text, size_t length) {
+    uint32_t h = 2166136261U;
+    for (size_t i = 0; i < length; i++) {
+        h ^= (unsigned char)text[i];
+        h *= 16777619U;
+    }
+    return h;
+}
 
-    for (size_t i = 0; i < db->count; i++) {
-        if (db->patients[i].id == id) {
-            printf("Removing patient %s (ID: %d)...\n", db->patients[i].name, id);
-            
-            // Free medical history memory
-            freeMedicalHistory(&db->patients[i].medicalHistory);
+// Initialize an empty string pool
+void initStringPool(StringPool* pool) {
+    pool->data = (char*)malloc(STRING_POOL_MIN_CAPACITY);
+    pool->table = (uint32_t*)calloc(INDEX_MIN_CAPACITY, sizeof(uint32_t));
+    if (pool->data == NULL || pool->table == NULL) {
+        fprintf(stderr, "Failed to allocate memory for string pool\n");
+        exit(EXIT_FAILURE);
+    }
+    pool->data[0] = '\0';
+    pool->length = 1;
+    pool->capacity = STRING_POOL_MIN_CAPACITY;
+    pool->tableCapacity = INDEX_MIN_CAPACITY;
+    pool->count = 0;
+}
 
-            // Shift remaining patients left
-            for (size_t j = i; j < db->count - 1; j++) {
-                db->patients[j] = db->patients[j + 1];
+// Double the interning table and re-insert every string
+bool growStringTable(StringPool* pool) {
+    size_t newCapacity = pool->tableCapacity * 2;
+    uint32_t* newTable = (uint32_t*)calloc(newCapacity, sizeof(uint32_t));
+    if (newTable == NULL) {
+        return false;
+    }
+    size_t mask = newCapacity - 1;
+    for (size_t i = 0; i < pool->tableCapacity; i++) {
+        uint32_t ref = pool->table[i];
+        if (ref != 0 && ref < pool->length) {  // entries of a damaged file that point past the pool are dropped
+            const char* text = pool->data + ref;
+            size_t slot = hashString(text, strlen(text)) & mask;
+            while (newTable[slot] != 0) {
+                slot = (slot + 1) & mask;
             }
-            db->count--;
-            printf("Patient with ID %d removed successfully.\n", id);
-            return true;
+            newTable[slot] = ref;
         }
     }
-    printf("Patient with ID %d not found.\n", id);
-    return false;
+    releaseBlock(pool->table);
+    pool->table = newTable;
+    pool->tableCapacity = newCapacity;
+    return true;
 }
 
-// Display all patients
-void displayAllPatients(const PatientDatabase* db) {
-    printf("\n=== Patient Database (%zu/%zu) ===\n", db->count, db->capacity);
-    if (db->count == 0) {
-        printf("No patients in the database.\n");
-    } else {
-        for (size_t i = 0; i < db->count; i++) {
-            displayPatient(&db->patients[i]);
-            printf("----------------------------\n");
+// Store a string once; identical names and diagnoses share their bytes
+uint32_t internString(StringPool* pool, const char* text, size_t length) {
+    if (length == 0) {
+        return 0;
+    }
+
+    // Table entries from a mapped file are checked as they are compared, and only a damaged table is ever full
+    size_t mask = pool->tableCapacity - 1;
+    size_t slot = hashString(text, length) & mask;
+    for (size_t probes = 0; pool->table[slot] != 0; probes++) {
+        uint32_t ref = pool->table[slot];
+        if (ref < pool->length && strncmp(pool->data + ref, text, length) == 0 && pool->data[ref + length] == '\0') {
+            return ref;
+        }
+        if (probes == mask) {
+            fprintf(stderr, "String table is damaged\n");
+            return NO_STRING;
+        }
+        slot = (slot + 1) & mask;
+    }
+
+    if (pool->length + length + 1 > UINT32_MAX - 1) {
+        fprintf(stderr, "String pool is full\n");
+        return NO_STRING;
+    }
+    if (pool->length + length + 1 > pool->capacity) {
+        size_t newCapacity = pool->capacity * 2;
+        while (newCapacity < pool->length + length + 1) {
+            newCapacity *= 2;
         }
+        char* newData = (char*)resizeBlock(pool->data, pool->length, newCapacity);
+        if (newData == NULL) {
+            fprintf(stderr, "Failed to expand string pool\n");
+            return NO_STRING;
+        }
+        pool->data = newData;
+        pool->capacity = newCapacity;
+    }
+
+    uint32_t ref = (uint32_t)pool->length;
+    memcpy(pool->data + ref, text, length);
+    pool->data[ref + length] = '\0';
+    pool->length += length + 1;
+    pool->table[slot] = ref;
+    pool->count++;
+
+    // Keep the interning table under 70% full
+    if (pool->count * 10 > pool->tableCapacity * 7 && !growStringTable(pool)) {
+        fprintf(stderr, "Failed to expand string pool\n");
     }
-    printf("*** End of Database ***\n");
+    return ref;
 }
 
-// Display a single patient
-void displayPatient(const Patient* p) {
-    printf("\nPatient ID: %d\n", p->id);
-    printf("Name: %s\n", p->name);
-    printf("Age: %d\n", p->age);
-    printf("Diagnosis: %s\n", p->diagnosis);
-    printf("Medical History:\n%s\n", p->medicalHistory.details);
+// Text of an interned string
+const char* poolString(const StringPool* pool, uint32_t ref) {
+    return ref < pool->length ? pool->data + ref : "";  // a ref from a damaged file reads as empty
 }
 
-// Free all database memory
-void freePatientDatabase(PatientDatabase* db) {
-    for (size_t i = 0; i < db->count; i++) {
-        freeMedicalHistory(&db->patients[i].medicalHistory);
+// Free string pool memory
+void freeStringPool(StringPool* pool) {
+    releaseBlock(pool->data);
+    releaseBlock(pool->table);
+    pool->data = NULL;
+    pool->table = NULL;
+    pool->length = 0;
+    pool->capacity = 0;
+    pool->tableCapacity = 0;
+    pool->count = 0;
+}
+
+// Check whether a block lies inside one of the open database files
+bool inMappedFile(const void* block) {
+    const char* p = (const char*)block;
+    for (int i = 0; i < MAX_MAPPED_FILES; i++) {
+        // Empty sections point one past the end, so that address counts as mapped too
+        if (mappedFiles[i].base != NULL && p >= mappedFiles[i].base && p <= mappedFiles[i].base + mappedFiles[i].size) {
+            return true;
+        }
     }
-    free(db->patients);
-    db->patients = NULL;
-    db->count = 0;
-    db->capacity = 0;
+    return false;
+}
+
+// Grow a block; mapped blocks cannot be realloc'ed so they are copied to the heap
+void* resizeBlock(void* block, size_t oldSize, size_t newSize) {
+    if (block == NULL || !inMappedFile(block)) {
+        return realloc(block, newSize);
+    }
+    void* copy = malloc(newSize);
+    if (copy != NULL) {
+        memcpy(copy, block, oldSize < newSize ? oldSize : newSize);
+    }
+    return copy;
+}
+
+// Free a heap block; mapped blocks go away with munmap
+void releaseBlock(void* block) {
+    if (!inMappedFile(block)) {
+        free(block);
+    }
+}
+
+// Initialize patient database
+void initPatientDatabase(PatientDatabase* db, size_t initialCapacity) {
+    db->ids = NULL;
+    db->ages = NULL;
+    db->nameRefs = NULL;
+    db->diagnosisRefs = NULL;
+    db->histories = NULL;
+    db->rowSlots = NULL;
+    db->count = 0;
+    db->capacity = 0;
+    memset(&db->file, 0, sizeof(db->file));
+    db->wal = NULL;
+    db->appliedLsn = 0;
+    db->index = NULL;
+    db->indexCapacity = 0;
+    db->slots = NULL;
+    db->slotCount = 0;
+    db->slotCapacity = 0;
+    db->freeSlot = INDEX_EMPTY;
+    memset(&db->search, 0, sizeof(db->search));
+    memset(&db->names, 0, sizeof(db->names));
+    memset(&db->byAge, 0, sizeof(db->byAge));
+    memset(&db->slotCounts, 0, sizeof(db->slotCounts));
+    if (!reservePatientDatabase(db, initialCapacity)) {
+        fprintf(stderr, "Failed to allocate memory for patient database\n");
+        exit(EXIT_FAILURE);
+    }
+    initStringPool(&db->strings);
+}
+
+// Grow one column; the old block stays valid if realloc fails
+bool growColumn(void** column, size_t oldCapacity, size_t capacity, size_t elementSize) {
+    void* grown = resizeBlock(*column, oldCapacity * elementSize, capacity * elementSize);
+    if (grown == NULL) {
+        return false;
+    }
+    addStat(STAT_COLUMN_RESIZES, 1);
+    addStat(STAT_COLUMN_BYTES_MOVED, (oldCapacity < capacity ? oldCapacity : capacity) * elementSize);
+    *column = grown;
+    return true;
+}
+
+// Resize every column at once so they stay parallel
+bool reservePatientDatabase(PatientDatabase* db, size_t capacity) {
+    if (capacity <= db->capacity) {
+        return true;
+    }
+    size_t old = db->capacity;
+    if (!growColumn((void**)&db->ids, old, capacity, sizeof(int)) ||
+        !growColumn((void**)&db->ages, old, capacity, sizeof(int)) ||
+        !growColumn((void**)&db->nameRefs, old, capacity, sizeof(uint32_t)) ||
+        !growColumn((void**)&db->diagnosisRefs, old, capacity, sizeof(uint32_t)) ||
+        !growColumn((void**)&db->histories, old, capacity, sizeof(MedicalHistory)) ||
+        !growColumn((void**)&db->rowSlots, old, capacity, sizeof(uint32_t))) {
+        return false;
+    }
+    db->capacity = capacity;
+
+    // Size the handle slots and the index too, so filling the rows never regrows them
+    if (db->slotCapacity < capacity) {
+        PatientSlot* newSlots = (PatientSlot*)resizeBlock(db->slots, db->slotCapacity * sizeof(PatientSlot), capacity * sizeof(PatientSlot));
+        if (newSlots == NULL) {
+            return false;
+        }
+        db->slots = newSlots;
+        db->slotCapacity = capacity;
+    }
+    if (capacity * 10 > db->indexCapacity * 7 && !initPatientIndex(db, capacity * 10 / 7 + 1)) {
+        return false;
+    }
+    return true;
+}
+
+// Mix the bits of an ID so sequential IDs spread across the index
+size_t hashPatientId(int id) {
+    uint32_t h = (uint32_t)id;
+    h ^= h >> 16;
+    h *= 0x7feb352dU;
+    h ^= h >> 15;
+    h *= 0x846ca68bU;
+    h ^= h >> 16;
+    return h;
+}
+
+// Build the ID index from scratch 
+bool initPatientIndex(PatientDatabase* db, size_t capacity) {
+    size_t newCapacity = INDEX_MIN_CAPACITY;
+    while (newCapacity < capacity) {
+        newCapacity *= 2;
+    }
+
+    IndexEntry* newIndex = (IndexEntry*)malloc(newCapacity * sizeof(IndexEntry));
+    if (newIndex == NULL) {
+        return false;
+    }
+    for (size_t i = 0; i < newCapacity; i++) {
+        newIndex[i].row = INDEX_EMPTY;
+    }
+
+    releaseBlock(db->index);
+    db->index = newIndex;
+    db->indexCapacity = newCapacity;
+    addStat(STAT_INDEX_REBUILDS, 1);
+    addStat(STAT_INDEX_ENTRIES_MOVED, db->count);
+
+    // Rows already in the database are re-inserted into the new table
+    size_t mask = newCapacity - 1;
+    for (size_t row = 0; row < db->count; row++) {
+        size_t slot = hashPatientId(db->ids[row]) & mask;
+        while (db->index[slot].row != INDEX_EMPTY) {
+            slot = (slot + 1) & mask;
+        }
+        db->index[slot].id = db->ids[row];
+        db->index[slot].row = row;
+    }
+    return true;
+}
+
+// Find the row of a patient in the ID index (linear probing); rows and probe runs of a mapped index are bounded here
+size_t lookupPatientRow(const PatientDatabase* db, int id) {
+    size_t mask = db->indexCapacity - 1;
+    size_t slot = hashPatientId(id) & mask;
+    for (size_t probes = 0; probes <= mask && db->index[slot].row != INDEX_EMPTY; probes++) {
+        if (db->index[slot].id == id) {
+            return db->index[slot].row < db->count ? db->index[slot].row : INDEX_EMPTY;
+        }
+        slot = (slot + 1) & mask;
+    }
+    return INDEX_EMPTY;
+}
+
+// Add an ID to the index, or point an existing ID at a new row
+bool indexPatient(PatientDatabase* db, int id, size_t row) {
+    // Keep the load factor under 70% so probe sequences stay short
+    if ((db->count + 1) * 10 > db->indexCapacity * 7) {
+        if (!initPatientIndex(db, db->indexCapacity * 2)) {
+            fprintf(stderr, "Failed to expand patient index\n");
+            return false;
+        }
+    }
+
+    size_t mask = db->indexCapacity - 1;
+    size_t slot = hashPatientId(id) & mask;
+    for (size_t probes = 0; db->index[slot].row != INDEX_EMPTY && db->index[slot].id != id; probes++) {
+        if (probes == mask) {
+            // Only a damaged file leaves no empty slot; rebuild the table from the ID column and retry
+            return initPatientIndex(db, db->indexCapacity) && indexPatient(db, id, row);
+        }
+        slot = (slot + 1) & mask;
+    }
+    db->index[slot].id = id;
+    db->index[slot].row = row;
+    return true;
+}
+
+// Remove an ID from the index without leaving tombstones
+void unindexPatient(PatientDatabase* db, int id) {
+    size_t mask = db->indexCapacity - 1;
+    size_t slot = hashPatientId(id) & mask;
+    size_t probes = 0;
+    while (db->index[slot].row != INDEX_EMPTY && db->index[slot].id != id && probes++ < mask) {
+        slot = (slot + 1) & mask;
+    }
+    if (db->index[slot].row == INDEX_EMPTY || db->index[slot].id != id) {
+        return;
+    }
+
+    // Backward-shift the rest of the cluster into the hole; the step bound only matters for a damaged table
+    size_t hole = slot;
+    size_t next = (hole + 1) & mask;
+    for (size_t steps = 0; steps < mask && db->index[next].row != INDEX_EMPTY; steps++) {
+        size_t home = hashPatientId(db->index[next].id) & mask;
+        if (((next - home) & mask) >= ((next - hole) & mask)) {
+            db->index[hole] = db->index[next];
+            hole = next;
+        }
+        next = (next + 1) & mask;
+    }
+    db->index[hole].row = INDEX_EMPTY;
+}
+
+// Add a new patient 
+bool addPatient(PatientDatabase* db) {
+    printf("\n*** Add New Patient ***\n");
+    
+    // Get patient details from user
+    int id;
+    while (1) {
+        id = getIntInput("Enter patient ID: ");
+        if (lookupPatientRow(db, id) == INDEX_EMPTY) {
+            break;
+        }
+        printf("Patient ID %d already exists. Please enter a different ID.\n", id);
+    }
+    
+    char name[MAX_NAME_LENGTH];
+    getStringInput("Enter patient name: ", name, sizeof(name));
+    
+    int age;
+    while (1) {
+        age = getIntInput("Enter patient age: ");
+        if (age > 0 && age <= MAX_PATIENT_AGE) {
+            break;
+        }
+        printf("Invalid age. Please enter a value between 1 and %d.\n", MAX_PATIENT_AGE);
+    }
+    
+    char diagnosis[MAX_DIAGNOSIS_LENGTH];
+    getStringInput("Enter primary diagnosis: ", diagnosis, sizeof(diagnosis));
+    
+    // Get initial medical history
+    char historyEntry[MAX_INPUT_LENGTH];
+    getStringInput("Enter initial medical history notes: ", historyEntry, sizeof(historyEntry));
+
+    if (!insertPatient(db, id, name, age, diagnosis, historyEntry)) {
+        printf("Patient could not be added.\n");
+        return false;
+    }
+    if (!commitPatientChanges(db)) {
+        printf("Patient added, but the change could not be written to disk.\n");
+        return false;
+    }
+    printf("Patient added successfully.\n");
+    return true;
+}
+
+// Store an already validated patient record
+bool insertPatient(PatientDatabase* db, int id, const char* name, int age, const char* diagnosis, const char* historyEntry) {
+    return insertPatientFields(db, id, name, strnlen(name, MAX_NAME_LENGTH - 1), age,
+                               diagnosis, strnlen(diagnosis, MAX_DIAGNOSIS_LENGTH - 1), historyEntry, strlen(historyEntry));
+}
+
+// Store a validated record whose text fields point into someone else's buffer; an empty history adds no entry
+bool insertPatientFields(PatientDatabase* db, int id, const char* name, size_t nameLength, int age,
+                         const char* diagnosis, size_t diagnosisLength, const char* historyEntry, size_t historyLength) {
+    uint64_t start = beginOperation(STAT_ADD);
+    if (lookupPatientRow(db, id) != INDEX_EMPTY) {
+        endOperation(STAT_ADD, start);
+        return false;
+    }
+
+    // Resize database 
+    if (db->count >= db->capacity && !reservePatientDatabase(db, db->capacity ? db->capacity * 2 : INITIAL_DATABASE_CAPACITY)) {
+        fprintf(stderr, "Failed to expand patient database\n");
+        endOperation(STAT_ADD, start);
+        return false;
+    }
+    uint32_t nameRef = internString(&db->strings, name, nameLength);
+    uint32_t diagnosisRef = internString(&db->strings, diagnosis, diagnosisLength);
+    if (nameRef == NO_STRING || diagnosisRef == NO_STRING) {
+        endOperation(STAT_ADD, start);
+        return false;
+    }
+
+    // Take a handle slot, reusing released ones first; a free list from a damaged file may lead out of the table
+    if (db->freeSlot != INDEX_EMPTY && db->freeSlot >= db->slotCount) {
+        db->freeSlot = INDEX_EMPTY;
+    }
+    size_t slot = db->freeSlot;
+    if (slot == INDEX_EMPTY) {
+        if (db->slotCount >= NO_SLOT) {
+            fprintf(stderr, "Too many patient handles\n");
+            endOperation(STAT_ADD, start);
+            return false;
+        }
+        if (db->slotCount >= db->slotCapacity) {
+            size_t newCapacity = db->slotCapacity ? db->slotCapacity * 2 : INITIAL_DATABASE_CAPACITY;
+            PatientSlot* newSlots = (PatientSlot*)resizeBlock(db->slots, db->slotCapacity * sizeof(PatientSlot), newCapacity * sizeof(PatientSlot));
+            if (newSlots == NULL) {
+                fprintf(stderr, "Failed to expand patient handles\n");
+                endOperation(STAT_ADD, start);
+                return false;
+            }
+            db->slots = newSlots;
+            db->slotCapacity = newCapacity;
+        }
+        slot = db->slotCount;
+        db->slots[slot].generation = 1;
+    }
+    MedicalHistory history;
+    initMedicalHistory(&history);
+    if (historyLength > 0 && !addMedicalHistoryEntry(&history, historyEntry, historyLength)) {
+        endOperation(STAT_ADD, start);
+        return false;
+    }
+    if (!indexPatient(db, id, db->count)) {
+        freeMedicalHistory(&history);
+        endOperation(STAT_ADD, start);
+        return false;
+    }
+
+    // Log before touching the columns so a failed record leaves nothing behind to be checkpointed
+    if (db->wal != NULL) {
+        const char* texts[3] = { name, diagnosis, historyEntry };
+        size_t lengths[3] = { nameLength, diagnosisLength, historyLength };
+        if (!walLogRecord(db->wal, WAL_ADD_PATIENT, id, age, texts, lengths, 3, &db->appliedLsn)) {
+            fprintf(stderr, "Patient %d not added: the change could not be logged\n", id);
+            unindexPatient(db, id);
+            freeMedicalHistory(&history);
+            endOperation(STAT_ADD, start);
+            return false;
+        }
+    }
+    if (slot == db->freeSlot) {
+        db->freeSlot = db->slots[slot].row;
+    } else {
+        db->slotCount++;
+    }
+    db->slots[slot].row = db->count;
+    db->rowSlots[db->count] = (uint32_t)slot;
+    countSlot(db, slot, true);
+
+    // Add the new patient
+    size_t row = db->count;
+    db->ids[row] = id;
+    db->ages[row] = age;
+    db->nameRefs[row] = nameRef;
+    db->diagnosisRefs[row] = diagnosisRef;
+    db->histories[row] = history;
+
+    db->count++;
+    if (db->search.built && !indexPatientRecord(db, row)) {
+        fprintf(stderr, "Search index dropped, it will be rebuilt by the next search\n");
+        freeSearchIndex(&db->search);
+    }
+    if (db->names.built && !addNameEntry(db, row)) {
+        freeNameIndex(&db->names);
+    }
+    if (db->byAge.built && !addAgeEntry(db, row)) {
+        freeAgeIndex(&db->byAge);
+    }
+    endOperation(STAT_ADD, start);
+    return true;
+}
+
+// Find a patient by ID; statistics cost the untimed calls one thread-local increment and no stack frame
+PatientHandle findPatient(PatientDatabase* db, int id) {
+    if (++pendingCalls[STAT_FIND] >= STATS_TIMING_INTERVAL) {
+        return timeFindPatient(db, id);
+    }
+    size_t row = lookupPatientRow(db, id);
+    if (row == INDEX_EMPTY) {
+        PatientHandle none = { NO_SLOT, 0 };
+        return none;
+    }
+    return rowHandle(db, row);
+}
+
+// The sampled findPatient call, kept out of it so the lookup path stays a leaf the compiler can inline
+PatientHandle timeFindPatient(PatientDatabase* db, int id) {
+    uint64_t start = startTimedCall(STAT_FIND);
+    PatientHandle handle = { NO_SLOT, 0 };
+    size_t row = lookupPatientRow(db, id);
+    if (row != INDEX_EMPTY) {
+        handle = rowHandle(db, row);
+    }
+    endOperation(STAT_FIND, start);
+    return handle;
+}
+
+// Handle of a row; a slot number from a damaged file that falls outside the slot table refers to nobody
+PatientHandle rowHandle(const PatientDatabase* db, size_t row) {
+    PatientHandle handle = { NO_SLOT, 0 };
+    uint32_t slot = db->rowSlots[row];
+    if (slot < db->slotCount) {
+        handle.slot = slot;
+        handle.generation = db->slots[slot].generation;
+    }
+    return handle;
+}
+
+// Resolve a handle to the patient's current row; the row must point back at the slot
+size_t getPatientRow(const PatientDatabase* db, PatientHandle handle) {
+    if (handle.slot >= db->slotCount || db->slots[handle.slot].generation != handle.generation) {
+        return INDEX_EMPTY;
+    }
+    size_t row = db->slots[handle.slot].row;
+    return row < db->count && db->rowSlots[row] == handle.slot ? row : INDEX_EMPTY;
+}
+
+// Assemble a patient view from the columns of one row
+void loadPatientRow(const PatientDatabase* db, size_t row, Patient* out) {
+    out->id = db->ids[row];
+    out->name = poolString(&db->strings, db->nameRefs[row]);
+    out->age = db->ages[row];
+    out->diagnosis = poolString(&db->strings, db->diagnosisRefs[row]);
+    out->medicalHistory = patientHistory(db, row);
+}
+
+// Look up a patient by handle; the view is valid until the next add or remove
+bool getPatient(const PatientDatabase* db, PatientHandle handle, Patient* out) {
+    size_t row = getPatientRow(db, handle);
+    if (row == INDEX_EMPTY) {
+        return false;
+    }
+    loadPatientRow(db, row, out);
+    return true;
+}
+
+// Append to the medical history of the patient behind a handle
+bool appendPatientHistory(PatientDatabase* db, PatientHandle handle, const char* entry) {
+    uint64_t start = beginOperation(STAT_APPEND);
+    size_t row = getPatientRow(db, handle);
+    if (row == INDEX_EMPTY) {
+        endOperation(STAT_APPEND, start);
+        return false;
+    }
+    // Make room first and log second, so the append itself can no longer fail once the record exists
+    MedicalHistory* history = patientHistory(db, row);
+    size_t length = strlen(entry);
+    if (!expandMedicalHistory(history, length + 1)) {
+        endOperation(STAT_APPEND, start);
+        return false;
+    }
+    if (db->wal != NULL && !walLogRecord(db->wal, WAL_APPEND_HISTORY, db->ids[row], 0, &entry, &length, 1, &db->appliedLsn)) {
+        fprintf(stderr, "History of patient %d not updated: the change could not be logged\n", db->ids[row]);
+        endOperation(STAT_APPEND, start);
+        return false;
+    }
+    addMedicalHistoryEntry(history, entry, length);
+    if (db->search.built && !indexSearchText(db, row, (uint32_t)history->entryCount, entry, strlen(entry))) {
+        fprintf(stderr, "Search index dropped, it will be rebuilt by the next search\n");
+        freeSearchIndex(&db->search);
+    }
+    endOperation(STAT_APPEND, start);
+    return true;
+}
+
+// Compare two names ignoring case
+int compareNames(const char* a, const char* b) {
+    while (*a != '\0' && tolower((unsigned char)*a) == tolower((unsigned char)*b)) {
+        a++;
+        b++;
+    }
+    return tolower((unsigned char)*a) - tolower((unsigned char)*b);
+}
+
+// Compare a name with a prefix ignoring case; 0 when the name starts with it
+int compareNamePrefix(const char* name, const char* prefix) {
+    for (; *prefix != '\0'; name++, prefix++) {
+        int diff = tolower((unsigned char)*name) - tolower((unsigned char)*prefix);
+        if (diff != 0) {
+            return diff;
+        }
+    }
+    return 0;
+}
+
+// Name order for the index; equal names keep a fixed order by string and slot
+int compareNameEntries(const void* a, const void* b) {
+    const NameEntry* x = (const NameEntry*)a;
+    const NameEntry* y = (const NameEntry*)b;
+    if (x->nameRef != y->nameRef) {
+        int diff = compareNames(poolString(nameSortPool, x->nameRef), poolString(nameSortPool, y->nameRef));
+        if (diff != 0) {
+            return diff;
+        }
+        return x->nameRef < y->nameRef ? -1 : 1;
+    }
+    return x->patient.slot < y->patient.slot ? -1 : x->patient.slot > y->patient.slot;
+}
+
+// First entry whose name is not ordered before the prefix
+size_t lowerBoundName(const PatientDatabase* db, const NameEntry* entries, size_t count, const char* prefix) {
+    size_t low = 0, high = count;
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        if (compareNamePrefix(poolString(&db->strings, entries[mid].nameRef), prefix) < 0) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+// Sort every patient by name; done once, on the first name query
+bool buildNameIndex(PatientDatabase* db) {
+    NameIndex* index = &db->names;
+    freeNameIndex(index);
+    index->entries = (NameEntry*)malloc((db->count ? db->count : 1) * sizeof(NameEntry));
+    index->recent = (NameEntry*)malloc(NAME_INDEX_RECENT_LIMIT * sizeof(NameEntry));
+    if (index->entries == NULL || index->recent == NULL) {
+        fprintf(stderr, "Failed to allocate memory for the name index\n");
+        freeNameIndex(index);
+        return false;
+    }
+    for (size_t row = 0; row < db->count; row++) {
+        index->entries[row].nameRef = db->nameRefs[row];
+        index->entries[row].patient = rowHandle(db, row);
+    }
+    nameSortPool = &db->strings;
+    qsort(index->entries, db->count, sizeof(NameEntry), compareNameEntries);
+    index->count = db->count;
+    index->capacity = db->count ? db->count : 1;
+    index->built = true;
+    return true;
+}
+
+// Fold the recent names into the sorted array, dropping removed patients
+bool mergeNameIndex(PatientDatabase* db) {
+    NameIndex* index = &db->names;
+    size_t total = index->count + index->recentCount;
+    NameEntry* merged = (NameEntry*)malloc((total ? total : 1) * sizeof(NameEntry));
+    if (merged == NULL) {
+        return false;
+    }
+    nameSortPool = &db->strings;
+    size_t a = 0, b = 0, n = 0;
+    while (a < index->count || b < index->recentCount) {
+        const NameEntry* next;
+        if (b == index->recentCount || (a < index->count && compareNameEntries(&index->entries[a], &index->recent[b]) <= 0)) {
+            next = &index->entries[a++];
+        } else {
+            next = &index->recent[b++];
+        }
+        if (getPatientRow(db, next->patient) != INDEX_EMPTY) {
+            merged[n++] = *next;
+        }
+    }
+    free(index->entries);
+    index->entries = merged;
+    index->count = n;
+    index->capacity = total ? total : 1;
+    index->recentCount = 0;
+    index->stale = 0;
+    return true;
+}
+
+// Add a new patient's name: binary search into the small recent buffer
+bool addNameEntry(PatientDatabase* db, size_t row) {
+    NameIndex* index = &db->names;
+    if (index->recentCount == NAME_INDEX_RECENT_LIMIT && !mergeNameIndex(db)) {
+        return false;
+    }
+    NameEntry entry;
+    entry.nameRef = db->nameRefs[row];
+    entry.patient = rowHandle(db, row);
+
+    nameSortPool = &db->strings;
+    size_t low = 0, high = index->recentCount;
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        if (compareNameEntries(&index->recent[mid], &entry) < 0) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    memmove(&index->recent[low + 1], &index->recent[low], (index->recentCount - low) * sizeof(NameEntry));
+    index->recent[low] = entry;
+    index->recentCount++;
+    return true;
+}
+
+// Patients whose name starts with prefix, alphabetically; only the matching range is read
+size_t findPatientsByNamePrefix(PatientDatabase* db, const char* prefix, PatientHandle* results, size_t maxResults) {
+    uint64_t start = beginOperation(STAT_NAME_QUERY);
+    NameIndex* index = &db->names;
+    if (!index->built && !buildNameIndex(db)) {
+        endOperation(STAT_NAME_QUERY, start);
+        return 0;
+    }
+    if (index->stale * 2 > index->count) {
+        mergeNameIndex(db);  // mostly removed patients left: compact before searching
+    }
+
+    // The match is one range in each sorted array; merge the two ranges
+    size_t a = lowerBoundName(db, index->entries, index->count, prefix);
+    size_t b = lowerBoundName(db, index->recent, index->recentCount, prefix);
+    size_t n = 0;
+    nameSortPool = &db->strings;
+    while (n < maxResults) {
+        bool inEntries = a < index->count && compareNamePrefix(poolString(&db->strings, index->entries[a].nameRef), prefix) == 0;
+        bool inRecent = b < index->recentCount && compareNamePrefix(poolString(&db->strings, index->recent[b].nameRef), prefix) == 0;
+        const NameEntry* next;
+        if (inEntries && (!inRecent || compareNameEntries(&index->entries[a], &index->recent[b]) <= 0)) {
+            next = &index->entries[a++];
+        } else if (inRecent) {
+            next = &index->recent[b++];
+        } else {
+            break;
+        }
+        if (getPatientRow(db, next->patient) != INDEX_EMPTY) {
+            results[n++] = next->patient;
+        }
+    }
+    endOperation(STAT_NAME_QUERY, start);
+    return n;
+}
+
+// Free the name index; it is rebuilt by the next name query
+void freeNameIndex(NameIndex* index) {
+    free(index->entries);
+    free(index->recent);
+    memset(index, 0, sizeof(*index));
+}
+
+// Put a patient in the bucket for their age
+bool addAgeEntry(PatientDatabase* db, size_t row) {
+    int age = db->ages[row];
+    if (age < 0 || age > MAX_PATIENT_AGE) {
+        return true;  // never accepted on input, so nothing to index
+    }
+    AgeBucket* bucket = &db->byAge.buckets[age];
+    if (bucket->count == bucket->capacity) {
+        // Drop removed patients before paying for a bigger block
+        if (bucket->live < bucket->count / 2) {
+            uint32_t n = 0;
+            for (uint32_t i = 0; i < bucket->count; i++) {
+                if (getPatientRow(db, bucket->patients[i]) != INDEX_EMPTY) {
+                    bucket->patients[n++] = bucket->patients[i];
+                }
+            }
+            bucket->count = n;
+        } else {
+            uint32_t newCapacity = bucket->capacity ? bucket->capacity * 2 : 4;
+            PatientHandle* patients = (PatientHandle*)realloc(bucket->patients, newCapacity * sizeof(PatientHandle));
+            if (patients == NULL) {
+                return false;
+            }
+            bucket->patients = patients;
+            bucket->capacity = newCapacity;
+        }
+    }
+    bucket->patients[bucket->count] = rowHandle(db, row);
+    bucket->count++;
+    bucket->live++;
+    return true;
+}
+
+// Bucket every patient by age; done once, on the first age query
+bool buildAgeIndex(PatientDatabase* db) {
+    freeAgeIndex(&db->byAge);
+    db->byAge.buckets = (AgeBucket*)calloc(MAX_PATIENT_AGE + 1, sizeof(AgeBucket));
+    if (db->byAge.buckets == NULL) {
+        fprintf(stderr, "Failed to allocate memory for the age index\n");
+        return false;
+    }
+    for (size_t row = 0; row < db->count; row++) {
+        if (!addAgeEntry(db, row)) {
+            fprintf(stderr, "Failed to allocate memory for the age index\n");
+            freeAgeIndex(&db->byAge);
+            return false;
+        }
+    }
+    db->byAge.built = true;
+    return true;
+}
+
+// Free the age index; it is rebuilt by the next age query
+void freeAgeIndex(AgeIndex* index) {
+    if (index->buckets != NULL) {
+        for (int age = 0; age <= MAX_PATIENT_AGE; age++) {
+            free(index->buckets[age].patients);
+        }
+        free(index->buckets);
+    }
+    index->buckets = NULL;
+    index->built = false;
+}
+
+// Count patients in an age band from the per-age counts
+size_t countPatientsByAge(PatientDatabase* db, int minAge, int maxAge) {
+    if (!db->byAge.built && !buildAgeIndex(db)) {
+        return 0;
+    }
+    size_t matches = 0;
+    for (int age = minAge < 0 ? 0 : minAge; age <= maxAge && age <= MAX_PATIENT_AGE; age++) {
+        matches += db->byAge.buckets[age].live;
+    }
+    return matches;
+}
+
+// Patients in an age band, youngest first; other ages are never looked at
+size_t findPatientsByAge(PatientDatabase* db, int minAge, int maxAge, PatientHandle* results, size_t maxResults) {
+    if (!db->byAge.built && !buildAgeIndex(db)) {
+        return 0;
+    }
+    size_t n = 0;
+    for (int age = minAge < 0 ? 0 : minAge; age <= maxAge && age <= MAX_PATIENT_AGE && n < maxResults; age++) {
+        const AgeBucket* bucket = &db->byAge.buckets[age];
+        for (uint32_t i = 0; i < bucket->count && n < maxResults; i++) {
+            if (getPatientRow(db, bucket->patients[i]) != INDEX_EMPTY) {
+                results[n++] = bucket->patients[i];
+            }
+        }
+    }
+    return n;
+}
+
+// Name search menu option
+void findPatientsByName(PatientDatabase* db) {
+    printf("\n*** Find Patients by Name ***\n");
+    char prefix[MAX_NAME_LENGTH];
+    getStringInput("Enter the start of the name: ", prefix, sizeof(prefix));
+
+    PatientHandle results[NAME_DISPLAY_RESULTS + 1];
+    size_t found = findPatientsByNamePrefix(db, prefix, results, NAME_DISPLAY_RESULTS + 1);
+    if (found == 0) {
+        printf("No patients with a name starting with \"%s\".\n", prefix);
+        return;
+    }
+    for (size_t i = 0; i < found && i < NAME_DISPLAY_RESULTS; i++) {
+        Patient p;
+        if (getPatient(db, results[i], &p)) {
+            printf("ID: %-8d Name: %-25s Age: %d\n", p.id, p.name, p.age);
+        }
+    }
+    if (found > NAME_DISPLAY_RESULTS) {
+        printf("(more matches, type more of the name to narrow them down)\n");
+    }
+}
+
+// Age band report menu option
+void displayAgeBands(PatientDatabase* db) {
+    printf("\n=== Patients by Age ===\n");
+    size_t total = 0;
+    for (int band = 0; band < 100; band += AGE_BAND_WIDTH) {
+        size_t count = countPatientsByAge(db, band, band + AGE_BAND_WIDTH - 1);
+        printf("%3d-%-3d : %zu\n", band, band + AGE_BAND_WIDTH - 1, count);
+        total += count;
+    }
+    size_t oldest = countPatientsByAge(db, 100, MAX_PATIENT_AGE);
+    printf("100+    : %zu\n", oldest);
+    printf("Total   : %zu\n", total + oldest);
+}
+// Cut the next word out of a text, lowercased; words are runs of letters and digits
+bool nextSearchWord(const char** p, const char* end, char* word, size_t* length) {
+    const char* s = *p;
+    while (s < end && !isalnum((unsigned char)*s)) {
+        s++;
+    }
+    if (s == end) {
+        *p = s;
+        return false;
+    }
+    size_t n = 0;
+    while (s < end && isalnum((unsigned char)*s)) {
+        if (n < SEARCH_TERM_LENGTH - 1) {
+            word[n++] = (char)tolower((unsigned char)*s);
+        }
+        s++;
+    }
+    word[n] = '\0';
+    *length = n;
+    *p = s;
+    return true;
+}
+
+// Rehash every term into a bigger table
+bool growSearchTable(SearchIndex* index, size_t capacity) {
+    uint32_t* table = (uint32_t*)calloc(capacity, sizeof(uint32_t));
+    if (table == NULL) {
+        return false;
+    }
+    size_t mask = capacity - 1;
+    for (size_t term = 0; term < index->termCount; term++) {
+        const char* text = index->terms[term].text;
+        size_t slot = hashString(text, strlen(text)) & mask;
+        while (table[slot] != 0) {
+            slot = (slot + 1) & mask;
+        }
+        table[slot] = (uint32_t)term + 1;
+    }
+    free(index->table);
+    index->table = table;
+    index->tableCapacity = capacity;
+    return true;
+}
+
+// Look a word up in the term table, adding it when create is set
+uint32_t findSearchTerm(SearchIndex* index, const char* word, size_t length, bool create) {
+    if (index->tableCapacity == 0) {
+        if (!create || !growSearchTable(index, INDEX_MIN_CAPACITY)) {
+            return NO_TERM;
+        }
+    }
+    size_t mask = index->tableCapacity - 1;
+    size_t slot = hashString(word, length) & mask;
+    while (index->table[slot] != 0) {
+        uint32_t term = index->table[slot] - 1;
+        if (strcmp(index->terms[term].text, word) == 0) {
+            return term;
+        }
+        slot = (slot + 1) & mask;
+    }
+    if (!create) {
+        return NO_TERM;
+    }
+
+    // New word: keep the table under 70% full, then take the empty slot
+    if ((index->termCount + 1) * 10 > index->tableCapacity * 7) {
+        if (!growSearchTable(index, index->tableCapacity * 2)) {
+            return NO_TERM;
+        }
+        mask = index->tableCapacity - 1;
+        slot = hashString(word, length) & mask;
+        while (index->table[slot] != 0) {
+            slot = (slot + 1) & mask;
+        }
+    }
+    if (index->termCount == index->termCapacity) {
+        size_t newCapacity = index->termCapacity ? index->termCapacity * 2 : INDEX_MIN_CAPACITY;
+        SearchTerm* terms = (SearchTerm*)realloc(index->terms, newCapacity * sizeof(SearchTerm));
+        if (terms == NULL) {
+            return NO_TERM;
+        }
+        index->terms = terms;
+        index->termCapacity = newCapacity;
+    }
+    SearchTerm* term = &index->terms[index->termCount];
+    memcpy(term->text, word, length + 1);
+    term->postings = NULL;
+    term->count = 0;
+    term->capacity = 0;
+    term->sorted = 0;
+    index->table[slot] = (uint32_t)++index->termCount;
+    return (uint32_t)index->termCount - 1;
+}
+
+// Order postings by slot so lists can be intersected by merging
+int comparePostings(const void* a, const void* b) {
+    const Posting* x = (const Posting*)a;
+    const Posting* y = (const Posting*)b;
+    if (x->slot != y->slot) {
+        return x->slot < y->slot ? -1 : 1;
+    }
+    if (x->generation != y->generation) {
+        return x->generation < y->generation ? -1 : 1;
+    }
+    return x->entry < y->entry ? -1 : x->entry > y->entry;
+}
+
+// Append a posting; the sorted prefix only grows while slots keep increasing
+bool addPosting(SearchTerm* term, Posting posting) {
+    if (term->count > 0) {
+        const Posting* last = &term->postings[term->count - 1];
+        if (last->slot == posting.slot && last->generation == posting.generation) {
+            return true;  // the word already points at this patient
+        }
+    }
+    if (term->count == term->capacity) {
+        uint32_t newCapacity = term->capacity ? term->capacity * 2 : 4;
+        Posting* postings = (Posting*)realloc(term->postings, newCapacity * sizeof(Posting));
+        if (postings == NULL) {
+            return false;
+        }
+        term->postings = postings;
+        term->capacity = newCapacity;
+    }
+    if (term->sorted == term->count && (term->count == 0 || comparePostings(&term->postings[term->count - 1], &posting) < 0)) {
+        term->sorted++;
+    }
+    term->postings[term->count++] = posting;
+    return true;
+}
+
+// A posting is live while its slot still has the generation it was made with
+bool postingLive(const PatientDatabase* db, const Posting* posting) {
+    return posting->slot < db->slotCount && db->slots[posting->slot].generation == posting->generation;
+}
+
+// Sort recent appends into the list and drop postings of removed patients
+bool normalizeSearchTerm(const PatientDatabase* db, SearchTerm* term, bool sweep) {
+    if (term->sorted == term->count && !sweep) {
+        return true;
+    }
+    qsort(term->postings + term->sorted, term->count - term->sorted, sizeof(Posting), comparePostings);
+    Posting* merged = (Posting*)malloc((term->count ? term->count : 1) * sizeof(Posting));
+    if (merged == NULL) {
+        return false;
+    }
+
+    size_t a = 0, b = term->sorted, n = 0;
+    while (a < term->sorted || b < term->count) {
+        const Posting* next;
+        if (b == term->count || (a < term->sorted && comparePostings(&term->postings[a], &term->postings[b]) <= 0)) {
+            next = &term->postings[a++];
+        } else {
+            next = &term->postings[b++];
+        }
+        if (!postingLive(db, next) || (n > 0 && merged[n - 1].slot == next->slot && merged[n - 1].generation == next->generation)) {
+            continue;
+        }
+        merged[n++] = *next;
+    }
+    free(term->postings);
+    term->postings = merged;
+    term->count = term->sorted = (uint32_t)n;
+    term->capacity = (uint32_t)(term->count ? term->count : 1);
+    return true;
+}
+
+// Add every word of one diagnosis or history entry
+bool indexSearchText(PatientDatabase* db, size_t row, uint32_t entry, const char* text, size_t length) {
+    PatientHandle handle = rowHandle(db, row);
+    Posting posting = { handle.slot, handle.generation, entry };
+    const char* p = text;
+    const char* end = text + length;
+    char word[SEARCH_TERM_LENGTH];
+    size_t wordLength;
+    while (nextSearchWord(&p, end, word, &wordLength)) {
+        uint32_t term = findSearchTerm(&db->search, word, wordLength, true);
+        if (term == NO_TERM || !addPosting(&db->search.terms[term], posting)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Index a whole patient: diagnosis first, then each history entry
+bool indexPatientRecord(PatientDatabase* db, size_t row) {
+    const char* diagnosis = poolString(&db->strings, db->diagnosisRefs[row]);
+    if (!indexSearchText(db, row, 0, diagnosis, strlen(diagnosis))) {
+        return false;
+    }
+    MedicalHistory scratch;
+    const MedicalHistory* history = peekPatientHistory(db, row, &scratch);
+    for (size_t i = 0; i < history->entryCount; i++) {
+        size_t length;
+        const char* entry = getMedicalHistoryEntry(history, i, &length);
+        if (!indexSearchText(db, row, (uint32_t)(i + 1), entry, length)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Index every patient; done once, on the first search
+bool buildSearchIndex(PatientDatabase* db) {
+    freeSearchIndex(&db->search);
+    for (size_t row = 0; row < db->count; row++) {
+        if (!indexPatientRecord(db, row)) {
+            freeSearchIndex(&db->search);
+            return false;
+        }
+    }
+    db->search.built = true;
+    return true;
+}
+
+// Free the index; it is rebuilt by the next search
+void freeSearchIndex(SearchIndex* index) {
+    for (size_t term = 0; term < index->termCount; term++) {
+        free(index->terms[term].postings);
+    }
+    free(index->terms);
+    free(index->table);
+    memset(index, 0, sizeof(*index));
+}
+
+// First posting at or after from whose slot is not below slot (exponential, then binary search)
+size_t gallopPostings(const SearchTerm* term, size_t from, uint32_t slot) {
+    size_t step = 1, high = from;
+    while (high < term->count && term->postings[high].slot < slot) {
+        from = high + 1;
+        high += step;
+        step *= 2;
+    }
+    if (high > term->count) {
+        high = term->count;
+    }
+    while (from < high) {
+        size_t mid = from + (high - from) / 2;
+        if (term->postings[mid].slot < slot) {
+            from = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return from;
+}
+
+// Slots of live patients found in every list; walks the shortest list and gallops through the others
+size_t intersectSearchTerms(const PatientDatabase* db, SearchTerm* terms[], int termCount, uint32_t* out) {
+    // Shortest list first
+    for (int i = 1; i < termCount; i++) {
+        for (int j = i; j > 0 && terms[j]->count < terms[j - 1]->count; j--) {
+            SearchTerm* swap = terms[j];
+            terms[j] = terms[j - 1];
+            terms[j - 1] = swap;
+        }
+    }
+
+    // With no removals since the last sweep every posting is live and each slot appears once per list
+    bool clean = db->search.removals == 0;
+    size_t cursors[SEARCH_MAX_QUERY_TERMS] = { 0 };
+    size_t n = 0;
+    for (size_t i = 0; i < terms[0]->count; i++) {
+        const Posting* candidate = &terms[0]->postings[i];
+        if (!clean && (!postingLive(db, candidate) || (n > 0 && out[n - 1] == candidate->slot))) {
+            continue;
+        }
+        bool everywhere = true;
+        for (int t = 1; t < termCount && everywhere; t++) {
+            size_t at = cursors[t] = gallopPostings(terms[t], cursors[t], candidate->slot);
+            everywhere = false;
+            while (at < terms[t]->count && terms[t]->postings[at].slot == candidate->slot) {
+                if (clean || terms[t]->postings[at].generation == candidate->generation) {
+                    everywhere = true;
+                    break;
+                }
+                at++;
+            }
+        }
+        if (everywhere) {
+            out[n++] = candidate->slot;
+        }
+    }
+    return n;
+}
+
+// Merge two sorted slot lists into out without duplicates
+size_t unionSlots(const uint32_t* a, size_t aCount, const uint32_t* b, size_t bCount, uint32_t* out) {
+    size_t i = 0, j = 0, n = 0;
+    while (i < aCount || j < bCount) {
+        uint32_t next;
+        if (j == bCount || (i < aCount && a[i] <= b[j])) {
+            next = a[i++];
+        } else {
+            next = b[j++];
+        }
+        if (n == 0 || out[n - 1] != next) {
+            out[n++] = next;
+        }
+    }
+    return n;
+}
+
+// Answer "word word OR word ..." queries: each part is an AND, the parts are ORed.
+// A part with more than SEARCH_MAX_QUERY_TERMS words is refused rather than answered for only some of them.
+size_t searchPatients(PatientDatabase* db, const char* query, PatientHandle* results, size_t maxResults) {
+    uint64_t start = beginOperation(STAT_SEARCH);
+    if (!db->search.built && !buildSearchIndex(db)) {
+        fprintf(stderr, "Failed to build the search index\n");
+        endOperation(STAT_SEARCH, start);
+        return 0;
+    }
+    // Once many patients are gone, sweep their postings out of every list
+    bool sweep = db->search.removals * 2 > db->count;
+    if (sweep) {
+        for (size_t term = 0; term < db->search.termCount; term++) {
+            normalizeSearchTerm(db, &db->search.terms[term], true);
+        }
+        db->search.removals = 0;
+    }
+
+    uint32_t* matches = NULL;
+    size_t matchCount = 0;
+    const char* p = query;
+    const char* end = query + strlen(query);
+    bool failed = false;
+    while (p < end && !failed) {
+        // Collect the words of one part, up to an OR
+        SearchTerm* terms[SEARCH_MAX_QUERY_TERMS];
+        int termCount = 0;
+        int wordCount = 0;
+        bool missing = false;
+        while (p < end) {
+            while (p < end && isspace((unsigned char)*p)) {
+                p++;
+            }
+            const char* wordEnd = p;
+            while (wordEnd < end && !isspace((unsigned char)*wordEnd)) {
+                wordEnd++;
+            }
+            size_t keyword = (size_t)(wordEnd - p);
+            if ((keyword == 2 && strncmp(p, "OR", 2) == 0) || (keyword == 3 && strncmp(p, "AND", 3) == 0)) {
+                p = wordEnd;
+                if (keyword == 2) {
+                    break;
+                }
+                continue;
+            }
+            char word[SEARCH_TERM_LENGTH];
+            size_t wordLength;
+            const char* w = p;
+            while (nextSearchWord(&w, wordEnd, word, &wordLength) && ++wordCount <= SEARCH_MAX_QUERY_TERMS) {
+                uint32_t term = findSearchTerm(&db->search, word, wordLength, false);
+                if (term == NO_TERM) {
+                    missing = true;
+                } else {
+                    terms[termCount++] = &db->search.terms[term];
+                }
+            }
+            p = wordEnd;
+        }
+        if (wordCount > SEARCH_MAX_QUERY_TERMS) {
+            free(matches);
+            endOperation(STAT_SEARCH, start);
+            return SEARCH_TOO_MANY_TERMS;
+        }
+        if (missing || termCount == 0) {
+            continue;  // a word nobody has: this part matches no one
+        }
+
+        for (int t = 0; t < termCount; t++) {
+            if (!normalizeSearchTerm(db, terms[t], false)) {
+                failed = true;
+            }
+        }
+        uint32_t* part = failed ? NULL : (uint32_t*)malloc(terms[0]->count * sizeof(uint32_t) + sizeof(uint32_t));
+        uint32_t* merged = part == NULL ? NULL : (uint32_t*)malloc((matchCount + terms[0]->count + 1) * sizeof(uint32_t));
+        if (merged == NULL) {
+            free(part);
+            failed = true;
+            break;
+        }
+        size_t partCount = intersectSearchTerms(db, terms, termCount, part);
+        matchCount = unionSlots(matches, matchCount, part, partCount, merged);
+        free(matches);
+        free(part);
+        matches = merged;
+    }
+    if (failed) {
+        fprintf(stderr, "Out of memory while searching\n");
+    }
+
+    for (size_t i = 0; i < matchCount && i < maxResults; i++) {
+        results[i].slot = matches[i];
+        results[i].generation = db->slots[matches[i]].generation;
+    }
+    free(matches);
+    endOperation(STAT_SEARCH, start);
+    return matchCount;
+}
+
+// Search menu option
+void searchRecords(PatientDatabase* db) {
+    printf("\n*** Search Diagnoses and Histories ***\n");
+    char query[MAX_INPUT_LENGTH];
+    getStringInput("Enter search words (words must all match, OR separates alternatives): ", query, sizeof(query));
+
+    PatientHandle results[SEARCH_DISPLAY_RESULTS];
+    uint64_t start = nowNanoseconds();
+    size_t found = searchPatients(db, query, results, SEARCH_DISPLAY_RESULTS);
+    double millis = (nowNanoseconds() - start) / 1e6;
+    if (found == SEARCH_TOO_MANY_TERMS) {
+        printf("Too many search words: use at most %d between ORs.\n", SEARCH_MAX_QUERY_TERMS);
+        return;
+    }
+
+    printf("%zu matching patients (%.3f ms)\n", found, millis);
+    for (size_t i = 0; i < found && i < SEARCH_DISPLAY_RESULTS; i++) {
+        Patient p;
+        if (getPatient(db, results[i], &p)) {
+            printf("ID: %-8d Name: %-25s Diagnosis: %s\n", p.id, p.name, p.diagnosis);
+        }
+    }
+    if (found > SEARCH_DISPLAY_RESULTS) {
+        printf("(%zu more not shown)\n", found - SEARCH_DISPLAY_RESULTS);
+    }
+}
+
+// Update patient medical history
+bool updateMedicalHistory(PatientDatabase* db) {
+    printf("\n*** Update Medical History ***\n");
+    int id = getIntInput("Enter patient ID to update: ");
+    
+    PatientHandle handle = findPatient(db, id);
+    Patient p;
+    if (!getPatient(db, handle, &p)) {
+        printf("Patient with ID %d not found.\n", id);
+        return false;
+    }
+    
+    printf("\nCurrent medical history for %s (ID: %d):\n", p.name, p.id);
+    displayRecentHistory(p.medicalHistory, HISTORY_DISPLAY_ENTRIES);
+    
+    char newEntry[MAX_INPUT_LENGTH];
+    getStringInput("Enter new medical history entry: ", newEntry, sizeof(newEntry));
+    
+    if (appendPatientHistory(db, handle, newEntry) && commitPatientChanges(db)) {
+        printf("Medical history updated successfully.\n");
+        return true;
+    } else {
+        printf("Failed to update medical history.\n");
+        return false;
+    }
+}
+
+// Remove a patient from the database 
+bool removePatient(PatientDatabase* db, int id) {
+    printf("\n*** Remove Discharged Patient ***\n");
+
+    Patient p;
+    if (!getPatient(db, findPatient(db, id), &p)) {
+        printf("Patient with ID %d not found.\n", id);
+        return false;
+    }
+
+    printf("Removing patient %s (ID: %d)...\n", p.name, id);
+    if (!erasePatient(db, id)) {
+        printf("Patient could not be removed.\n");
+        return false;
+    }
+    if (!commitPatientChanges(db)) {
+        printf("Patient removed, but the change could not be written to disk.\n");
+        return false;
+    }
+    printf("Patient with ID %d removed successfully.\n", id);
+    return true;
+}
+
+// Drop a patient in O(1): the last row moves into the hole and handles stay valid
+bool erasePatient(PatientDatabase* db, int id) {
+    uint64_t start = beginOperation(STAT_REMOVE);
+    size_t i = lookupPatientRow(db, id);
+    if (i == INDEX_EMPTY) {
+        endOperation(STAT_REMOVE, start);
+        return false;
+    }
+    if (db->wal != NULL && !walLogRecord(db->wal, WAL_REMOVE_PATIENT, id, 0, NULL, NULL, 0, &db->appliedLsn)) {
+        fprintf(stderr, "Patient %d not removed: the change could not be logged\n", id);
+        endOperation(STAT_REMOVE, start);
+        return false;
+    }
+
+    // Free medical history memory
+    freeMedicalHistory(resolvePatientHistory(db, i));
+    unindexPatient(db, id);
+
+    // Release the handle slot; outstanding handles now fail the generation check
+    uint32_t slot = db->rowSlots[i];
+    if (slot < db->slotCount) {
+        if (db->slots[slot].row == i) {
+            countSlot(db, slot, false);
+        }
+        db->slots[slot].generation++;
+        db->slots[slot].row = db->freeSlot;
+        db->freeSlot = slot;
+    }
+    db->search.removals++;  // its postings are now stale and get swept lazily
+    db->names.stale++;
+    if (db->byAge.built && db->ages[i] >= 0 && db->ages[i] <= MAX_PATIENT_AGE) {
+        db->byAge.buckets[db->ages[i]].live--;
+    }
+
+    size_t last = db->count - 1;
+    if (i != last) {
+        db->ids[i] = db->ids[last];
+        db->ages[i] = db->ages[last];
+        db->nameRefs[i] = db->nameRefs[last];
+        db->diagnosisRefs[i] = db->diagnosisRefs[last];
+        db->histories[i] = *resolvePatientHistory(db, last); // resolve before the row number changes
+        db->rowSlots[i] = db->rowSlots[last];
+        if (db->rowSlots[i] < db->slotCount) {
+            db->slots[db->rowSlots[i]].row = i;
+        }
+        indexPatient(db, db->ids[i], i);
+        addStat(STAT_ROWS_MOVED, 1);
+    }
+    db->count--;
+    maybeShrinkPatientDatabase(db);
+    endOperation(STAT_REMOVE, start);
+    return true;
+}
+
+// Give the columns back down to capacity rows (never below the patient count); the ID index follows
+bool shrinkPatientDatabase(PatientDatabase* db, size_t capacity) {
+    if (capacity < db->count) {
+        capacity = db->count;
+    }
+    if (capacity < INITIAL_DATABASE_CAPACITY) {
+        capacity = INITIAL_DATABASE_CAPACITY;
+    }
+    // Columns still in the mapped file cost no heap; copying them out to shrink would
+    if (capacity >= db->capacity || inMappedFile(db->ids)) {
+        return false;
+    }
+    size_t old = db->capacity;
+    // growColumn shrinks too; a column that fails to shrink is still big enough
+    growColumn((void**)&db->ids, old, capacity, sizeof(int));
+    growColumn((void**)&db->ages, old, capacity, sizeof(int));
+    growColumn((void**)&db->nameRefs, old, capacity, sizeof(uint32_t));
+    growColumn((void**)&db->diagnosisRefs, old, capacity, sizeof(uint32_t));
+    growColumn((void**)&db->histories, old, capacity, sizeof(MedicalHistory));
+    growColumn((void**)&db->rowSlots, old, capacity, sizeof(uint32_t));
+    db->capacity = capacity;
+
+    // Handle slots stay: their generations must outlive the handles that carry them
+    size_t indexSize = capacity * 10 / 7 + 1;
+    if (db->indexCapacity > INDEX_MIN_CAPACITY && indexSize <= db->indexCapacity / 2) {
+        initPatientIndex(db, indexSize);
+    }
+    return true;
+}
+
+// Hysteresis: halve once occupancy drops below a quarter, so a half-full database is stable in both directions.
+// Slab pages are left to compactPatientDatabase: discharges scatter their free blocks over every page.
+void maybeShrinkPatientDatabase(PatientDatabase* db) {
+    if (db->capacity > INITIAL_DATABASE_CAPACITY && db->count < db->capacity / SHRINK_OCCUPANCY_DIVISOR) {
+        shrinkPatientDatabase(db, db->capacity / 2);
+    }
+}
+
+// Copy a history into new blocks of the right size; the blocks it leaves go to retired for the caller to free
+size_t moveMedicalHistory(MedicalHistory* history, void* retired[2], size_t retiredSizes[2]) {
+    size_t count = 0;
+    if (history->details != NULL && !inMappedFile(history->details)) {
+        size_t used = history->packedLength != 0 ? history->packedLength : history->length + 1;
+        size_t granted;
+        char* block = (char*)slabAlloc(used, &granted);
+        if (block != NULL) {
+            memcpy(block, history->details, used);
+            retired[count] = history->details;
+            retiredSizes[count++] = history->capacity;
+            history->details = block;
+            history->capacity = granted;
+        }
+    }
+    if (history->entryOffsets != NULL && !inMappedFile(history->entryOffsets)) {
+        size_t used = history->entryCount * sizeof(uint32_t);
+        size_t granted = 0;
+        uint32_t* block = used != 0 ? (uint32_t*)slabAlloc(used, &granted) : NULL;
+        if (block != NULL || used == 0) {
+            if (block != NULL) {
+                memcpy(block, history->entryOffsets, used);
+            }
+            retired[count] = history->entryOffsets;
+            retiredSizes[count++] = history->entryCapacity * sizeof(uint32_t);
+            history->entryOffsets = block;
+            history->entryCapacity = granted / sizeof(uint32_t);
+        }
+    }
+    return count;
+}
+
+// Re-intern only the names and diagnoses still in use, dropping those of discharged patients
+bool rebuildStringPool(PatientDatabase* db) {
+    StringPool fresh;
+    initStringPool(&fresh);
+    uint32_t* refs = (uint32_t*)malloc((2 * db->count + 1) * sizeof(uint32_t));
+    if (refs == NULL) {
+        freeStringPool(&fresh);
+        return false;
+    }
+    for (size_t row = 0; row < db->count; row++) {
+        const char* name = poolString(&db->strings, db->nameRefs[row]);
+        const char* diagnosis = poolString(&db->strings, db->diagnosisRefs[row]);
+        refs[2 * row] = internString(&fresh, name, strlen(name));
+        refs[2 * row + 1] = internString(&fresh, diagnosis, strlen(diagnosis));
+        if (refs[2 * row] == NO_STRING || refs[2 * row + 1] == NO_STRING) {
+            free(refs);
+            freeStringPool(&fresh);
+            return false;
+        }
+    }
+    // A mapped pool costs no heap; replace it only when most of it is dead
+    if (inMappedFile(db->strings.data) && fresh.length * 4 > db->strings.length) {
+        free(refs);
+        freeStringPool(&fresh);
+        return false;
+    }
+    for (size_t row = 0; row < db->count; row++) {
+        db->nameRefs[row] = refs[2 * row];
+        db->diagnosisRefs[row] = refs[2 * row + 1];
+    }
+    free(refs);
+    freeStringPool(&db->strings);
+    db->strings = fresh;
+    freeNameIndex(&db->names);  // it holds name references into the old pool
+    return true;
+}
+
+// Explicit compaction: right-size every column and history, drop dead strings and the derived indexes,
+// and hand empty pages back to the system
+void compactPatientDatabase(PatientDatabase* db) {
+    shrinkPatientDatabase(db, db->count);
+
+    // Discharges leave live blocks scattered over every slab page; packing the histories into fresh pages
+    // lets the old ones empty out. Old blocks are freed only after all moves, so none is reused meanwhile.
+    void** retired = (void**)malloc((2 * db->count + 1) * sizeof(void*));
+    size_t* retiredSizes = (size_t*)malloc((2 * db->count + 1) * sizeof(size_t));
+    if (retired != NULL && retiredSizes != NULL) {
+        void* detached[SLAB_CLASS_COUNT];
+        detachSlabFreeLists(detached);
+        size_t count = 0;
+        for (size_t row = 0; row < db->count; row++) {
+            if (db->histories[row].capacity != 0) {  // 0: still read from the mapped file
+                count += moveMedicalHistory(&db->histories[row], retired + count, retiredSizes + count);
+            }
+        }
+        for (size_t i = 0; i < count; i++) {
+            slabFree(retired[i], retiredSizes[i]);
+        }
+        reattachSlabFreeLists(detached);
+    }
+    free(retired);
+    free(retiredSizes);
+
+    rebuildStringPool(db);
+    freeSearchIndex(&db->search);  // indexes are rebuilt by their next query, without stale entries
+    freeNameIndex(&db->names);
+    freeAgeIndex(&db->byAge);
+    trimHistorySlabs();
+#ifdef __GLIBC__
+    malloc_trim(0);  // freed heap at the top of the arena is otherwise kept by the allocator
+#endif
+}
+
+// Menu option: compact and show the resident memory it gave back
+void compactStorage(PatientDatabase* db) {
+    size_t before = residentBytes();
+    uint64_t start = nowNanoseconds();
+    compactPatientDatabase(db);
+    double millis = (nowNanoseconds() - start) / 1e6;
+    size_t after = residentBytes();
+    printf("Compacted %zu patients in %.1f ms\n", db->count, millis);
+    printf("Resident memory: %.1f MB -> %.1f MB\n", before / 1048576.0, after / 1048576.0);
+}
+
+// Scan lengths of the ID index, read from the table instead of counted on every lookup: a hit scans from
+// the entry's home slot to the entry, a miss from its home slot to the next empty one
+void measureIndexProbes(const PatientDatabase* db, double* hitProbes, double* missProbes, size_t* longest) {
+    size_t mask = db->indexCapacity - 1;
+    size_t hits = 0, hitTotal = 0, missTotal = 0;
+    *longest = 0;
+    size_t empty = 0;
+    while (empty < db->indexCapacity && db->index[empty].row != INDEX_EMPTY) {
+        empty++;
+    }
+    if (empty == db->indexCapacity) {  // cannot happen below the 70% load limit
+        *hitProbes = *missProbes = 0.0;
+        return;
+    }
+    // Walk backwards from an empty slot so the distance to the next empty slot is known at each step
+    size_t run = 0;
+    for (size_t step = 0; step < db->indexCapacity; step++) {
+        size_t slot = (empty - step) & mask;
+        if (db->index[slot].row == INDEX_EMPTY) {
+            run = 0;
+        } else {
+            run++;
+            size_t probes = ((slot - hashPatientId(db->index[slot].id)) & mask) + 1;
+            hits++;
+            hitTotal += probes;
+            if (probes > *longest) {
+                *longest = probes;
+            }
+        }
+        missTotal += run + 1;
+    }
+    *hitProbes = hits ? (double)hitTotal / hits : 0.0;
+    *missProbes = (double)missTotal / db->indexCapacity;
+}
+
+// Menu option: operation latencies, growth counters and how full the history storage is
+void displayPatientStats(const PatientDatabase* db) {
+    StatsSummary* summary = (StatsSummary*)malloc(sizeof(StatsSummary));
+    if (summary == NULL) {
+        fprintf(stderr, "Failed to allocate memory for statistics\n");
+        return;
+    }
+    collectPatientStats(summary);
+    const uint64_t* counters = summary->counters;
+
+    printf("\n=== Runtime Statistics ===\n");
+    printf("%-8s %10s %8s %8s %8s %8s %8s %10s  (ns)\n", "op", "calls", "timed", "mean", "p50", "p99", "p99.9", "max");
+    for (int op = 0; op < STAT_OPERATION_COUNT; op++) {
+        const LatencyHistogram* latencies = &summary->latencies[op];
+        if (latencies->samples == 0) {
+            printf("%-8s %10llu\n", statOperationNames[op], (unsigned long long)summary->calls[op]);
+            continue;
+        }
+        printf("%-8s %10llu %8llu %8.0f %8llu %8llu %8llu %10llu\n", statOperationNames[op],
+               (unsigned long long)summary->calls[op], (unsigned long long)latencies->samples,
+               (double)latencies->totalNanos / latencies->samples,
+               (unsigned long long)latencyPercentile(latencies, 0.50), (unsigned long long)latencyPercentile(latencies, 0.99),
+               (unsigned long long)latencyPercentile(latencies, 0.999), (unsigned long long)latencies->maxNanos);
+    }
+
+    double hitProbes, missProbes;
+    size_t longest;
+    measureIndexProbes(db, &hitProbes, &missProbes, &longest);
+    printf("ID index:        %zu of %zu slots used; a lookup scans %.2f slots (longest %zu), a miss %.2f\n",
+           db->count, db->indexCapacity, hitProbes, longest, missProbes);
+    printf("Index rebuilds:  %llu (%llu entries reinserted)\n", (unsigned long long)counters[STAT_INDEX_REBUILDS],
+           (unsigned long long)counters[STAT_INDEX_ENTRIES_MOVED]);
+    printf("Column resizes:  %llu (up to %.1f KB copied); rows moved by removals: %llu\n",
+           (unsigned long long)counters[STAT_COLUMN_RESIZES], counters[STAT_COLUMN_BYTES_MOVED] / 1024.0,
+           (unsigned long long)counters[STAT_ROWS_MOVED]);
+    printf("History growth:  %llu text moves (%.1f KB copied), %llu offset table moves (%.1f KB copied)\n",
+           (unsigned long long)counters[STAT_HISTORY_MOVES], counters[STAT_HISTORY_BYTES_MOVED] / 1024.0,
+           (unsigned long long)counters[STAT_OFFSET_MOVES], counters[STAT_OFFSET_BYTES_MOVED] / 1024.0);
+    free(summary);
+
+    // Allocated against used bytes of every history; inline buffers count as allocated
+    size_t inlineCount = 0, slabCount = 0, mappedCount = 0, packedCount = 0;
+    size_t allocated = 0, used = 0, offsetsAllocated = 0, offsetsUsed = 0;
+    for (size_t row = 0; row < db->count; row++) {
+        const MedicalHistory* history = &db->histories[row];
+        if (history->capacity == 0 || inMappedFile(history->details)) {
+            mappedCount++;  // read from the database file, no heap
+            continue;
+        }
+        if (history->details == NULL) {
+            inlineCount++;
+            allocated += HISTORY_INLINE_SIZE;
+            used += history->length + 1;
+        } else {
+            slabCount++;
+            packedCount += history->packedLength != 0;
+            allocated += history->capacity;
+            used += history->packedLength != 0 ? history->packedLength : history->length + 1;
+        }
+        if (history->entryOffsets != NULL && !inMappedFile(history->entryOffsets)) {
+            offsetsAllocated += history->entryCapacity * sizeof(uint32_t);
+            offsetsUsed += history->entryCount * sizeof(uint32_t);
+        }
+    }
+    printf("Histories:       %zu inline, %zu in slab blocks (%zu compressed), %zu still in the mapped file\n",
+           inlineCount, slabCount, packedCount, mappedCount);
+    printf("History text:    %.1f KB allocated, %.1f KB used (%.0f%%)\n", allocated / 1024.0, used / 1024.0,
+           allocated ? 100.0 * used / allocated : 0.0);
+    printf("Entry offsets:   %.1f KB allocated, %.1f KB used (%.0f%%)\n", offsetsAllocated / 1024.0, offsetsUsed / 1024.0,
+           offsetsAllocated ? 100.0 * offsetsUsed / offsetsAllocated : 0.0);
+    printf("Slab pages:      %.1f KB held, %.1f KB in blocks handed out, %.1f KB in large blocks\n",
+           historySlabs.pageBytes / 1024.0, (historyBytesInUse() - historySlabs.largeBytes) / 1024.0,
+           historySlabs.largeBytes / 1024.0);
+    if (historyColdSeconds != 0) {
+        displayHistoryTiering(db);
+    }
+}
+
+// Display all patients
+void displayAllPatients(PatientDatabase* db) {
+    printf("\n=== Patient Database (%zu/%zu) ===\n", db->count, db->capacity);
+    if (db->count == 0) {
+        printf("No patients in the database.\n");
+        printf("*** End of Database ***\n");
+        return;
+    }
+
+    // Only the requested page is formatted; the cursor carries on to the next one
+    size_t pages = (db->count + LISTING_PAGE_SIZE - 1) / LISTING_PAGE_SIZE;
+    size_t page = 1;
+    size_t cursor = 0;
+    while (1) {
+        PatientHandle results[LISTING_PAGE_SIZE];
+        size_t found = listPatientPage(db, &cursor, results, LISTING_PAGE_SIZE);
+        for (size_t i = 0; i < found; i++) {
+            Patient p;
+            getPatient(db, results[i], &p);
+            displayPatient(&p);
+            printf("----------------------------\n");
+        }
+        printf("*** Page %zu of %zu ***\n", page, pages);
+        if (pages == 1) {
+            return;
+        }
+        int next = getIntInput("Page to show (0 to return to the menu): ");
+        if (next <= 0) {
+            return;
+        }
+        if ((size_t)next > pages) {
+            printf("There are only %zu pages.\n", pages);
+            next = (int)pages;
+        }
+        if ((size_t)next != page + 1) {
+            cursor = seekPatientPage(db, (size_t)next - 1, LISTING_PAGE_SIZE);
+        }
+        page = (size_t)next;
+    }
+}
+
+// Fill a page in handle slot order, which survives removals moving rows; returns how many were found
+size_t listPatientPage(const PatientDatabase* db, size_t* cursor, PatientHandle* results, size_t pageSize) {
+    size_t found = 0;
+    size_t slot = *cursor;
+    for (; slot < db->slotCount && found < pageSize; slot++) {
+        size_t row = db->slots[slot].row;
+        // A released slot's row field links the free list, so it must also own that row to be live
+        if (row < db->count && db->rowSlots[row] == slot) {
+            results[found].slot = (uint32_t)slot;
+            results[found].generation = db->slots[slot].generation;
+            found++;
+        }
+    }
+    *cursor = slot;
+    return found;
+}
+
+// Cursor at the start of a page: whole blocks of slots are skipped by their live counts, then the rest counted
+size_t seekPatientPage(PatientDatabase* db, size_t page, size_t pageSize) {
+    size_t skip = page * pageSize;
+    size_t slot = 0;
+    if (db->slotCounts.built || buildSlotCounts(db)) {
+        size_t block = 0;
+        while (block < db->slotCounts.blocks && db->slotCounts.live[block] <= skip) {
+            skip -= db->slotCounts.live[block++];
+        }
+        slot = block * SLOT_BLOCK_SIZE < db->slotCount ? block * SLOT_BLOCK_SIZE : db->slotCount;
+    }
+    for (; slot < db->slotCount && skip > 0; slot++) {
+        size_t row = db->slots[slot].row;
+        if (row < db->count && db->rowSlots[row] == slot) {
+            skip--;
+        }
+    }
+    return slot;
+}
+
+// Count the live patients in every block of handle slots
+bool buildSlotCounts(PatientDatabase* db) {
+    size_t blocks = (db->slotCount + SLOT_BLOCK_SIZE - 1) / SLOT_BLOCK_SIZE;
+    uint32_t* live = (uint32_t*)calloc(blocks > 0 ? blocks : 1, sizeof(uint32_t));
+    if (live == NULL) {
+        return false;
+    }
+    for (size_t row = 0; row < db->count; row++) {
+        uint32_t slot = db->rowSlots[row];
+        if (slot < db->slotCount && db->slots[slot].row == row) {
+            live[slot / SLOT_BLOCK_SIZE]++;
+        }
+    }
+    db->slotCounts.live = live;
+    db->slotCounts.blocks = blocks;
+    db->slotCounts.built = true;
+    return true;
+}
+
+// Keep the live counts in step with a slot being taken or released; they are dropped if they cannot grow
+void countSlot(PatientDatabase* db, size_t slot, bool live) {
+    SlotCounts* counts = &db->slotCounts;
+    if (!counts->built) {
+        return;
+    }
+    size_t block = slot / SLOT_BLOCK_SIZE;
+    if (block >= counts->blocks) {
+        size_t blocks = counts->blocks * 2 > block + 1 ? counts->blocks * 2 : block + 1;
+        uint32_t* grown = (uint32_t*)realloc(counts->live, blocks * sizeof(uint32_t));
+        if (grown == NULL) {
+            freeSlotCounts(counts);
+            return;
+        }
+        memset(grown + counts->blocks, 0, (blocks - counts->blocks) * sizeof(uint32_t));
+        counts->live = grown;
+        counts->blocks = blocks;
+    }
+    if (live) {
+        counts->live[block]++;
+    } else if (counts->live[block] > 0) {
+        counts->live[block]--;
+    }
+}
+
+// Free the live counts; they are rebuilt by the next page seek
+void freeSlotCounts(SlotCounts* counts) {
+    free(counts->live);
+    counts->live = NULL;
+    counts->blocks = 0;
+    counts->built = false;
+}
+
+// Display a single patient
+void displayPatient(const Patient* p) {
+    printf("\nPatient ID: %d\n", p->id);
+    printf("Name: %s\n", p->name);
+    printf("Age: %d\n", p->age);
+    printf("Diagnosis: %s\n", p->diagnosis);
+    printf("Medical History:\n");
+    displayRecentHistory(p->medicalHistory, HISTORY_DISPLAY_ENTRIES);
+}
+
+// History of a row; rows loaded from a file point at it until they are written to
+MedicalHistory* resolvePatientHistory(const PatientDatabase* db, size_t row) {
+    MedicalHistory* history = &db->histories[row];
+    if (history->capacity != 0 || db->file.base == NULL || row >= db->file.rows) {
+        return history;
+    }
+
+    // The record and its entry offsets come from the file, so check them before they are followed
+    const HistoryRecord* record = &db->file.histories[row];
+    bool valid = record->textOffset < db->file.textBytes && record->length < db->file.textBytes - record->textOffset &&
+        db->file.text[record->textOffset + record->length] == '\0' &&
+        record->offsetsOffset % sizeof(uint32_t) == 0 && record->offsetsOffset <= db->file.offsetsBytes &&
+        record->entryCount <= (db->file.offsetsBytes - record->offsetsOffset) / sizeof(uint32_t);
+    const uint32_t* offsets = valid ? (const uint32_t*)(db->file.offsets + record->offsetsOffset) : NULL;
+    valid = valid && (record->entryCount == 0 || offsets[0] == 0);
+    for (uint32_t i = 1; valid && i < record->entryCount; i++) {
+        valid = offsets[i] > offsets[i - 1] && offsets[i] <= record->length;
+    }
+    if (!valid) {
+        fprintf(stderr, "Corrupt medical history record at row %zu\n", row);
+        initMedicalHistory(history);
+        return history;
+    }
+    history->details = (char*)db->file.text + record->textOffset;
+    history->entryOffsets = (uint32_t*)(db->file.offsets + record->offsetsOffset);
+    history->length = record->length;
+    history->capacity = record->length + 1;   // full, so the first append copies it out
+    history->entryCount = record->entryCount;
+    history->entryCapacity = record->entryCount;
+    return history;
+}
+// History of a row for reading or appending: decompressed if it went cold, and marked as used
+MedicalHistory* patientHistory(const PatientDatabase* db, size_t row) {
+    MedicalHistory* history = resolvePatientHistory(db, row);
+    if (history->packedLength != 0 && !unpackMedicalHistory(history)) {
+        history->entryCount = 0;  // unreadable; show it as empty rather than garbage
+        history->length = 0;
+    }
+    if (historyColdSeconds != 0) {
+        history->lastUsed = historyClock();
+    }
+    return history;
+}
+
+// Read-only view for whole-database passes (save, export, search build) that must not warm every history;
+// compressed text is decoded into a per-thread buffer that the next peek reuses
+const MedicalHistory* peekPatientHistory(const PatientDatabase* db, size_t row, MedicalHistory* scratch) {
+    const MedicalHistory* history = resolvePatientHistory(db, row);
+    if (history->packedLength == 0) {
+        return history;
+    }
+    if (peekBufferCapacity < history->length + 1) {
+        char* grown = (char*)realloc(peekBuffer, history->length + 1);
+        if (grown == NULL) {
+            fprintf(stderr, "Failed to decompress medical history\n");
+            initMedicalHistory(scratch);
+            return scratch;
+        }
+        peekBuffer = grown;
+        peekBufferCapacity = history->length + 1;
+    }
+    *scratch = *history;
+    if (!lzDecompress(&historyDictionary, history->details, history->packedLength, peekBuffer, history->length)) {
+        fprintf(stderr, "Corrupt compressed medical history\n");
+        initMedicalHistory(scratch);
+        return scratch;
+    }
+    peekBuffer[history->length] = '\0';
+    scratch->details = peekBuffer;
+    scratch->capacity = history->length + 1;
+    scratch->packedLength = 0;
+    return scratch;
+}
+
+int compareDictionaryCandidates(const void* a, const void* b) {
+    const DictionaryCandidate* x = (const DictionaryCandidate*)a;
+    const DictionaryCandidate* y = (const DictionaryCandidate*)b;
+    size_t xScore = (size_t)x->count * x->length;
+    size_t yScore = (size_t)y->count * y->length;
+    return (xScore < yScore) - (xScore > yScore);
+}
+
+// Build the shared dictionary from the history entries that repeat most across a sample of patients
+bool trainHistoryDictionary(const PatientDatabase* db) {
+    size_t capacity = 1;
+    while (capacity < 2 * HISTORY_DICTIONARY_ENTRIES) {
+        capacity *= 2;
+    }
+    DictionaryCandidate* candidates = (DictionaryCandidate*)calloc(capacity, sizeof(DictionaryCandidate));
+    if (candidates == NULL) {
+        return false;
+    }
+    size_t distinct = 0;
+    size_t step = db->count / HISTORY_DICTIONARY_SAMPLE + 1;
+    for (size_t row = 0; row < db->count && distinct < HISTORY_DICTIONARY_ENTRIES; row += step) {
+        const MedicalHistory* history = resolvePatientHistory(db, row);
+        if (history->packedLength != 0) {
+            continue;
+        }
+        for (size_t i = 0; i < history->entryCount && distinct < HISTORY_DICTIONARY_ENTRIES; i++) {
+            size_t length;
+            const char* entry = getMedicalHistoryEntry(history, i, &length);
+            if (length < LZ_MIN_MATCH) {
+                continue;
+            }
+            size_t slot = hashString(entry, length) & (capacity - 1);
+            while (candidates[slot].text != NULL &&
+                   (candidates[slot].length != length || memcmp(candidates[slot].text, entry, length) != 0)) {
+                slot = (slot + 1) & (capacity - 1);
+            }
+            if (candidates[slot].text == NULL) {
+                candidates[slot].text = entry;
+                candidates[slot].length = (uint32_t)length;
+                distinct++;
+            }
+            candidates[slot].count++;
+        }
+    }
+
+    // Most bytes saved first; entries seen once are not worth dictionary space
+    qsort(candidates, capacity, sizeof(DictionaryCandidate), compareDictionaryCandidates);
+    char* text = (char*)malloc(HISTORY_DICTIONARY_SIZE);
+    if (text == NULL) {
+        free(candidates);
+        return false;
+    }
+    size_t used = 0;
+    for (size_t i = 0; i < capacity && candidates[i].count > 1; i++) {
+        if (used + candidates[i].length + 1 > HISTORY_DICTIONARY_SIZE) {
+            continue;
+        }
+        memcpy(text + used, candidates[i].text, candidates[i].length);
+        used += candidates[i].length;
+        text[used++] = '\n';
+    }
+    free(candidates);
+
+    historyDictionary.text = text;
+    historyDictionary.length = used;
+    memset(historyDictionary.table, 0, sizeof(historyDictionary.table));
+    for (size_t pos = 0; pos + LZ_MIN_MATCH <= used; pos++) {
+        historyDictionary.table[lzHash((const unsigned char*)text + pos, LZ_HASH_BITS)] = (uint16_t)(pos + 1);
+    }
+    return true;
+}
+
+// Compress every history that has not been read or appended to for historyColdSeconds
+size_t compressColdHistories(PatientDatabase* db) {
+    if (historyColdSeconds == 0) {
+        return 0;
+    }
+    uint32_t now = historyClock();
+    size_t packed = 0;
+    for (size_t row = 0; row < db->count; row++) {
+        MedicalHistory* history = &db->histories[row];
+        // capacity 0: still in the mapped file, which costs no heap memory
+        if (history->capacity == 0 || history->details == NULL || history->packedLength != 0 ||
+            now - history->lastUsed < historyColdSeconds) {
+            continue;
+        }
+        if (historyDictionary.text == NULL && !trainHistoryDictionary(db)) {
+            return packed;
+        }
+        if (packMedicalHistory(history)) {
+            packed++;
+        } else {
+            history->lastUsed = now;  // retry after another window, not on every sweep
+        }
+    }
+    return packed;
+}
+
+// Compressed histories and the slab bytes they save right now, plus decompression counters
+void displayHistoryTiering(const PatientDatabase* db) {
+    size_t packed = 0, textBytes = 0, packedBytes = 0, plainBytes = 0;
+    for (size_t row = 0; row < db->count; row++) {
+        const MedicalHistory* history = &db->histories[row];
+        if (history->packedLength != 0) {
+            packed++;
+            textBytes += history->length + 1;
+            packedBytes += history->capacity;
+            int c = slabClassFor(history->length + 1);
+            plainBytes += c < 0 ? history->length + 1 : (size_t)SLAB_MIN_BLOCK << c;
+        }
+    }
+    printf("Compressed histories:  %zu of %zu (dictionary %zu bytes)\n", packed, db->count, historyDictionary.length);
+    printf("History text:          %.1f KB in %.1f KB of blocks, %.1f KB saved\n",
+           textBytes / 1024.0, packedBytes / 1024.0, (double)(plainBytes - packedBytes) / 1024.0);
+    printf("Decompressions:        %zu (avg %.2f us, max %.2f us)\n", tieringStats.decompressions,
+           tieringStats.decompressions ? tieringStats.decompressNanos / 1e3 / tieringStats.decompressions : 0.0,
+           tieringStats.maxDecompressNanos / 1e3);
+}
+
+
+// Write one section at the next 8-byte boundary and record where it went
+bool writeSection(FILE* f, PatientFileHeader* header, int section, const void* data, size_t bytes) {
+    static const char padding[8] = { 0 };
+    long position = ftell(f);
+    if (position < 0) {
+        return false;
+    }
+    size_t pad = (8 - (size_t)position % 8) % 8;
+    if (pad > 0 && fwrite(padding, 1, pad, f) != pad) {
+        return false;
+    }
+    header->sections[section].offset = (uint64_t)position + pad;
+    header->sections[section].bytes = bytes;
+    return bytes == 0 || fwrite(data, 1, bytes, f) == bytes;
+}
+
+// Save the whole database in the mappable file format
+bool savePatientDatabase(PatientDatabase* db, const char* path) {
+    uint64_t start = beginOperation(STAT_SAVE);
+    char tmpPath[4096];
+    if (snprintf(tmpPath, sizeof(tmpPath), "%s.tmp", path) >= (int)sizeof(tmpPath)) {
+        fprintf(stderr, "Database path too long\n");
+        endOperation(STAT_SAVE, start);
+        return false;
+    }
+
+    // Lay out every history in the text and offsets sections first
+    HistoryRecord* records = (HistoryRecord*)malloc((db->count ? db->count : 1) * sizeof(HistoryRecord));
+    if (records == NULL) {
+        fprintf(stderr, "Failed to allocate memory for saving\n");
+        endOperation(STAT_SAVE, start);
+        return false;
+    }
+    uint64_t textBytes = 0;
+    uint64_t offsetsBytes = 0;
+    for (size_t row = 0; row < db->count; row++) {
+        const MedicalHistory* history = resolvePatientHistory(db, row);
+        records[row].textOffset = textBytes;
+        records[row].offsetsOffset = offsetsBytes;
+        records[row].length = (uint32_t)history->length;
+        records[row].entryCount = (uint32_t)history->entryCount;
+        textBytes += history->length + 1;
+        offsetsBytes += history->entryCount * sizeof(uint32_t);
+    }
+
+    FILE* f = fopen(tmpPath, "wb");
+    if (f == NULL) {
+        fprintf(stderr, "Cannot write %s\n", tmpPath);
+        free(records);
+        endOperation(STAT_SAVE, start);
+        return false;
+    }
+
+    PatientFileHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, PATIENT_FILE_MAGIC, sizeof(header.magic));
+    header.version = PATIENT_FILE_VERSION;
+    header.headerSize = sizeof(header);
+    header.count = db->count;
+    header.slotCount = db->slotCount;
+    header.freeSlot = db->freeSlot == INDEX_EMPTY ? UINT64_MAX : db->freeSlot;
+    header.indexCapacity = db->indexCapacity;
+    header.stringCount = db->strings.count;
+    header.appliedLsn = db->appliedLsn;
+
+    bool ok = fwrite(&header, sizeof(header), 1, f) == 1 &&
+        writeSection(f, &header, SECTION_IDS, db->ids, db->count * sizeof(int)) &&
+        writeSection(f, &header, SECTION_AGES, db->ages, db->count * sizeof(int)) &&
+        writeSection(f, &header, SECTION_NAME_REFS, db->nameRefs, db->count * sizeof(uint32_t)) &&
+        writeSection(f, &header, SECTION_DIAGNOSIS_REFS, db->diagnosisRefs, db->count * sizeof(uint32_t)) &&
+        writeSection(f, &header, SECTION_ROW_SLOTS, db->rowSlots, db->count * sizeof(uint32_t)) &&
+        writeSection(f, &header, SECTION_SLOTS, db->slots, db->slotCount * sizeof(PatientSlot)) &&
+        writeSection(f, &header, SECTION_INDEX, db->index, db->indexCapacity * sizeof(IndexEntry)) &&
+        writeSection(f, &header, SECTION_STRINGS, db->strings.data, db->strings.length) &&
+        writeSection(f, &header, SECTION_STRING_TABLE, db->strings.table, db->strings.tableCapacity * sizeof(uint32_t)) &&
+        writeSection(f, &header, SECTION_HISTORIES, records, db->count * sizeof(HistoryRecord)) &&
+        writeSection(f, &header, SECTION_HISTORY_TEXT, NULL, 0);
+
+    // History text and offsets are streamed row by row
+    // The file always holds plain text; compressed histories are decoded on the way out
+    for (size_t row = 0; ok && row < db->count; row++) {
+        MedicalHistory scratch;
+        const MedicalHistory* history = peekPatientHistory(db, row, &scratch);
+        ok = fwrite(getMedicalHistoryText(history), 1, history->length + 1, f) == history->length + 1;
+    }
+    header.sections[SECTION_HISTORY_TEXT].bytes = textBytes;
+    ok = ok && writeSection(f, &header, SECTION_HISTORY_OFFSETS, NULL, 0);
+    for (size_t row = 0; ok && row < db->count; row++) {
+        const MedicalHistory* history = resolvePatientHistory(db, row);
+        size_t bytes = history->entryCount * sizeof(uint32_t);
+        ok = bytes == 0 || fwrite(history->entryOffsets, 1, bytes, f) == bytes;
+    }
+    header.sections[SECTION_HISTORY_OFFSETS].bytes = offsetsBytes;
+    free(records);
+
+    ok = ok && fseek(f, 0, SEEK_SET) == 0 && fwrite(&header, sizeof(header), 1, f) == 1;
+    ok = ok && fflush(f) == 0 && fsync(fileno(f)) == 0;
+    ok = fclose(f) == 0 && ok;
+    if (!ok || rename(tmpPath, path) != 0) {
+        fprintf(stderr, "Failed to save patient database to %s\n", path);
+        remove(tmpPath);
+        endOperation(STAT_SAVE, start);
+        return false;
+    }
+    // Until the directory entry is on disk a crash can bring back the old file, so the log must not shrink yet
+    bool synced = syncParentDirectory(path);
+    endOperation(STAT_SAVE, start);
+    return synced;
+}
+
+// fsync the directory holding path, so a rename into it survives a crash
+bool syncParentDirectory(const char* path) {
+    char dir[4096];
+    const char* slash = strrchr(path, '/');
+    size_t length = slash == NULL ? 1 : slash == path ? 1 : (size_t)(slash - path);
+    if (length >= sizeof(dir)) {
+        fprintf(stderr, "Database path too long\n");
+        return false;
+    }
+    if (slash == NULL) {
+        dir[0] = '.';
+    } else {
+        memcpy(dir, path, length);
+    }
+    dir[length] = '\0';
+    int fd = open(dir, O_RDONLY | O_DIRECTORY);
+    bool ok = fd >= 0 && fsync(fd) == 0;
+    if (fd >= 0) {
+        close(fd);
+    }
+    if (!ok) {
+        fprintf(stderr, "Failed to sync directory %s\n", dir);
+    }
+    return ok;
+}
+
+// Pointer to a section of a mapped file, NULL if it is out of bounds or the wrong size
+void* mappedSection(const PatientFile* file, const PatientFileHeader* header, int section, size_t expectedBytes) {
+    const FileSection* fs = &header->sections[section];
+    if (fs->offset % 8 != 0 || fs->offset > file->size || fs->bytes > file->size - fs->offset ||
+        (expectedBytes != SIZE_MAX && fs->bytes != expectedBytes)) {
+        return NULL;
+    }
+    return file->base + fs->offset;
+}
+
+// Check what the header promises about the columns without reading them, so opening costs the same at any size.
+// The references stored in the columns (string refs, row slots, the free slot list, the ID and string tables and
+// the history records) are checked where they are followed.
+bool validatePatientFile(const PatientFileHeader* header, void* const sections[SECTION_COUNT]) {
+    size_t n = (size_t)header->count;
+    size_t slotCount = (size_t)header->slotCount;
+    size_t tableCapacity = (size_t)header->sections[SECTION_STRING_TABLE].bytes / sizeof(uint32_t);
+    const char* strings = (const char*)sections[SECTION_STRINGS];
+    return strings[0] == '\0' && n <= slotCount &&
+        (header->freeSlot == UINT64_MAX || header->freeSlot < slotCount) &&
+        n < (size_t)header->indexCapacity && (size_t)header->stringCount < tableCapacity;
+}
+
+// Map a saved database; nothing is read per patient until that patient is used
+bool openPatientDatabase(PatientDatabase* db, const char* path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(PatientFileHeaderV1)) {
+        fprintf(stderr, "%s is not a patient database\n", path);
+        close(fd);
+        return false;
+    }
+
+    // Two ranges: the file and the history views that go with it
+    int mapSlot = 0;
+    while (mapSlot < MAX_MAPPED_FILES && mappedFiles[mapSlot].base != NULL) {
+        mapSlot++;
+    }
+    int viewSlot = mapSlot + 1;
+    while (viewSlot < MAX_MAPPED_FILES && mappedFiles[viewSlot].base != NULL) {
+        viewSlot++;
+    }
+    if (viewSlot >= MAX_MAPPED_FILES) {
+        fprintf(stderr, "Too many open database files\n");
+        close(fd);
+        return false;
+    }
+
+    // Private writable mapping: in-place updates copy the page, the file is never modified
+    void* base = mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        fprintf(stderr, "Cannot map %s\n", path);
+        return false;
+    }
+
+    PatientFile file;
+    memset(&file, 0, sizeof(file));
+    file.base = (char*)base;
+    file.size = (size_t)st.st_size;
+
+    // Version 1 headers lack appliedLsn; they are read into the current layout with nothing applied from a log
+    PatientFileHeader stored;
+    const PatientFileHeader* header = &stored;
+    uint32_t version;
+    memcpy(&version, file.base + offsetof(PatientFileHeader, version), sizeof(version));
+    if (memcmp(file.base, PATIENT_FILE_MAGIC, sizeof(stored.magic)) != 0 ||
+        (version != 1 && version != PATIENT_FILE_VERSION) ||
+        (version == PATIENT_FILE_VERSION && file.size < sizeof(PatientFileHeader))) {
+        fprintf(stderr, "%s is not a patient database this program can read (version %d expected)\n", path, PATIENT_FILE_VERSION);
+        munmap(base, file.size);
+        return false;
+    }
+    if (version == 1) {
+        PatientFileHeaderV1 old;
+        memcpy(&old, file.base, sizeof(old));
+        memset(&stored, 0, sizeof(stored));
+        memcpy(stored.magic, old.magic, sizeof(stored.magic));
+        stored.version = old.version;
+        stored.headerSize = old.headerSize == sizeof(PatientFileHeaderV1) ? sizeof(PatientFileHeader) : 0;
+        stored.count = old.count;
+        stored.slotCount = old.slotCount;
+        stored.freeSlot = old.freeSlot;
+        stored.indexCapacity = old.indexCapacity;
+        stored.stringCount = old.stringCount;
+        stored.appliedLsn = 0;
+        memcpy(stored.sections, old.sections, sizeof(stored.sections));
+    } else {
+        memcpy(&stored, file.base, sizeof(stored));
+    }
+
+    size_t n = (size_t)header->count;
+    bool valid = header->headerSize == sizeof(PatientFileHeader) &&
+        header->count < UINT32_MAX && header->slotCount < UINT32_MAX &&
+        header->indexCapacity >= INDEX_MIN_CAPACITY && (header->indexCapacity & (header->indexCapacity - 1)) == 0 &&
+        header->indexCapacity <= file.size / sizeof(IndexEntry);
+
+    void* sections[SECTION_COUNT] = { NULL };
+    if (valid) {
+        size_t expected[SECTION_COUNT] = {
+            n * sizeof(int), n * sizeof(int), n * sizeof(uint32_t), n * sizeof(uint32_t), n * sizeof(uint32_t),
+            (size_t)header->slotCount * sizeof(PatientSlot), (size_t)header->indexCapacity * sizeof(IndexEntry),
+            SIZE_MAX, SIZE_MAX, n * sizeof(HistoryRecord), SIZE_MAX, SIZE_MAX
+        };
+        for (int i = 0; i < SECTION_COUNT && valid; i++) {
+            sections[i] = mappedSection(&file, header, i, expected[i]);
+            valid = sections[i] != NULL;
+        }
+    }
+    size_t stringBytes = valid ? (size_t)header->sections[SECTION_STRINGS].bytes : 0;
+    size_t tableCapacity = valid ? (size_t)header->sections[SECTION_STRING_TABLE].bytes / sizeof(uint32_t) : 0;
+    valid = valid && stringBytes > 0 && file.base[header->sections[SECTION_STRINGS].offset + stringBytes - 1] == '\0' &&
+        tableCapacity >= INDEX_MIN_CAPACITY && (tableCapacity & (tableCapacity - 1)) == 0 &&
+        validatePatientFile(header, sections);
+    if (!valid) {
+        fprintf(stderr, "%s is a damaged version %u patient database\n", path, version);
+        munmap(base, file.size);
+        return false;
+    }
+
+    file.histories = (const HistoryRecord*)sections[SECTION_HISTORIES];
+    file.rows = n;
+    file.text = (const char*)sections[SECTION_HISTORY_TEXT];
+    file.textBytes = (size_t)header->sections[SECTION_HISTORY_TEXT].bytes;
+    file.offsets = (const char*)sections[SECTION_HISTORY_OFFSETS];
+    file.offsetsBytes = (size_t)header->sections[SECTION_HISTORY_OFFSETS].bytes;
+
+    // History views are filled in on first use; anonymous pages stay unallocated and zero until then,
+    // where a heap column would be allocated (and possibly cleared) for every patient up front
+    file.viewsSize = (n ? n : 1) * sizeof(MedicalHistory);
+    void* views = mmap(NULL, file.viewsSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (views == MAP_FAILED) {
+        fprintf(stderr, "Failed to allocate memory for patient database\n");
+        munmap(base, file.size);
+        return false;
+    }
+    file.views = (char*)views;
+    db->histories = (MedicalHistory*)views;
+    mappedFiles[mapSlot].base = file.base;
+    mappedFiles[mapSlot].size = file.size;
+    mappedFiles[viewSlot].base = file.views;
+    mappedFiles[viewSlot].size = file.viewsSize;
+
+    db->ids = (int*)sections[SECTION_IDS];
+    db->ages = (int*)sections[SECTION_AGES];
+    db->nameRefs = (uint32_t*)sections[SECTION_NAME_REFS];
+    db->diagnosisRefs = (uint32_t*)sections[SECTION_DIAGNOSIS_REFS];
+    db->rowSlots = (uint32_t*)sections[SECTION_ROW_SLOTS];
+    db->count = n;
+    db->capacity = n;
+    db->strings.data = (char*)sections[SECTION_STRINGS];
+    db->strings.length = stringBytes;
+    db->strings.capacity = stringBytes;
+    db->strings.table = (uint32_t*)sections[SECTION_STRING_TABLE];
+    db->strings.tableCapacity = tableCapacity;
+    db->strings.count = (size_t)header->stringCount;
+    db->index = (IndexEntry*)sections[SECTION_INDEX];
+    db->indexCapacity = (size_t)header->indexCapacity;
+    db->slots = (PatientSlot*)sections[SECTION_SLOTS];
+    db->slotCount = (size_t)header->slotCount;
+    db->slotCapacity = (size_t)header->slotCount;
+    db->freeSlot = header->freeSlot == UINT64_MAX ? INDEX_EMPTY : (size_t)header->freeSlot;
+    db->file = file;
+    db->wal = NULL;
+    db->appliedLsn = header->appliedLsn;
+    memset(&db->search, 0, sizeof(db->search));
+    if (version != PATIENT_FILE_VERSION) {
+        printf("%s uses file version %u; it is rewritten as version %d at the next checkpoint\n", path, version, PATIENT_FILE_VERSION);
+    }
+    memset(&db->names, 0, sizeof(db->names));
+    memset(&db->byAge, 0, sizeof(db->byAge));
+    return true;
+}
+
+// Unmap a database file; blocks still inside it must not be used afterwards
+void closePatientFile(PatientFile* file) {
+    if (file->base == NULL) {
+        return;
+    }
+    for (int i = 0; i < MAX_MAPPED_FILES; i++) {
+        if (mappedFiles[i].base == file->base || mappedFiles[i].base == file->views) {
+            mappedFiles[i].base = NULL;
+            mappedFiles[i].size = 0;
+        }
+    }
+    munmap(file->base, file->size);
+    munmap(file->views, file->viewsSize);
+    memset(file, 0, sizeof(*file));
+}
+
+// Update a CRC-32 (IEEE) with more bytes
+uint32_t crc32Update(uint32_t crc, const void* data, size_t length) {
+    static uint32_t table[256];
+    static bool tableReady = false;
+    if (!tableReady) {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++) {
+                c = (c & 1) ? 0xEDB88320U ^ (c >> 1) : c >> 1;
+            }
+            table[i] = c;
+        }
+        tableReady = true;
+    }
+    const unsigned char* bytes = (const unsigned char*)data;
+    crc = ~crc;
+    for (size_t i = 0; i < length; i++) {
+        crc = table[(crc ^ bytes[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+// Write a whole buffer, retrying short writes
+bool writeFully(int fd, const char* data, size_t length) {
+    while (length > 0) {
+        ssize_t written = write(fd, data, length);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written < 0) {
+            return false;
+        }
+        data += written;
+        length -= (size_t)written;
+    }
+    return true;
+}
+
+// Background thread: collects records for up to commitDelay, then writes and fsyncs them as one batch
+void* walFlusher(void* arg) {
+    WriteAheadLog* wal = (WriteAheadLog*)arg;
+    pthread_mutex_lock(&wal->lock);
+    while (1) {
+        while (wal->length == 0 && !wal->stopping) {
+            pthread_cond_wait(&wal->work, &wal->lock);
+        }
+        if (wal->length == 0) {
+            break; // stopping with nothing left to write
+        }
+
+        // Give concurrent writers a chance to share this fsync
+        uint64_t deadline = wal->batchStart + wal->commitDelay;
+        while (!wal->flushNow && !wal->stopping && wal->length < WAL_GROUP_BYTES && nowNanoseconds() < deadline) {
+            struct timespec ts = { (time_t)(deadline / 1000000000ULL), (long)(deadline % 1000000000ULL) };
+            pthread_cond_timedwait(&wal->work, &wal->lock, &ts);
+        }
+
+        char* batch = wal->buffer;
+        size_t batchBytes = wal->length;
+        uint64_t batchEnd = wal->nextLsn - 1;
+        wal->buffer = wal->spare;
+        wal->spare = batch;
+        size_t capacity = wal->capacity;
+        wal->capacity = wal->spareCapacity;
+        wal->spareCapacity = capacity;
+        wal->length = 0;
+        wal->flushNow = false;
+        wal->inFlight = batchBytes;
+        int fd = wal->fd;
+        pthread_mutex_unlock(&wal->lock);
+
+        bool ok = writeFully(fd, batch, batchBytes) && fdatasync(fd) == 0;
+
+        pthread_mutex_lock(&wal->lock);
+        wal->inFlight = 0;
+        if (ok) {
+            wal->durableLsn = batchEnd;
+            wal->fileBytes += batchBytes;
+            wal->commits++;
+        } else if (!wal->failed) {
+            fprintf(stderr, "Failed to write the write-ahead log\n");
+            wal->failed = true;
+        }
+        pthread_cond_broadcast(&wal->done);
+    }
+    pthread_mutex_unlock(&wal->lock);
+    return NULL;
+}
+
+// Open (or create) a log file; replay it before starting to log new records
+bool openWriteAheadLog(WriteAheadLog* wal, const char* path, unsigned commitDelayMicros) {
+    memset(wal, 0, sizeof(*wal));
+    wal->fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0644);
+    if (wal->fd < 0) {
+        fprintf(stderr, "Cannot open write-ahead log %s\n", path);
+        return false;
+    }
+    wal->capacity = wal->spareCapacity = 4096;
+    wal->buffer = (char*)malloc(wal->capacity);
+    wal->spare = (char*)malloc(wal->spareCapacity);
+    if (wal->buffer == NULL || wal->spare == NULL) {
+        fprintf(stderr, "Failed to allocate memory for write-ahead log\n");
+        free(wal->buffer);
+        free(wal->spare);
+        close(wal->fd);
+        return false;
+    }
+    snprintf(wal->path, sizeof(wal->path), "%s", path);
+    wal->nextLsn = 1;
+    wal->commitDelay = (uint64_t)commitDelayMicros * 1000;
+
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_mutex_init(&wal->lock, NULL);
+    pthread_cond_init(&wal->work, &attr);
+    pthread_cond_init(&wal->done, NULL);
+    pthread_condattr_destroy(&attr);
+    return true;
+}
+
+// Start the group-commit thread
+bool startWriteAheadLog(WriteAheadLog* wal) {
+    if (pthread_create(&wal->flusher, NULL, walFlusher, wal) != 0) {
+        fprintf(stderr, "Failed to start write-ahead log thread\n");
+        return false;
+    }
+    wal->running = true;
+    return true;
+}
+
+// Buffer one record; it becomes durable with the next group commit.
+// On failure the log is marked failed, so every later commit reports the loss too.
+bool walLogRecord(WriteAheadLog* wal, int type, int id, int age, const char* const texts[], const size_t lengths[], int textCount, uint64_t* lsn) {
+    size_t payload = 1 + 2 * sizeof(int32_t);
+    for (int i = 0; i < textCount; i++) {
+        payload += sizeof(uint32_t) + lengths[i];
+    }
+    size_t size = sizeof(WalRecordHeader) + payload;
+
+    pthread_mutex_lock(&wal->lock);
+    if (wal->length + size > wal->capacity) {
+        size_t newCapacity = wal->capacity * 2;
+        while (newCapacity < wal->length + size) {
+            newCapacity *= 2;
+        }
+        char* newBuffer = (char*)realloc(wal->buffer, newCapacity);
+        if (newBuffer == NULL) {
+            fprintf(stderr, "Failed to expand write-ahead log buffer\n");
+            wal->failed = true;
+            pthread_cond_broadcast(&wal->done);
+            pthread_mutex_unlock(&wal->lock);
+            return false;
+        }
+        wal->buffer = newBuffer;
+        wal->capacity = newCapacity;
+    }
+
+    char* record = wal->buffer + wal->length;
+    WalRecordHeader header = { (uint32_t)payload, 0, wal->nextLsn++ };
+    char* p = record + sizeof(header);
+    int32_t fields[2] = { id, age };
+    *p++ = (char)type;
+    memcpy(p, fields, sizeof(fields));
+    p += sizeof(fields);
+    for (int i = 0; i < textCount; i++) {
+        uint32_t length = (uint32_t)lengths[i];
+        memcpy(p, &length, sizeof(length));
+        memcpy(p + sizeof(length), texts[i], lengths[i]);
+        p += sizeof(length) + lengths[i];
+    }
+    header.crc = crc32Update(crc32Update(0, &header.lsn, sizeof(header.lsn)), record + sizeof(header), payload);
+    memcpy(record, &header, sizeof(header));
+
+    if (wal->length == 0) {
+        wal->batchStart = nowNanoseconds();
+        pthread_cond_signal(&wal->work);
+    }
+    wal->length += size;
+    wal->records++;
+    if (wal->length >= WAL_GROUP_BYTES) {
+        pthread_cond_signal(&wal->work);
+    }
+    *lsn = header.lsn;
+    pthread_mutex_unlock(&wal->lock);
+    return true;
+}
+
+// Wait for the group commit that contains a record
+bool walWaitDurable(WriteAheadLog* wal, uint64_t lsn) {
+    pthread_mutex_lock(&wal->lock);
+    while (wal->durableLsn < lsn && !wal->failed) {
+        pthread_cond_wait(&wal->done, &wal->lock);
+    }
+    bool ok = !wal->failed;
+    pthread_mutex_unlock(&wal->lock);
+    return ok;
+}
+
+// Commit everything logged so far without waiting out the group delay
+bool walSync(WriteAheadLog* wal) {
+    pthread_mutex_lock(&wal->lock);
+    uint64_t target = wal->nextLsn - 1;
+    wal->flushNow = true;
+    pthread_cond_signal(&wal->work);
+    while (wal->durableLsn < target && !wal->failed) {
+        pthread_cond_wait(&wal->done, &wal->lock);
+    }
+    bool ok = !wal->failed;
+    pthread_mutex_unlock(&wal->lock);
+    return ok;
+}
+
+// Drop every record; callers must have saved a snapshot that includes them, directory entry synced
+bool walTruncate(WriteAheadLog* wal) {
+    if (!walSync(wal)) {
+        return false;
+    }
+    pthread_mutex_lock(&wal->lock);
+    bool ok = ftruncate(wal->fd, 0) == 0 && fsync(wal->fd) == 0;
+    if (ok) {
+        wal->fileBytes = 0;
+    } else {
+        fprintf(stderr, "Failed to truncate the write-ahead log\n");
+    }
+    pthread_mutex_unlock(&wal->lock);
+    return ok;
+}
+
+// Last sequence number handed out, and the file offset at which the records after it will start
+uint64_t walPosition(WriteAheadLog* wal, size_t* offset) {
+    pthread_mutex_lock(&wal->lock);
+    uint64_t lsn = wal->nextLsn - 1;
+    *offset = wal->fileBytes + wal->inFlight + wal->length;
+    pthread_mutex_unlock(&wal->lock);
+    return lsn;
+}
+
+// Append bytes [from, to) of one file to another
+bool copyFileBytes(int in, int out, size_t from, size_t to) {
+    char buffer[1 << 16];
+    while (from < to) {
+        size_t want = to - from < sizeof(buffer) ? to - from : sizeof(buffer);
+        ssize_t got = pread(in, buffer, want, (off_t)from);
+        if (got <= 0 || !writeFully(out, buffer, (size_t)got)) {
+            return false;
+        }
+        from += (size_t)got;
+    }
+    return true;
+}
+
+// Drop the records before offset once a saved snapshot holds them. The records after it move to a new
+// file that replaces the log; writers only wait while the bytes logged during the copy are added.
+bool walDropPrefix(WriteAheadLog* wal, size_t offset) {
+    char tmpPath[sizeof(wal->path) + 4];
+    snprintf(tmpPath, sizeof(tmpPath), "%s.tmp", wal->path);
+    int fd = open(tmpPath, O_RDWR | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "Cannot create %s\n", tmpPath);
+        return false;
+    }
+    // Only this thread replaces the file, and written bytes never change, so most of the copy needs no lock
+    pthread_mutex_lock(&wal->lock);
+    size_t copied = wal->fileBytes;
+    pthread_mutex_unlock(&wal->lock);
+    bool ok = offset <= copied && copyFileBytes(wal->fd, fd, offset, copied);
+
+    pthread_mutex_lock(&wal->lock);
+    while (wal->inFlight > 0) {
+        pthread_cond_wait(&wal->done, &wal->lock);
+    }
+    ok = ok && copyFileBytes(wal->fd, fd, copied, wal->fileBytes) && fsync(fd) == 0 && rename(tmpPath, wal->path) == 0;
+    if (ok) {
+        // The new file is the log from here on, even if the directory sync fails
+        close(wal->fd);
+        wal->fd = fd;
+        wal->fileBytes -= offset;
+        ok = syncParentDirectory(wal->path);
+    } else {
+        fprintf(stderr, "Failed to rewrite the write-ahead log\n");
+        close(fd);
+        unlink(tmpPath);
+    }
+    pthread_mutex_unlock(&wal->lock);
+    return ok;
+}
+
+// Bytes in the log file plus those still buffered
+size_t walLogBytes(WriteAheadLog* wal) {
+    pthread_mutex_lock(&wal->lock);
+    size_t bytes = wal->fileBytes + wal->length;
+    pthread_mutex_unlock(&wal->lock);
+    return bytes;
+}
+
+// Flush what is left, stop the flusher and close the file
+void closeWriteAheadLog(WriteAheadLog* wal) {
+    if (wal->running) {
+        pthread_mutex_lock(&wal->lock);
+        wal->stopping = true;
+        pthread_cond_signal(&wal->work);
+        pthread_mutex_unlock(&wal->lock);
+        pthread_join(wal->flusher, NULL);
+        wal->running = false;
+    }
+    close(wal->fd);
+    free(wal->buffer);
+    free(wal->spare);
+    pthread_mutex_destroy(&wal->lock);
+    pthread_cond_destroy(&wal->work);
+    pthread_cond_destroy(&wal->done);
+    wal->fd = -1;
+    wal->buffer = wal->spare = NULL;
+}
+
+// Read a length-prefixed string out of a log record into a NUL-terminated buffer
+const char* walReadText(const char** p, const char* end, char* out, size_t outSize) {
+    uint32_t length;
+    if ((size_t)(end - *p) < sizeof(length)) {
+        return NULL;
+    }
+    memcpy(&length, *p, sizeof(length));
+    *p += sizeof(length);
+    if ((size_t)(end - *p) < length) {
+        return NULL;
+    }
+    size_t copy = length < outSize - 1 ? length : outSize - 1;
+    memcpy(out, *p, copy);
+    out[copy] = '\0';
+    *p += length;
+    return out;
+}
+
+// Apply one logged mutation to the database
+bool applyWalRecord(PatientDatabase* db, const char* payload, size_t size) {
+    const char* end = payload + size;
+    if (size < 1 + 2 * sizeof(int32_t)) {
+        return false;
+    }
+    int type = payload[0];
+    int32_t fields[2];
+    memcpy(fields, payload + 1, sizeof(fields));
+    const char* p = payload + 1 + sizeof(fields);
+
+    static char name[MAX_NAME_LENGTH], diagnosis[MAX_DIAGNOSIS_LENGTH], text[1 << 16];
+    switch (type) {
+        case WAL_ADD_PATIENT:
+            if (!walReadText(&p, end, name, sizeof(name)) || !walReadText(&p, end, diagnosis, sizeof(diagnosis)) ||
+                !walReadText(&p, end, text, sizeof(text))) {
+                return false;
+            }
+            insertPatient(db, fields[0], name, fields[1], diagnosis, text);
+            return true;
+        case WAL_APPEND_HISTORY:
+            if (!walReadText(&p, end, text, sizeof(text))) {
+                return false;
+            }
+            appendPatientHistory(db, findPatient(db, fields[0]), text);
+            return true;
+        case WAL_REMOVE_PATIENT:
+            erasePatient(db, fields[0]);
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Re-apply logged mutations newer than the snapshot; a torn tail is cut off, a gap in the sequence is an error
+bool replayWriteAheadLog(PatientDatabase* db, WriteAheadLog* wal, size_t* applied) {
+    *applied = 0;
+    struct stat st;
+    if (fstat(wal->fd, &st) != 0) {
+        return false;
+    }
+    size_t size = (size_t)st.st_size;
+    char* log = (char*)malloc(size ? size : 1);
+    if (log == NULL) {
+        fprintf(stderr, "Failed to allocate memory for log replay\n");
+        return false;
+    }
+    size_t have = 0;
+    while (have < size) {
+        ssize_t got = pread(wal->fd, log + have, size - have, (off_t)have);
+        if (got <= 0) {
+            break;
+        }
+        have += (size_t)got;
+    }
+
+    WriteAheadLog* saved = db->wal;
+    db->wal = NULL; // replayed changes are already in the log
+    uint64_t lastLsn = db->appliedLsn;
+    size_t offset = 0;
+    while (offset + sizeof(WalRecordHeader) <= have) {
+        WalRecordHeader header;
+        memcpy(&header, log + offset, sizeof(header));
+        const char* payload = log + offset + sizeof(header);
+        if (header.size > have - offset - sizeof(header) ||
+            crc32Update(crc32Update(0, &header.lsn, sizeof(header.lsn)), payload, header.size) != header.crc) {
+            break;
+        }
+        if (header.lsn > db->appliedLsn) {
+            // A gap means the snapshot is older than the log expects: records it should hold were dropped
+            if (header.lsn != db->appliedLsn + 1) {
+                fprintf(stderr, "The write-ahead log skips from change %llu to %llu; the snapshot is missing changes\n",
+                        (unsigned long long)db->appliedLsn, (unsigned long long)header.lsn);
+                db->wal = saved;
+                free(log);
+                return false;
+            }
+            if (!applyWalRecord(db, payload, header.size)) {
+                break;
+            }
+            db->appliedLsn = header.lsn;
+            (*applied)++;
+        }
+        if (header.lsn > lastLsn) {
+            lastLsn = header.lsn;
+        }
+        offset += sizeof(header) + header.size;
+    }
+    db->wal = saved;
+    free(log);
+
+    if (offset < size) {
+        fprintf(stderr, "Discarding %zu bytes of incomplete log records\n", size - offset);
+        if (ftruncate(wal->fd, (off_t)offset) != 0) {
+            return false;
+        }
+    }
+    wal->nextLsn = lastLsn + 1;
+    wal->durableLsn = lastLsn;
+    wal->fileBytes = offset;
+    return true;
+}
+
+// Wait until the most recent change of this database is on disk
+bool commitPatientChanges(PatientDatabase* db) {
+    return db->wal == NULL || walWaitDurable(db->wal, db->appliedLsn);
+}
+
+// Snapshot the database, then drop the log records it now contains
+bool checkpointPatientDatabase(PatientDatabase* db, const char* path) {
+    if (db->wal != NULL && !walSync(db->wal)) {
+        return false;
+    }
+    if (!savePatientDatabase(db, path)) {
+        return false;
+    }
+    return db->wal == NULL || walTruncate(db->wal);
+}
+
+// Open the snapshot (or start empty if there is none yet) and recover every change logged since
+bool openPatientStore(PatientDatabase* db, WriteAheadLog* wal, const char* path, unsigned commitDelayMicros) {
+    // A file that exists but cannot be loaded is never replaced: the exit checkpoint would overwrite it
+    struct stat st;
+    if (stat(path, &st) != 0 && errno == ENOENT) {
+        initPatientDatabase(db, INITIAL_DATABASE_CAPACITY);
+    } else if (openPatientDatabase(db, path)) {
+        printf("Loaded %zu patients from %s\n", db->count, path);
+    } else {
+        fprintf(stderr, "Cannot load %s; it was left untouched. Move it aside to start with an empty database.\n", path);
+        return false;
+    }
+
+    char walPath[4096];
+    size_t applied;
+    if (snprintf(walPath, sizeof(walPath), "%s.wal", path) >= (int)sizeof(walPath) ||
+        !openWriteAheadLog(wal, walPath, commitDelayMicros)) {
+        freePatientDatabase(db);
+        return false;
+    }
+    if (!replayWriteAheadLog(db, wal, &applied) || !startWriteAheadLog(wal)) {
+        fprintf(stderr, "Failed to recover from %s\n", walPath);
+        closeWriteAheadLog(wal);
+        freePatientDatabase(db);
+        return false;
+    }
+    if (applied > 0) {
+        printf("Recovered %zu logged changes from %s\n", applied, walPath);
+    }
+    db->wal = wal;
+    return true;
+}
+
+// Checkpoint on the way out so the next start only has to map the snapshot
+bool closePatientStore(PatientDatabase* db, const char* path) {
+    bool ok = checkpointPatientDatabase(db, path);
+    if (db->wal != NULL) {
+        closeWriteAheadLog(db->wal);
+        db->wal = NULL;
+    }
+    freePatientDatabase(db);
+    return ok;
+}
+
+// Free all database memory
+void freePatientDatabase(PatientDatabase* db) {
+    // Histories never touched since the file was opened own no memory
+    for (size_t i = 0; i < db->count; i++) {
+        if (db->histories[i].capacity != 0) {
+            freeMedicalHistory(&db->histories[i]);
+        }
+    }
+    releaseBlock(db->ids);
+    releaseBlock(db->ages);
+    releaseBlock(db->nameRefs);
+    releaseBlock(db->diagnosisRefs);
+    releaseBlock(db->histories);
+    freeStringPool(&db->strings);
+    freeSearchIndex(&db->search);
+    freeNameIndex(&db->names);
+    freeAgeIndex(&db->byAge);
+    freeSlotCounts(&db->slotCounts);
+    releaseBlock(db->index);
+    releaseBlock(db->slots);
+    releaseBlock(db->rowSlots);
+    closePatientFile(&db->file);
+    db->ids = NULL;
+    db->ages = NULL;
+    db->nameRefs = NULL;
+    db->diagnosisRefs = NULL;
+    db->histories = NULL;
+    db->index = NULL;
+    db->slots = NULL;
+    db->rowSlots = NULL;
+    db->count = 0;
+    db->capacity = 0;
+    db->indexCapacity = 0;
+    db->slotCount = 0;
+    db->slotCapacity = 0;
+    db->freeSlot = INDEX_EMPTY;
+}
+
+// Get the whole ingest input in memory; regular files are mapped rather than copied
+bool readIngestInput(const char* path, const char** data, size_t* size, bool* mapped) {
+    int fd = strcmp(path, "-") == 0 ? STDIN_FILENO : open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Cannot open %s\n", path);
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        void* base = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (base != MAP_FAILED) {
+            posix_madvise(base, (size_t)st.st_size, POSIX_MADV_SEQUENTIAL);
+            if (fd != STDIN_FILENO) {
+                close(fd);
+            }
+            *data = (const char*)base;
+            *size = (size_t)st.st_size;
+            *mapped = true;
+            return true;
+        }
+    }
+
+    // Pipes have no size up front, so read them into a buffer that doubles
+    size_t capacity = INGEST_READ_CHUNK, length = 0;
+    char* buffer = (char*)malloc(capacity);
+    ssize_t got = 0;
+    while (buffer != NULL) {
+        if (length == capacity) {
+            char* grown = (char*)realloc(buffer, capacity * 2);
+            if (grown == NULL) {
+                free(buffer);
+                buffer = NULL;
+                break;
+            }
+            buffer = grown;
+            capacity *= 2;
+        }
+        got = read(fd, buffer + length, capacity - length);
+        if (got <= 0) {
+            break;
+        }
+        length += (size_t)got;
+    }
+    if (fd != STDIN_FILENO) {
+        close(fd);
+    }
+    if (buffer == NULL || got < 0) {
+        fprintf(stderr, "Failed to read %s\n", path);
+        free(buffer);
+        return false;
+    }
+    *data = buffer;
+    *size = length;
+    *mapped = false;
+    return true;
+}
+
+// Split one CSV line; fields point into the input and a malformed line reports -1 fields
+const char* nextCsvRecord(const char* p, const char* end, CsvField fields[], int maxFields, int* fieldCount) {
+    const char* lineEnd = (const char*)memchr(p, '\n', (size_t)(end - p));
+    if (lineEnd == NULL) {
+        lineEnd = end;
+    }
+    const char* next = lineEnd < end ? lineEnd + 1 : end;
+    if (lineEnd > p && lineEnd[-1] == '\r') {
+        lineEnd--;
+    }
+
+    int count = 0;
+    while (1) {
+        CsvField field = { p, 0, false };
+        if (p < lineEnd && *p == '"') {
+            // Quoted field: runs to the closing quote, "" stands for one quote
+            field.start = ++p;
+            while (1) {
+                const char* quote = (const char*)memchr(p, '"', (size_t)(lineEnd - p));
+                if (quote == NULL) {
+                    *fieldCount = -1;
+                    return next;
+                }
+                if (quote + 1 < lineEnd && quote[1] == '"') {
+                    field.escaped = true;
+                    p = quote + 2;
+                    continue;
+                }
+                field.length = (size_t)(quote - field.start);
+                p = quote + 1;
+                break;
+            }
+            if (p < lineEnd && *p != ',') {
+                *fieldCount = -1;
+                return next;
+            }
+        } else {
+            const char* comma = (const char*)memchr(p, ',', (size_t)(lineEnd - p));
+            if (comma == NULL) {
+                comma = lineEnd;
+            }
+            field.length = (size_t)(comma - p);
+            p = comma;
+        }
+
+        if (count < maxFields) {
+            fields[count] = field;
+        }
+        count++;
+        if (p >= lineEnd) {
+            break;
+        }
+        p++;  // skip the comma
+    }
+    *fieldCount = count;
+    return next;
+}
+
+// Parse a decimal field without needing a NUL after it
+bool parseIntField(const CsvField* field, int* value) {
+    const char* p = field->start;
+    const char* end = p + field->length;
+    while (p < end && isspace((unsigned char)*p)) {
+        p++;
+    }
+    while (end > p && isspace((unsigned char)end[-1])) {
+        end--;
+    }
+    bool negative = p < end && *p == '-';
+    if (negative || (p < end && *p == '+')) {
+        p++;
+    }
+    if (p == end) {
+        return false;
+    }
+    long long result = 0;
+    for (; p < end; p++) {
+        if (!isdigit((unsigned char)*p)) {
+            return false;
+        }
+        result = result * 10 + (*p - '0');
+        if (result > (long long)INT_MAX + 1) {
+            return false;
+        }
+    }
+    if (negative) {
+        result = -result;
+    }
+    if (result > INT_MAX) {
+        return false;
+    }
+    *value = (int)result;
+    return true;
+}
+
+// Text of a field; only quoted fields with "" in them are copied, into scratch
+const char* csvFieldText(const CsvField* field, char* scratch, size_t scratchSize, size_t* length) {
+    if (!field->escaped) {
+        *length = field->length;
+        return field->start;
+    }
+    if (field->length >= scratchSize) {
+        return NULL;
+    }
+    size_t n = 0;
+    for (size_t i = 0; i < field->length; i++) {
+        scratch[n++] = field->start[i];
+        if (field->start[i] == '"') {
+            i++;  // second quote of the pair
+        }
+    }
+    *length = n;
+    return scratch;
+}
+
+// Apply the limits addPatient enforces by prompting to a record from a file or a client
+const char* checkPatientFields(int age, size_t nameLength, size_t diagnosisLength, size_t historyLength) {
+    if (age <= 0 || age > MAX_PATIENT_AGE) {
+        return "age must be between 1 and 999";
+    }
+    if (nameLength == 0 || nameLength >= MAX_NAME_LENGTH) {
+        return "name is empty or too long";
+    }
+    if (diagnosisLength == 0 || diagnosisLength >= MAX_DIAGNOSIS_LENGTH) {
+        return "diagnosis is empty or too long";
+    }
+    if (historyLength >= MAX_INPUT_LENGTH) {
+        return "medical history notes are too long";
+    }
+    return NULL;
+}
+
+// Bulk load an admissions feed; bad lines are reported and skipped, good ones stored without prompts.
+// Fields after the diagnosis are history entries, one per field, so an export reads back unchanged.
+bool ingestPatients(PatientDatabase* db, const char* path, size_t* added, size_t* rejected) {
+    const char* data;
+    size_t size;
+    bool mapped;
+    *added = 0;
+    *rejected = 0;
+    if (!readIngestInput(path, &data, &size, &mapped)) {
+        return false;
+    }
+    const char* end = data + size;
+
+    // Count lines first so the columns, handle slots and index are sized exactly once
+    size_t lines = 0;
+    for (const char* p = data; p < end && (p = (const char*)memchr(p, '\n', (size_t)(end - p))) != NULL; p++) {
+        lines++;
+    }
+    if (size > 0 && end[-1] != '\n') {
+        lines++;
+    }
+    bool ok = reservePatientDatabase(db, db->count + lines);
+    if (!ok) {
+        fprintf(stderr, "Failed to reserve room for %zu patients\n", db->count + lines);
+    }
+
+    // One checkpoint makes the batch durable; logging every record would double the I/O
+    WriteAheadLog* wal = db->wal;
+    db->wal = NULL;
+
+    char nameScratch[MAX_NAME_LENGTH], diagnosisScratch[MAX_DIAGNOSIS_LENGTH], historyScratch[MAX_INPUT_LENGTH];
+    CsvField* fields = (CsvField*)malloc(INGEST_FIELD_COUNT * sizeof(CsvField));
+    int fieldCapacity = INGEST_FIELD_COUNT;
+    if (fields == NULL) {
+        fprintf(stderr, "Failed to allocate memory for the ingest fields\n");
+        ok = false;
+    }
+    size_t lineNumber = 0;
+    const char* p = data;
+    while (ok && p < end) {
+        int fieldCount;
+        const char* next = nextCsvRecord(p, end, fields, fieldCapacity, &fieldCount);
+        if (fieldCount > fieldCapacity) {
+            // A long history: grow the field array and split the same line again
+            CsvField* grown = (CsvField*)realloc(fields, (size_t)fieldCount * sizeof(CsvField));
+            if (grown == NULL) {
+                fprintf(stderr, "Failed to allocate memory for the ingest fields\n");
+                ok = false;
+                break;
+            }
+            fields = grown;
+            fieldCapacity = fieldCount;
+            continue;
+        }
+        p = next;
+        lineNumber++;
+        if (fieldCount == 1 && fields[0].length == 0) {
+            continue;  // blank line
+        }
+
+        int id = 0, age = 0;
+        const char* name = NULL;
+        const char* diagnosis = NULL;
+        const char* history = "";
+        size_t nameLength = 0, diagnosisLength = 0, historyLength = 0;
+        int firstEntry = INGEST_FIELD_COUNT - 1;  // field of the entry stored with the record
+        const char* reason = NULL;
+        if (fieldCount < INGEST_FIELD_COUNT - 1) {
+            reason = fieldCount < 0 ? "unterminated quote" : "expected id,name,age,diagnosis[,history...]";
+        } else if (!parseIntField(&fields[0], &id)) {
+            if (lineNumber == 1) {
+                continue;  // header line
+            }
+            reason = "patient ID is not a number";
+        } else {
+            // Fields too long for the scratch buffers fail the length checks
+            if (!parseIntField(&fields[2], &age)) {
+                age = 0;
+            }
+            if ((name = csvFieldText(&fields[1], nameScratch, sizeof(nameScratch), &nameLength)) == NULL) {
+                nameLength = MAX_NAME_LENGTH;
+            }
+            if ((diagnosis = csvFieldText(&fields[3], diagnosisScratch, sizeof(diagnosisScratch), &diagnosisLength)) == NULL) {
+                diagnosisLength = MAX_DIAGNOSIS_LENGTH;
+            }
+            // Each entry is held to the limit of one typed at the prompt; empty fields add no entry
+            for (int i = firstEntry; i < fieldCount; i++) {
+                if (fields[i].length >= MAX_INPUT_LENGTH) {
+                    historyLength = MAX_INPUT_LENGTH;
+                }
+            }
+            while (firstEntry < fieldCount && fields[firstEntry].length == 0) {
+                firstEntry++;
+            }
+            if (historyLength == 0 && firstEntry < fieldCount) {
+                history = csvFieldText(&fields[firstEntry], historyScratch, sizeof(historyScratch), &historyLength);
+            }
+            reason = checkPatientFields(age, nameLength, diagnosisLength, historyLength);
+            if (reason == NULL && lookupPatientRow(db, id) != INDEX_EMPTY) {
+                reason = "patient ID already exists";
+            }
+        }
+
+        if (reason != NULL) {
+            if (*rejected < INGEST_REPORTED_ERRORS) {
+                fprintf(stderr, "Line %zu skipped: %s\n", lineNumber, reason);
+            }
+            (*rejected)++;
+            continue;
+        }
+        if (!insertPatientFields(db, id, name, nameLength, age, diagnosis, diagnosisLength, history, historyLength)) {
+            fprintf(stderr, "Failed to store patient from line %zu\n", lineNumber);
+            ok = false;
+            break;
+        }
+        // The rest of the entries are appended in order
+        PatientHandle handle = { NO_SLOT, 0 };
+        if (firstEntry + 1 < fieldCount) {
+            handle = findPatient(db, id);
+        }
+        for (int i = firstEntry + 1; ok && i < fieldCount; i++) {
+            size_t entryLength;
+            const char* entry = csvFieldText(&fields[i], historyScratch, sizeof(historyScratch), &entryLength);
+            if (entryLength == 0) {
+                continue;
+            }
+            if (entry != historyScratch) {
+                memcpy(historyScratch, entry, entryLength);
+            }
+            historyScratch[entryLength] = '\0';
+            if (!appendPatientHistory(db, handle, historyScratch)) {
+                fprintf(stderr, "Failed to store the history of line %zu\n", lineNumber);
+                ok = false;
+            }
+        }
+        if (!ok) {
+            break;
+        }
+        (*added)++;
+    }
+    free(fields);
+    if (*rejected > INGEST_REPORTED_ERRORS) {
+        fprintf(stderr, "... %zu more lines skipped\n", *rejected - INGEST_REPORTED_ERRORS);
+    }
+
+    db->wal = wal;
+    if (mapped) {
+        munmap((void*)data, size);
+    } else {
+        free((void*)data);
+    }
+    return ok;
+}
+
+// Write every piece of an iovec array, resuming after short writes
+bool writevFully(int fd, struct iovec* pieces, int count) {
+    while (count > 0) {
+        ssize_t written = writev(fd, pieces, count);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written < 0) {
+            return false;
+        }
+        while (count > 0 && (size_t)written >= pieces->iov_len) {
+            written -= (ssize_t)pieces->iov_len;
+            pieces++;
+            count--;
+        }
+        if (count > 0) {
+            pieces->iov_base = (char*)pieces->iov_base + written;
+            pieces->iov_len -= (size_t)written;
+        }
+    }
+    return true;
+}
+
+void initExportWriter(ExportWriter* writer, int fd) {
+    memset(writer, 0, sizeof(*writer));
+    writer->fd = fd;
+    writer->buffer = (char*)malloc(EXPORT_BUFFER_SIZE);
+    if (writer->buffer == NULL) {
+        fprintf(stderr, "Failed to allocate memory for the export buffer\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Hand everything gathered so far to the kernel in one writev
+bool flushExportWriter(ExportWriter* writer) {
+    if (!writer->failed && writer->pieceCount > 0 && !writevFully(writer->fd, writer->pieces, writer->pieceCount)) {
+        fprintf(stderr, "Export write failed\n");
+        writer->failed = true;
+    }
+    writer->pieceCount = 0;
+    writer->used = 0;
+    return !writer->failed;
+}
+
+void freeExportWriter(ExportWriter* writer) {
+    free(writer->buffer);
+    writer->buffer = NULL;
+}
+
+// Copy bytes into the buffer, extending the last piece when it already ends there
+void exportCopy(ExportWriter* writer, const char* data, size_t length) {
+    if (writer->used + length > EXPORT_BUFFER_SIZE || writer->pieceCount == EXPORT_IOV_COUNT) {
+        flushExportWriter(writer);
+    }
+    if (length > EXPORT_BUFFER_SIZE) {
+        // Only a caller bug could get here; field lengths are far below the buffer size
+        struct iovec piece = { (void*)data, length };
+        if (!writer->failed && !writevFully(writer->fd, &piece, 1)) {
+            writer->failed = true;
+        }
+        return;
+    }
+    char* at = writer->buffer + writer->used;
+    memcpy(at, data, length);
+    writer->used += length;
+    struct iovec* last = writer->pieceCount > 0 ? &writer->pieces[writer->pieceCount - 1] : NULL;
+    if (last != NULL && (char*)last->iov_base + last->iov_len == at) {
+        last->iov_len += length;
+    } else {
+        writer->pieces[writer->pieceCount].iov_base = at;
+        writer->pieces[writer->pieceCount].iov_len = length;
+        writer->pieceCount++;
+    }
+}
+
+// Point a piece straight at text that stays put until the next flush (pool strings, histories)
+void exportReference(ExportWriter* writer, const char* data, size_t length) {
+    if (length < EXPORT_COPY_BELOW || writer->copyText) {
+        exportCopy(writer, data, length);
+        return;
+    }
+    if (writer->pieceCount == EXPORT_IOV_COUNT) {
+        flushExportWriter(writer);
+    }
+    writer->pieces[writer->pieceCount].iov_base = (void*)data;
+    writer->pieces[writer->pieceCount].iov_len = length;
+    writer->pieceCount++;
+}
+
+void exportInt(ExportWriter* writer, int value) {
+    char digits[16];
+    char* p = digits + sizeof(digits);
+    unsigned magnitude = value < 0 ? 0U - (unsigned)value : (unsigned)value;
+    do {
+        *--p = (char)('0' + magnitude % 10);
+        magnitude /= 10;
+    } while (magnitude > 0);
+    if (value < 0) {
+        *--p = '-';
+    }
+    exportCopy(writer, p, (size_t)(digits + sizeof(digits) - p));
+}
+
+// Whether a CSV field has to be quoted
+bool csvNeedsQuotes(const char* text, size_t length) {
+    for (size_t i = 0; i < length; i++) {
+        if (text[i] == ',' || text[i] == '"' || text[i] == '\n' || text[i] == '\r') {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Inside of a quoted CSV field: quotes doubled, line breaks flattened (the ingest format is one record per line)
+void exportCsvEscaped(ExportWriter* writer, const char* text, size_t length) {
+    size_t start = 0;
+    for (size_t i = 0; i < length; i++) {
+        if (text[i] == '"' || text[i] == '\n' || text[i] == '\r') {
+            exportReference(writer, text + start, i - start);
+            exportCopy(writer, text[i] == '"' ? "\"\"" : " ", text[i] == '"' ? 2 : 1);
+            start = i + 1;
+        }
+    }
+    exportReference(writer, text + start, length - start);
+}
+
+void exportCsvText(ExportWriter* writer, const char* text, size_t length) {
+    if (!csvNeedsQuotes(text, length)) {
+        exportReference(writer, text, length);
+        return;
+    }
+    exportCopy(writer, "\"", 1);
+    exportCsvEscaped(writer, text, length);
+    exportCopy(writer, "\"", 1);
+}
+
+// JSON string with quotes, backslashes and control characters escaped
+void exportJsonText(ExportWriter* writer, const char* text, size_t length) {
+    exportCopy(writer, "\"", 1);
+    size_t start = 0;
+    for (size_t i = 0; i < length; i++) {
+        unsigned char c = (unsigned char)text[i];
+        if (c != '"' && c != '\\' && c >= 0x20) {
+            continue;
+        }
+        exportReference(writer, text + start, i - start);
+        char escape[8];
+        if (c == '"' || c == '\\') {
+            escape[0] = '\\';
+            escape[1] = (char)c;
+            exportCopy(writer, escape, 2);
+        } else {
+            snprintf(escape, sizeof(escape), "\\u%04x", c);
+            exportCopy(writer, escape, 6);
+        }
+        start = i + 1;
+    }
+    exportReference(writer, text + start, length - start);
+    exportCopy(writer, "\"", 1);
+}
+
+// Filter test on the hot age column first, the name only when the age passes
+bool exportFilterMatches(const PatientDatabase* db, const ExportFilter* filter, size_t row) {
+    if (db->ages[row] < filter->minAge || db->ages[row] > filter->maxAge) {
+        return false;
+    }
+    return filter->namePrefix == NULL || filter->namePrefix[0] == '\0' ||
+           compareNamePrefix(poolString(&db->strings, db->nameRefs[row]), filter->namePrefix) == 0;
+}
+
+// Export matching patients as CSV (the ingest format, one field per history entry) or a JSON array
+bool exportPatients(const PatientDatabase* db, int fd, ExportFormat format, const ExportFilter* filter, size_t* exported) {
+    ExportWriter writer;
+    initExportWriter(&writer, fd);
+    *exported = 0;
+    if (format == EXPORT_CSV) {
+        exportCopy(&writer, "id,name,age,diagnosis,history\n", 30);
+    } else {
+        exportCopy(&writer, "[", 1);
+    }
+    for (size_t row = 0; row < db->count && !writer.failed; row++) {
+        if (filter != NULL && !exportFilterMatches(db, filter, row)) {
+            continue;
+        }
+        const char* name = poolString(&db->strings, db->nameRefs[row]);
+        const char* diagnosis = poolString(&db->strings, db->diagnosisRefs[row]);
+        MedicalHistory scratch;
+        const MedicalHistory* history = peekPatientHistory(db, row, &scratch);
+        writer.copyText = history == &scratch;  // the peek buffer is reused by the next row
+        if (format == EXPORT_CSV) {
+            exportInt(&writer, db->ids[row]);
+            exportCopy(&writer, ",", 1);
+            exportCsvText(&writer, name, strlen(name));
+            exportCopy(&writer, ",", 1);
+            exportInt(&writer, db->ages[row]);
+            exportCopy(&writer, ",", 1);
+            exportCsvText(&writer, diagnosis, strlen(diagnosis));
+            if (history->entryCount == 0) {
+                exportCopy(&writer, ",", 1);
+            }
+            for (size_t i = 0; i < history->entryCount; i++) {
+                size_t length;
+                const char* entry = getMedicalHistoryEntry(history, i, &length);
+                exportCopy(&writer, ",", 1);
+                exportCsvText(&writer, entry, length);
+            }
+            exportCopy(&writer, "\n", 1);
+        } else {
+            exportCopy(&writer, *exported == 0 ? "\n{\"id\":" : ",\n{\"id\":", *exported == 0 ? 7 : 8);
+            exportInt(&writer, db->ids[row]);
+            exportCopy(&writer, ",\"name\":", 8);
+            exportJsonText(&writer, name, strlen(name));
+            exportCopy(&writer, ",\"age\":", 7);
+            exportInt(&writer, db->ages[row]);
+            exportCopy(&writer, ",\"diagnosis\":", 13);
+            exportJsonText(&writer, diagnosis, strlen(diagnosis));
+            exportCopy(&writer, ",\"history\":[", 12);
+            for (size_t i = 0; i < history->entryCount; i++) {
+                size_t length;
+                const char* entry = getMedicalHistoryEntry(history, i, &length);
+                if (i > 0) {
+                    exportCopy(&writer, ",", 1);
+                }
+                exportJsonText(&writer, entry, length);
+            }
+            exportCopy(&writer, "]}", 2);
+        }
+        (*exported)++;
+    }
+    if (format == EXPORT_JSON) {
+        exportCopy(&writer, "\n]\n", 3);
+    }
+    bool ok = flushExportWriter(&writer);
+    freeExportWriter(&writer);
+    return ok;
+}
+
+// Open an export target: "-" is standard output, anything else a file that is created or replaced
+int openExportFile(const char* path) {
+    if (strcmp(path, "-") == 0) {
+        return STDOUT_FILENO;
+    }
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "Cannot create %s\n", path);
+    }
+    return fd;
+}
+
+// Menu option: export to a file in either format
+void exportRecords(PatientDatabase* db) {
+    char path[MAX_INPUT_LENGTH];
+    getStringInput("Enter export file path: ", path, sizeof(path));
+    int choice = getIntInput("Format (1 = CSV, 2 = JSON): ");
+    if (choice != 1 && choice != 2) {
+        printf("Invalid format.\n");
+        return;
+    }
+    int fd = openExportFile(path);
+    if (fd < 0) {
+        return;
+    }
+    size_t exported;
+    uint64_t start = nowNanoseconds();
+    bool ok = exportPatients(db, fd, choice == 1 ? EXPORT_CSV : EXPORT_JSON, NULL, &exported);
+    if (fd != STDOUT_FILENO && close(fd) != 0) {
+        ok = false;
+    }
+    if (ok) {
+        printf("Exported %zu patients to %s in %.3f s\n", exported, path, (nowNanoseconds() - start) / 1e9);
+    } else {
+        printf("Export to %s failed.\n", path);
+    }
+}
+
+// Shard of a patient ID; a different hash from the ID index so each shard's index still spreads
+size_t shardFor(const PatientServer* server, int id) {
+    return (((uint32_t)id * 2654435761U) >> 16) % server->shardCount;
+}
+
+// Copy one patient, history included, into another database (no logging)
+bool copyPatientRow(PatientDatabase* to, PatientDatabase* from, size_t row) {
+    const char* name = poolString(&from->strings, from->nameRefs[row]);
+    const char* diagnosis = poolString(&from->strings, from->diagnosisRefs[row]);
+    const MedicalHistory* history = patientHistory(from, row);
+    const char* first = "";
+    size_t firstLength = 0;
+    if (history->entryCount > 0) {
+        first = getMedicalHistoryEntry(history, 0, &firstLength);
+    }
+    if (!insertPatientFields(to, from->ids[row], name, strlen(name), from->ages[row], diagnosis, strlen(diagnosis), first, firstLength)) {
+        return false;
+    }
+    MedicalHistory* copy = &to->histories[to->count - 1];
+    for (size_t i = 1; i < history->entryCount; i++) {
+        size_t length;
+        const char* entry = getMedicalHistoryEntry(history, i, &length);
+        if (!addMedicalHistoryEntry(copy, entry, length)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Fold every shard back into one database, e.g. for a checkpoint or on shutdown
+bool mergePatientShards(PatientServer* server, PatientDatabase* merged) {
+    size_t total = 0;
+    uint64_t appliedLsn = 0;
+    for (size_t s = 0; s < server->shardCount; s++) {
+        total += server->shards[s].db.count;
+        if (server->shards[s].db.appliedLsn > appliedLsn) {
+            appliedLsn = server->shards[s].db.appliedLsn;
+        }
+    }
+    initPatientDatabase(merged, total > INITIAL_DATABASE_CAPACITY ? total : INITIAL_DATABASE_CAPACITY);
+    for (size_t s = 0; s < server->shardCount; s++) {
+        for (size_t row = 0; row < server->shards[s].db.count; row++) {
+            if (!copyPatientRow(merged, &server->shards[s].db, row)) {
+                fprintf(stderr, "Failed to merge patient shards\n");
+                freePatientDatabase(merged);
+                return false;
+            }
+        }
+    }
+    merged->appliedLsn = appliedLsn;
+    return true;
+}
+
+// Build one database from a published snapshot; the caller keeps its reader epoch meanwhile
+bool copySnapshotPatients(PatientDatabase* to, const PatientSnapshot* root, size_t shardCount) {
+    initPatientDatabase(to, root->count > INITIAL_DATABASE_CAPACITY ? root->count : INITIAL_DATABASE_CAPACITY);
+    for (size_t s = 0; s < shardCount; s++) {
+        const ShardSnapshot* view = root->shards[s];
+        for (size_t row = 0; row < view->count; row++) {
+            const SnapshotRecord* p = view->chunks[row / SNAPSHOT_CHUNK_ROWS]->rows[row % SNAPSHOT_CHUNK_ROWS];
+            const char* entry = p->text + p->history;
+            const char* end = entry + p->historyLength;
+            const char* newline = p->entryCount > 1 ? (const char*)memchr(entry, '\n', p->historyLength) : NULL;
+            size_t length = (size_t)((newline != NULL ? newline : end) - entry);
+            bool ok = insertPatientFields(to, p->id, p->text, strlen(p->text), p->age, p->text + p->diagnosis,
+                                          strlen(p->text + p->diagnosis), entry, p->entryCount > 0 ? length : 0);
+            // Entries are newline separated, as in MedicalHistory
+            for (size_t i = 1; ok && i < p->entryCount; i++) {
+                entry = newline + 1;
+                newline = (const char*)memchr(entry, '\n', (size_t)(end - entry));
+                length = (size_t)((newline != NULL ? newline : end) - entry);
+                ok = addMedicalHistoryEntry(&to->histories[to->count - 1], entry, length);
+            }
+            if (!ok) {
+                freePatientDatabase(to);
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// Save every shard as of one moment without stalling the server: the write locks are held together
+// only to read a published root and the log position that matches it
+bool checkpointPatientServer(PatientServer* server) {
+    if (!refreshPatientSnapshot(server)) {
+        return false;
+    }
+    size_t reader = enterSnapshotEpoch(server);
+    for (size_t s = 0; s < server->shardCount; s++) {
+        pthread_rwlock_wrlock(&server->shards[s].lock);
+    }
+    bool current = true;
+    for (size_t s = 0; s < server->shardCount; s++) {
+        current = current && !server->shards[s].stale;
+    }
+    size_t offset;
+    uint64_t cut = walPosition(server->wal, &offset);
+    const PatientSnapshot* root = atomic_load(&server->snapshot);
+    for (size_t s = server->shardCount; s-- > 0;) {
+        pthread_rwlock_unlock(&server->shards[s].lock);
+    }
+
+    // A shard that missed a change is copied again by the next attempt; the log keeps everything meanwhile
+    PatientDatabase merged;
+    bool ok = current && walWaitDurable(server->wal, cut) && copySnapshotPatients(&merged, root, server->shardCount);
+    leaveSnapshotEpoch(server, reader);
+    if (ok) {
+        merged.appliedLsn = cut;
+        ok = savePatientDatabase(&merged, server->path);
+        freePatientDatabase(&merged);
+    }
+    return ok && walDropPrefix(server->wal, offset);
+}
+
+// Wake the checkpointer; writes never checkpoint themselves
+void requestServerCheckpoint(PatientServer* server) {
+    pthread_mutex_lock(&server->checkpointLock);
+    server->checkpointWanted = true;
+    pthread_cond_signal(&server->checkpointReady);
+    pthread_mutex_unlock(&server->checkpointLock);
+}
+
+// Checkpointer thread: keeps the shared log bounded in the background
+void* serverCheckpointer(void* arg) {
+    PatientServer* server = (PatientServer*)arg;
+    pthread_mutex_lock(&server->checkpointLock);
+    while (1) {
+        while (!server->checkpointWanted && !server->checkpointStop) {
+            pthread_cond_wait(&server->checkpointReady, &server->checkpointLock);
+        }
+        if (server->checkpointStop) {
+            break;
+        }
+        server->checkpointWanted = false;
+        pthread_mutex_unlock(&server->checkpointLock);
+        // Writes during the last checkpoint may have asked for one although the log is short again
+        if (walLogBytes(server->wal) > WAL_CHECKPOINT_BYTES && !checkpointPatientServer(server)) {
+            fprintf(stderr, "Checkpoint failed; the log keeps every change until the next one\n");
+        }
+        pthread_mutex_lock(&server->checkpointLock);
+    }
+    pthread_mutex_unlock(&server->checkpointLock);
+    return NULL;
+}
+
+// Reply buffer helpers; a connection's replies are sent with one write per batch of requests
+bool replyReserve(ServerReply* reply, size_t extra) {
+    if (reply->length + extra <= reply->capacity) {
+        return true;
+    }
+    size_t capacity = reply->capacity ? reply->capacity : SERVER_LINE_LENGTH;
+    while (capacity < reply->length + extra) {
+        capacity *= 2;
+    }
+    char* data = (char*)realloc(reply->data, capacity);
+    if (data == NULL) {
+        return false;
+    }
+    reply->data = data;
+    reply->capacity = capacity;
+    return true;
+}
+
+void replyText(ServerReply* reply, const char* text, size_t length) {
+    if (replyReserve(reply, length)) {
+        memcpy(reply->data + reply->length, text, length);
+        reply->length += length;
+    }
+}
+
+void replyFormat(ServerReply* reply, const char* format, ...) {
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(NULL, 0, format, args);
+    va_end(args);
+    if (length < 0 || !replyReserve(reply, (size_t)length + 1)) {
+        return;
+    }
+    va_start(args, format);
+    vsnprintf(reply->data + reply->length, (size_t)length + 1, format, args);
+    va_end(args);
+    reply->length += (size_t)length;
+}
+
+// Copy one patient into a single read-only block; called with the shard locked
+SnapshotRecord* copySnapshotRecord(const PatientDatabase* db, size_t row) {
+    const char* name = poolString(&db->strings, db->nameRefs[row]);
+    const char* diagnosis = poolString(&db->strings, db->diagnosisRefs[row]);
+    const MedicalHistory* history = patientHistory(db, row);
+    size_t nameLength = strlen(name) + 1;
+    size_t diagnosisLength = strlen(diagnosis) + 1;
+    SnapshotRecord* record = (SnapshotRecord*)malloc(sizeof(SnapshotRecord) + nameLength + diagnosisLength + history->length + 1);
+    if (record == NULL) {
+        return NULL;
+    }
+    record->id = db->ids[row];
+    record->age = db->ages[row];
+    record->diagnosis = nameLength;
+    record->history = nameLength + diagnosisLength;
+    record->historyLength = history->length;
+    record->entryCount = history->entryCount;
+    memcpy(record->text, name, nameLength);
+    memcpy(record->text + record->diagnosis, diagnosis, diagnosisLength);
+    memcpy(record->text + record->history, getMedicalHistoryText(history), history->length);
+    record->text[record->history + history->length] = '\0';
+    return record;
+}
+
+// Copy a whole shard, one record per patient; called with the shard locked for reading
+ShardSnapshot* copyShardSnapshot(const PatientDatabase* db) {
+    size_t chunkCount = (db->count + SNAPSHOT_CHUNK_ROWS - 1) / SNAPSHOT_CHUNK_ROWS;
+    ShardSnapshot* snapshot = (ShardSnapshot*)calloc(1, sizeof(ShardSnapshot) + chunkCount * sizeof(SnapshotChunk*));
+    if (snapshot == NULL) {
+        return NULL;
+    }
+    snapshot->chunkCount = chunkCount;
+    for (size_t row = 0; row < db->count; row++) {
+        SnapshotChunk** chunk = &snapshot->chunks[row / SNAPSHOT_CHUNK_ROWS];
+        SnapshotRecord* record = copySnapshotRecord(db, row);
+        if (record == NULL || (*chunk == NULL && (*chunk = (SnapshotChunk*)malloc(sizeof(SnapshotChunk))) == NULL)) {
+            free(record);
+            freeShardSnapshot(snapshot);
+            return NULL;
+        }
+        (*chunk)->rows[row % SNAPSHOT_CHUNK_ROWS] = record;
+        snapshot->count = row + 1;
+    }
+    return snapshot;
+}
+
+void freeShardSnapshot(ShardSnapshot* snapshot) {
+    if (snapshot != NULL) {
+        for (size_t row = 0; row < snapshot->count; row++) {
+            free((void*)snapshot->chunks[row / SNAPSHOT_CHUNK_ROWS]->rows[row % SNAPSHOT_CHUNK_ROWS]);
+        }
+        for (size_t c = 0; c < snapshot->chunkCount; c++) {
+            free(snapshot->chunks[c]);
+        }
+        free(snapshot);
+    }
+}
+
+// Announce the epoch a listing starts in; blocks retired from then on stay allocated until it leaves
+size_t enterSnapshotEpoch(PatientServer* server) {
+    while (1) {
+        for (size_t reader = 0; reader < server->readerCount; reader++) {
+            uint64_t idle = 0;
+            if (atomic_compare_exchange_strong(&server->readerEpochs[reader], &idle, atomic_load(&server->epoch))) {
+                return reader;
+            }
+        }
+        sched_yield();  // every worker and the checkpointer hold one slot at most, so one frees up quickly
+    }
+}
+
+void leaveSnapshotEpoch(PatientServer* server, size_t reader) {
+    atomic_store(&server->readerEpochs[reader], 0);
+}
+
+// Queue the blocks one publish unlinked and free the batches no listing can still hold; called with rootLock held
+void retireSnapshotBlocks(PatientServer* server, RetiredBlocks* batch) {
+    batch->epoch = atomic_fetch_add(&server->epoch, 1);
+    batch->next = NULL;
+    if (server->retiredTail != NULL) {
+        server->retiredTail->next = batch;
+    } else {
+        server->retiredHead = batch;
+    }
+    server->retiredTail = batch;
+
+    // A listing that announced an epoch after the retirement loaded the new root
+    uint64_t oldest = UINT64_MAX;
+    for (size_t reader = 0; reader < server->readerCount; reader++) {
+        uint64_t epoch = atomic_load(&server->readerEpochs[reader]);
+        if (epoch != 0 && epoch < oldest) {
+            oldest = epoch;
+        }
+    }
+    while (server->retiredHead != NULL && server->retiredHead->epoch < oldest) {
+        RetiredBlocks* old = server->retiredHead;
+        server->retiredHead = old->next;
+        for (size_t i = 0; i < old->count; i++) {
+            free(old->blocks[i]);
+        }
+        free(old);
+    }
+    if (server->retiredHead == NULL) {
+        server->retiredTail = NULL;
+    }
+}
+
+// Swap in a root in which the shard's part is fresh; the caller allocated root and batch, so this cannot fail
+void publishShardSnapshot(PatientServer* server, size_t shard, ShardSnapshot* fresh, PatientSnapshot* root, RetiredBlocks* batch) {
+    pthread_mutex_lock(&server->rootLock);
+    PatientSnapshot* old = atomic_load(&server->snapshot);
+    memcpy(root->shards, old->shards, server->shardCount * sizeof(ShardSnapshot*));
+    root->count = old->count - (old->shards[shard] != NULL ? old->shards[shard]->count : 0) + fresh->count;
+    root->shards[shard] = fresh;
+    atomic_store(&server->snapshot, root);
+    batch->blocks[batch->count++] = old;
+    retireSnapshotBlocks(server, batch);
+    pthread_mutex_unlock(&server->rootLock);
+}
+
+PatientSnapshot* allocPatientSnapshot(const PatientServer* server) {
+    return (PatientSnapshot*)calloc(1, sizeof(PatientSnapshot) + server->shardCount * sizeof(ShardSnapshot*));
+}
+
+RetiredBlocks* allocRetiredBlocks(size_t count) {
+    RetiredBlocks* batch = (RetiredBlocks*)malloc(sizeof(RetiredBlocks) + count * sizeof(void*));
+    if (batch != NULL) {
+        batch->count = 0;
+    }
+    return batch;
+}
+
+// Publish a row as it is now, or a new last row after an add: one record, one chunk and the roots above it are copied
+void publishPatientRow(PatientServer* server, size_t shard, size_t row) {
+    PatientShard* part = &server->shards[shard];
+    ShardSnapshot* current = part->published;
+    if (current == NULL || part->stale) {
+        return;  // no listing has asked for this shard yet, or the next one copies it whole
+    }
+    bool added = row == current->count;
+    size_t c = row / SNAPSHOT_CHUNK_ROWS;
+    size_t chunkCount = c < current->chunkCount ? current->chunkCount : c + 1;
+    SnapshotRecord* record = copySnapshotRecord(&part->db, row);
+    SnapshotChunk* chunk = (SnapshotChunk*)malloc(sizeof(SnapshotChunk));
+    ShardSnapshot* fresh = (ShardSnapshot*)malloc(sizeof(ShardSnapshot) + chunkCount * sizeof(SnapshotChunk*));
+    PatientSnapshot* root = allocPatientSnapshot(server);
+    RetiredBlocks* batch = allocRetiredBlocks(4);
+    if (record == NULL || chunk == NULL || fresh == NULL || root == NULL || batch == NULL ||
+        row > current->count || current->count + added != part->db.count) {
+        free(record);
+        free(chunk);
+        free(fresh);
+        free(root);
+        free(batch);
+        part->stale = true;
+        return;
+    }
+    if (c < current->chunkCount) {
+        *chunk = *current->chunks[c];
+        batch->blocks[batch->count++] = current->chunks[c];
+    }
+    if (!added) {
+        batch->blocks[batch->count++] = (void*)chunk->rows[row % SNAPSHOT_CHUNK_ROWS];
+    }
+    chunk->rows[row % SNAPSHOT_CHUNK_ROWS] = record;
+    fresh->count = part->db.count;
+    fresh->chunkCount = chunkCount;
+    memcpy(fresh->chunks, current->chunks, current->chunkCount * sizeof(SnapshotChunk*));
+    fresh->chunks[c] = chunk;
+    batch->blocks[batch->count++] = current;
+    part->published = fresh;
+    publishShardSnapshot(server, shard, fresh, root, batch);
+}
+
+// Publish a removal the way erasePatient made it: the last record moves into the hole
+void publishPatientRemoval(PatientServer* server, size_t shard, size_t row) {
+    PatientShard* part = &server->shards[shard];
+    ShardSnapshot* current = part->published;
+    if (current == NULL || part->stale) {
+        return;
+    }
+    if (row >= current->count || current->count != part->db.count + 1) {
+        part->stale = true;
+        return;
+    }
+    size_t last = current->count - 1;
+    size_t c = row / SNAPSHOT_CHUNK_ROWS;
+    size_t lastChunk = last / SNAPSHOT_CHUNK_ROWS;
+    bool dropLast = last % SNAPSHOT_CHUNK_ROWS == 0;  // the last chunk ends up empty
+    size_t chunkCount = dropLast ? current->chunkCount - 1 : current->chunkCount;
+    SnapshotChunk* chunk = row != last ? (SnapshotChunk*)malloc(sizeof(SnapshotChunk)) : NULL;
+    ShardSnapshot* fresh = (ShardSnapshot*)malloc(sizeof(ShardSnapshot) + chunkCount * sizeof(SnapshotChunk*));
+    PatientSnapshot* root = allocPatientSnapshot(server);
+    RetiredBlocks* batch = allocRetiredBlocks(5);
+    if ((row != last && chunk == NULL) || fresh == NULL || root == NULL || batch == NULL) {
+        free(chunk);
+        free(fresh);
+        free(root);
+        free(batch);
+        part->stale = true;
+        return;
+    }
+    batch->blocks[batch->count++] = (void*)current->chunks[c]->rows[row % SNAPSHOT_CHUNK_ROWS];
+    fresh->count = last;
+    fresh->chunkCount = chunkCount;
+    memcpy(fresh->chunks, current->chunks, chunkCount * sizeof(SnapshotChunk*));
+    // Slots past the count are never read, so a chunk only changes when a record moves into it
+    if (row != last) {
+        *chunk = *current->chunks[c];
+        chunk->rows[row % SNAPSHOT_CHUNK_ROWS] = current->chunks[lastChunk]->rows[last % SNAPSHOT_CHUNK_ROWS];
+        fresh->chunks[c] = chunk;
+        batch->blocks[batch->count++] = current->chunks[c];
+    }
+    if (dropLast) {
+        batch->blocks[batch->count++] = current->chunks[lastChunk];
+    }
+    batch->blocks[batch->count++] = current;
+    part->published = fresh;
+    publishShardSnapshot(server, shard, fresh, root, batch);
+}
+
+// Copy the shards no listing has asked for yet, or that missed a change, each under its own read lock only
+bool refreshPatientSnapshot(PatientServer* server) {
+    bool ok = true;
+    pthread_mutex_lock(&server->snapshotLock);
+    for (size_t s = 0; s < server->shardCount && ok; s++) {
+        PatientShard* shard = &server->shards[s];
+        pthread_rwlock_rdlock(&shard->lock);
+        if (shard->published == NULL || shard->stale) {
+            ShardSnapshot* old = shard->published;
+            ShardSnapshot* fresh = copyShardSnapshot(&shard->db);
+            PatientSnapshot* root = allocPatientSnapshot(server);
+            RetiredBlocks* batch = allocRetiredBlocks(old != NULL ? old->count + old->chunkCount + 2 : 1);
+            if (fresh == NULL || root == NULL || batch == NULL) {
+                freeShardSnapshot(fresh);
+                free(root);
+                free(batch);
+                ok = false;
+            } else {
+                for (size_t row = 0; old != NULL && row < old->count; row++) {
+                    batch->blocks[batch->count++] = (void*)old->chunks[row / SNAPSHOT_CHUNK_ROWS]->rows[row % SNAPSHOT_CHUNK_ROWS];
+                }
+                for (size_t c = 0; old != NULL && c < old->chunkCount; c++) {
+                    batch->blocks[batch->count++] = old->chunks[c];
+                }
+                if (old != NULL) {
+                    batch->blocks[batch->count++] = old;
+                }
+                shard->published = fresh;
+                shard->stale = false;
+                publishShardSnapshot(server, s, fresh, root, batch);
+            }
+        }
+        pthread_rwlock_unlock(&shard->lock);
+    }
+    pthread_mutex_unlock(&server->snapshotLock);
+    return ok;
+}
+
+// LIST: every patient as of one moment, read from the published root without taking any shard lock
+bool listPatients(PatientServer* server, ServerReply* reply, int fd) {
+    if (!refreshPatientSnapshot(server)) {
+        return false;
+    }
+    size_t reader = enterSnapshotEpoch(server);
+    const PatientSnapshot* root = atomic_load(&server->snapshot);
+    replyFormat(reply, "OK\t%zu\n", root->count);
+    bool connected = true;
+    for (size_t s = 0; s < server->shardCount && connected; s++) {
+        const ShardSnapshot* view = root->shards[s];
+        for (size_t row = 0; row < view->count && connected; row++) {
+            const SnapshotRecord* p = view->chunks[row / SNAPSHOT_CHUNK_ROWS]->rows[row % SNAPSHOT_CHUNK_ROWS];
+            replyFormat(reply, "%d\t%s\t%d\t%s\t%zu\n", p->id, p->text, p->age, p->text + p->diagnosis, p->entryCount);
+            if (p->entryCount > 0) {
+                replyText(reply, p->text + p->history, p->historyLength);
+                replyText(reply, "\n", 1);
+            }
+            if (reply->length >= SERVER_REPLY_FLUSH) {
+                connected = writeFully(fd, reply->data, reply->length);
+                reply->length = 0;
+            }
+        }
+    }
+    leaveSnapshotEpoch(server, reader);
+    return true;
+}
+
+// Patient header line plus one line per history entry
+void replyPatient(ServerReply* reply, const PatientDatabase* db, size_t row) {
+    Patient p;
+    loadPatientRow(db, row, &p);
+    replyFormat(reply, "%d\t%s\t%d\t%s\t%zu\n", p.id, p.name, p.age, p.diagnosis, p.medicalHistory->entryCount);
+    for (size_t i = 0; i < p.medicalHistory->entryCount; i++) {
+        size_t length;
+        const char* entry = getMedicalHistoryEntry(p.medicalHistory, i, &length);
+        replyText(reply, entry, length);
+        replyText(reply, "\n", 1);
+    }
+}
+
+// Split a request line on tabs, in place
+int splitRequest(char* line, char* fields[], int maxFields) {
+    int count = 0;
+    while (count < maxFields) {
+        fields[count++] = line;
+        char* tab = strchr(line, '\t');
+        if (tab == NULL) {
+            break;
+        }
+        *tab = '\0';
+        line = tab + 1;
+    }
+    return count;
+}
+
+// Parse a whole request field as an int
+bool parseRequestInt(const char* text, int* value) {
+    CsvField field = { text, strlen(text), false };
+    return parseIntField(&field, value);
+}
+
+// Server STATS reply: one "name<TAB>value..." line per operation and counter
+void replyPatientStats(ServerReply* reply) {
+    StatsSummary* summary = (StatsSummary*)malloc(sizeof(StatsSummary));
+    if (summary == NULL) {
+        replyText(reply, "ERR out of memory\n", 18);
+        return;
+    }
+    collectPatientStats(summary);
+    replyFormat(reply, "OK\t%d\n", STAT_OPERATION_COUNT + STAT_COUNTER_COUNT);
+    for (int op = 0; op < STAT_OPERATION_COUNT; op++) {
+        const LatencyHistogram* latencies = &summary->latencies[op];
+        replyFormat(reply, "%s\t%llu\t%llu\t%llu\t%llu\t%llu\n", statOperationNames[op], (unsigned long long)summary->calls[op],
+                    (unsigned long long)latencyPercentile(latencies, 0.50), (unsigned long long)latencyPercentile(latencies, 0.99),
+                    (unsigned long long)latencyPercentile(latencies, 0.999), (unsigned long long)latencies->maxNanos);
+    }
+    for (int k = 0; k < STAT_COUNTER_COUNT; k++) {
+        replyFormat(reply, "%s\t%llu\n", statCounterNames[k], (unsigned long long)summary->counters[k]);
+    }
+    free(summary);
+}
+
+// Execute one request; writes take their shard's lock alone and wait for the log after releasing it
+void handleRequest(PatientServer* server, char* line, ServerReply* reply, int fd) {
+    char* fields[SERVER_MAX_FIELDS];
+    int count = splitRequest(line, fields, SERVER_MAX_FIELDS);
+    const char* command = fields[0];
+    int id = 0, age = 0, maxAge = 0, pageSize = 0;
+    uint64_t lsn = 0;
+
+    if (strcmp(command, "PING") == 0) {
+        replyText(reply, "OK\n", 3);
+    } else if (strcmp(command, "GET") == 0 && count == 2 && parseRequestInt(fields[1], &id)) {
+        PatientShard* shard = &server->shards[shardFor(server, id)];
+        uint64_t start = beginOperation(STAT_FIND);
+        pthread_rwlock_rdlock(&shard->lock);
+        size_t row = lookupPatientRow(&shard->db, id);
+        if (row != INDEX_EMPTY) {
+            replyText(reply, "OK\t", 3);
+            replyPatient(reply, &shard->db, row);
+        }
+        pthread_rwlock_unlock(&shard->lock);
+        endOperation(STAT_FIND, start);
+        if (row == INDEX_EMPTY) {
+            replyFormat(reply, "ERR patient %d not found\n", id);
+        }
+    } else if (strcmp(command, "ADD") == 0 && (count == 5 || count == 6) && parseRequestInt(fields[1], &id)) {
+        const char* history = count == 6 ? fields[5] : "";
+        if (!parseRequestInt(fields[3], &age)) {
+            age = 0;
+        }
+        const char* reason = checkPatientFields(age, strlen(fields[2]), strlen(fields[4]), strlen(history));
+        size_t s = shardFor(server, id);
+        PatientShard* shard = &server->shards[s];
+        if (reason == NULL) {
+            pthread_rwlock_wrlock(&shard->lock);
+            size_t rows = shard->db.count;
+            if (lookupPatientRow(&shard->db, id) != INDEX_EMPTY) {
+                reason = "patient ID already exists";
+            } else if (!insertPatientFields(&shard->db, id, fields[2], strlen(fields[2]), age, fields[4], strlen(fields[4]), history, strlen(history))) {
+                reason = "out of memory";
+            }
+            // A row may be in place even when logging it failed, so it is published either way
+            if (shard->db.count > rows) {
+                publishPatientRow(server, s, rows);
+            }
+            lsn = shard->db.appliedLsn;
+            pthread_rwlock_unlock(&shard->lock);
+        }
+        if (reason != NULL) {
+            replyFormat(reply, "ERR %s\n", reason);
+        } else if (server->wal != NULL && !walWaitDurable(server->wal, lsn)) {
+            replyText(reply, "ERR not written to disk\n", 24);
+        } else {
+            replyText(reply, "OK\n", 3);
+        }
+    } else if (strcmp(command, "APPEND") == 0 && count == 3 && parseRequestInt(fields[1], &id)) {
+        size_t s = shardFor(server, id);
+        PatientShard* shard = &server->shards[s];
+        bool found = false;
+        bool appended = false;
+        if (fields[2][0] != '\0' && strlen(fields[2]) < MAX_INPUT_LENGTH) {
+            pthread_rwlock_wrlock(&shard->lock);
+            size_t row = lookupPatientRow(&shard->db, id);
+            found = row != INDEX_EMPTY;
+            appended = found && appendPatientHistory(&shard->db, findPatient(&shard->db, id), fields[2]);
+            if (found) {
+                publishPatientRow(server, s, row);
+            }
+            lsn = shard->db.appliedLsn;
+            pthread_rwlock_unlock(&shard->lock);
+        }
+        if (!found) {
+            replyFormat(reply, "ERR cannot update patient %d\n", id);
+        } else if (!appended || (server->wal != NULL && !walWaitDurable(server->wal, lsn))) {
+            replyText(reply, "ERR not written to disk\n", 24);
+        } else {
+            replyText(reply, "OK\n", 3);
+        }
+    } else if (strcmp(command, "REMOVE") == 0 && count == 2 && parseRequestInt(fields[1], &id)) {
+        size_t s = shardFor(server, id);
+        PatientShard* shard = &server->shards[s];
+        pthread_rwlock_wrlock(&shard->lock);
+        size_t row = lookupPatientRow(&shard->db, id);
+        bool found = row != INDEX_EMPTY;
+        bool removed = found && erasePatient(&shard->db, id);
+        if (found) {
+            publishPatientRemoval(server, s, row);
+        }
+        lsn = shard->db.appliedLsn;
+        pthread_rwlock_unlock(&shard->lock);
+        if (!found) {
+            replyFormat(reply, "ERR patient %d not found\n", id);
+        } else if (!removed || (server->wal != NULL && !walWaitDurable(server->wal, lsn))) {
+            replyText(reply, "ERR not written to disk\n", 24);
+        } else {
+            replyText(reply, "OK\n", 3);
+        }
+    } else if (strcmp(command, "COUNT") == 0 && count == 3 && parseRequestInt(fields[1], &age) && parseRequestInt(fields[2], &maxAge)) {
+        // The age index is built at start and kept up to date by writes; only a compaction drops it
+        size_t total = 0;
+        for (size_t s = 0; s < server->shardCount; s++) {
+            pthread_rwlock_rdlock(&server->shards[s].lock);
+            if (!server->shards[s].db.byAge.built) {
+                pthread_rwlock_unlock(&server->shards[s].lock);
+                pthread_rwlock_wrlock(&server->shards[s].lock);  // the first count after that rebuilds it
+            }
+            total += countPatientsByAge(&server->shards[s].db, age, maxAge);
+            pthread_rwlock_unlock(&server->shards[s].lock);
+        }
+        replyFormat(reply, "OK\t%zu\n", total);
+    } else if (strcmp(command, "PAGE") == 0 && count == 3 && parseRequestInt(fields[2], &pageSize) && pageSize > 0) {
+        // Cursor = shard << 32 | slot within the shard; "end" once every shard is done
+        char* end;
+        unsigned long long cursor = strtoull(fields[1], &end, 10);
+        size_t limit = (size_t)pageSize < SERVER_PAGE_LIMIT ? (size_t)pageSize : SERVER_PAGE_LIMIT;
+        size_t shard = (size_t)(cursor >> 32);
+        size_t slot = (size_t)(cursor & UINT32_MAX);
+        if (*end != '\0' || end == fields[1]) {
+            replyText(reply, "ERR bad cursor\n", 15);
+            return;
+        }
+        PatientHandle results[SERVER_PAGE_LIMIT];
+        ServerReply lines = { NULL, 0, 0 };
+        size_t listed = 0;
+        while (shard < server->shardCount && listed < limit) {
+            PatientShard* part = &server->shards[shard];
+            pthread_rwlock_rdlock(&part->lock);
+            size_t found = listPatientPage(&part->db, &slot, results, limit - listed);
+            for (size_t i = 0; i < found; i++) {
+                replyPatient(&lines, &part->db, getPatientRow(&part->db, results[i]));
+            }
+            bool exhausted = slot >= part->db.slotCount;
+            pthread_rwlock_unlock(&part->lock);
+            listed += found;
+            if (exhausted) {
+                shard++;
+                slot = 0;
+            }
+        }
+        if (shard < server->shardCount) {
+            replyFormat(reply, "OK\t%llu\t%zu\n", ((unsigned long long)shard << 32) | slot, listed);
+        } else {
+            replyFormat(reply, "OK\tend\t%zu\n", listed);
+        }
+        replyText(reply, lines.data, lines.length);
+        free(lines.data);
+    } else if (strcmp(command, "STATS") == 0 && count == 1) {
+        replyPatientStats(reply);
+    } else if (strcmp(command, "LIST") == 0 && count == 1) {
+        if (!listPatients(server, reply, fd)) {
+            replyText(reply, "ERR out of memory\n", 18);
+        }
+    } else if (strcmp(command, "SEARCH") == 0 && count == 2) {
+        ServerReply lines = { NULL, 0, 0 };
+        size_t total = 0, listed = 0;
+        for (size_t s = 0; s < server->shardCount; s++) {
+            PatientHandle results[SEARCH_DISPLAY_RESULTS];
+            PatientDatabase* db = &server->shards[s].db;
+            pthread_rwlock_rdlock(&server->shards[s].lock);
+            pthread_mutex_lock(&server->shards[s].indexLock);
+            size_t found = searchPatients(db, fields[1], results, SEARCH_DISPLAY_RESULTS - listed);
+            pthread_mutex_unlock(&server->shards[s].indexLock);
+            if (found == SEARCH_TOO_MANY_TERMS) {
+                pthread_rwlock_unlock(&server->shards[s].lock);
+                total = found;
+                break;
+            }
+            for (size_t i = 0; i < found && listed < SEARCH_DISPLAY_RESULTS; i++, listed++) {
+                Patient p;
+                getPatient(db, results[i], &p);
+                replyFormat(&lines, "%d\t%s\t%s\n", p.id, p.name, p.diagnosis);
+            }
+            pthread_rwlock_unlock(&server->shards[s].lock);
+            total += found;
+        }
+        if (total == SEARCH_TOO_MANY_TERMS) {
+            replyFormat(reply, "ERR more than %d words between ORs\n", SEARCH_MAX_QUERY_TERMS);
+        } else {
+            replyFormat(reply, "OK\t%zu\t%zu\n", total, listed);
+            replyText(reply, lines.data, lines.length);
+        }
+        free(lines.data);
+    } else {
+        replyText(reply, "ERR unknown or malformed request\n", 33);
+    }
+
+    // Keep the shared log bounded
+    if (lsn != 0 && server->wal != NULL && walLogBytes(server->wal) > WAL_CHECKPOINT_BYTES) {
+        requestServerCheckpoint(server);
+    }
+}
+
+bool serverStopping(PatientServer* server) {
+    pthread_mutex_lock(&server->queueLock);
+    bool stopping = server->stopping;
+    pthread_mutex_unlock(&server->queueLock);
+    return stopping;
+}
+
+// Answer every complete request a client has sent so far; pipelined requests share one reply write
+bool serveConnection(PatientServer* server, ServerConnection* connection, ServerReply* reply) {
+    ssize_t got = read(connection->fd, connection->buffer + connection->length, sizeof(connection->buffer) - connection->length);
+    if (got <= 0) {
+        return got < 0 && (errno == EINTR || errno == EAGAIN);
+    }
+    connection->length += (size_t)got;
+
+    bool open = true;
+    char* start = connection->buffer;
+    char* newline;
+    while ((newline = (char*)memchr(start, '\n', connection->length - (size_t)(start - connection->buffer))) != NULL) {
+        *newline = '\0';
+        if (newline > start && newline[-1] == '\r') {
+            newline[-1] = '\0';
+        }
+        if (strcmp(start, "QUIT") == 0) {
+            open = false;
+            break;
+        }
+        handleRequest(server, start, reply, connection->fd);
+        start = newline + 1;
+    }
+    connection->length -= (size_t)(start - connection->buffer);
+    memmove(connection->buffer, start, connection->length);
+    if (open && connection->length == sizeof(connection->buffer)) {
+        replyText(reply, "ERR request too long\n", 21);
+        open = false;
+    }
+    if (reply->length > 0 && !writeFully(connection->fd, reply->data, reply->length)) {
+        open = false;
+    }
+    reply->length = 0;
+    return open;
+}
+
+// Poll the socket and every idle connection, then queue the connections with input and accept a new one.
+// Called by the polling worker with queueLock held; the lock is dropped while it waits.
+void pollServerConnections(PatientServer* server, struct pollfd polled[], ServerConnection* waiting[]) {
+    nfds_t count = 0;
+    polled[count++] = (struct pollfd){ server->wakeFds[0], POLLIN, 0 };
+    bool accepting = server->connectionCount < SERVER_MAX_CONNECTIONS;  // when full, clients wait in listen()
+    if (accepting) {
+        polled[count++] = (struct pollfd){ server->listenFd, POLLIN, 0 };
+    }
+    nfds_t first = count;
+    for (size_t c = 0; c < server->connectionCount;) {
+        ServerConnection* connection = server->connections[c];
+        if (connection->busy) {
+            c++;
+        } else if (connection->closed) {
+            close(connection->fd);
+            free(connection);
+            server->connections[c] = server->connections[--server->connectionCount];
+        } else {
+            waiting[count - first] = connection;
+            polled[count++] = (struct pollfd){ connection->fd, POLLIN, 0 };
+            c++;
+        }
+    }
+    pthread_mutex_unlock(&server->queueLock);
+
+    int events = poll(polled, count, SERVER_POLL_MILLIS);
+    if (events > 0 && polled[0].revents != 0) {
+        char drain[64];
+        while (read(server->wakeFds[0], drain, sizeof(drain)) > 0) {
+        }
+    }
+    if (events > 0 && accepting && polled[1].revents != 0) {
+        int fd = accept(server->listenFd, NULL, NULL);
+        ServerConnection* connection = fd < 0 ? NULL : (ServerConnection*)calloc(1, sizeof(ServerConnection));
+        if (connection != NULL) {
+            connection->fd = fd;
+            server->connections[server->connectionCount++] = connection;
+        } else if (fd >= 0) {
+            close(fd);
+        }
+    }
+
+    pthread_mutex_lock(&server->queueLock);
+    for (nfds_t i = first; events > 0 && i < count; i++) {
+        if (polled[i].revents != 0) {
+            ServerConnection* connection = waiting[i - first];
+            connection->busy = true;
+            server->ready[(server->readyHead + server->readyCount) % SERVER_MAX_CONNECTIONS] = connection;
+            server->readyCount++;
+        }
+    }
+}
+
+// Worker thread. Workers take turns polling: the one that polls queues every connection with input and
+// serves the first itself, so a lone client never waits for a handoff. A worker serves one batch of
+// requests and then gives the connection back, so no client holds a worker while it is quiet.
+void* serverWorker(void* arg) {
+    PatientServer* server = (PatientServer*)arg;
+    struct pollfd polled[SERVER_MAX_CONNECTIONS + 2];
+    ServerConnection* waiting[SERVER_MAX_CONNECTIONS];
+    ServerReply reply = { NULL, 0, 0 };
+    pthread_mutex_lock(&server->queueLock);
+    while (!server->stopping) {
+        if (server->readyCount > 0) {
+            ServerConnection* connection = server->ready[server->readyHead];
+            server->readyHead = (server->readyHead + 1) % SERVER_MAX_CONNECTIONS;
+            server->readyCount--;
+            pthread_mutex_unlock(&server->queueLock);
+
+            bool open = serveConnection(server, connection, &reply);
+
+            pthread_mutex_lock(&server->queueLock);
+            connection->closed = !open;
+            connection->busy = false;
+            char wake = 0;
+            if (server->polling && write(server->wakeFds[1], &wake, 1) < 0) {
+                // The pipe is full, so the polling worker is about to look again anyway
+            }
+        } else if (!server->polling) {
+            server->polling = true;
+            pollServerConnections(server, polled, waiting);
+            server->polling = false;
+            // This worker serves one of the queued connections, idle workers the others, and one of them polls next
+            for (size_t i = 0; i < server->readyCount; i++) {
+                pthread_cond_signal(&server->queueReady);
+            }
+        } else {
+            pthread_cond_wait(&server->queueReady, &server->queueLock);
+        }
+    }
+    pthread_mutex_unlock(&server->queueLock);
+    free(reply.data);
+    flushSlabCache();  // blocks left in this thread's cache would never be reused or trimmed
+    return NULL;
+}
+
+// Split the database into shards, listen on the socket and start the worker threads
+bool startPatientServer(PatientServer* server, PatientDatabase* db, const char* dbPath, const char* socketPath,
+                        size_t shardCount, size_t workerCount) {
+    memset(server, 0, sizeof(*server));
+    server->shardCount = shardCount ? shardCount : 1;
+    server->workerCount = workerCount ? workerCount : 1;
+    server->wal = db->wal;
+    server->path = dbPath;
+    server->listenFd = -1;
+
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(socketPath) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "Socket path %s is too long\n", socketPath);
+        return false;
+    }
+    strcpy(address.sun_path, socketPath);
+    unlink(socketPath);
+    server->listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (server->listenFd < 0 || bind(server->listenFd, (struct sockaddr*)&address, sizeof(address)) != 0 ||
+        listen(server->listenFd, SERVER_QUEUE_LENGTH) != 0) {
+        fprintf(stderr, "Cannot listen on %s\n", socketPath);
+        if (server->listenFd >= 0) {
+            close(server->listenFd);
+        }
+        return false;
+    }
+    if (pipe(server->wakeFds) != 0 || fcntl(server->wakeFds[0], F_SETFL, O_NONBLOCK) != 0 ||
+        fcntl(server->wakeFds[1], F_SETFL, O_NONBLOCK) != 0) {
+        fprintf(stderr, "Cannot create the server's wake-up pipe\n");
+        close(server->listenFd);
+        return false;
+    }
+
+    server->shards = (PatientShard*)calloc(server->shardCount, sizeof(PatientShard));
+    server->workers = (pthread_t*)calloc(server->workerCount, sizeof(pthread_t));
+    if (server->shards == NULL || server->workers == NULL) {
+        fprintf(stderr, "Failed to allocate memory for the server\n");
+        exit(EXIT_FAILURE);
+    }
+    size_t perShard = db->count / server->shardCount + db->count / (4 * server->shardCount);
+    for (size_t s = 0; s < server->shardCount; s++) {
+        initPatientDatabase(&server->shards[s].db, perShard > INITIAL_DATABASE_CAPACITY ? perShard : INITIAL_DATABASE_CAPACITY);
+        pthread_rwlock_init(&server->shards[s].lock, NULL);
+        pthread_mutex_init(&server->shards[s].indexLock, NULL);
+    }
+    for (size_t row = 0; row < db->count; row++) {
+        if (!copyPatientRow(&server->shards[shardFor(server, db->ids[row])].db, db, row)) {
+            fprintf(stderr, "Failed to allocate memory for patient shards\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    for (size_t s = 0; s < server->shardCount; s++) {
+        // Built now so that COUNT can share the read lock
+        if (!buildAgeIndex(&server->shards[s].db)) {
+            exit(EXIT_FAILURE);
+        }
+        server->shards[s].db.wal = db->wal;
+        server->shards[s].db.appliedLsn = db->appliedLsn;
+    }
+    db->wal = NULL;
+    freePatientDatabase(db);
+
+    pthread_mutex_init(&server->queueLock, NULL);
+    pthread_cond_init(&server->queueReady, NULL);
+    pthread_mutex_init(&server->checkpointLock, NULL);
+    pthread_cond_init(&server->checkpointReady, NULL);
+    pthread_mutex_init(&server->snapshotLock, NULL);
+    pthread_mutex_init(&server->rootLock, NULL);
+    server->readerCount = server->workerCount + 1;
+    server->readerEpochs = (_Atomic uint64_t*)calloc(server->readerCount, sizeof(_Atomic uint64_t));
+    PatientSnapshot* root = allocPatientSnapshot(server);
+    atomic_store(&server->snapshot, root);
+    if (server->readerEpochs == NULL || root == NULL) {
+        fprintf(stderr, "Failed to allocate memory for the server\n");
+        exit(EXIT_FAILURE);
+    }
+    atomic_store(&server->epoch, 1);
+
+    // Without every thread the server does not start; the shards go back into db
+    size_t started = 0;
+    while (started < server->workerCount && pthread_create(&server->workers[started], NULL, serverWorker, server) == 0) {
+        started++;
+    }
+    bool ok = started == server->workerCount;
+    if (ok && server->wal != NULL) {
+        ok = server->checkpointerRunning = pthread_create(&server->checkpointer, NULL, serverCheckpointer, server) == 0;
+    }
+    if (!ok) {
+        fprintf(stderr, "Failed to start the server threads\n");
+        server->workerCount = started;
+        stopPatientServer(server, db, socketPath);
+    }
+    return ok;
+}
+
+// Wait for SIGINT/SIGTERM or stopPatientServer; the workers accept and serve connections themselves
+void waitPatientServer(PatientServer* server) {
+    while (!serverSignalled && !serverStopping(server)) {
+        struct timespec pause = { 0, SERVER_POLL_MILLIS * 1000000L };
+        nanosleep(&pause, NULL);
+    }
+}
+
+// Stop the workers and the checkpointer, then merge the shards back into db (which keeps the shared log)
+bool stopPatientServer(PatientServer* server, PatientDatabase* db, const char* socketPath) {
+    pthread_mutex_lock(&server->queueLock);
+    server->stopping = true;
+    pthread_cond_broadcast(&server->queueReady);
+    char wake = 0;
+    if (write(server->wakeFds[1], &wake, 1) < 0) {
+        // A full pipe wakes the polling worker just the same
+    }
+    pthread_mutex_unlock(&server->queueLock);
+    for (size_t w = 0; w < server->workerCount; w++) {
+        pthread_join(server->workers[w], NULL);
+    }
+    if (server->checkpointerRunning) {
+        pthread_mutex_lock(&server->checkpointLock);
+        server->checkpointStop = true;
+        pthread_cond_signal(&server->checkpointReady);
+        pthread_mutex_unlock(&server->checkpointLock);
+        pthread_join(server->checkpointer, NULL);
+    }
+    for (size_t c = 0; c < server->connectionCount; c++) {
+        close(server->connections[c]->fd);
+        free(server->connections[c]);
+    }
+    close(server->wakeFds[0]);
+    close(server->wakeFds[1]);
+    close(server->listenFd);
+    unlink(socketPath);
+
+    bool ok = mergePatientShards(server, db);
+    if (!ok) {
+        initPatientDatabase(db, INITIAL_DATABASE_CAPACITY);
+    }
+    db->wal = server->wal;
+    for (size_t s = 0; s < server->shardCount; s++) {
+        server->shards[s].db.wal = NULL;
+        freePatientDatabase(&server->shards[s].db);
+        freeShardSnapshot(server->shards[s].published);
+        pthread_rwlock_destroy(&server->shards[s].lock);
+        pthread_mutex_destroy(&server->shards[s].indexLock);
+    }
+    while (server->retiredHead != NULL) {
+        RetiredBlocks* old = server->retiredHead;
+        server->retiredHead = old->next;
+        for (size_t i = 0; i < old->count; i++) {
+            free(old->blocks[i]);
+        }
+        free(old);
+    }
+    free(atomic_load(&server->snapshot));
+    free(server->shards);
+    free(server->workers);
+    free(server->readerEpochs);
+    pthread_mutex_destroy(&server->snapshotLock);
+    pthread_mutex_destroy(&server->rootLock);
+    pthread_mutex_destroy(&server->queueLock);
+    pthread_cond_destroy(&server->queueReady);
+    pthread_mutex_destroy(&server->checkpointLock);
+    pthread_cond_destroy(&server->checkpointReady);
+    return ok;
+}
+
+void onServerSignal(int signal) {
+    (void)signal;
+    serverSignalled = 1;
+}
+
+// Server mode: serve the database on a Unix socket until SIGINT/SIGTERM, then checkpoint it
+int runPatientServer(PatientDatabase* db, const char* dbPath, const char* socketPath, size_t shardCount, size_t workerCount) {
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = onServerSignal;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    action.sa_handler = SIG_IGN;
+    sigaction(SIGPIPE, &action, NULL);  // a client hanging up must not kill the server
+
+    PatientServer server;
+    if (!startPatientServer(&server, db, dbPath, socketPath, shardCount, workerCount)) {
+        return EXIT_FAILURE;
+    }
+    printf("Serving on %s with %zu shards and %zu worker threads (Ctrl+C to stop)\n", socketPath, server.shardCount, server.workerCount);
+    fflush(stdout);
+    waitPatientServer(&server);
+    printf("Stopping server...\n");
+    bool ok = stopPatientServer(&server, db, socketPath);
+    return ok ? 0 : EXIT_FAILURE;
+}
+
+// Start one benchmark thread; a benchmark missing some of its threads would report wrong numbers
+void startBenchmarkThread(pthread_t* thread, void* (*run)(void*), void* arg) {
+    if (pthread_create(thread, NULL, run, arg) != 0) {
+        fprintf(stderr, "Failed to start a benchmark thread\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Current time in nanoseconds for benchmarks
+uint64_t nowNanoseconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+// Time random ID lookups as the database grows; latency should stay flat
+int runLookupBenchmark(void) {
+    const size_t sizes[] = { 1000, 10000, 100000, 1000000 };
+    const size_t lookups = 1000000;
+
+    const size_t removals = 1000;
+
+    printf("%10s %14s %14s %14s %14s\n", "patients", "ns/lookup", "ns/dup-check", "ns/age-count", "ns/remove");
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        PatientDatabase db;
+        initPatientDatabase(&db, 16);
+        for (size_t i = 0; i < sizes[s]; i++) {
+            insertPatient(&db, (int)(i * 7 + 1), "Benchmark Patient", 40, "Observation", "Admitted");
+        }
+
+        uint64_t seed = 88172645463325252ULL;
+        size_t found = 0;
+        uint64_t start = nowNanoseconds();
+        for (size_t i = 0; i < lookups; i++) {
+            seed ^= seed << 13; seed ^= seed >> 7; seed ^= seed << 17;
+            int id = (int)((seed % sizes[s]) * 7 + 1);
+            found += getPatientRow(&db, findPatient(&db, id)) != INDEX_EMPTY;
+        }
+        uint64_t hitTime = nowNanoseconds() - start;
+
+        // Misses exercise the duplicate-ID check done by addPatient
+        start = nowNanoseconds();
+        for (size_t i = 0; i < lookups; i++) {
+            found += getPatientRow(&db, findPatient(&db, -(int)i - 1)) != INDEX_EMPTY;
+        }
+        uint64_t missTime = nowNanoseconds() - start;
+
+        // Age band count once the age buckets exist; independent of the census size
+        buildAgeIndex(&db);
+        start = nowNanoseconds();
+        size_t adults = countPatientsByAge(&db, 18, 64);
+        uint64_t countTime = nowNanoseconds() - start;
+
+        // Discharge from the front, the worst case for a shifting array
+        start = nowNanoseconds();
+        for (size_t i = 0; i < removals; i++) {
+            erasePatient(&db, (int)(i * 7 + 1));
+        }
+        uint64_t removeTime = nowNanoseconds() - start;
+
+        printf("%10zu %14.1f %14.1f %14.2f %14.1f\n", sizes[s], (double)hitTime / lookups,
+               (double)missTime / lookups, (double)countTime, (double)removeTime / removals);
+        if (found != lookups || adults > sizes[s]) {
+            fprintf(stderr, "Lookup benchmark found %zu of %zu patients\n", found, lookups);
+        }
+        freePatientDatabase(&db);
+    }
+    return 0;
+}
+
+// Save a synthetic census, then time how long reopening it takes
+int runStoreBenchmark(size_t patients, const char* path) {
+    PatientDatabase db;
+    initPatientDatabase(&db, 16);
+    for (size_t i = 0; i < patients; i++) {
+        insertPatient(&db, (int)i + 1, "Synthetic Patient", (int)(i % 99) + 1, "Observation", "Admitted for observation");
+    }
+
+    uint64_t start = nowNanoseconds();
+    bool saved = savePatientDatabase(&db, path);
+    uint64_t saveTime = nowNanoseconds() - start;
+    freePatientDatabase(&db);
+    if (!saved) {
+        return EXIT_FAILURE;
+    }
+
+    start = nowNanoseconds();
+    bool opened = openPatientDatabase(&db, path);
+    uint64_t openTime = nowNanoseconds() - start;
+    if (!opened) {
+        return EXIT_FAILURE;
+    }
+
+    start = nowNanoseconds();
+    Patient p;
+    bool found = getPatient(&db, findPatient(&db, (int)(patients / 2) + 1), &p);
+    uint64_t firstLookup = nowNanoseconds() - start;
+
+    printf("Patients:           %zu\n", patients);
+    printf("Save:               %.1f ms\n", saveTime / 1e6);
+    printf("Open:               %.3f ms\n", openTime / 1e6);
+    printf("First lookup:       %.3f ms (%s)\n", firstLookup / 1e6, found ? "found" : "missing");
+
+    start = nowNanoseconds();
+    freePatientDatabase(&db);
+    printf("Close:              %.1f ms\n", (nowNanoseconds() - start) / 1e6);
+    releaseHistorySlabs();
+    remove(path);
+    return found ? 0 : EXIT_FAILURE;
+}
+
+typedef struct {
+    WriteAheadLog* wal;
+    size_t operations;
+} WalBenchmarkWorker;
+
+// One writer: log a history update and wait for it to become durable, repeatedly
+void* walBenchmarkWriter(void* arg) {
+    WalBenchmarkWorker* worker = (WalBenchmarkWorker*)arg;
+    const char* entry = "Vitals stable, continue current treatment";
+    size_t length = strlen(entry);
+    for (size_t i = 0; i < worker->operations; i++) {
+        uint64_t lsn;
+        if (!walLogRecord(worker->wal, WAL_APPEND_HISTORY, (int)i, 0, &entry, &length, 1, &lsn) ||
+            !walWaitDurable(worker->wal, lsn)) {
+            break;
+        }
+    }
+    return NULL;
+}
+
+// Durable operations per second as more writers share each group commit
+int runWalBenchmark(size_t operations, const char* path) {
+    const int threadCounts[] = { 1, 4, 16, 64 };
+    printf("%8s %12s %12s %14s\n", "writers", "ops/sec", "fsyncs", "ops/fsync");
+    for (size_t t = 0; t < sizeof(threadCounts) / sizeof(threadCounts[0]); t++) {
+        int threads = threadCounts[t];
+        remove(path);
+        WriteAheadLog wal;
+        if (!openWriteAheadLog(&wal, path, WAL_COMMIT_DELAY_MICROS) || !startWriteAheadLog(&wal)) {
+            return EXIT_FAILURE;
+        }
+
+        pthread_t ids[64];
+        WalBenchmarkWorker worker = { &wal, operations / (size_t)threads };
+        uint64_t start = nowNanoseconds();
+        for (int i = 0; i < threads; i++) {
+            startBenchmarkThread(&ids[i], walBenchmarkWriter, &worker);
+        }
+        for (int i = 0; i < threads; i++) {
+            pthread_join(ids[i], NULL);
+        }
+        double seconds = (nowNanoseconds() - start) / 1e9;
+
+        size_t done = worker.operations * (size_t)threads;
+        printf("%8d %12.0f %12zu %14.1f\n", threads, done / seconds, wal.commits,
+               wal.commits ? (double)done / wal.commits : 0.0);
+        closeWriteAheadLog(&wal);
+    }
+    remove(path);
+    return 0;
+}
+
+// Resident set size of this process in bytes (Linux), 0 when unavailable
+size_t residentBytes(void) {
+    FILE* f = fopen("/proc/self/statm", "r");
+    if (f == NULL) {
+        return 0;
+    }
+    unsigned long pages = 0, resident = 0;
+    if (fscanf(f, "%lu %lu", &pages, &resident) != 2) {
+        resident = 0;
+    }
+    fclose(f);
+    return (size_t)resident * (size_t)sysconf(_SC_PAGESIZE);
+}
+
+// Load a synthetic census and report resident memory per patient
+int runMemoryBenchmark(size_t patients) {
+    static const char* notes[] = {
+        "Admitted via emergency department",
+        "BP 120/80, afebrile",
+        "Started IV antibiotics, review culture results in 48h",
+        "Discharge planning discussed with family",
+    };
+    size_t noteCount = sizeof(notes) / sizeof(notes[0]);
+
+    size_t before = residentBytes();
+    PatientDatabase db;
+    initPatientDatabase(&db, 16);
+
+    uint64_t seed = 88172645463325252ULL;
+    for (size_t i = 0; i < patients; i++) {
+        seed ^= seed << 13; seed ^= seed >> 7; seed ^= seed << 17;
+        int id = (int)i + 1;
+        insertPatient(&db, id, "Synthetic Patient", (int)(seed % 99) + 1, "Observation", notes[seed % noteCount]);
+
+        // Most stays are short: 0-2 follow-up notes
+        size_t followUps = (seed >> 8) % 3;
+        for (size_t n = 0; n < followUps; n++) {
+            appendPatientHistory(&db, findPatient(&db, id), notes[(seed >> (16 + n)) % noteCount]);
+        }
+    }
+    size_t after = residentBytes();
+
+    printf("Patients loaded:       %zu\n", patients);
+    printf("Resident before:       %.1f MB\n", before / 1048576.0);
+    printf("Resident after:        %.1f MB\n", after / 1048576.0);
+    printf("Resident per patient:  %.1f bytes\n", patients ? (double)(after - before) / patients : 0.0);
+    printf("String pool:           %.1f MB\n", db.strings.capacity / 1048576.0);
+    printf("History slab pages:    %.1f MB (+%.1f MB large blocks)\n",
+           historySlabs.pageBytes / 1048576.0, historySlabs.largeBytes / 1048576.0);
+
+    freePatientDatabase(&db);
+    releaseHistorySlabs();
+    return 0;
+}
+
+// Discharge 90% of a synthetic census and report what the automatic shrink and an explicit compaction give back
+int runShrinkBenchmark(size_t patients) {
+    static const char* notes[] = {
+        "Admitted via emergency department",
+        "BP 120/80, afebrile",
+        "Started IV antibiotics, review culture results in 48h",
+        "Discharge planning discussed with family",
+    };
+    size_t noteCount = sizeof(notes) / sizeof(notes[0]);
+    char name[MAX_NAME_LENGTH];
+
+    size_t start = residentBytes();
+    PatientDatabase db;
+    initPatientDatabase(&db, 16);
+    uint64_t seed = 88172645463325252ULL;
+    for (size_t i = 0; i < patients; i++) {
+        seed ^= seed << 13; seed ^= seed >> 7; seed ^= seed << 17;
+        int id = (int)i + 1;
+        snprintf(name, sizeof(name), "Synthetic Patient %zu", i);  // distinct names, so discharges leave dead strings
+        insertPatient(&db, id, name, (int)(seed % 99) + 1, "Observation", notes[seed % noteCount]);
+        size_t followUps = (seed >> 8) % 4;
+        for (size_t n = 0; n < followUps; n++) {
+            appendPatientHistory(&db, findPatient(&db, id), notes[(seed >> (16 + n)) % noteCount]);
+        }
+    }
+    size_t loaded = residentBytes();
+    size_t loadedCapacity = db.capacity;
+
+    // Discharge in random order: shuffle the IDs and keep the last tenth
+    int* order = (int*)malloc((patients ? patients : 1) * sizeof(int));
+    if (order == NULL) {
+        freePatientDatabase(&db);
+        return EXIT_FAILURE;
+    }
+    for (size_t i = 0; i < patients; i++) {
+        order[i] = (int)i + 1;
+    }
+    for (size_t i = patients; i > 1; i--) {
+        seed ^= seed << 13; seed ^= seed >> 7; seed ^= seed << 17;
+        size_t j = (size_t)(seed % i);
+        int t = order[i - 1]; order[i - 1] = order[j]; order[j] = t;
+    }
+    size_t discharged = patients - patients / 10;
+    uint64_t begin = nowNanoseconds();
+    for (size_t i = 0; i < discharged; i++) {
+        erasePatient(&db, order[i]);
+    }
+    double dischargeSeconds = (nowNanoseconds() - begin) / 1e9;
+    free(order);
+    size_t shrunk = residentBytes();
+    size_t shrunkCapacity = db.capacity;
+    size_t shrunkPages = historySlabs.pageBytes;
+
+    begin = nowNanoseconds();
+    compactPatientDatabase(&db);
+    double compactMillis = (nowNanoseconds() - begin) / 1e6;
+    size_t compacted = residentBytes();
+
+    printf("Patients:              %zu loaded, %zu discharged (%.0f ns each)\n", patients, discharged,
+           discharged ? dischargeSeconds * 1e9 / discharged : 0.0);
+    printf("Resident loaded:       %.1f MB (%zu rows)\n", (loaded - start) / 1048576.0, loadedCapacity);
+    printf("After discharge:       %.1f MB (%zu rows, slab pages %.1f MB)\n", (shrunk - start) / 1048576.0,
+           shrunkCapacity, shrunkPages / 1048576.0);
+    printf("After compaction:      %.1f MB (%zu rows, slab pages %.1f MB) in %.1f ms\n", (compacted - start) / 1048576.0,
+           db.capacity, historySlabs.pageBytes / 1048576.0, compactMillis);
+
+    freePatientDatabase(&db);
+    releaseHistorySlabs();
+    return 0;
+}
+
+// Bucket of a latency: exact below 16 ns, then 16 buckets per power of two
+size_t latencyBucket(uint64_t nanos) {
+    if (nanos < (1u << LATENCY_SUB_BITS)) {
+        return (size_t)nanos;
+    }
+    int exponent = 63 - __builtin_clzll(nanos);
+    size_t sub = (size_t)(nanos >> (exponent - LATENCY_SUB_BITS)) & ((1u << LATENCY_SUB_BITS) - 1);
+    return ((size_t)(exponent - LATENCY_SUB_BITS + 1) << LATENCY_SUB_BITS) + sub;
+}
+
+// Largest latency that falls in a bucket
+uint64_t latencyBucketLimit(size_t bucket) {
+    if (bucket < (1u << LATENCY_SUB_BITS)) {
+        return bucket;
+    }
+    int exponent = (int)(bucket >> LATENCY_SUB_BITS) + LATENCY_SUB_BITS - 1;
+    uint64_t sub = bucket & ((1u << LATENCY_SUB_BITS) - 1);
+    uint64_t low = ((1ULL << LATENCY_SUB_BITS) + sub) << (exponent - LATENCY_SUB_BITS);
+    return low + (1ULL << (exponent - LATENCY_SUB_BITS)) - 1;
+}
+
+// Count one timed operation
+void recordLatency(LatencyHistogram* histogram, uint64_t nanos) {
+    histogram->counts[latencyBucket(nanos)]++;
+    histogram->samples++;
+    histogram->totalNanos += nanos;
+    if (nanos > histogram->maxNanos) {
+        histogram->maxNanos = nanos;
+    }
+}
+
+// Latency below which this fraction of the samples fall
+uint64_t latencyPercentile(const LatencyHistogram* histogram, double fraction) {
+    if (histogram->samples == 0) {
+        return 0;
+    }
+    uint64_t rank = (uint64_t)(fraction * (double)histogram->samples);
+    if (rank >= histogram->samples) {
+        rank = histogram->samples - 1;
+    }
+    uint64_t seen = 0;
+    for (size_t b = 0; b < LATENCY_BUCKETS; b++) {
+        seen += histogram->counts[b];
+        if (seen > rank) {
+            uint64_t limit = latencyBucketLimit(b);
+            return limit < histogram->maxNanos ? limit : histogram->maxNanos;
+        }
+    }
+    return histogram->maxNanos;
+}
+
+// Add one histogram into another
+void mergeLatencies(LatencyHistogram* into, const LatencyHistogram* from) {
+    for (size_t b = 0; b < LATENCY_BUCKETS; b++) {
+        into->counts[b] += from->counts[b];
+    }
+    into->samples += from->samples;
+    into->totalNanos += from->totalNanos;
+    if (from->maxNanos > into->maxNanos) {
+        into->maxNanos = from->maxNanos;
+    }
+}
+
+// Uniform double in [0, 1) from the xorshift state
+double randomUnit(uint64_t* seed) {
+    *seed ^= *seed << 13; *seed ^= *seed >> 7; *seed ^= *seed << 17;
+    return (double)(*seed >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// log1p(x) / x and expm1(x) / x, with their series near 0 where the division loses precision
+double zipfLogRatio(double x) {
+    return fabs(x) > 1e-8 ? log1p(x) / x : 1.0 - x * (0.5 - x * (1.0 / 3.0 - 0.25 * x));
+}
+double zipfExpRatio(double x) {
+    return fabs(x) > 1e-8 ? expm1(x) / x : 1.0 + x * 0.5 * (1.0 + x / 3.0 * (1.0 + 0.25 * x));
+}
+
+// Integral of the hat function x^-exponent, and its inverse
+double zipfHIntegral(const ZipfGenerator* zipf, double x) {
+    double logX = log(x);
+    return zipfExpRatio((1.0 - zipf->exponent) * logX) * logX;
+}
+double zipfHIntegralInverse(const ZipfGenerator* zipf, double x) {
+    double t = x * (1.0 - zipf->exponent);
+    if (t < -1.0) {
+        t = -1.0;  // rounding can step past the pole
+    }
+    return exp(zipfLogRatio(t) * x);
+}
+
+// Prepare a generator over n ranks (Hormann and Derflinger's rejection-inversion)
+void initZipfGenerator(ZipfGenerator* zipf, double exponent, size_t n) {
+    zipf->exponent = exponent;
+    zipf->hIntegralX1 = zipfHIntegral(zipf, 1.5) - 1.0;
+    zipf->threshold = 2.0 - zipfHIntegralInverse(zipf, zipfHIntegral(zipf, 2.5) - exp(-exponent * log(2.0)));
+    resizeZipfGenerator(zipf, n);
+}
+
+// Follow a population that grows or shrinks; only the upper end of the integral moves
+void resizeZipfGenerator(ZipfGenerator* zipf, size_t n) {
+    zipf->n = n;
+    zipf->hIntegralN = zipfHIntegral(zipf, (double)n + 0.5);
+}
+
+// Draw a rank; rank 0 is the most frequent
+size_t nextZipfRank(const ZipfGenerator* zipf, uint64_t* seed) {
+    if (zipf->n <= 1) {
+        return 0;
+    }
+    if (zipf->exponent <= 0.0) {
+        return (size_t)(randomUnit(seed) * (double)zipf->n);
+    }
+    while (1) {
+        double u = zipf->hIntegralN + randomUnit(seed) * (zipf->hIntegralX1 - zipf->hIntegralN);
+        double x = zipfHIntegralInverse(zipf, u);
+        double k = floor(x + 0.5);
+        if (k < 1.0) {
+            k = 1.0;
+        } else if (k > (double)zipf->n) {
+            k = (double)zipf->n;
+        }
+        if (k - x <= zipf->threshold || u >= zipfHIntegral(zipf, k + 0.5) - exp(-zipf->exponent * log(k))) {
+            return (size_t)k - 1;
+        }
+    }
+}
+
+// Read a mix such as 70,20,5,5 (find, append, add, remove); it must add up to 100
+bool parseWorkloadMix(const char* text, unsigned mix[WORKLOAD_OP_COUNT]) {
+    unsigned total = 0;
+    for (int op = 0; op < WORKLOAD_OP_COUNT; op++) {
+        char* end;
+        unsigned long share = strtoul(text, &end, 10);
+        if (end == text || share > 100 || (op + 1 < WORKLOAD_OP_COUNT ? *end != ',' : *end != '\0')) {
+            return false;
+        }
+        mix[op] = (unsigned)share;
+        total += (unsigned)share;
+        text = end + 1;
+    }
+    return total == 100;
+}
+
+// Print one line of the latency table
+void printLatencyRow(const char* label, const LatencyHistogram* histogram) {
+    if (histogram->samples == 0) {
+        printf("%-8s %10s\n", label, "-");
+        return;
+    }
+    printf("%-8s %10llu %11.0f %8.0f %8llu %8llu %8llu %9llu\n", label, (unsigned long long)histogram->samples,
+           histogram->samples * 1e9 / (double)histogram->totalNanos, (double)histogram->totalNanos / histogram->samples,
+           (unsigned long long)latencyPercentile(histogram, 0.50), (unsigned long long)latencyPercentile(histogram, 0.99),
+           (unsigned long long)latencyPercentile(histogram, 0.999), (unsigned long long)histogram->maxNanos);
+}
+
+// Preload a census, run the configured mix against it and report throughput and latency percentiles
+bool runWorkload(const WorkloadConfig* config) {
+    static const char* labels[WORKLOAD_OP_COUNT] = { "find", "append", "add", "remove" };
+    char entry[MAX_INPUT_LENGTH];
+    size_t entryBytes = config->entryBytes < sizeof(entry) - 1 ? config->entryBytes : sizeof(entry) - 1;
+    for (size_t i = 0; i < entryBytes; i++) {
+        entry[i] = i % 8 == 7 ? ' ' : (char)('a' + i % 26);
+    }
+    entry[entryBytes] = '\0';
+
+    size_t liveCapacity = config->patients + config->operations + 1;
+    int* live = (int*)malloc(liveCapacity * sizeof(int));  // IDs by Zipf rank
+    LatencyHistogram* histograms = (LatencyHistogram*)calloc(WORKLOAD_OP_COUNT + 1, sizeof(LatencyHistogram));
+    if (live == NULL || histograms == NULL) {
+        fprintf(stderr, "Failed to allocate memory for the workload\n");
+        free(live);
+        free(histograms);
+        return false;
+    }
+
+    PatientDatabase db;
+    initPatientDatabase(&db, 16);
+    uint64_t seed = config->seed;
+    uint64_t start = nowNanoseconds();
+    for (size_t i = 0; i < config->patients; i++) {
+        int id = (int)i + 1;
+        insertPatient(&db, id, "Synthetic Patient", (int)(i % 99) + 1, "Observation", entry);
+        for (size_t n = 1; n < config->historyEntries; n++) {
+            appendPatientHistory(&db, findPatient(&db, id), entry);
+        }
+        live[i] = id;
+    }
+    double preloadSeconds = (nowNanoseconds() - start) / 1e9;
+
+    // Hot patients are spread over the ID space rather than being the lowest IDs
+    for (size_t i = config->patients; i > 1; i--) {
+        seed ^= seed << 13; seed ^= seed >> 7; seed ^= seed << 17;
+        size_t j = (size_t)(seed % i);
+        int t = live[i - 1]; live[i - 1] = live[j]; live[j] = t;
+    }
+    size_t liveCount = config->patients;
+    int nextId = (int)config->patients + 1;
+    ZipfGenerator zipf;
+    initZipfGenerator(&zipf, config->zipfExponent, liveCount);
+
+    size_t misses = 0;
+    uint64_t runStart = nowNanoseconds();
+    for (size_t i = 0; i < config->operations; i++) {
+        seed ^= seed << 13; seed ^= seed >> 7; seed ^= seed << 17;
+        unsigned pick = (unsigned)(seed % 100);
+        int op = 0;
+        while (op + 1 < WORKLOAD_OP_COUNT && pick >= config->mix[op]) {
+            pick -= config->mix[op];
+            op++;
+        }
+        if (op != WORKLOAD_ADD && liveCount == 0) {
+            misses++;
+            continue;
+        }
+        size_t rank = op != WORKLOAD_ADD ? nextZipfRank(&zipf, &seed) : 0;
+        Patient p;
+        bool done = false;
+        uint64_t begin = nowNanoseconds();
+        switch (op) {
+            case WORKLOAD_FIND:
+                done = getPatient(&db, findPatient(&db, live[rank]), &p);
+                break;
+            case WORKLOAD_APPEND:
+                done = appendPatientHistory(&db, findPatient(&db, live[rank]), entry);
+                break;
+            case WORKLOAD_ADD:
+                done = insertPatient(&db, nextId, "Synthetic Patient", nextId % 99 + 1, "Observation", entry);
+                break;
+            case WORKLOAD_REMOVE:
+                done = erasePatient(&db, live[rank]);
+                break;
+        }
+        recordLatency(&histograms[op], nowNanoseconds() - begin);
+        misses += !done;
+
+        // Population bookkeeping stays outside the timed region
+        if (op == WORKLOAD_ADD && done) {
+            live[liveCount++] = nextId++;
+            resizeZipfGenerator(&zipf, liveCount);
+        } else if (op == WORKLOAD_REMOVE && done) {
+            live[rank] = live[--liveCount];
+            resizeZipfGenerator(&zipf, liveCount);
+        }
+    }
+    double runSeconds = (nowNanoseconds() - runStart) / 1e9;
+
+    printf("\n%zu patients x %zu history entries of %zu bytes, %zu operations, mix find/append/add/remove %u/%u/%u/%u, zipf %.2f\n",
+           config->patients, config->historyEntries, entryBytes, config->operations,
+           config->mix[0], config->mix[1], config->mix[2], config->mix[3], config->zipfExponent);
+    printf("Preload: %.3f s (%.0f patients/s)\n", preloadSeconds, preloadSeconds > 0 ? config->patients / preloadSeconds : 0.0);
+    printf("Run:     %.3f s (%.0f ops/s including the benchmark's own bookkeeping), %zu misses, %zu patients left\n",
+           runSeconds, runSeconds > 0 ? config->operations / runSeconds : 0.0, misses, db.count);
+    printf("%-8s %10s %11s %8s %8s %8s %8s %9s  (ns)\n", "op", "count", "ops/s", "mean", "p50", "p99", "p99.9", "max");
+    LatencyHistogram* all = &histograms[WORKLOAD_OP_COUNT];
+    for (int op = 0; op < WORKLOAD_OP_COUNT; op++) {
+        printLatencyRow(labels[op], &histograms[op]);
+        mergeLatencies(all, &histograms[op]);
+    }
+    printLatencyRow("all", all);
+
+    // Coarse view of the whole distribution: one line per power of two
+    printf("Latency histogram (all operations):\n");
+    for (size_t b = 0; b < LATENCY_BUCKETS; ) {
+        size_t end = b < (1u << LATENCY_SUB_BITS) ? (1u << LATENCY_SUB_BITS) : b + (1u << LATENCY_SUB_BITS);
+        uint64_t count = 0;
+        for (size_t k = b; k < end; k++) {
+            count += all->counts[k];
+        }
+        if (count != 0) {
+            double share = (double)count / all->samples;
+            int bar = (int)(share * 50.0 + 0.5);
+            printf("  %9llu - %9llu ns %6.2f%% %.*s\n", (unsigned long long)(b == 0 ? 0 : latencyBucketLimit(b - 1) + 1),
+                   (unsigned long long)latencyBucketLimit(end - 1), share * 100.0, bar,
+                   "##################################################");
+        }
+        b = end;
+    }
+
+    freePatientDatabase(&db);
+    releaseHistorySlabs();
+    free(live);
+    free(histograms);
+    return true;
+}
+
+// --bench-workload: parse the options, then run one census size or the 1e3..1e6 sweep
+int runWorkloadBenchmark(int argc, char* argv[]) {
+    WorkloadConfig config = { 0, WORKLOAD_DEFAULT_OPERATIONS, { 70, 20, 5, 5 }, 0.99, 4, 48, 88172645463325252ULL };
+    for (int i = 2; i < argc; i += 2) {
+        if (i + 1 >= argc) {
+            fprintf(stderr, "Missing value for %s\n", argv[i]);
+            return EXIT_FAILURE;
+        }
+        const char* value = argv[i + 1];
+        if (strcmp(argv[i], "--patients") == 0) {
+            config.patients = strtoul(value, NULL, 10);
+        } else if (strcmp(argv[i], "--ops") == 0) {
+            config.operations = strtoul(value, NULL, 10);
+        } else if (strcmp(argv[i], "--mix") == 0) {
+            if (!parseWorkloadMix(value, config.mix)) {
+                fprintf(stderr, "--mix takes four percentages adding up to 100: find,append,add,remove\n");
+                return EXIT_FAILURE;
+            }
+        } else if (strcmp(argv[i], "--zipf") == 0) {
+            config.zipfExponent = strtod(value, NULL);
+        } else if (strcmp(argv[i], "--history") == 0) {
+            config.historyEntries = strtoul(value, NULL, 10);
+        } else if (strcmp(argv[i], "--entry-bytes") == 0) {
+            config.entryBytes = strtoul(value, NULL, 10);
+        } else if (strcmp(argv[i], "--seed") == 0) {
+            config.seed = strtoull(value, NULL, 10) | 1;  // xorshift must not start at 0
+        } else {
+            fprintf(stderr, "Unknown workload option %s\n", argv[i]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (config.patients > (size_t)INT_MAX - config.operations || config.zipfExponent < 0.0) {
+        fprintf(stderr, "Workload too large or negative Zipf exponent\n");
+        return EXIT_FAILURE;
+    }
+
+    if (config.patients != 0) {
+        return runWorkload(&config) ? 0 : EXIT_FAILURE;
+    }
+    const size_t sizes[] = { 1000, 10000, 100000, 1000000 };
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        config.patients = sizes[s];
+        if (!runWorkload(&config)) {
+            return EXIT_FAILURE;
+        }
+    }
+    return 0;
+}
+
+// Build the search, name and age indexes over a synthetic census and time typical queries
+int runSearchBenchmark(size_t patients) {
+    static const char* firstNames[] = { "Amina", "Brian", "Chen", "Daniel", "Esther", "Faith", "George", "Hassan", "Irene", "James" };
+    static const char* lastNames[] = { "Achieng", "Barasa", "Cheruiyot", "Kamau", "Mwangi", "Njoroge", "Otieno", "Wanjiru" };
+    static const char* diagnoses[] = {
+        "Observation", "Community acquired pneumonia", "Type 2 diabetes", "Hypertension",
+        "Asthma exacerbation", "Fractured left femur", "Migraine", "Chronic kidney disease",
+    };
+    static const char* notes[] = {
+        "Admitted via emergency department",
+        "BP 120/80, afebrile",
+        "Started IV antibiotics, review culture results in 48h",
+        "Chest X-ray clear",
+        "Discharge planning discussed with family",
+    };
+    static const char* queries[] = {
+        "sepsis", "pneumonia antibiotics", "sepsis OR stroke", "sepsis AND family", "diabetes chest", "nonexistentword",
+    };
+    size_t diagnosisCount = sizeof(diagnoses) / sizeof(diagnoses[0]);
+    size_t noteCount = sizeof(notes) / sizeof(notes[0]);
+    size_t queryCount = sizeof(queries) / sizeof(queries[0]);
+    const int repeats = 200;
+
+    PatientDatabase db;
+    initPatientDatabase(&db, 16);
+    uint64_t seed = 88172645463325252ULL;
+    for (size_t i = 0; i < patients; i++) {
+        seed ^= seed << 13; seed ^= seed >> 7; seed ^= seed << 17;
+        // Rare conditions make the selective queries
+        const char* diagnosis = seed % 100 == 0 ? "Sepsis, unknown source" :
+                                seed % 100 == 1 ? "Ischaemic stroke" : diagnoses[(seed >> 8) % diagnosisCount];
+        char name[MAX_NAME_LENGTH];
+        snprintf(name, sizeof(name), "%s %s %zu", firstNames[(seed >> 40) % 10], lastNames[(seed >> 44) % 8], i % 1000);
+        insertPatient(&db, (int)i + 1, name, (int)(seed % 99) + 1, diagnosis, notes[(seed >> 16) % noteCount]);
+        if ((seed >> 24) % 2) {
+            appendPatientHistory(&db, findPatient(&db, (int)i + 1), notes[(seed >> 32) % noteCount]);
+        }
+    }
+
+    uint64_t start = nowNanoseconds();
+    bool built = buildSearchIndex(&db);
+    uint64_t buildTime = nowNanoseconds() - start;
+    if (!built) {
+        freePatientDatabase(&db);
+        return EXIT_FAILURE;
+    }
+    printf("Patients: %zu, words: %zu, index built in %.1f ms\n", patients, db.search.termCount, buildTime / 1e6);
+
+    // Keep the index busy between rounds so queries also pay for merging recent appends
+    printf("%-26s %10s %14s\n", "query", "matches", "avg latency");
+    PatientHandle results[SEARCH_DISPLAY_RESULTS];
+    for (size_t q = 0; q < queryCount; q++) {
+        size_t found = 0;
+        uint64_t total = 0;
+        for (int r = 0; r < repeats; r++) {
+            int id = (int)(seed % (patients ? patients : 1)) + 1;
+            seed ^= seed << 13; seed ^= seed >> 7; seed ^= seed << 17;
+            appendPatientHistory(&db, findPatient(&db, id), "Reviewed, sepsis ruled out");
+            start = nowNanoseconds();
+            found = searchPatients(&db, queries[q], results, SEARCH_DISPLAY_RESULTS);
+            total += nowNanoseconds() - start;
+        }
+        printf("%-26s %10zu %11.3f ms\n", queries[q], found, total / 1e6 / repeats);
+    }
+
+    // Secondary indexes: prefix lookups and age bands, with admissions in between
+    static const char* prefixes[] = { "Esther Kamau 42", "hassan o", "Zzz" };
+    start = nowNanoseconds();
+    bool indexed = buildNameIndex(&db) && buildAgeIndex(&db);
+    printf("Name and age indexes built in %.1f ms\n", (nowNanoseconds() - start) / 1e6);
+    for (size_t q = 0; indexed && q < sizeof(prefixes) / sizeof(prefixes[0]); q++) {
+        size_t found = 0;
+        uint64_t total = 0;
+        for (int r = 0; r < repeats; r++) {
+            int id = (int)(patients + q * repeats + r) + 1;
+            insertPatient(&db, id, "Late Admission", 30, "Observation", "Admitted");
+            start = nowNanoseconds();
+            found = findPatientsByNamePrefix(&db, prefixes[q], results, SEARCH_DISPLAY_RESULTS);
+            total += nowNanoseconds() - start;
+        }
+        printf("name \"%s\"%*s %10zu %11.3f ms\n", prefixes[q], (int)(19 - strlen(prefixes[q])), "", found, total / 1e6 / repeats);
+    }
+    start = nowNanoseconds();
+    size_t adults = countPatientsByAge(&db, 18, 64);
+    uint64_t countTime = nowNanoseconds() - start;
+    start = nowNanoseconds();
+    size_t elderly = findPatientsByAge(&db, 90, MAX_PATIENT_AGE, results, SEARCH_DISPLAY_RESULTS);
+    uint64_t listTime = nowNanoseconds() - start;
+    printf("%-26s %10zu %11.3f ms\n", "count ages 18-64", adults, countTime / 1e6);
+    printf("%-26s %10zu %11.3f ms\n", "first ages 90+", elderly, listTime / 1e6);
+
+    freePatientDatabase(&db);
+    releaseHistorySlabs();
+    return 0;
+}
+
+// Client side of the socket protocol, used by the benchmarks
+int connectPatientServer(const char* socketPath) {
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, socketPath);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd >= 0 && connect(fd, (struct sockaddr*)&address, sizeof(address)) != 0) {
+        close(fd);
+        fd = -1;
+    }
+    return fd;
+}
+
+typedef struct {
+    const char* socketPath;
+    size_t requests;
+    int patients;
+    int nextId;              //first ID this client may add
+    int writePercent;
+} ServerBenchmarkClient;
+
+// One client connection: request, wait for the reply, repeat
+void* serverBenchmarkClient(void* arg) {
+    ServerBenchmarkClient* client = (ServerBenchmarkClient*)arg;
+    int fd = connectPatientServer(client->socketPath);
+    if (fd < 0) {
+        fprintf(stderr, "Benchmark client cannot connect\n");
+        return NULL;
+    }
+    uint32_t seed = (uint32_t)client->nextId | 1;
+    char request[SERVER_LINE_LENGTH];
+    char reply[SERVER_LINE_LENGTH];
+    int nextId = client->nextId;
+    for (size_t i = 0; i < client->requests; i++) {
+        seed = seed * 1103515245U + 12345U;
+        int length;
+        if ((int)((seed >> 8) % 100) < client->writePercent) {
+            length = snprintf(request, sizeof(request), "ADD\t%d\tBench Patient\t40\tObservation\t\n", nextId++);
+        } else {
+            length = snprintf(request, sizeof(request), "GET\t%d\n", (int)((seed >> 4) % (uint32_t)client->patients) + 1);
+        }
+        if (!writeFully(fd, request, (size_t)length)) {
+            break;
+        }
+        // Every benchmark reply is a single line (no history entries)
+        size_t got = 0;
+        while (got == 0 || reply[got - 1] != '\n') {
+            ssize_t n = read(fd, reply + got, sizeof(reply) - got);
+            if (n <= 0) {
+                close(fd);
+                return NULL;
+            }
+            got += (size_t)n;
+        }
+    }
+    writeFully(fd, "QUIT\n", 5);
+    close(fd);
+    return NULL;
+}
+
+// Requests per second through the socket as clients and workers grow, with one shard and with many
+int runServerBenchmark(size_t patients, const char* socketPath) {
+    const size_t threadCounts[] = { 1, 2, 4, 8 };
+    const size_t shardCounts[] = { 1, SERVER_DEFAULT_SHARDS };
+    const int writePercents[] = { 0, 10 };
+    const size_t requests = 20000;
+    printf("%d online CPUs, %zu patients, no write-ahead log\n", (int)sysconf(_SC_NPROCESSORS_ONLN), patients);
+    printf("%8s %8s %8s %14s\n", "threads", "shards", "writes", "requests/sec");
+    for (size_t w = 0; w < sizeof(writePercents) / sizeof(writePercents[0]); w++) {
+        for (size_t s = 0; s < sizeof(shardCounts) / sizeof(shardCounts[0]); s++) {
+            for (size_t t = 0; t < sizeof(threadCounts) / sizeof(threadCounts[0]); t++) {
+                size_t threads = threadCounts[t];
+                PatientDatabase db;
+                initPatientDatabase(&db, patients);
+                for (size_t i = 0; i < patients; i++) {
+                    insertPatient(&db, (int)i + 1, "Bench Patient", (int)(i % 90) + 1, "Observation", "");
+                }
+                PatientServer server;
+                if (!startPatientServer(&server, &db, NULL, socketPath, shardCounts[s], threads)) {
+                    return EXIT_FAILURE;
+                }
+                pthread_t clients[8];
+                ServerBenchmarkClient work[8];
+                uint64_t start = nowNanoseconds();
+                for (size_t c = 0; c < threads; c++) {
+                    work[c] = (ServerBenchmarkClient){ socketPath, requests / threads, (int)patients,
+                                                       (int)(patients + 1 + c * requests), writePercents[w] };
+                    startBenchmarkThread(&clients[c], serverBenchmarkClient, &work[c]);
+                }
+                for (size_t c = 0; c < threads; c++) {
+                    pthread_join(clients[c], NULL);
+                }
+                double seconds = (nowNanoseconds() - start) / 1e9;
+                printf("%8zu %8zu %7d%% %14.0f\n", threads, shardCounts[s], writePercents[w], requests / threads * threads / seconds);
+
+                stopPatientServer(&server, &db, socketPath);
+                freePatientDatabase(&db);
+            }
+        }
+    }
+    releaseHistorySlabs();
+    return 0;
+}
+
+typedef struct {
+    const char* socketPath;
+    int firstId;
+    size_t requests;         //adds for a writer, listings for a reader
+    uint64_t* latencies;     //per add, NULL for a listing client
+    volatile bool* done;     //listing clients run until the writers finish
+    size_t listings;
+} SnapshotBenchmarkClient;
+
+// Writer: timed ADDs, one at a time; listing client: LIST followed by PING, read up to the PING's OK
+void* snapshotBenchmarkClient(void* arg) {
+    SnapshotBenchmarkClient* client = (SnapshotBenchmarkClient*)arg;
+    int fd = connectPatientServer(client->socketPath);
+    if (fd < 0) {
+        fprintf(stderr, "Benchmark client cannot connect\n");
+        return NULL;
+    }
+    char* buffer = (char*)malloc(SERVER_REPLY_FLUSH);
+    if (buffer == NULL) {
+        close(fd);
+        return NULL;
+    }
+    char request[SERVER_LINE_LENGTH];
+    for (size_t i = 0; client->latencies != NULL ? i < client->requests : !*client->done; i++) {
+        int length = client->latencies != NULL
+            ? snprintf(request, sizeof(request), "ADD\t%d\tBench Patient\t40\tObservation\t\n", client->firstId + (int)i)
+            : snprintf(request, sizeof(request), "LIST\nPING\n");
+        uint64_t start = nowNanoseconds();
+        if (!writeFully(fd, request, (size_t)length)) {
+            break;
+        }
+        // Bench patients have no history, so the last reply line is the only bare "OK"
+        char tail[4] = { 0, 0, 0, 0 };
+        while (memcmp(tail, "\nOK\n", 4) != 0 && (client->latencies == NULL || memcmp(tail + 1, "OK\n", 3) != 0)) {
+            ssize_t n = read(fd, buffer, SERVER_REPLY_FLUSH);
+            if (n <= 0) {
+                free(buffer);
+                close(fd);
+                return NULL;
+            }
+            for (ssize_t k = 0; k < n; k++) {
+                memmove(tail, tail + 1, 3);
+                tail[3] = buffer[k];
+            }
+        }
+        if (client->latencies != NULL) {
+            client->latencies[i] = nowNanoseconds() - start;
+        } else {
+            client->listings++;
+        }
+    }
+    writeFully(fd, "QUIT\n", 5);
+    free(buffer);
+    close(fd);
+    return NULL;
+}
+
+int compareLatencies(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+// Admission latency with and without full listings running against the same server
+int runSnapshotBenchmark(size_t patients, const char* socketPath) {
+    const size_t writers = 2;
+    const size_t adds = 5000;
+    printf("%zu patients, %zu writers x %zu adds, %d shards, no write-ahead log\n", patients, writers, adds, SERVER_DEFAULT_SHARDS);
+    printf("%9s %12s %12s %12s %12s\n", "listers", "p50 us", "p99 us", "max us", "listings");
+    for (size_t listers = 0; listers <= 2; listers += 2) {
+        PatientDatabase db;
+        initPatientDatabase(&db, patients);
+        for (size_t i = 0; i < patients; i++) {
+            insertPatient(&db, (int)i + 1, "Bench Patient", (int)(i % 90) + 1, "Observation", "");
+        }
+        PatientServer server;
+        if (!startPatientServer(&server, &db, NULL, socketPath, SERVER_DEFAULT_SHARDS, writers + listers)) {
+            return EXIT_FAILURE;
+        }
+        uint64_t* latencies = (uint64_t*)malloc(writers * adds * sizeof(uint64_t));
+        if (latencies == NULL) {
+            return EXIT_FAILURE;
+        }
+        volatile bool done = false;
+        pthread_t threads[4];
+        SnapshotBenchmarkClient clients[4];
+        for (size_t c = 0; c < writers + listers; c++) {
+            bool writer = c < writers;
+            clients[c] = (SnapshotBenchmarkClient){ socketPath, (int)(patients + 1 + c * adds), adds,
+                                                    writer ? latencies + c * adds : NULL, &done, 0 };
+            startBenchmarkThread(&threads[c], snapshotBenchmarkClient, &clients[c]);
+        }
+        for (size_t c = 0; c < writers; c++) {
+            pthread_join(threads[c], NULL);
+        }
+        done = true;
+        size_t listings = 0;
+        for (size_t c = writers; c < writers + listers; c++) {
+            pthread_join(threads[c], NULL);
+            listings += clients[c].listings;
+        }
+        qsort(latencies, writers * adds, sizeof(uint64_t), compareLatencies);
+        printf("%9zu %12.1f %12.1f %12.1f %12zu\n", listers, latencies[writers * adds / 2] / 1e3,
+               latencies[writers * adds * 99 / 100] / 1e3, latencies[writers * adds - 1] / 1e3, listings);
+        free(latencies);
+
+        stopPatientServer(&server, &db, socketPath);
+        freePatientDatabase(&db);
+    }
+    releaseHistorySlabs();
+    return 0;
+}
+
+// Bytes of history blocks handed out and not yet released
+size_t historyBytesInUse(void) {
+    size_t bytes = historySlabs.largeBytes;
+    for (int c = 0; c < SLAB_CLASS_COUNT; c++) {
+        bytes += historySlabs.classes[c].blocksInUse * ((size_t)SLAB_MIN_BLOCK << c);
+    }
+    return bytes;
+}
+
+// Hash of every history's text, to check that compression round-trips
+size_t historyChecksum(const PatientDatabase* db) {
+    size_t sum = 0;
+    for (size_t row = 0; row < db->count; row++) {
+        MedicalHistory scratch;
+        const MedicalHistory* history = peekPatientHistory(db, row, &scratch);
+        sum += hashString(getMedicalHistoryText(history), history->length) * (row + 1);
+    }
+    return sum;
+}
+
+// Memory saved by compressing every history and the latency of bringing one back
+int runTieringBenchmark(size_t patients) {
+    static const char* notes[] = {
+        "Admitted via emergency department with shortness of breath",
+        "BP %d/%d, HR %d, afebrile, oxygen saturation %d%% on room air",
+        "Started IV antibiotics, review culture results in 48h",
+        "Chest X-ray shows no acute changes, continue current treatment",
+        "Pain score %d/10, paracetamol 1g given, reassess in 4h",
+        "Seen by physiotherapy, mobilising with frame",
+        "Bloods: Hb %d g/L, WCC %d, CRP %d",
+        "Discharge planning discussed with family",
+        "Medication reconciliation completed by pharmacy",
+        "Wound inspected, clean and dry, dressing changed",
+    };
+    size_t noteCount = sizeof(notes) / sizeof(notes[0]);
+    historyColdSeconds = 1;
+
+    PatientDatabase db;
+    initPatientDatabase(&db, patients);
+    uint64_t seed = 88172645463325252ULL;
+    char entry[MAX_INPUT_LENGTH];
+    for (size_t i = 0; i < patients; i++) {
+        int id = (int)i + 1;
+        size_t entries = 3 + (size_t)(seed % 10);
+        for (size_t n = 0; n < entries; n++) {
+            seed ^= seed << 13; seed ^= seed >> 7; seed ^= seed << 17;
+            snprintf(entry, sizeof(entry), notes[seed % noteCount], (int)(seed >> 8) % 60 + 90, (int)(seed >> 16) % 40 + 50,
+                     (int)(seed >> 24) % 60 + 50, (int)(seed >> 32) % 8 + 92);
+            if (n == 0) {
+                insertPatient(&db, id, "Synthetic Patient", (int)(seed % 99) + 1, "Observation", entry);
+            } else {
+                appendPatientHistory(&db, findPatient(&db, id), entry);
+            }
+        }
+    }
+    size_t checksum = historyChecksum(&db);
+    size_t textBytes = 0;
+    for (size_t row = 0; row < db.count; row++) {
+        textBytes += db.histories[row].length;
+        db.histories[row].lastUsed = 0;  // everything is cold
+    }
+    size_t before = historyBytesInUse();
+
+    uint64_t start = nowNanoseconds();
+    size_t packed = compressColdHistories(&db);
+    double seconds = (nowNanoseconds() - start) / 1e9;
+    size_t after = historyBytesInUse();
+    bool intact = historyChecksum(&db) == checksum;
+
+    printf("Patients:              %zu (%.1f MB of history text)\n", patients, textBytes / 1048576.0);
+    printf("Compressed:            %zu histories in %.3f s (%.0f MB/s), dictionary %zu bytes\n",
+           packed, seconds, seconds > 0 ? textBytes / 1048576.0 / seconds : 0.0, historyDictionary.length);
+    printf("History blocks:        %.1f MB -> %.1f MB (%.1f%% saved)\n", before / 1048576.0, after / 1048576.0,
+           before ? 100.0 * (double)(before - after) / before : 0.0);
+    printf("Round trip:            %s\n", intact ? "verified" : "MISMATCH");
+
+    // Reads of random cold patients, each decompressing one history
+    size_t samples = patients < 10000 ? patients : 10000;
+    uint64_t* latencies = (uint64_t*)malloc((samples ? samples : 1) * sizeof(uint64_t));
+    if (latencies == NULL) {
+        return EXIT_FAILURE;
+    }
+    for (size_t i = 0; i < samples; i++) {
+        seed ^= seed << 13; seed ^= seed >> 7; seed ^= seed << 17;
+        size_t row = (size_t)(seed % db.count);
+        db.histories[row].lastUsed = 0;
+        packMedicalHistory(&db.histories[row]);  // a sample may hit a row already warmed
+        start = nowNanoseconds();
+        Patient p;
+        loadPatientRow(&db, row, &p);
+        latencies[i] = nowNanoseconds() - start;
+    }
+    qsort(latencies, samples, sizeof(uint64_t), compareLatencies);
+    if (samples > 0) {
+        printf("Cold read latency:     p50 %.2f us, p99 %.2f us, max %.2f us\n", latencies[samples / 2] / 1e3,
+               latencies[samples * 99 / 100] / 1e3, latencies[samples - 1] / 1e3);
+    }
+    free(latencies);
+    displayHistoryTiering(&db);
+
+    freePatientDatabase(&db);
+    releaseHistorySlabs();
+    historyColdSeconds = 0;
+    return intact ? 0 : EXIT_FAILURE;
 }
@@ -0,0 +1,157 @@
+#!/bin/sh
+# Behaviour tests for patient_record: CSV ingest/export round trip, write-ahead log recovery and search.
+# Usage: tests/run_tests.sh [path/to/patient_record]
+# Without a path the program is built from ../patient_record.c into a scratch directory.
+# Prints one PASS/FAIL line per check and exits non-zero if any check failed.
+
+here=$(cd "$(dirname "$0")" && pwd)
+work=$(mktemp -d "${TMPDIR:-/tmp}/patient_record_tests.XXXXXX") || exit 1
+trap 'rm -rf "$work"' EXIT INT TERM
+failures=0
+
+if [ $# -gt 0 ]; then
+    prog=$1
+else
+    prog=$work/patient_record
+    ${CC:-cc} -std=c11 -Wall -Wextra -O2 -pthread "$here/../patient_record.c" -o "$prog" -lm || exit 1
+fi
+
+pass() {
+    echo "PASS: $1"
+}
+
+fail() {
+    echo "FAIL: $1"
+    failures=$((failures + 1))
+}
+
+# check <description> <command...>: the command's exit status decides
+check() {
+    description=$1
+    shift
+    if "$@"; then
+        pass "$description"
+    else
+        fail "$description"
+    fi
+}
+
+# Run the menu on the given input; it must end by choosing 12 (Exit), which checkpoints the database
+menu() {
+    printf "$2" | "$prog" --db "$1" 2>&1
+}
+
+# Run the menu on the given input, wait until it has reported <count> successful changes, then kill -9 it
+crash_after() {
+    fifo=$work/menu.fifo
+    rm -f "$fifo"
+    mkfifo "$fifo"
+    "$prog" --db "$1" < "$fifo" > "$work/crash.out" 2>&1 &
+    pid=$!
+    exec 3> "$fifo"
+    printf "$2" >&3   # the descriptor stays open, so the menu waits for more input instead of reading EOF
+    tries=0
+    while [ "$(grep -c 'successfully' "$work/crash.out")" -lt "$3" ] && [ $tries -lt 100 ]; do
+        sleep 0.1
+        tries=$((tries + 1))
+    done
+    kill -9 $pid 2> /dev/null
+    wait $pid 2> /dev/null
+    exec 3>&-
+}
+
+# ---- Ingest and export ----
+cat > "$work/feed.csv" <<'CSV'
+id,name,age,diagnosis,history
+7,"Smith, John",45,Flu,fever for two days,"prescribed ""rest"" and fluids"
+12,Ann Lee,30,Asthma
+3,Bob Stone,61,flu and cough,cough at night
+12,Duplicate,50,Cold,x
+abc,Bad Id,50,Cold,x
+9,Too Old,1000,Cold,x
+CSV
+cat > "$work/expected.csv" <<'CSV'
+id,name,age,diagnosis,history
+7,"Smith, John",45,Flu,fever for two days,"prescribed ""rest"" and fluids"
+12,Ann Lee,30,Asthma,
+3,Bob Stone,61,flu and cough,cough at night
+CSV
+cat > "$work/expected.json" <<'JSON'
+[
+{"id":7,"name":"Smith, John","age":45,"diagnosis":"Flu","history":["fever for two days","prescribed \"rest\" and fluids"]},
+{"id":12,"name":"Ann Lee","age":30,"diagnosis":"Asthma","history":[]},
+{"id":3,"name":"Bob Stone","age":61,"diagnosis":"flu and cough","history":["cough at night"]}
+]
+JSON
+
+"$prog" --db "$work/ingest.db" --ingest "$work/feed.csv" > "$work/ingest.out" 2>&1
+check "ingest succeeds" [ $? -eq 0 ]
+check "ingest adds 3 patients and rejects 3 lines" grep -q "Ingested 3 patients, rejected 3 lines" "$work/ingest.out"
+check "duplicate ID is reported" grep -q "Line 5 skipped" "$work/ingest.out"
+
+"$prog" --db "$work/ingest.db" --export "$work/export.csv" > /dev/null 2>&1
+check "CSV export matches the ingested records" cmp -s "$work/expected.csv" "$work/export.csv"
+"$prog" --db "$work/ingest.db" --export - --format json > "$work/export.json" 2> /dev/null
+check "JSON export matches the ingested records" cmp -s "$work/expected.json" "$work/export.json"
+"$prog" --db "$work/ingest.db" --export - --min-age 40 --max-age 50 > "$work/filtered.csv" 2> /dev/null
+check "age filter keeps only patient 7" [ "$(tail -n +2 "$work/filtered.csv" | cut -d, -f1)" = "7" ]
+
+"$prog" --db "$work/again.db" --ingest "$work/export.csv" > /dev/null 2>&1
+"$prog" --db "$work/again.db" --export "$work/again.csv" > /dev/null 2>&1
+check "ingesting an export gives the same export back" cmp -s "$work/export.csv" "$work/again.csv"
+
+# ---- Write-ahead log recovery ----
+db=$work/wal.db
+crash_after "$db" "1\n101\nAlice Moss\n40\nflu\nfever\n1\n102\nBob Hart\n50\ncold\ncough\n2\n101\nsecond note\n3\n102\n" 4
+check "changes reach the log before the crash" [ -s "$db.wal" ]
+cat > "$work/recovered.csv" <<'CSV'
+id,name,age,diagnosis,history
+101,Alice Moss,40,flu,fever,second note
+CSV
+"$prog" --db "$db" --export "$work/after_crash.csv" > /dev/null 2>&1
+check "replaying the log restores adds, appends and removals" cmp -s "$work/recovered.csv" "$work/after_crash.csv"
+
+printf 'torn record' >> "$db.wal"
+"$prog" --db "$db" --export "$work/after_tear.csv" > "$work/tear.out" 2>&1
+check "a torn tail is discarded" grep -q "Discarding 11 bytes of incomplete log records" "$work/tear.out"
+check "records before a torn tail survive" cmp -s "$work/recovered.csv" "$work/after_tear.csv"
+
+# Drop the first record (16-byte header: payload size, CRC, LSN) so the log starts at change 2
+first=$(od -An -tu4 -N4 "$db.wal" | tr -d ' ')
+tail -c +$((16 + first + 1)) "$db.wal" > "$work/gap.wal" && cp "$work/gap.wal" "$db.wal"
+"$prog" --db "$db" --export "$work/after_gap.csv" > "$work/gap.out" 2>&1
+check "a log with a gap is refused" [ $? -ne 0 ]
+check "the gap is reported" grep -q "skips from change 0 to 2" "$work/gap.out"
+
+db=$work/checkpoint.db
+menu "$db" "1\n201\nCara Dune\n33\nsprain\nleft ankle\n12\n" > /dev/null
+check "exiting checkpoints and empties the log" [ -f "$db" ] && [ ! -s "$db.wal" ]
+"$prog" --db "$db" --export - 2> /dev/null | grep -q "^201,Cara Dune,33,sprain,left ankle$"
+check "a checkpointed patient is read back from the snapshot" [ $? -eq 0 ]
+
+# ---- Search ----
+cat > "$work/search.csv" <<'CSV'
+1,Ann Lee,30,Asthma,wheezing after exercise
+2,Bob Stone,61,flu and cough,cough at night
+3,Cy Young,45,Flu,fever for two days
+4,Di Prince,52,Fracture,cast on left arm
+CSV
+"$prog" --db "$work/search.db" --ingest "$work/search.csv" > /dev/null 2>&1
+menu "$work/search.db" "6\nflu\n6\nFLU COUGH\n6\nasthma OR fracture\n6\nmeasles\n6\na b c d e f g h i j k l m n o p q\n2\n4\nflu shot given\n6\nflu\n12\n" > "$work/search.out"
+grep -o "[0-9]* matching patients\|Too many search words" "$work/search.out" > "$work/search.results"
+cat > "$work/search.expected" <<'TXT'
+2 matching patients
+1 matching patients
+2 matching patients
+0 matching patients
+Too many search words
+3 matching patients
+TXT
+check "search answers AND, OR, case-insensitive and unknown-word queries" cmp -s "$work/search.expected" "$work/search.results"
+check "search finds the patients with both words" grep -q "ID: 2 .*Bob Stone" "$work/search.out"
+
+if [ $failures -ne 0 ]; then
+    echo "$failures check(s) failed"
+    exit 1
+fi
+echo "All checks passed"
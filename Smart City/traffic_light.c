@@ -1,9 +1,47 @@
+#define _POSIX_C_SOURCE 200809L // clock_gettime, sysconf, mmap
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <time.h>
 #include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sched.h>
+#include <math.h> // Simulated arrival times (link with -lm)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <signal.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h> // SSE4.1 / AVX2 median kernels, chosen at run time
+#define COUNT_KERNELS_X86 1
+#endif
 
 #define BUFFER_SIZE 128
+#define SENSOR_SLOT_EMPTY -1
+#define MAX_WORKERS 64           // Upper bound on threads in the signal pool
+#define SIGNAL_CHUNK 1024        // Intersections claimed at a time in a parallel signal pass
+#define INGEST_RING_CAPACITY 65536 // Readings buffered between producers and the consumer (power of two)
+#define INGEST_BATCH 256         // Readings the consumer takes from the ring at a time
+#define STALE_AFTER 120          // Seconds without a reading before a sensor leaves the median
+#define WHEEL_SLOTS 256          // One-second timer wheel slots; must exceed STALE_AFTER
+#define WINDOW_BUCKETS 12        // Per-sensor ring of queue reading sums ...
+#define WINDOW_BUCKET_SECONDS 5  // ... 5 seconds each: a one-minute window
+#define EARLIEST_READING 946684800LL // 2000-01-01; an earlier timestamp is corrupt
+#define MAX_CLOCK_SKEW 300       // Seconds a reading may be dated ahead of this machine's clock
+#define SIM_LANES 4              // Sensed approach lanes per simulated intersection
+#define SIM_SENSOR_PERIOD 5      // Seconds between simulated sensor reports
+#define SIM_MAIN_HEADWAY 2.0     // Seconds between departures from each sensed lane on green or yellow
+#define SIM_CROSS_HEADWAY 1.0    // Seconds between cross-street departures on red
+#define SIM_MAIN_PEAK_RATE 0.12  // Vehicles per second per sensed lane at rush hour
+#define SIM_CROSS_PEAK_RATE 0.25 // Vehicles per second on the cross street at rush hour
+#define SIM_WAIT_BUCKETS 3601    // One-second wait histogram; the last bucket collects longer waits
+#define TRACE_MAGIC "TLTRACE1"
+#define TRACE_BLOCK_RECORDS 4096 // Records buffered per columnar block
+#define TRACE_MAP_STEP (1 << 20) // The trace file and its mapping grow 1 MB at a time
 
 typedef enum { RED, GREEN, YELLOW } LightState; // States of traffic signal
 
@@ -14,29 +52,868 @@ typedef struct {
 
 typedef struct SensorNode {
     int id;
-    int vehicle_count;
+    int vehicle_count;       // Latest reading: vehicles queued over the detector
+    int average_count;       // Mean reading over the window ending at the latest one; orders the median heaps
     time_t last_update;
-    struct SensorNode* next; // Pointer for garbage collection simulation
+    int intersection;        // Index of the owning intersection
+    int heap_index;          // Position inside its median heap
+    int in_upper;            // 1 if that heap is the intersection's upper_half
+    int active;              // 1 while the sensor counts toward the median
+    time_t deadline;         // When the sensor goes stale without a new reading
+    int timer_slot;          // Timer wheel slot holding the sensor while active
+    int timer_next;          // Neighbours in that slot's list, -1 at the ends
+    int timer_prev;
+    long long window_epoch;  // Bucket number of the newest window bucket
+    int window[WINDOW_BUCKETS]; // Sum of the readings per bucket, indexed by bucket number
+    int window_readings[WINDOW_BUCKETS]; // Readings per bucket
 } TrafficSensor;
 
-TrafficSensor* sensor_head = NULL; // Head pointer
+// Binary heap of sensor indices ordered by vehicle count; each sensor knows its own position
+typedef struct {
+    int* items;
+    int size;
+    int capacity;
+    int is_max; // 1: largest count on top, 0: smallest
+} SensorHeap;
+
+// A junction with its own signal, driven by the median of the sensors it owns.
+// The median splits the counts in two: lower half in a max-heap, upper half in a min-heap;
+// lower_half holds the extra sensor when the count is odd.
+typedef struct {
+    int id;
+    int sensor_count;
+    SensorHeap lower_half;
+    SensorHeap upper_half;
+    TrafficSignal signal;
+} Intersection;
+
+typedef void (*ParallelTask)(int begin, int end, void* arg);
+
+// Chunks of the current pass owned by one worker; idle workers steal from the others
+typedef struct {
+    _Alignas(64) atomic_int next; // Next chunk to claim
+    int end;                      // One past the worker's last chunk
+} WorkRange;
+
+// Persistent threads that split a loop over intersections; the calling thread is worker 0
+typedef struct {
+    pthread_t threads[MAX_WORKERS];
+    WorkRange ranges[MAX_WORKERS];
+    int worker_count;          // Threads started plus the caller; 0 until first use
+    ParallelTask task;
+    void* arg;
+    int items;
+    int chunk;
+    pthread_mutex_t lock;
+    pthread_cond_t start;      // A new pass was published
+    pthread_cond_t done;       // The last helper finished the pass
+    unsigned long generation;  // Passes published so far
+    int busy;                  // Helpers still working on the current pass
+    int stopping;
+} WorkerPool;
+
+// Thresholds and durations update_signal() turns a median vehicle count into
+typedef struct {
+    const char* name;
+    int fixed;            // 1: cycle green, yellow, red regardless of the sensors
+    int green_above;      // Median above this turns the signal green ...
+    int yellow_above;     // ... above this yellow, otherwise red
+    int green_seconds;
+    int yellow_seconds;
+    int red_seconds;
+    int idle_seconds;     // Red duration when no sensor is active
+} SignalPolicy;
+
+typedef enum { SIM_ARRIVAL, SIM_CROSS_ARRIVAL, SIM_DEPARTURE, SIM_SENSOR_REPORT, SIM_PHASE_END } SimEventType;
+
+// Something that happens at a virtual time; order breaks ties in scheduling order
+typedef struct {
+    double time;
+    unsigned long long order;
+    int type;
+    int target;           // Lane for arrivals (intersection * SIM_LANES + lane), intersection otherwise
+} SimEvent;
+
+// Vehicles waiting in one lane, oldest first, with their arrival times
+typedef struct {
+    double* arrivals;
+    int head;
+    int count;
+    int capacity;
+    int longest;
+    double area;          // Integral of the queue length over time
+    double changed;       // Virtual time of the last length change
+} SimQueue;
+
+// A simulated intersection: sensed approach lanes plus an unsensed cross street served on red
+typedef struct {
+    TrafficSignal signal;
+    TrafficSensor sensors[SIM_LANES];
+    SimQueue lanes[SIM_LANES];
+    SimQueue cross;
+    double demand;        // Multiplier on the arrival rates
+    int serving;          // 1 while a departure event is pending
+} SimIntersection;
+
+// One independent simulation: a city, a policy, a seed and its results
+typedef struct {
+    const SignalPolicy* policy;
+    int intersections;
+    double duration;
+    unsigned long long rng;
+    SimIntersection* city;
+    SimEvent* events;     // Binary min-heap on time
+    int event_count;
+    int event_capacity;
+    unsigned long long next_order;
+    double now;
+    unsigned long long events_handled;
+    unsigned long long arrived;
+    unsigned long long served_main;
+    unsigned long long served_cross;
+    unsigned long long left_waiting;
+    double wait_main;
+    double wait_cross;
+    unsigned long long wait_histogram[SIM_WAIT_BUCKETS];
+    double queue_area;
+    int longest_queue;
+    long long wall_nanos;
+    int failed;
+} SimRun;
+
+typedef enum { TRACE_INTERSECTION = 1, TRACE_CREATE, TRACE_UPDATE, TRACE_DELETE } TraceOp;
+
+// Start of a trace file; complete blocks follow up to used
+typedef struct {
+    char magic[8];
+    uint64_t used;        // Bytes of header plus complete blocks
+    int64_t last_time;    // Timestamp of the last record, where appended deltas continue
+} TraceHeader;
+
+// A block of records stored column by column: ops (1 byte each), then zigzag-varint sensor IDs,
+// zigzag-varint timestamp deltas and varint counts (the intersection ID for TRACE_CREATE)
+typedef struct {
+    uint32_t records;
+    uint32_t id_bytes;
+    uint32_t time_bytes;
+    uint32_t count_bytes;
+} TraceBlockHeader;
+
+// Open trace: the file is mapped and the current block is buffered until full or the menu action ends
+typedef struct {
+    int fd;
+    unsigned char* map;
+    size_t mapped;
+    size_t used;
+    int64_t last_time;
+    int records;
+    int id_bytes;
+    int time_bytes;
+    int count_bytes;
+    unsigned char ops[TRACE_BLOCK_RECORDS];
+    unsigned char ids[TRACE_BLOCK_RECORDS * 5];
+    unsigned char times[TRACE_BLOCK_RECORDS * 10];
+    unsigned char counts[TRACE_BLOCK_RECORDS * 5];
+} TraceWriter;
+
+// Vectorizable passes over a contiguous column of vehicle counts, one set per instruction set
+typedef struct {
+    const char* name;
+    void (*minmax)(const int* counts, int n, int* low, int* high);
+    long long (*count_above)(const int* counts, int n, int pivot);
+    int (*min_above)(const int* counts, int n, int floor); // INT_MAX if no count is above floor
+} CountKernels;
+
+// One vehicle count reported by a loop detector
+typedef struct {
+    int sensor_id;
+    int vehicle_count;
+    time_t timestamp;
+} SensorReading;
+
+// Ring slot; sequence tells producers and the consumer whose turn it is
+typedef struct {
+    atomic_size_t sequence;
+    SensorReading reading;
+} IngestSlot;
+
+// Bounded lock-free ring: many producers claim slots with a CAS on tail, one consumer drains from head
+typedef struct {
+    IngestSlot* slots;
+    size_t mask;
+    _Alignas(64) atomic_size_t tail;      // Next slot a producer claims
+    _Alignas(64) size_t head;             // Next slot the consumer reads
+    _Alignas(64) atomic_ulong accepted;   // Readings queued
+    atomic_ulong dropped;                 // Readings discarded because the ring was full
+    atomic_ulong stalls;                  // Times a blocking producer waited for room
+    unsigned long applied;                // Readings applied to a sensor
+    unsigned long stale;                  // Readings older than the sensor's last update
+    unsigned long unknown;                // Readings for sensors that do not exist
+    unsigned long bad_time;               // Readings dated before EARLIEST_READING or too far in the future
+    unsigned long batches;                // Non-empty drains
+} IngestRing;
+
+// Sensors are stored contiguously; deleting one moves the last sensor into its place,
+// so pointers returned by create_sensor/find_sensor are only valid until the next add or delete
+TrafficSensor* sensors = NULL;
 int sensor_count = 0;
+int sensor_capacity = 0;
 
-// Allocate memory for a sensor - Dynamic memory allocation
-TrafficSensor* create_sensor(int id) {
-    TrafficSensor* sensor = (TrafficSensor*)malloc(sizeof(TrafficSensor));
-    if (sensor == NULL) {
-        printf("Memory allocation failed for sensor %d\n", id);
+// Open-addressing map from sensor ID to index in sensors; SENSOR_SLOT_EMPTY marks a free slot
+int* sensor_slots = NULL;
+int slot_capacity = 0; // Power of two, kept at most half full
+
+// Timer wheel of active sensors keyed by deadline; wheel_time is the next second to expire
+int wheel[WHEEL_SLOTS];
+int wheel_ready = 0;
+time_t wheel_time = 0;
+
+// Intersections are numbered from 1 in creation order; ID n lives at index n - 1
+Intersection* intersections = NULL;
+int intersection_count = 0;
+int intersection_capacity = 0;
+
+IngestRing ingest; // Slots allocated by init_ingest()
+TraceWriter* trace = NULL; // Set while recording with --trace
+volatile sig_atomic_t stop_requested = 0; // Set by SIGINT/SIGTERM; the menu exits at its next prompt
+
+// The thresholds the signals have always used
+const SignalPolicy default_policy = { "current", 0, 10, 5, 45, 5, 20, 30 };
+
+WorkerPool pool = { .lock = PTHREAD_MUTEX_INITIALIZER, .start = PTHREAD_COND_INITIALIZER,
+                    .done = PTHREAD_COND_INITIALIZER };
+
+// Home slot of a sensor ID
+int slot_for(int id) {
+    return (int)(((unsigned int)id * 2654435761u) & (unsigned int)(slot_capacity - 1));
+}
+
+// Slot holding a sensor ID, or the empty slot where it would go
+int find_slot(int id) {
+    int slot = slot_for(id);
+    while (sensor_slots[slot] != SENSOR_SLOT_EMPTY && sensors[sensor_slots[slot]].id != id) {
+        slot = (slot + 1) & (slot_capacity - 1);
+    }
+    return slot;
+}
+
+// Grow the ID map so it stays at most half full with count sensors; returns 0 if memory ran out
+int reserve_slots(int count) {
+    if (count * 2 <= slot_capacity) {
+        return 1;
+    }
+    int new_capacity = slot_capacity ? slot_capacity * 2 : 32;
+    while (count * 2 > new_capacity) {
+        new_capacity *= 2;
+    }
+    int* slots = (int*)malloc(new_capacity * sizeof(int));
+    if (slots == NULL) {
+        return 0;
+    }
+    for (int i = 0; i < new_capacity; i++) {
+        slots[i] = SENSOR_SLOT_EMPTY;
+    }
+    free(sensor_slots);
+    sensor_slots = slots;
+    slot_capacity = new_capacity;
+    for (int i = 0; i < sensor_count; i++) {
+        sensor_slots[find_slot(sensors[i].id)] = i;
+    }
+    return 1;
+}
+
+// Empty a slot, shifting later entries of the probe run back so lookups never stop early
+void erase_slot(int slot) {
+    int mask = slot_capacity - 1;
+    int next = (slot + 1) & mask;
+    while (sensor_slots[next] != SENSOR_SLOT_EMPTY) {
+        int home = slot_for(sensors[sensor_slots[next]].id);
+        // Move the entry back unless its home lies cyclically in (slot, next]
+        if (((next - home) & mask) >= ((next - slot) & mask)) {
+            sensor_slots[slot] = sensor_slots[next];
+            slot = next;
+        }
+        next = (next + 1) & mask;
+    }
+    sensor_slots[slot] = SENSOR_SLOT_EMPTY;
+}
+
+// True if sensor a belongs above sensor b in the heap
+int heap_above(const SensorHeap* heap, int a, int b) {
+    return heap->is_max ? sensors[a].average_count > sensors[b].average_count
+                        : sensors[a].average_count < sensors[b].average_count;
+}
+
+// Put a sensor at a heap position and record it in the sensor
+void heap_place(SensorHeap* heap, int index, int sensor) {
+    heap->items[index] = sensor;
+    sensors[sensor].heap_index = index;
+    sensors[sensor].in_upper = !heap->is_max;
+}
+
+// Median heap currently holding a sensor
+SensorHeap* sensor_heap(int sensor) {
+    Intersection* owner = &intersections[sensors[sensor].intersection];
+    return sensors[sensor].in_upper ? &owner->upper_half : &owner->lower_half;
+}
+
+// Move the sensor at index up until its parent is not below it
+void heap_sift_up(SensorHeap* heap, int index) {
+    int sensor = heap->items[index];
+    while (index > 0) {
+        int parent = (index - 1) / 2;
+        if (!heap_above(heap, sensor, heap->items[parent])) {
+            break;
+        }
+        heap_place(heap, index, heap->items[parent]);
+        index = parent;
+    }
+    heap_place(heap, index, sensor);
+}
+
+// Move the sensor at index down until no child belongs above it
+void heap_sift_down(SensorHeap* heap, int index) {
+    int sensor = heap->items[index];
+    while (1) {
+        int child = 2 * index + 1;
+        if (child >= heap->size) {
+            break;
+        }
+        if (child + 1 < heap->size && heap_above(heap, heap->items[child + 1], heap->items[child])) {
+            child++;
+        }
+        if (!heap_above(heap, heap->items[child], sensor)) {
+            break;
+        }
+        heap_place(heap, index, heap->items[child]);
+        index = child;
+    }
+    heap_place(heap, index, sensor);
+}
+
+// Make room for at least capacity sensors; returns 0 if memory ran out
+int heap_reserve(SensorHeap* heap, int capacity) {
+    if (capacity <= heap->capacity) {
+        return 1;
+    }
+    int new_capacity = heap->capacity ? heap->capacity * 2 : 16;
+    while (new_capacity < capacity) {
+        new_capacity *= 2;
+    }
+    int* items = (int*)realloc(heap->items, new_capacity * sizeof(int));
+    if (items == NULL) {
+        return 0;
+    }
+    heap->items = items;
+    heap->capacity = new_capacity;
+    return 1;
+}
+
+// Add a sensor; the caller has reserved room
+void heap_push(SensorHeap* heap, int sensor) {
+    heap->items[heap->size++] = sensor;
+    heap_sift_up(heap, heap->size - 1);
+}
+
+// Take a sensor out of the heap it is in
+void heap_remove(int sensor) {
+    SensorHeap* heap = sensor_heap(sensor);
+    int index = sensors[sensor].heap_index;
+    int last = heap->items[--heap->size];
+    if (index == heap->size) {
+        return;
+    }
+    // The last sensor fills the gap and moves whichever way its count requires
+    heap_place(heap, index, last);
+    heap_sift_up(heap, index);
+    heap_sift_down(heap, sensors[last].heap_index);
+}
+
+// Restore the size invariant after one insertion or removal
+void rebalance_median(Intersection* owner) {
+    if (owner->lower_half.size > owner->upper_half.size + 1) {
+        int moved = owner->lower_half.items[0];
+        heap_remove(moved);
+        heap_push(&owner->upper_half, moved);
+    } else if (owner->upper_half.size > owner->lower_half.size) {
+        int moved = owner->upper_half.items[0];
+        heap_remove(moved);
+        heap_push(&owner->lower_half, moved);
+    }
+}
+
+// Add a new sensor to its intersection's median heaps; the caller has reserved room
+void median_insert(int sensor) {
+    Intersection* owner = &intersections[sensors[sensor].intersection];
+    if (owner->lower_half.size == 0 ||
+        sensors[sensor].average_count <= sensors[owner->lower_half.items[0]].average_count) {
+        heap_push(&owner->lower_half, sensor);
+    } else {
+        heap_push(&owner->upper_half, sensor);
+    }
+    rebalance_median(owner);
+}
+
+// Reposition a sensor after its average count changed
+void median_update(int sensor) {
+    Intersection* owner = &intersections[sensors[sensor].intersection];
+    SensorHeap* heap = sensor_heap(sensor);
+    heap_sift_up(heap, sensors[sensor].heap_index);
+    heap_sift_down(heap, sensors[sensor].heap_index);
+
+    // One changed count can leave at most one sensor on the wrong side; swap the two tops
+    if (owner->upper_half.size > 0 &&
+        sensors[owner->lower_half.items[0]].average_count > sensors[owner->upper_half.items[0]].average_count) {
+        int low = owner->lower_half.items[0];
+        int high = owner->upper_half.items[0];
+        heap_remove(low);
+        heap_remove(high);
+        heap_push(&owner->lower_half, high);
+        heap_push(&owner->upper_half, low);
+    }
+}
+
+// Drop a sensor from its intersection's median heaps
+void median_remove(int sensor) {
+    heap_remove(sensor);
+    rebalance_median(&intersections[sensors[sensor].intersection]);
+}
+
+// Schedule a sensor to go stale STALE_AFTER seconds after its last reading
+void timer_link(int sensor) {
+    if (!wheel_ready) {
+        for (int i = 0; i < WHEEL_SLOTS; i++) {
+            wheel[i] = -1;
+        }
+        wheel_ready = 1;
+    }
+    TrafficSensor* s = &sensors[sensor];
+    s->deadline = s->last_update + STALE_AFTER;
+    if (wheel_time == 0) {
+        wheel_time = s->last_update; // The wheel starts turning at the first reading
+    }
+    // A deadline the wheel has already passed goes in the last slot it visited, which it revisits
+    time_t due = s->deadline < wheel_time ? wheel_time - 1 : s->deadline;
+    s->timer_slot = (int)(due % WHEEL_SLOTS);
+    s->timer_prev = -1;
+    s->timer_next = wheel[s->timer_slot];
+    if (s->timer_next != -1) {
+        sensors[s->timer_next].timer_prev = sensor;
+    }
+    wheel[s->timer_slot] = sensor;
+}
+
+// Take a sensor out of its timer wheel slot
+void timer_unlink(int sensor) {
+    TrafficSensor* s = &sensors[sensor];
+    if (s->timer_prev != -1) {
+        sensors[s->timer_prev].timer_next = s->timer_next;
+    } else {
+        wheel[s->timer_slot] = s->timer_next;
+    }
+    if (s->timer_next != -1) {
+        sensors[s->timer_next].timer_prev = s->timer_prev;
+    }
+}
+
+// Point the neighbours of a sensor that moved to a new index at its new position
+void timer_relink(int sensor) {
+    TrafficSensor* s = &sensors[sensor];
+    if (s->timer_prev != -1) {
+        sensors[s->timer_prev].timer_next = sensor;
+    } else {
+        wheel[s->timer_slot] = sensor;
+    }
+    if (s->timer_next != -1) {
+        sensors[s->timer_next].timer_prev = sensor;
+    }
+}
+
+// Remove sensors with no reading in the last STALE_AFTER seconds from the median.
+// Each call visits only the slots for the seconds since the previous call.
+void expire_stale_sensors(time_t now) {
+    if (!wheel_ready) {
+        return;
+    }
+    time_t second = wheel_time - 1; // Revisit the last slot for overdue readings filed there
+    // After a gap of a full turn or more, one turn visits every slot
+    if (now - second >= WHEEL_SLOTS) {
+        second = now - WHEEL_SLOTS + 1;
+    }
+    for (; second <= now; second++) {
+        int sensor = wheel[second % WHEEL_SLOTS];
+        while (sensor != -1) {
+            int next = sensors[sensor].timer_next;
+            // Entries for a later turn of the wheel stay put
+            if (sensors[sensor].deadline <= now) {
+                timer_unlink(sensor);
+                median_remove(sensor);
+                sensors[sensor].active = 0;
+            }
+            sensor = next;
+        }
+    }
+    if (now >= wheel_time) {
+        wheel_time = now + 1;
+    }
+}
+
+// A time a sensor could really have sent. Readings outside this range never reach a sensor: one far in the
+// future would make every later reading look stale, and the wheel and window indexes assume positive times.
+int plausible_time(long long when, time_t now) {
+    return when >= EARLIEST_READING && when <= (long long)now + MAX_CLOCK_SKEW;
+}
+
+// Add a queue reading to the sensor's bucket ring, clearing buckets that fell out of the window
+void record_window(TrafficSensor* s, int count, time_t when) {
+    long long bucket = (long long)when / WINDOW_BUCKET_SECONDS;
+    if (bucket <= s->window_epoch - WINDOW_BUCKETS) {
+        return; // Older than the whole window
+    }
+    if (bucket > s->window_epoch) {
+        long long cleared = bucket - s->window_epoch < WINDOW_BUCKETS ? bucket - s->window_epoch : WINDOW_BUCKETS;
+        for (long long b = bucket - cleared + 1; b <= bucket; b++) {
+            s->window[b % WINDOW_BUCKETS] = 0;
+            s->window_readings[b % WINDOW_BUCKETS] = 0;
+        }
+        s->window_epoch = bucket;
+    }
+    s->window[bucket % WINDOW_BUCKETS] += count;
+    s->window_readings[bucket % WINDOW_BUCKETS]++;
+}
+
+// Sum of the readings a sensor reported during the window ending at now; readings receives how many there were
+int window_sum(const TrafficSensor* sensor, time_t now, int* readings) {
+    long long newest = (long long)now / WINDOW_BUCKET_SECONDS;
+    long long oldest = newest - WINDOW_BUCKETS + 1;
+    if (oldest <= sensor->window_epoch - WINDOW_BUCKETS) {
+        oldest = sensor->window_epoch - WINDOW_BUCKETS + 1;
+    }
+    if (oldest < 0) {
+        oldest = 0; // The simulator's clock starts at 0
+    }
+    int total = 0;
+    *readings = 0;
+    for (long long b = oldest; b <= newest && b <= sensor->window_epoch; b++) {
+        total += sensor->window[b % WINDOW_BUCKETS];
+        *readings += sensor->window_readings[b % WINDOW_BUCKETS];
+    }
+    return total;
+}
+
+// Mean queue reading over the window ending at now, rounded; the latest reading if the window is empty.
+// Readings are queue levels, not arrivals, so they are averaged rather than added up.
+int window_average(const TrafficSensor* sensor, time_t now) {
+    int readings;
+    int total = window_sum(sensor, now, &readings);
+    return readings > 0 ? (total + readings / 2) / readings : sensor->vehicle_count;
+}
+
+// Append an unsigned LEB128 varint; returns the bytes written
+int put_varint(unsigned char* out, uint64_t value) {
+    int n = 0;
+    while (value >= 0x80) {
+        out[n++] = (unsigned char)(value | 0x80);
+        value >>= 7;
+    }
+    out[n++] = (unsigned char)value;
+    return n;
+}
+
+// Read a varint at *pos, advancing it; returns 0 past end
+uint64_t get_varint(const unsigned char* in, size_t end, size_t* pos) {
+    uint64_t value = 0;
+    for (int shift = 0; *pos < end && shift < 64; shift += 7) {
+        unsigned char byte = in[(*pos)++];
+        value |= (uint64_t)(byte & 0x7F) << shift;
+        if (!(byte & 0x80)) {
+            break;
+        }
+    }
+    return value;
+}
+
+// Map signed values to unsigned so small negatives stay short: 0, -1, 1, -2 ... -> 0, 1, 2, 3 ...
+uint64_t zigzag(int64_t value) {
+    return ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+}
+
+int64_t unzigzag(uint64_t value) {
+    return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+}
+
+// Make the trace mapping hold at least size bytes, growing the file; returns 0 on failure
+int trace_reserve(size_t size) {
+    if (size <= trace->mapped) {
+        return 1;
+    }
+    size_t grown = (size + TRACE_MAP_STEP - 1) / TRACE_MAP_STEP * TRACE_MAP_STEP;
+    if (ftruncate(trace->fd, (off_t)grown) != 0) {
+        return 0;
+    }
+    unsigned char* map = (unsigned char*)mmap(NULL, grown, PROT_READ | PROT_WRITE, MAP_SHARED, trace->fd, 0);
+    if (map == MAP_FAILED) {
+        return 0;
+    }
+    if (trace->map) {
+        munmap(trace->map, trace->mapped);
+    }
+    trace->map = map;
+    trace->mapped = grown;
+    return 1;
+}
+
+// Write the buffered block into the mapping and publish it in the header
+void trace_flush() {
+    if (trace == NULL || trace->records == 0) {
+        return;
+    }
+    TraceBlockHeader block = { (uint32_t)trace->records, (uint32_t)trace->id_bytes, (uint32_t)trace->time_bytes,
+                               (uint32_t)trace->count_bytes };
+    size_t size = sizeof(block) + trace->records + trace->id_bytes + trace->time_bytes + trace->count_bytes;
+    if (!trace_reserve(trace->used + size)) {
+        printf("Could not grow the trace file; %d records lost.\n", trace->records);
+    } else {
+        unsigned char* out = trace->map + trace->used;
+        memcpy(out, &block, sizeof(block));
+        out += sizeof(block);
+        memcpy(out, trace->ops, trace->records);
+        out += trace->records;
+        memcpy(out, trace->ids, trace->id_bytes);
+        out += trace->id_bytes;
+        memcpy(out, trace->times, trace->time_bytes);
+        out += trace->time_bytes;
+        memcpy(out, trace->counts, trace->count_bytes);
+        trace->used += size;
+        // The header moves last, so a crash while copying leaves the earlier blocks readable
+        TraceHeader* header = (TraceHeader*)trace->map;
+        header->last_time = trace->last_time;
+        header->used = trace->used;
+    }
+    trace->records = trace->id_bytes = trace->time_bytes = trace->count_bytes = 0;
+}
+
+// Record one change; a no-op unless a trace is open
+void trace_record(TraceOp op, int id, time_t when, int count) {
+    if (trace == NULL) {
+        return;
+    }
+    trace->ops[trace->records++] = (unsigned char)op;
+    trace->id_bytes += put_varint(trace->ids + trace->id_bytes, zigzag(id));
+    // Readings can arrive out of order, so deltas may be negative
+    trace->time_bytes += put_varint(trace->times + trace->time_bytes, zigzag((int64_t)when - trace->last_time));
+    trace->count_bytes += put_varint(trace->counts + trace->count_bytes, (uint32_t)count);
+    trace->last_time = when;
+    if (trace->records == TRACE_BLOCK_RECORDS) {
+        trace_flush();
+    }
+}
+
+// Start recording a session to path, replacing any earlier trace; returns 0 on failure.
+// Each session starts from no sensors, so a trace covers exactly one run of the program.
+int open_trace(const char* path) {
+    trace = (TraceWriter*)calloc(1, sizeof(TraceWriter));
+    if (trace == NULL) {
+        printf("Memory allocation failed for the trace writer\n");
+        return 0;
+    }
+    trace->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (trace->fd < 0 || !trace_reserve(sizeof(TraceHeader))) {
+        printf("Could not open trace file %s.\n", path);
+        if (trace->fd >= 0) close(trace->fd);
+        free(trace);
+        trace = NULL;
+        return 0;
+    }
+    TraceHeader* header = (TraceHeader*)trace->map;
+    memcpy(header->magic, TRACE_MAGIC, sizeof(header->magic));
+    header->used = trace->used = sizeof(TraceHeader);
+    header->last_time = trace->last_time = 0;
+    return 1;
+}
+
+// Flush the open block and trim the file to the bytes in use
+void close_trace() {
+    if (trace == NULL) {
+        return;
+    }
+    trace_flush();
+    munmap(trace->map, trace->mapped);
+    if (ftruncate(trace->fd, (off_t)trace->used) != 0) {
+        printf("Could not trim the trace file.\n");
+    }
+    close(trace->fd);
+    free(trace);
+    trace = NULL;
+}
+
+// Make room for one more sensor in the pool, the ID map and an intersection's median heaps
+int reserve_sensor(Intersection* owner) {
+    if (sensor_count == sensor_capacity) {
+        int new_capacity = sensor_capacity ? sensor_capacity * 2 : 16;
+        TrafficSensor* grown = (TrafficSensor*)realloc(sensors, new_capacity * sizeof(TrafficSensor));
+        if (grown == NULL) {
+            return 0;
+        }
+        sensors = grown;
+        sensor_capacity = new_capacity;
+    }
+    // Room for the half that grows plus the sensor that may move across
+    int half = (owner->sensor_count + 1) / 2 + 1;
+    return reserve_slots(sensor_count + 1) && heap_reserve(&owner->lower_half, half) &&
+           heap_reserve(&owner->upper_half, half);
+}
+
+// Append an intersection with no sensors; returns its index or -1 if memory ran out
+int add_intersection() {
+    if (intersection_count == intersection_capacity) {
+        int new_capacity = intersection_capacity ? intersection_capacity * 2 : 16;
+        Intersection* grown = (Intersection*)realloc(intersections, new_capacity * sizeof(Intersection));
+        if (grown == NULL) {
+            return -1;
+        }
+        intersections = grown;
+        intersection_capacity = new_capacity;
+    }
+    int index = intersection_count++;
+    Intersection* intersection = &intersections[index];
+    intersection->id = index + 1;
+    intersection->sensor_count = 0;
+    intersection->lower_half = (SensorHeap){ NULL, 0, 0, 1 };
+    intersection->upper_half = (SensorHeap){ NULL, 0, 0, 0 };
+    intersection->signal = (TrafficSignal){ RED, 30 };
+    trace_record(TRACE_INTERSECTION, intersection->id, time(NULL), 0);
+    return index;
+}
+
+// Create a new intersection and report it
+Intersection* create_intersection() {
+    int index = add_intersection();
+    if (index < 0) {
+        printf("Memory allocation failed for intersection %d\n", intersection_count + 1);
         return NULL;
-    }  
+    }
+    printf("Intersection %d added successfully.\n", intersections[index].id);
+    return &intersections[index];
+}
+
+// Find an intersection by ID
+Intersection* find_intersection(int id) {
+    return id >= 1 && id <= intersection_count ? &intersections[id - 1] : NULL;
+}
+
+// Insert a sensor whose ID is not in use yet, first seen at when; returns its index or -1 if memory ran out
+int add_sensor(int id, Intersection* owner, time_t when) {
+    if (!reserve_sensor(owner)) {
+        return -1;
+    }
+    int index = sensor_count++;
+    TrafficSensor* sensor = &sensors[index];
     sensor->id = id;
     sensor->vehicle_count = 0;
-    sensor->last_update = time(NULL); // Properly timestamp new sensors
-    sensor->next = sensor_head;
-    sensor_head = sensor;
-    sensor_count++;
+    sensor->average_count = 0;
+    sensor->last_update = when; // Properly timestamp new sensors
+    sensor->intersection = (int)(owner - intersections);
+    sensor->active = 1;
+    sensor->window_epoch = (long long)sensor->last_update / WINDOW_BUCKET_SECONDS;
+    memset(sensor->window, 0, sizeof(sensor->window));
+    memset(sensor->window_readings, 0, sizeof(sensor->window_readings));
+    sensor_slots[find_slot(id)] = index;
+    owner->sensor_count++;
+    median_insert(index);
+    timer_link(index);
+    trace_record(TRACE_CREATE, id, when, owner->id);
+    return index;
+}
+
+// Find a sensor by ID
+TrafficSensor* find_sensor(int id) {
+    if (sensor_count == 0) {
+        return NULL;
+    }
+    
+    int index = sensor_slots[find_slot(id)];
+    return index == SENSOR_SLOT_EMPTY ? NULL : &sensors[index];
+}
+
+// Allocate memory for a sensor - Dynamic memory allocation
+TrafficSensor* create_sensor(int id, int intersection_id) {
+    Intersection* owner = find_intersection(intersection_id);
+    if (owner == NULL) {
+        printf("Intersection with ID %d not found.\n", intersection_id);
+        return NULL;
+    }
+    if (find_sensor(id)) {
+        printf("Sensor %d already exists.\n", id);
+        return NULL;
+    }
+    int index = add_sensor(id, owner, time(NULL));
+    if (index < 0) {
+        printf("Memory allocation failed for sensor %d\n", id);
+        return NULL;
+    }
     printf("Sensor %d added successfully.\n", id);
-    return sensor;
+    return &sensors[index];
+}
+
+// Apply a new vehicle count to the sensor at index and reposition it by its new window average
+void set_vehicle_count(int index, int count, time_t when) {
+    sensors[index].vehicle_count = count;
+    sensors[index].last_update = when;
+    record_window(&sensors[index], count, when);
+    sensors[index].average_count = window_average(&sensors[index], when);
+    trace_record(TRACE_UPDATE, sensors[index].id, when, count);
+    if (sensors[index].active) {
+        median_update(index);
+        timer_unlink(index);
+    } else {
+        // A stale sensor rejoins the median with its first new reading
+        median_insert(index);
+        sensors[index].active = 1;
+    }
+    timer_link(index);
+}
+
+// SIGINT/SIGTERM handler: only sets a flag, the menu thread does the cleanup
+void request_stop(int signal_number) {
+    (void)signal_number;
+    stop_requested = 1;
+}
+
+// Route SIGINT/SIGTERM to request_stop without SA_RESTART, so a blocked prompt read returns.
+// A signal the parent set to be ignored (as for a background job) stays ignored.
+void install_stop_handler() {
+    int stop_signals[2] = { SIGINT, SIGTERM };
+    for (int i = 0; i < 2; i++) {
+        struct sigaction action;
+        if (sigaction(stop_signals[i], NULL, &action) == 0 && action.sa_handler == SIG_IGN) {
+            continue;
+        }
+        memset(&action, 0, sizeof(action));
+        action.sa_handler = request_stop;
+        sigemptyset(&action.sa_mask);
+        sigaction(stop_signals[i], &action, NULL);
+    }
+}
+
+// Leave through exit() once a stop was requested, so atexit cleanup closes the trace
+void exit_if_stopped() {
+    if (stop_requested) {
+        printf("\nStopping.\n");
+        exit(0);
+    }
+}
+
+// Start a thread with SIGINT/SIGTERM blocked in it, so they reach the menu thread's prompt
+int start_thread(pthread_t* thread, void* (*run)(void*), void* arg) {
+    sigset_t stop_signals, saved;
+    sigemptyset(&stop_signals);
+    sigaddset(&stop_signals, SIGINT);
+    sigaddset(&stop_signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &stop_signals, &saved);
+    int result = pthread_create(thread, NULL, run, arg);
+    pthread_sigmask(SIG_SETMASK, &saved, NULL);
+    return result;
 }
 
 // Safe input handling to prevent buffer overflows
@@ -45,9 +922,11 @@ int get_int_input(const char* prompt) {
     int value;
     
     while (1) {
+        exit_if_stopped();
         printf("%s", prompt);
         
         if (fgets(buffer, BUFFER_SIZE, stdin) == NULL) {
+            exit_if_stopped(); // A signal interrupts the read
             printf("Input error. Try again.\n");
             continue;
         }
@@ -77,84 +956,436 @@ int get_int_input(const char* prompt) {
     }
 }
 
-// Deallocate Memory Delete a sensor by ID
-void delete_sensor(int id) {
-    TrafficSensor* current = sensor_head;
-    TrafficSensor* prev = NULL;
-    
-    while (current != NULL) {
-        if (current->id == id) {
-            // Found the sensor to delete
-            if (prev == NULL) {
-                // It's the head node
-                sensor_head = current->next;
-            } else {
-                // It's not the head node
-                prev->next = current->next;
-            }
-            
-            printf("Sensor %d removed from memory.\n", id);
-            free(current);
-            sensor_count--;
-            return;
+// Read one line of text with the same overflow protection as get_int_input
+void get_text_input(const char* prompt, char* buffer) {
+    while (1) {
+        exit_if_stopped();
+        printf("%s", prompt);
+        
+        if (fgets(buffer, BUFFER_SIZE, stdin) == NULL) {
+            exit_if_stopped();
+            printf("Input error. Try again.\n");
+            continue;
+        }
+        
+        if (buffer[strlen(buffer) - 1] != '\n') {
+            printf("Input too long! Maximum %d characters allowed.\n", BUFFER_SIZE - 1);
+            int c;
+            while ((c = getchar()) != '\n' && c != EOF);
+            continue;
         }
         
-        prev = current;
-        current = current->next;
+        buffer[strcspn(buffer, "\n")] = 0;
+        return;
     }
+}
+
+// Remove the sensor in an ID map slot; the last sensor moves into its place
+void remove_sensor(int slot, time_t when) {
+    int index = sensor_slots[slot];
+    trace_record(TRACE_DELETE, sensors[index].id, when, 0);
+    int last = sensor_count - 1;
+    if (sensors[index].active) {
+        median_remove(index);
+        timer_unlink(index);
+    }
+    erase_slot(slot);
+    intersections[sensors[index].intersection].sensor_count--;
     
-    printf("Sensor with ID %d not found.\n", id);
+    // Fill the hole with the last sensor and repoint its heap entry, timer links and map slot
+    if (index != last) {
+        sensors[index] = sensors[last];
+        if (sensors[index].active) {
+            sensor_heap(index)->items[sensors[index].heap_index] = index;
+            timer_relink(index);
+        }
+        sensor_slots[find_slot(sensors[index].id)] = index;
+    }
+    sensor_count--;
 }
 
-// Calculate the median vehicle count, ignoring faulty sensors
-int calculate_median() {
-    if (sensor_count == 0) return 0;
+// Deallocate Memory Delete a sensor by ID
+void delete_sensor(int id) {
+    int slot = sensor_count ? find_slot(id) : 0;
     
-    int counts[sensor_count];
-    int valid_count = 0;
-    TrafficSensor* current = sensor_head;
+    if (sensor_count == 0 || sensor_slots[slot] == SENSOR_SLOT_EMPTY) {
+        printf("Sensor with ID %d not found.\n", id);
+        return;
+    }
     
-    while (current) {
-        counts[valid_count++] = current->vehicle_count;
-        current = current->next;
+    remove_sensor(slot, time(NULL));
+    printf("Sensor %d removed from memory.\n", id);
+}
+
+// Calculate the median of the sensors' window averages, ignoring stale sensors; O(1) from the tops of the two heaps
+int calculate_median(const Intersection* intersection) {
+    int active = intersection->lower_half.size + intersection->upper_half.size;
+    if (active == 0) return 0;
+    
+    int low = sensors[intersection->lower_half.items[0]].average_count;
+    if (active % 2 == 0)
+        return (low + sensors[intersection->upper_half.items[0]].average_count) / 2;
+    else
+        return low;
+}
+
+// Smallest and largest count, portable version
+void minmax_scalar(const int* counts, int n, int* low, int* high) {
+    int lo = counts[0], hi = counts[0];
+    for (int i = 1; i < n; i++) {
+        if (counts[i] < lo) lo = counts[i];
+        if (counts[i] > hi) hi = counts[i];
+    }
+    *low = lo;
+    *high = hi;
+}
+
+// Number of counts above pivot, portable version
+long long count_above_scalar(const int* counts, int n, int pivot) {
+    long long above = 0;
+    for (int i = 0; i < n; i++) {
+        above += counts[i] > pivot;
+    }
+    return above;
+}
+
+// Smallest count above floor (INT_MAX if none), portable version
+int min_above_scalar(const int* counts, int n, int floor) {
+    int best = INT_MAX;
+    for (int i = 0; i < n; i++) {
+        if (counts[i] > floor && counts[i] < best) best = counts[i];
+    }
+    return best;
+}
+
+#ifdef COUNT_KERNELS_X86
+__attribute__((target("sse4.1")))
+void minmax_sse41(const int* counts, int n, int* low, int* high) {
+    __m128i lo = _mm_set1_epi32(counts[0]), hi = lo;
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(counts + i));
+        lo = _mm_min_epi32(lo, v);
+        hi = _mm_max_epi32(hi, v);
+    }
+    int lanes_lo[4], lanes_hi[4];
+    _mm_storeu_si128((__m128i*)lanes_lo, lo);
+    _mm_storeu_si128((__m128i*)lanes_hi, hi);
+    minmax_scalar(lanes_lo, 4, low, &lanes_lo[0]);
+    minmax_scalar(lanes_hi, 4, &lanes_hi[0], high);
+    for (; i < n; i++) {
+        if (counts[i] < *low) *low = counts[i];
+        if (counts[i] > *high) *high = counts[i];
+    }
+}
+
+__attribute__((target("sse4.1")))
+long long count_above_sse41(const int* counts, int n, int pivot) {
+    __m128i p = _mm_set1_epi32(pivot), a0 = _mm_setzero_si128(), a1 = _mm_setzero_si128();
+    int i = 0;
+    // A true comparison is -1 in every bit, so subtracting it counts the lane
+    for (; i + 8 <= n; i += 8) {
+        a0 = _mm_sub_epi32(a0, _mm_cmpgt_epi32(_mm_loadu_si128((const __m128i*)(counts + i)), p));
+        a1 = _mm_sub_epi32(a1, _mm_cmpgt_epi32(_mm_loadu_si128((const __m128i*)(counts + i + 4)), p));
+    }
+    int lanes[4];
+    _mm_storeu_si128((__m128i*)lanes, _mm_add_epi32(a0, a1));
+    return (long long)lanes[0] + lanes[1] + lanes[2] + lanes[3] + count_above_scalar(counts + i, n - i, pivot);
+}
+
+__attribute__((target("sse4.1")))
+int min_above_sse41(const int* counts, int n, int floor) {
+    __m128i f = _mm_set1_epi32(floor), none = _mm_set1_epi32(INT_MAX), best = none;
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(counts + i));
+        best = _mm_min_epi32(best, _mm_blendv_epi8(none, v, _mm_cmpgt_epi32(v, f)));
+    }
+    int lanes[4];
+    _mm_storeu_si128((__m128i*)lanes, best);
+    int result = min_above_scalar(counts + i, n - i, floor);
+    for (int l = 0; l < 4; l++) {
+        if (lanes[l] < result) result = lanes[l];
+    }
+    return result;
+}
+
+__attribute__((target("avx2")))
+void minmax_avx2(const int* counts, int n, int* low, int* high) {
+    __m256i lo = _mm256_set1_epi32(counts[0]), hi = lo;
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(counts + i));
+        lo = _mm256_min_epi32(lo, v);
+        hi = _mm256_max_epi32(hi, v);
     }
+    int lanes_lo[8], lanes_hi[8];
+    _mm256_storeu_si256((__m256i*)lanes_lo, lo);
+    _mm256_storeu_si256((__m256i*)lanes_hi, hi);
+    minmax_scalar(lanes_lo, 8, low, &lanes_lo[0]);
+    minmax_scalar(lanes_hi, 8, &lanes_hi[0], high);
+    for (; i < n; i++) {
+        if (counts[i] < *low) *low = counts[i];
+        if (counts[i] > *high) *high = counts[i];
+    }
+}
+
+__attribute__((target("avx2")))
+long long count_above_avx2(const int* counts, int n, int pivot) {
+    __m256i p = _mm256_set1_epi32(pivot), a0 = _mm256_setzero_si256(), a1 = _mm256_setzero_si256();
+    int i = 0;
+    for (; i + 16 <= n; i += 16) {
+        a0 = _mm256_sub_epi32(a0, _mm256_cmpgt_epi32(_mm256_loadu_si256((const __m256i*)(counts + i)), p));
+        a1 = _mm256_sub_epi32(a1, _mm256_cmpgt_epi32(_mm256_loadu_si256((const __m256i*)(counts + i + 8)), p));
+    }
+    int lanes[8];
+    _mm256_storeu_si256((__m256i*)lanes, _mm256_add_epi32(a0, a1));
+    long long above = count_above_scalar(counts + i, n - i, pivot);
+    for (int l = 0; l < 8; l++) {
+        above += lanes[l];
+    }
+    return above;
+}
+
+__attribute__((target("avx2")))
+int min_above_avx2(const int* counts, int n, int floor) {
+    __m256i f = _mm256_set1_epi32(floor), none = _mm256_set1_epi32(INT_MAX), best = none;
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(counts + i));
+        best = _mm256_min_epi32(best, _mm256_blendv_epi8(none, v, _mm256_cmpgt_epi32(v, f)));
+    }
+    int lanes[8];
+    _mm256_storeu_si256((__m256i*)lanes, best);
+    int result = min_above_scalar(counts + i, n - i, floor);
+    for (int l = 0; l < 8; l++) {
+        if (lanes[l] < result) result = lanes[l];
+    }
+    return result;
+}
+#endif
+
+const CountKernels scalar_kernels = { "scalar", minmax_scalar, count_above_scalar, min_above_scalar };
+#ifdef COUNT_KERNELS_X86
+const CountKernels sse41_kernels = { "sse4.1", minmax_sse41, count_above_sse41, min_above_sse41 };
+const CountKernels avx2_kernels = { "avx2", minmax_avx2, count_above_avx2, min_above_avx2 };
+#endif
+
+// True if this CPU can run a kernel set
+int kernels_supported(const CountKernels* kernels) {
+#ifdef COUNT_KERNELS_X86
+    __builtin_cpu_init();
+    if (kernels == &avx2_kernels) return __builtin_cpu_supports("avx2");
+    if (kernels == &sse41_kernels) return __builtin_cpu_supports("sse4.1");
+#endif
+    return kernels == &scalar_kernels;
+}
+
+// Widest kernel set this CPU supports, picked on first use
+const CountKernels* count_kernels() {
+    static const CountKernels* selected = NULL;
+    if (selected == NULL) {
+        selected = &scalar_kernels;
+#ifdef COUNT_KERNELS_X86
+        if (kernels_supported(&avx2_kernels)) selected = &avx2_kernels;
+        else if (kernels_supported(&sse41_kernels)) selected = &sse41_kernels;
+#endif
+    }
+    return selected;
+}
+
+// Median of a count column with the same rounding as calculate_median.
+// Bisects the value range; every step is one vectorized counting pass, so small ranges need few passes.
+int median_with(const CountKernels* kernels, const int* counts, int n) {
+    if (n == 0) return 0;
     
-    for (int j = 0; j < valid_count - 1; j++) {
-        for (int k = j + 1; k < valid_count; k++) {
-            if (counts[j] > counts[k]) {
-                int temp = counts[j];
-                counts[j] = counts[k];
-                counts[k] = temp;
-            }
+    int low, high;
+    kernels->minmax(counts, n, &low, &high);
+    // The lower middle is the smallest value with at most n / 2 counts above it
+    while (low < high) {
+        int mid = (int)(low + ((long long)high - low) / 2);
+        if (kernels->count_above(counts, n, mid) <= n / 2) {
+            high = mid;
+        } else {
+            low = mid + 1;
         }
     }
+    if (n % 2) return low;
     
-    if (valid_count % 2 == 0)
-        return (counts[valid_count/2 - 1] + counts[valid_count/2]) / 2;
-    else
-        return counts[valid_count/2];
+    // The upper middle repeats the lower one unless n / 2 or more counts lie above it
+    int upper = kernels->count_above(counts, n, low) < n / 2 ? low : kernels->min_above(counts, n, low);
+    return (int)(((long long)low + upper) / 2);
 }
 
-// Update traffic signal state based on median vehicle count
-void update_signal(TrafficSignal *signal) {
-    if (sensor_count == 0) {
+// Median of a contiguous count column using the fastest kernels available
+int median_of_counts(const int* counts, int n) {
+    return median_with(count_kernels(), counts, n);
+}
+
+// Median vehicle count over every active sensor in the city; returns -1 if memory ran out
+int city_median(int* active_sensors) {
+    int* column = (int*)malloc((sensor_count ? sensor_count : 1) * sizeof(int));
+    if (column == NULL) {
+        return -1;
+    }
+    int n = 0;
+    for (int i = 0; i < sensor_count; i++) {
+        if (sensors[i].active) column[n++] = sensors[i].average_count;
+    }
+    int median = median_of_counts(column, n);
+    free(column);
+    *active_sensors = n;
+    return median;
+}
+
+// Set a signal's state and duration from the median vehicle count of active sensors under a policy
+void apply_policy(const SignalPolicy* policy, TrafficSignal* signal, int active, int median_count) {
+    if (policy->fixed) {
+        signal->state = signal->state == GREEN ? YELLOW : signal->state == YELLOW ? RED : GREEN;
+    } else if (active == 0) { // No sensors, or all of them stale
         signal->state = RED;
-        signal->duration = 30;
+        signal->duration = policy->idle_seconds;
         return;
-    }
-    
-    int median_count = calculate_median();
-    
-    if (median_count > 10) {
+    } else if (median_count > policy->green_above) {
         signal->state = GREEN;
-        signal->duration = 45;
-    } else if (median_count > 5) {
+    } else if (median_count > policy->yellow_above) {
         signal->state = YELLOW;
-        signal->duration = 5;
     } else {
         signal->state = RED;
-        signal->duration = 20;
     }
+    
+    switch (signal->state) {
+        case GREEN:  signal->duration = policy->green_seconds;  break;
+        case YELLOW: signal->duration = policy->yellow_seconds; break;
+        case RED:    signal->duration = policy->red_seconds;    break;
+    }
+}
+
+// Update an intersection's signal state from the median of its sensors' one-minute average queues
+void update_signal(Intersection* intersection) {
+    int active = intersection->lower_half.size + intersection->upper_half.size;
+    apply_policy(&default_policy, &intersection->signal, active, calculate_median(intersection));
+}
+
+// Claim chunks from the worker's own range first, then steal from the others
+void run_chunks(int self) {
+    for (int k = 0; k < pool.worker_count; k++) {
+        WorkRange* range = &pool.ranges[(self + k) % pool.worker_count];
+        int chunk;
+        while ((chunk = atomic_fetch_add(&range->next, 1)) < range->end) {
+            int begin = chunk * pool.chunk;
+            int end = pool.items - begin < pool.chunk ? pool.items : begin + pool.chunk;
+            pool.task(begin, end, pool.arg);
+        }
+    }
+}
+
+// Helper thread: wait for a pass, work on it, report back
+void* pool_worker(void* arg) {
+    int self = (int)(intptr_t)arg;
+    unsigned long seen = 0;
+    
+    pthread_mutex_lock(&pool.lock);
+    while (1) {
+        while (pool.generation == seen && !pool.stopping) {
+            pthread_cond_wait(&pool.start, &pool.lock);
+        }
+        if (pool.stopping) {
+            break;
+        }
+        seen = pool.generation;
+        pthread_mutex_unlock(&pool.lock);
+        
+        run_chunks(self);
+        
+        pthread_mutex_lock(&pool.lock);
+        if (--pool.busy == 0) {
+            pthread_cond_signal(&pool.done);
+        }
+    }
+    pthread_mutex_unlock(&pool.lock);
+    return NULL;
+}
+
+// Start the pool with the given number of workers, counting the calling thread
+void start_pool(int workers) {
+    if (workers > MAX_WORKERS) workers = MAX_WORKERS;
+    if (workers < 1) workers = 1;
+    
+    pool.stopping = 0;
+    pool.generation = 0;
+    pool.worker_count = 1;
+    for (int i = 1; i < workers; i++) {
+        if (start_thread(&pool.threads[i], pool_worker, (void*)(intptr_t)i) != 0) {
+            printf("Could not start worker thread; continuing with %d.\n", pool.worker_count);
+            break;
+        }
+        pool.worker_count++;
+    }
+}
+
+// Stop and join the pool's threads
+void stop_pool() {
+    if (pool.worker_count == 0) {
+        return;
+    }
+    pthread_mutex_lock(&pool.lock);
+    pool.stopping = 1;
+    pthread_cond_broadcast(&pool.start);
+    pthread_mutex_unlock(&pool.lock);
+    for (int i = 1; i < pool.worker_count; i++) {
+        pthread_join(pool.threads[i], NULL);
+    }
+    pool.worker_count = 0;
+}
+
+// Run task over [0, items) in chunks spread across the pool; returns when every chunk is done
+void run_parallel(int items, int chunk, ParallelTask task, void* arg) {
+    if (pool.worker_count == 0) {
+        start_pool((int)sysconf(_SC_NPROCESSORS_ONLN));
+    }
+    int chunks = (items + chunk - 1) / chunk;
+    if (pool.worker_count == 1 || chunks <= 1) {
+        if (items > 0) task(0, items, arg);
+        return;
+    }
+    
+    pool.task = task;
+    pool.arg = arg;
+    pool.items = items;
+    pool.chunk = chunk;
+    for (int w = 0; w < pool.worker_count; w++) {
+        atomic_store(&pool.ranges[w].next, (int)((long long)chunks * w / pool.worker_count));
+        pool.ranges[w].end = (int)((long long)chunks * (w + 1) / pool.worker_count);
+    }
+    
+    pthread_mutex_lock(&pool.lock);
+    pool.busy = pool.worker_count - 1;
+    pool.generation++;
+    pthread_cond_broadcast(&pool.start);
+    pthread_mutex_unlock(&pool.lock);
+    
+    run_chunks(0);
+    
+    pthread_mutex_lock(&pool.lock);
+    while (pool.busy > 0) {
+        pthread_cond_wait(&pool.done, &pool.lock);
+    }
+    pthread_mutex_unlock(&pool.lock);
+}
+
+// Recompute the signals of intersections [begin, end)
+void update_signal_range(int begin, int end, void* arg) {
+    (void)arg;
+    for (int i = begin; i < end; i++) {
+        update_signal(&intersections[i]);
+    }
+}
+
+// Expire stale sensors as of now, then recompute every intersection's signal in parallel
+void update_all_signals(time_t now) {
+    expire_stale_sensors(now);
+    run_parallel(intersection_count, SIGNAL_CHUNK, update_signal_range, NULL);
 }
 
 // Display traffic light state
@@ -173,76 +1404,255 @@ void display_signal(TrafficSignal *signal) {
             printf("YELLOW - Slow Down (%d seconds)\n", signal->duration); 
             break;
     }
-    printf("-------------------------------\n");
+    printf("-------------------------------\n");
+}
+
+// Display all sensors
+void display_sensors() {
+    if (sensor_count == 0) {
+        printf("No sensors available.\n");
+        return;
+    }
+    
+    time_t now = time(NULL);
+    printf("\n----- SENSORS -----\n");
+    for (int i = 0; i < sensor_count; i++) {
+        int readings;
+        int total = window_sum(&sensors[i], now, &readings);
+        printf("Sensor ID: %d\n", sensors[i].id);
+        printf("  Intersection: %d\n", intersections[sensors[i].intersection].id);
+        printf("  Vehicle Count: %d\n", sensors[i].vehicle_count);
+        if (readings > 0) {
+            printf("  Last %d s: average queue %.1f vehicles over %d reading%s\n", WINDOW_BUCKETS * WINDOW_BUCKET_SECONDS,
+                   (double)total / readings, readings, readings == 1 ? "" : "s");
+        } else {
+            printf("  Last %d s: no readings\n", WINDOW_BUCKETS * WINDOW_BUCKET_SECONDS);
+        }
+        if (!sensors[i].active) {
+            printf("  Status: stale, no reading for %lld s\n", (long long)(now - sensors[i].last_update));
+        }
+        printf("---------------------------\n");
+    }
+}
+
+// Update sensor data with buffer overflow protection
+void update_sensor(int id) {
+    TrafficSensor* sensor = find_sensor(id);
+    
+    if (!sensor) {
+        printf("Sensor with ID %d not found.\n", id);
+        return;
+    }
+    
+    int count = get_int_input("Enter vehicle count: ");
+    if (count < 0) {
+        printf("Invalid vehicle count. Using 0 instead.\n");
+        count = 0;
+    }
+    
+    set_vehicle_count((int)(sensor - sensors), count, time(NULL));
+    
+    printf("Sensor %d updated successfully.\n", id);
+}
+
+// Allocate the ingest ring; returns 0 if memory ran out
+int init_ingest() {
+    if (ingest.slots) {
+        return 1;
+    }
+    ingest.slots = (IngestSlot*)malloc(INGEST_RING_CAPACITY * sizeof(IngestSlot));
+    if (ingest.slots == NULL) {
+        printf("Memory allocation failed for the ingest ring\n");
+        return 0;
+    }
+    for (size_t i = 0; i < INGEST_RING_CAPACITY; i++) {
+        atomic_init(&ingest.slots[i].sequence, i);
+    }
+    ingest.mask = INGEST_RING_CAPACITY - 1;
+    atomic_init(&ingest.tail, 0);
+    ingest.head = 0;
+    return 1;
+}
+
+// Queue a reading; returns 0 if the ring is full. Safe to call from any number of threads.
+int ring_push(const SensorReading* reading) {
+    size_t pos = atomic_load_explicit(&ingest.tail, memory_order_relaxed);
+    while (1) {
+        IngestSlot* slot = &ingest.slots[pos & ingest.mask];
+        size_t sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+        intptr_t lag = (intptr_t)sequence - (intptr_t)pos;
+        if (lag == 0) {
+            // Slot is free for this lap; claim it, fill it, then hand it to the consumer
+            if (atomic_compare_exchange_weak_explicit(&ingest.tail, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                slot->reading = *reading;
+                atomic_store_explicit(&slot->sequence, pos + 1, memory_order_release);
+                return 1;
+            }
+        } else if (lag < 0) {
+            return 0; // The consumer has not freed this slot from the previous lap
+        } else {
+            pos = atomic_load_explicit(&ingest.tail, memory_order_relaxed);
+        }
+    }
+}
+
+// Take the oldest reading; returns 0 if the ring is empty. Consumer thread only.
+int ring_pop(SensorReading* reading) {
+    IngestSlot* slot = &ingest.slots[ingest.head & ingest.mask];
+    if (atomic_load_explicit(&slot->sequence, memory_order_acquire) != ingest.head + 1) {
+        return 0;
+    }
+    *reading = slot->reading;
+    atomic_store_explicit(&slot->sequence, ingest.head + ingest.mask + 1, memory_order_release);
+    ingest.head++;
+    return 1;
+}
+
+// Producer side: queue a reading, either waiting for room (block) or dropping it when the ring is full
+int submit_reading(int sensor_id, int vehicle_count, time_t timestamp, int block) {
+    SensorReading reading = { sensor_id, vehicle_count, timestamp };
+    while (!ring_push(&reading)) {
+        if (!block) {
+            atomic_fetch_add_explicit(&ingest.dropped, 1, memory_order_relaxed);
+            return 0;
+        }
+        atomic_fetch_add_explicit(&ingest.stalls, 1, memory_order_relaxed);
+        sched_yield();
+    }
+    atomic_fetch_add_explicit(&ingest.accepted, 1, memory_order_relaxed);
+    return 1;
 }
 
-// Display all sensors
-void display_sensors() {
-    TrafficSensor* current = sensor_head;
-    
-    if (!current) {
-        printf("No sensors available.\n");
-        return;
+// Consumer side: apply up to one batch of queued readings; returns how many were taken
+int drain_readings() {
+    SensorReading batch[INGEST_BATCH];
+    int taken = 0;
+    while (taken < INGEST_BATCH && ring_pop(&batch[taken])) {
+        taken++;
+    }
+    if (taken == 0) {
+        return 0;
     }
+    ingest.batches++;
     
-    printf("\n----- SENSORS -----\n");
-    while (current) {
-        printf("Sensor ID: %d\n", current->id);
-        printf("  Vehicle Count: %d\n", current->vehicle_count);
-        printf("---------------------------\n");
-        current = current->next;
+    time_t now = time(NULL);
+    for (int i = 0; i < taken; i++) {
+        TrafficSensor* sensor = find_sensor(batch[i].sensor_id);
+        if (sensor == NULL) {
+            ingest.unknown++;
+        } else if (!plausible_time(batch[i].timestamp, now)) {
+            ingest.bad_time++;
+        } else if (batch[i].timestamp < sensor->last_update) {
+            ingest.stale++; // Producers race, so an older reading may arrive after a newer one
+        } else {
+            int count = batch[i].vehicle_count < 0 ? 0 : batch[i].vehicle_count;
+            set_vehicle_count((int)(sensor - sensors), count, batch[i].timestamp);
+            ingest.applied++;
+        }
     }
+    return taken;
 }
 
-// Find a sensor by ID
-TrafficSensor* find_sensor(int id) {
-    TrafficSensor* current = sensor_head;
-    
-    while (current) {
-        if (current->id == id) {
-            return current;
+// Apply readings until every producer has finished and the ring is empty
+void consume_readings(atomic_int* producers_running) {
+    while (1) {
+        if (drain_readings() > 0) {
+            continue;
+        }
+        // Producers decrement only after their last push, so one more drain sees everything
+        if (atomic_load(producers_running) == 0 && drain_readings() == 0) {
+            return;
         }
-        current = current->next;
+        sched_yield();
     }
+}
+
+// Print the ingest counters
+void display_ingest_stats() {
+    printf("Accepted: %lu  Applied: %lu  Stale: %lu  Unknown sensor: %lu  Bad time: %lu\n",
+           atomic_load(&ingest.accepted), ingest.applied, ingest.stale, ingest.unknown, ingest.bad_time);
+    printf("Dropped: %lu  Producer stalls: %lu  Batches: %lu\n",
+           atomic_load(&ingest.dropped), atomic_load(&ingest.stalls), ingest.batches);
+}
+
+typedef struct {
+    FILE* file;
+    atomic_int* running;
+    int malformed;
+} FileFeed;
+
+// Producer thread: read "sensor_id count [unix_time]" lines into the ring
+void* read_feed(void* arg) {
+    FileFeed* feed = (FileFeed*)arg;
+    char line[BUFFER_SIZE];
     
+    while (fgets(line, sizeof(line), feed->file)) {
+        int id, count;
+        long long when;
+        int fields = sscanf(line, "%d %d %lld", &id, &count, &when);
+        if (fields < 2) {
+            feed->malformed++;
+            continue;
+        }
+        submit_reading(id, count, fields == 3 ? (time_t)when : time(NULL), 1);
+    }
+    atomic_fetch_sub(feed->running, 1);
     return NULL;
 }
 
-// Update sensor data with buffer overflow protection
-void update_sensor(int id) {
-    TrafficSensor* sensor = find_sensor(id);
-    
-    if (!sensor) {
-        printf("Sensor with ID %d not found.\n", id);
+// Ingest a reading file on a producer thread while this thread applies the readings
+void ingest_file(const char* path) {
+    FileFeed feed = { fopen(path, "r"), NULL, 0 };
+    if (feed.file == NULL) {
+        printf("Could not open %s.\n", path);
         return;
     }
-    
-    int count = get_int_input("Enter vehicle count: ");
-    if (count < 0) {
-        printf("Invalid vehicle count. Using 0 instead.\n");
-        count = 0;
+    if (!init_ingest()) {
+        fclose(feed.file);
+        return;
     }
     
-    sensor->vehicle_count = count;
-    sensor->last_update = time(NULL);
+    atomic_int running = 1;
+    feed.running = &running;
+    pthread_t producer;
+    if (start_thread(&producer, read_feed, &feed) != 0) {
+        printf("Could not start the feed thread.\n");
+        fclose(feed.file);
+        return;
+    }
+    consume_readings(&running);
+    pthread_join(producer, NULL);
+    fclose(feed.file);
     
-    printf("Sensor %d updated successfully.\n", id);
+    if (feed.malformed > 0) {
+        printf("Skipped %d malformed lines.\n", feed.malformed);
+    }
+    display_ingest_stats();
 }
 
 // Clean up all resources to prevent memory leaks
 void cleanup_resources() {
-    TrafficSensor* current = sensor_head;
-    int freed = 0;
+    int freed = sensor_count;
     
-    while (current) {
-        TrafficSensor* next = current->next;
-        free(current);
-        current = next;
-        freed++;
+    stop_pool();
+    close_trace();
+    for (int i = 0; i < intersection_count; i++) {
+        free(intersections[i].lower_half.items);
+        free(intersections[i].upper_half.items);
     }
-    
-    sensor_head = NULL;
-    sensor_count = 0;
+    free(intersections);
+    intersections = NULL;
+    intersection_count = intersection_capacity = 0;
+    free(ingest.slots);
+    ingest.slots = NULL;
+    free(sensors);
+    free(sensor_slots);
+    sensors = NULL;
+    sensor_slots = NULL;
+    sensor_count = sensor_capacity = slot_capacity = 0;
+    wheel_ready = 0;
+    wheel_time = 0;
     
     if (freed > 0) {
         printf("Cleanup completed: %d sensors freed from memory.\n", freed);
@@ -251,16 +1661,21 @@ void cleanup_resources() {
 
 // Reading user input for menu selection
 void menu() {
-    TrafficSignal signal = { RED, 30 };
+    if (intersection_count == 0 && add_intersection() < 0) {
+        printf("Memory allocation failed for intersection 1\n");
+        return;
+    }
     
     while (1) {
         printf("\n----- TRAFFIC MANAGEMENT SYSTEM -----\n");
         printf("1. Add a new sensor\n");
         printf("2. Update sensor data\n");
         printf("3. View all sensors\n");
-        printf("4. Update traffic signal\n");
+        printf("4. Update traffic signals\n");
         printf("5. Delete a sensor\n");
-        printf("6. Exit\n");
+        printf("6. Add a new intersection\n");
+        printf("7. Ingest readings from a file\n");
+        printf("8. Exit\n");
         printf("-------------------------------------\n");
         
         int choice = get_int_input("Enter your choice: ");
@@ -268,7 +1683,14 @@ void menu() {
         switch (choice) {
             case 1: {
                 int id = sensor_count + 1;
-                create_sensor(id);
+                while (find_sensor(id)) {
+                    id++; // Skip IDs still held after a deletion
+                }
+                int intersection_id = 1;
+                if (intersection_count > 1) {
+                    intersection_id = get_int_input("Enter intersection ID: ");
+                }
+                create_sensor(id, intersection_id);
                 break;
             }
             
@@ -289,8 +1711,17 @@ void menu() {
                 break;
                 
             case 4:
-                update_signal(&signal);
-                display_signal(&signal);
+                update_all_signals(time(NULL));
+                for (int i = 0; i < intersection_count; i++) {
+                    printf("\nIntersection %d (%d sensors)", intersections[i].id, intersections[i].sensor_count);
+                    display_signal(&intersections[i].signal);
+                }
+                if (intersection_count > 1) {
+                    int active = 0;
+                    int median = city_median(&active);
+                    if (median < 0) printf("Memory allocation failed for the city-wide median\n");
+                    else printf("City-wide median: %d vehicles across %d active sensors\n", median, active);
+                }
                 break;
                 
             case 5: {
@@ -306,6 +1737,17 @@ void menu() {
             }
             
             case 6:
+                create_intersection();
+                break;
+                
+            case 7: {
+                char path[BUFFER_SIZE];
+                get_text_input("Enter reading file path: ", path);
+                ingest_file(path);
+                break;
+            }
+            
+            case 8:
                 cleanup_resources();
                 printf("Exiting the system.\n");
                 exit(0);
@@ -313,15 +1755,795 @@ void menu() {
             default:
                 printf("Invalid choice. Please try again.\n");
         }
+        // Publish the action's records now, so a crash or kill loses at most the action in progress
+        trace_flush();
+    }
+}
+
+// Current monotonic time in nanoseconds
+long long now_nanos() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// Time a city-wide signal recomputation for growing worker counts
+int run_signal_benchmark(int intersection_total, int sensors_each, int cores) {
+    if (intersection_total < 1 || sensors_each < 0) {
+        printf("Usage: --bench-signals [intersections] [sensors per intersection] [max workers]\n");
+        return 1;
+    }
+    srand(42);
+    int next_id = 1;
+    for (int i = 0; i < intersection_total; i++) {
+        int index = add_intersection();
+        if (index < 0) {
+            printf("Memory allocation failed for intersection %d\n", i + 1);
+            return 1;
+        }
+        for (int s = 0; s < sensors_each; s++) {
+            int sensor = add_sensor(next_id++, &intersections[index], time(NULL));
+            if (sensor < 0) {
+                printf("Memory allocation failed for sensor %d\n", next_id - 1);
+                return 1;
+            }
+            sensors[sensor].vehicle_count = sensors[sensor].average_count = rand() % 25;
+            median_update(sensor);
+        }
+    }
+    
+    if (cores < 1) cores = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (cores > MAX_WORKERS) cores = MAX_WORKERS;
+    printf("%d intersections x %d sensors, up to %d workers\n", intersection_total, sensors_each, cores);
+    printf("%8s %12s %16s %8s\n", "workers", "pass (us)", "ns/intersection", "speedup");
+    
+    double single = 0;
+    for (int workers = 1; ; workers = workers * 2 > cores && workers < cores ? cores : workers * 2) {
+        stop_pool();
+        start_pool(workers);
+        long long best = -1;
+        for (int rep = 0; rep < 20; rep++) {
+            long long start = now_nanos();
+            update_all_signals(time(NULL));
+            long long elapsed = now_nanos() - start;
+            if (best < 0 || elapsed < best) best = elapsed;
+        }
+        if (workers == 1) single = (double)best;
+        printf("%8d %12.1f %16.2f %7.2fx\n", pool.worker_count, best / 1000.0,
+               (double)best / intersection_total, single / best);
+        if (workers >= cores) break;
+    }
+    
+    // Every pass must agree with a serial recomputation
+    int green = 0;
+    for (int i = 0; i < intersection_count; i++) {
+        TrafficSignal parallel = intersections[i].signal;
+        update_signal(&intersections[i]);
+        if (parallel.state != intersections[i].signal.state || parallel.duration != intersections[i].signal.duration) {
+            printf("Signal mismatch at intersection %d\n", intersections[i].id);
+            return 1;
+        }
+    }
+    for (int i = 0; i < intersection_count; i++) {
+        green += intersections[i].signal.state == GREEN;
+    }
+    printf("%d of %d signals green\n", green, intersection_count);
+    return 0;
+}
+
+typedef struct {
+    atomic_int* running;
+    int readings;
+    int sensor_total;
+    int block;
+    unsigned int seed;
+} BenchProducer;
+
+// Producer thread for the ingest benchmark: random sensors, random counts, current time
+void* bench_produce(void* arg) {
+    BenchProducer* producer = (BenchProducer*)arg;
+    unsigned int x = producer->seed;
+    
+    for (int i = 0; i < producer->readings; i++) {
+        x ^= x << 13; x ^= x >> 17; x ^= x << 5;
+        submit_reading(1 + (int)(x % (unsigned int)producer->sensor_total), (int)(x >> 24) % 25,
+                       time(NULL), producer->block);
+    }
+    atomic_fetch_sub(producer->running, 1);
+    return NULL;
+}
+
+// Measure ingest throughput for 1..max producers, blocking and dropping when the ring is full
+int run_ingest_benchmark(int max_producers, int readings_each, int sensor_total) {
+    if (max_producers < 1 || max_producers > MAX_WORKERS || readings_each < 1 || sensor_total < 1) {
+        printf("Usage: --bench-ingest [max producers] [readings per producer] [sensors]\n");
+        return 1;
+    }
+    if (!init_ingest()) {
+        return 1;
+    }
+    // Sensors in groups of 16 per intersection
+    for (int id = 1; id <= sensor_total; id++) {
+        if ((id - 1) % 16 == 0 && add_intersection() < 0) {
+            printf("Memory allocation failed for intersection %d\n", intersection_count + 1);
+            return 1;
+        }
+        if (add_sensor(id, &intersections[intersection_count - 1], time(NULL)) < 0) {
+            printf("Memory allocation failed for sensor %d\n", id);
+            return 1;
+        }
+    }
+    
+    printf("%d sensors, %d readings per producer, ring of %d\n", sensor_total, readings_each, INGEST_RING_CAPACITY);
+    printf("%9s %6s %12s %12s %10s %10s %10s\n", "producers", "mode", "offered/s", "applied/s", "dropped", "stalls",
+           "avg batch");
+    for (int block = 1; block >= 0; block--) {
+        for (int producers = 1; producers <= max_producers; producers *= 2) {
+            pthread_t threads[MAX_WORKERS];
+            BenchProducer work[MAX_WORKERS];
+            atomic_int running = producers;
+            unsigned long applied = ingest.applied, batches = ingest.batches;
+            unsigned long taken = ingest.applied + ingest.stale + ingest.unknown + ingest.bad_time;
+            unsigned long dropped = atomic_load(&ingest.dropped), stalls = atomic_load(&ingest.stalls);
+            
+            long long start = now_nanos();
+            for (int p = 0; p < producers; p++) {
+                work[p] = (BenchProducer){ &running, readings_each, sensor_total, block, 2463534242u + 7919u * p };
+                if (start_thread(&threads[p], bench_produce, &work[p]) != 0) {
+                    printf("Could not start producer thread.\n");
+                    exit(EXIT_FAILURE);
+                }
+            }
+            consume_readings(&running);
+            long long elapsed = now_nanos() - start;
+            for (int p = 0; p < producers; p++) {
+                pthread_join(threads[p], NULL);
+            }
+            
+            applied = ingest.applied - applied;
+            batches = ingest.batches - batches;
+            taken = ingest.applied + ingest.stale + ingest.unknown + ingest.bad_time - taken;
+            printf("%9d %6s %12.0f %12.0f %10lu %10lu %10.1f\n", producers, block ? "block" : "drop",
+                   (double)producers * readings_each * 1e9 / elapsed, (double)applied * 1e9 / elapsed,
+                   atomic_load(&ingest.dropped) - dropped, atomic_load(&ingest.stalls) - stalls,
+                   batches ? (double)taken / batches : 0.0);
+        }
+    }
+    return 0;
+}
+
+// Pop the oldest vehicle of a simulated queue, keeping its time-weighted length; returns its arrival time
+double sim_dequeue(SimQueue* queue, double now) {
+    queue->area += queue->count * (now - queue->changed);
+    queue->changed = now;
+    double arrived = queue->arrivals[queue->head];
+    queue->head = (queue->head + 1) % queue->capacity;
+    queue->count--;
+    return arrived;
+}
+
+// Append a vehicle to a simulated queue; returns 0 if memory ran out
+int sim_enqueue(SimQueue* queue, double now) {
+    if (queue->count == queue->capacity) {
+        int new_capacity = queue->capacity ? queue->capacity * 2 : 16;
+        double* grown = (double*)malloc(new_capacity * sizeof(double));
+        if (grown == NULL) {
+            return 0;
+        }
+        for (int i = 0; i < queue->count; i++) {
+            grown[i] = queue->arrivals[(queue->head + i) % queue->capacity];
+        }
+        free(queue->arrivals);
+        queue->arrivals = grown;
+        queue->head = 0;
+        queue->capacity = new_capacity;
+    }
+    queue->area += queue->count * (now - queue->changed);
+    queue->changed = now;
+    queue->arrivals[(queue->head + queue->count) % queue->capacity] = now;
+    queue->count++;
+    if (queue->count > queue->longest) {
+        queue->longest = queue->count;
+    }
+    return 1;
+}
+
+// True if event a happens before event b; ties keep scheduling order so runs are reproducible
+int sim_before(const SimEvent* a, const SimEvent* b) {
+    return a->time < b->time || (a->time == b->time && a->order < b->order);
+}
+
+// Schedule an event; returns 0 if memory ran out
+int sim_schedule(SimRun* run, double time, int type, int target) {
+    if (run->event_count == run->event_capacity) {
+        int new_capacity = run->event_capacity ? run->event_capacity * 2 : 1024;
+        SimEvent* grown = (SimEvent*)realloc(run->events, new_capacity * sizeof(SimEvent));
+        if (grown == NULL) {
+            return 0;
+        }
+        run->events = grown;
+        run->event_capacity = new_capacity;
+    }
+    SimEvent event = { time, run->next_order++, type, target };
+    int index = run->event_count++;
+    while (index > 0 && sim_before(&event, &run->events[(index - 1) / 2])) {
+        run->events[index] = run->events[(index - 1) / 2];
+        index = (index - 1) / 2;
+    }
+    run->events[index] = event;
+    return 1;
+}
+
+// Remove and return the earliest event
+SimEvent sim_next_event(SimRun* run) {
+    SimEvent first = run->events[0];
+    SimEvent last = run->events[--run->event_count];
+    int index = 0;
+    while (1) {
+        int child = 2 * index + 1;
+        if (child >= run->event_count) {
+            break;
+        }
+        if (child + 1 < run->event_count && sim_before(&run->events[child + 1], &run->events[child])) {
+            child++;
+        }
+        if (!sim_before(&run->events[child], &last)) {
+            break;
+        }
+        run->events[index] = run->events[child];
+        index = child;
+    }
+    run->events[index] = last;
+    return first;
+}
+
+// Uniform random number in [0, 1) from the run's xorshift generator
+double sim_random(SimRun* run) {
+    run->rng ^= run->rng << 13;
+    run->rng ^= run->rng >> 7;
+    run->rng ^= run->rng << 17;
+    return (run->rng >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// Seconds until the next arrival of a Poisson stream whose peak rate is scaled by the hour of day
+double sim_interarrival(SimRun* run, double peak_rate) {
+    static const double hourly[24] = { 0.10, 0.08, 0.06, 0.06, 0.10, 0.25, 0.55, 0.90, 1.00, 0.75, 0.60, 0.60,
+                                       0.65, 0.60, 0.60, 0.70, 0.90, 1.00, 0.85, 0.60, 0.45, 0.35, 0.25, 0.15 };
+    double rate = peak_rate * hourly[(int)(run->now / 3600) % 24];
+    return -log(1.0 - sim_random(run)) / rate;
+}
+
+// True if the intersection's current signal state serves a non-empty queue
+int sim_has_work(const SimIntersection* node) {
+    if (node->signal.state == RED) {
+        return node->cross.count > 0;
+    }
+    for (int lane = 0; lane < SIM_LANES; lane++) {
+        if (node->lanes[lane].count > 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Start releasing vehicles if the signal serves a waiting queue and no departure is pending
+int sim_start_service(SimRun* run, int target) {
+    SimIntersection* node = &run->city[target];
+    if (node->serving || !sim_has_work(node)) {
+        return 1;
+    }
+    node->serving = 1;
+    return sim_schedule(run, run->now, SIM_DEPARTURE, target);
+}
+
+// Record how long a departing vehicle waited
+void sim_record_wait(SimRun* run, double wait, int cross) {
+    int bucket = wait < SIM_WAIT_BUCKETS - 1 ? (int)wait : SIM_WAIT_BUCKETS - 1;
+    run->wait_histogram[bucket]++;
+    if (cross) {
+        run->served_cross++;
+        run->wait_cross += wait;
+    } else {
+        run->served_main++;
+        run->wait_main += wait;
+    }
+}
+
+// Apply one event to the simulated city; returns 0 if memory ran out
+int sim_handle(SimRun* run, const SimEvent* event) {
+    int target = event->type == SIM_ARRIVAL ? event->target / SIM_LANES : event->target;
+    SimIntersection* node = &run->city[target];
+    
+    switch (event->type) {
+        case SIM_ARRIVAL: {
+            run->arrived++;
+            if (!sim_enqueue(&node->lanes[event->target % SIM_LANES], run->now)) return 0;
+            double next = run->now + sim_interarrival(run, SIM_MAIN_PEAK_RATE * node->demand);
+            return sim_schedule(run, next, SIM_ARRIVAL, event->target) && sim_start_service(run, target);
+        }
+        
+        case SIM_CROSS_ARRIVAL: {
+            run->arrived++;
+            if (!sim_enqueue(&node->cross, run->now)) return 0;
+            double next = run->now + sim_interarrival(run, SIM_CROSS_PEAK_RATE * node->demand);
+            return sim_schedule(run, next, SIM_CROSS_ARRIVAL, target) && sim_start_service(run, target);
+        }
+        
+        case SIM_DEPARTURE:
+            // Green and yellow release the head of every sensed lane, red releases the cross street
+            if (node->signal.state == RED) {
+                if (node->cross.count > 0) {
+                    sim_record_wait(run, run->now - sim_dequeue(&node->cross, run->now), 1);
+                }
+            } else {
+                for (int lane = 0; lane < SIM_LANES; lane++) {
+                    if (node->lanes[lane].count > 0) {
+                        sim_record_wait(run, run->now - sim_dequeue(&node->lanes[lane], run->now), 0);
+                    }
+                }
+            }
+            if (!sim_has_work(node)) {
+                node->serving = 0;
+                return 1;
+            }
+            return sim_schedule(run, run->now + (node->signal.state == RED ? SIM_CROSS_HEADWAY : SIM_MAIN_HEADWAY),
+                                SIM_DEPARTURE, target);
+        
+        case SIM_SENSOR_REPORT:
+            // Loop detectors report the vehicles queued on their lane; the signal sees the window average as in update_signal
+            for (int lane = 0; lane < SIM_LANES; lane++) {
+                TrafficSensor* sensor = &node->sensors[lane];
+                sensor->vehicle_count = node->lanes[lane].count;
+                sensor->last_update = (time_t)run->now;
+                record_window(sensor, sensor->vehicle_count, sensor->last_update);
+                sensor->average_count = window_average(sensor, sensor->last_update);
+            }
+            return sim_schedule(run, run->now + SIM_SENSOR_PERIOD, SIM_SENSOR_REPORT, target);
+        
+        case SIM_PHASE_END: {
+            int counts[SIM_LANES];
+            for (int lane = 0; lane < SIM_LANES; lane++) {
+                int count = node->sensors[lane].average_count;
+                int i = lane;
+                for (; i > 0 && counts[i - 1] > count; i--) {
+                    counts[i] = counts[i - 1];
+                }
+                counts[i] = count;
+            }
+            int median = SIM_LANES % 2 ? counts[SIM_LANES / 2]
+                                       : (counts[SIM_LANES / 2 - 1] + counts[SIM_LANES / 2]) / 2;
+            apply_policy(run->policy, &node->signal, SIM_LANES, median);
+            return sim_schedule(run, run->now + node->signal.duration, SIM_PHASE_END, target) &&
+                   sim_start_service(run, target);
+        }
+    }
+    return 1;
+}
+
+// Simulate one city under one policy for run->duration virtual seconds
+void run_simulation(SimRun* run) {
+    long long start = now_nanos();
+    run->city = (SimIntersection*)calloc(run->intersections, sizeof(SimIntersection));
+    run->failed = run->city == NULL;
+    run->now = 0;
+    
+    for (int i = 0; i < run->intersections && !run->failed; i++) {
+        SimIntersection* node = &run->city[i];
+        node->signal = (TrafficSignal){ RED, run->policy->idle_seconds };
+        node->demand = 0.5 + sim_random(run); // Some intersections are busier than others
+        for (int lane = 0; lane < SIM_LANES; lane++) {
+            node->sensors[lane].id = i * SIM_LANES + lane + 1;
+            if (!sim_schedule(run, sim_interarrival(run, SIM_MAIN_PEAK_RATE * node->demand), SIM_ARRIVAL,
+                              i * SIM_LANES + lane)) {
+                run->failed = 1;
+            }
+        }
+        // Stagger phases and reports so intersections do not switch in lockstep
+        if (!sim_schedule(run, sim_interarrival(run, SIM_CROSS_PEAK_RATE * node->demand), SIM_CROSS_ARRIVAL, i) ||
+            !sim_schedule(run, sim_random(run) * SIM_SENSOR_PERIOD, SIM_SENSOR_REPORT, i) ||
+            !sim_schedule(run, sim_random(run) * run->policy->idle_seconds, SIM_PHASE_END, i)) {
+            run->failed = 1;
+        }
+    }
+    
+    while (!run->failed && run->event_count > 0 && run->events[0].time < run->duration) {
+        SimEvent event = sim_next_event(run);
+        run->now = event.time;
+        run->events_handled++;
+        if (!sim_handle(run, &event)) {
+            run->failed = 1;
+        }
+    }
+    
+    // Close the queue-length integrals at the end of the day and release the city
+    for (int i = 0; run->city && i < run->intersections; i++) {
+        for (int lane = 0; lane < SIM_LANES; lane++) {
+            SimQueue* queue = &run->city[i].lanes[lane];
+            queue->area += queue->count * (run->duration - queue->changed);
+            run->queue_area += queue->area;
+            run->left_waiting += queue->count;
+            if (queue->longest > run->longest_queue) {
+                run->longest_queue = queue->longest;
+            }
+            free(queue->arrivals);
+        }
+        run->left_waiting += run->city[i].cross.count;
+        free(run->city[i].cross.arrivals);
+    }
+    free(run->city);
+    free(run->events);
+    run->city = NULL;
+    run->events = NULL;
+    run->wall_nanos = now_nanos() - start;
+}
+
+// Pool task: simulate runs [begin, end)
+void simulate_range(int begin, int end, void* arg) {
+    SimRun* runs = (SimRun*)arg;
+    for (int i = begin; i < end; i++) {
+        run_simulation(&runs[i]);
+    }
+}
+
+// Simulate every policy over several seeds in parallel and compare queues and waits
+int run_policy_simulation(int intersection_total, double hours, int seeds) {
+    static const SignalPolicy policies[] = {
+        { "current",       0, 10, 5, 45, 5, 20, 30 },
+        { "fixed-time",    1,  0, 0, 30, 5, 30, 30 },
+        { "short-green",   0, 10, 5, 30, 5, 20, 30 },
+        { "low-threshold", 0,  6, 3, 45, 5, 20, 30 },
+        { "long-red",      0, 10, 5, 45, 5, 30, 30 },
+    };
+    int policy_count = (int)(sizeof(policies) / sizeof(policies[0]));
+    if (intersection_total < 1 || hours <= 0 || seeds < 1) {
+        printf("Usage: --simulate [intersections] [hours] [runs per policy]\n");
+        return 1;
+    }
+    
+    int run_count = policy_count * seeds;
+    SimRun* runs = (SimRun*)calloc(run_count, sizeof(SimRun));
+    if (runs == NULL) {
+        printf("Memory allocation failed for %d simulation runs\n", run_count);
+        return 1;
+    }
+    for (int i = 0; i < run_count; i++) {
+        runs[i].policy = &policies[i / seeds];
+        runs[i].intersections = intersection_total;
+        runs[i].duration = hours * 3600;
+        runs[i].rng = 0x9E3779B97F4A7C15ULL * (unsigned long long)(i % seeds + 1); // Same seeds for every policy
+    }
+    
+    long long start = now_nanos();
+    run_parallel(run_count, 1, simulate_range, runs);
+    double wall = (now_nanos() - start) / 1e9;
+    
+    printf("%d intersections x %d sensed lanes + cross street, %.1f h, %d runs per policy\n",
+           intersection_total, SIM_LANES, hours, seeds);
+    printf("%-14s %10s %10s %10s %9s %10s %10s %10s\n", "policy", "vehicles", "main wait", "cross wait",
+           "p95 wait", "avg queue", "max queue", "left");
+    for (int p = 0; p < policy_count; p++) {
+        unsigned long long served_main = 0, served_cross = 0, left = 0, histogram[SIM_WAIT_BUCKETS] = { 0 };
+        double wait_main = 0, wait_cross = 0, area = 0;
+        int longest = 0;
+        for (int s = 0; s < seeds; s++) {
+            SimRun* run = &runs[p * seeds + s];
+            if (run->failed) {
+                printf("Memory allocation failed during a %s run\n", run->policy->name);
+                free(runs);
+                return 1;
+            }
+            served_main += run->served_main;
+            served_cross += run->served_cross;
+            wait_main += run->wait_main;
+            wait_cross += run->wait_cross;
+            area += run->queue_area;
+            left += run->left_waiting;
+            if (run->longest_queue > longest) longest = run->longest_queue;
+            for (int b = 0; b < SIM_WAIT_BUCKETS; b++) histogram[b] += run->wait_histogram[b];
+        }
+        unsigned long long served = served_main + served_cross, seen = 0;
+        int p95 = 0;
+        while (p95 < SIM_WAIT_BUCKETS - 1 && (seen += histogram[p95]) < served * 0.95) p95++;
+        printf("%-14s %10llu %9.1fs %9.1fs %8ds %10.2f %10d %10llu\n", policies[p].name, served / seeds,
+               served_main ? wait_main / served_main : 0.0, served_cross ? wait_cross / served_cross : 0.0, p95,
+               area / ((double)seeds * intersection_total * SIM_LANES * hours * 3600), longest, left / seeds);
+    }
+    
+    unsigned long long events = 0;
+    double busy = 0;
+    for (int i = 0; i < run_count; i++) {
+        events += runs[i].events_handled;
+        busy += runs[i].wall_nanos / 1e9;
+    }
+    printf("%d runs, %.2f s wall (%.2f s per run, %.0f events/s, %.0fx real time per run)\n", run_count, wall,
+           busy / run_count, events / busy, hours * 3600 / (busy / run_count));
+    free(runs);
+    return 0;
+}
+
+// Feed a recorded trace back through the same functions that recorded it.
+// speed 0 replays as fast as possible; otherwise trace seconds pass speed times faster than real time.
+int replay_trace(const char* path, double speed) {
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(TraceHeader)) {
+        printf("Could not open trace file %s.\n", path);
+        if (fd >= 0) close(fd);
+        return 1;
+    }
+    const unsigned char* map = (const unsigned char*)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED || memcmp(((const TraceHeader*)map)->magic, TRACE_MAGIC, 8) != 0) {
+        printf("%s is not a trace file.\n", path);
+        if (map != MAP_FAILED) munmap((void*)map, st.st_size);
+        return 1;
+    }
+    size_t used = ((const TraceHeader*)map)->used;
+    if (used > (size_t)st.st_size) {
+        used = (size_t)st.st_size; // A writer that crashed before trimming
+    }
+    
+    LightState* previous = NULL;
+    int previous_count = 0;
+    unsigned long long records = 0, skipped = 0, changes = 0;
+    uint64_t digest = 1469598103934665603ULL; // FNV-1a over every signal state, once per trace second
+    int64_t now = 0, first = 0, latest = 0, second = 0;
+    long long wall_start = now_nanos();
+    time_t recorded_by = time(NULL); // A trace cannot hold times later than this, give or take clock skew
+    int damaged = 0;
+    
+    size_t pos = sizeof(TraceHeader);
+    while (!damaged && pos + sizeof(TraceBlockHeader) <= used) {
+        TraceBlockHeader block;
+        memcpy(&block, map + pos, sizeof(block));
+        size_t ops = pos + sizeof(block);
+        size_t ids = ops + block.records;
+        size_t times = ids + block.id_bytes;
+        size_t counts = times + block.time_bytes;
+        size_t end = counts + block.count_bytes;
+        if (end > used) {
+            printf("Trace is truncated; stopping at byte %zu.\n", pos);
+            break;
+        }
+        
+        for (uint32_t r = 0; r < block.records; r++) {
+            int op = map[ops + r];
+            int id = (int)unzigzag(get_varint(map, times, &ids));
+            int64_t when = (int64_t)((uint64_t)now + (uint64_t)unzigzag(get_varint(map, counts, &times))); // wraps, not overflows
+            int count = (int)get_varint(map, end, &counts);
+            // Times are deltas, so every record after a corrupt one is off too
+            if (!plausible_time(when, recorded_by)) {
+                printf("Trace has an impossible time (%lld) in record %llu; stopping.\n", (long long)when, records);
+                damaged = 1;
+                break;
+            }
+            now = when;
+            if (records == 0) {
+                first = latest = second = now;
+            }
+            if (now > latest) {
+                latest = now;
+            }
+            
+            // Once per trace second, recompute the signals and fold them into the digest
+            if (now > second) {
+                update_all_signals((time_t)second);
+                if (intersection_count > previous_count) {
+                    LightState* grown = (LightState*)realloc(previous, intersection_count * sizeof(LightState));
+                    if (grown == NULL) {
+                        printf("Memory allocation failed during replay\n");
+                        free(previous);
+                        munmap((void*)map, st.st_size);
+                        return 1;
+                    }
+                    for (int i = previous_count; i < intersection_count; i++) grown[i] = intersections[i].signal.state;
+                    previous = grown;
+                    previous_count = intersection_count;
+                }
+                for (int i = 0; i < intersection_count; i++) {
+                    changes += intersections[i].signal.state != previous[i];
+                    previous[i] = intersections[i].signal.state;
+                    digest = (digest ^ (uint64_t)(intersections[i].signal.state * 64 + intersections[i].signal.duration))
+                             * 1099511628211ULL;
+                }
+                second = now;
+                if (speed > 0) {
+                    long long due = wall_start + (long long)((now - first) * 1e9 / speed);
+                    long long wait = due - now_nanos();
+                    if (wait > 0) {
+                        struct timespec pause = { wait / 1000000000LL, wait % 1000000000LL };
+                        nanosleep(&pause, NULL);
+                    }
+                }
+            }
+            
+            records++;
+            if (op == TRACE_INTERSECTION) {
+                if (add_intersection() < 0) skipped++;
+            } else if (op == TRACE_CREATE) {
+                Intersection* owner = find_intersection(count);
+                if (owner == NULL || find_sensor(id) || add_sensor(id, owner, (time_t)now) < 0) skipped++;
+            } else if (op == TRACE_UPDATE) {
+                TrafficSensor* sensor = find_sensor(id);
+                if (sensor) set_vehicle_count((int)(sensor - sensors), count, (time_t)now);
+                else skipped++;
+            } else if (op == TRACE_DELETE) {
+                if (find_sensor(id)) remove_sensor(find_slot(id), (time_t)now);
+                else skipped++;
+            } else {
+                skipped++;
+            }
+        }
+        pos = end;
+    }
+    update_all_signals((time_t)now);
+    
+    double wall = (now_nanos() - wall_start) / 1e9;
+    int states[3] = { 0, 0, 0 };
+    for (int i = 0; i < intersection_count; i++) {
+        states[intersections[i].signal.state]++;
+        digest = (digest ^ (uint64_t)(intersections[i].signal.state * 64 + intersections[i].signal.duration)) * 1099511628211ULL;
+    }
+    printf("Replayed %llu records (%zu bytes, %.2f bytes/record) covering %lld s in %.3f s (%.0f records/s)\n",
+           records, used, records ? (double)used / records : 0.0, (long long)(latest - first), wall,
+           wall > 0 ? records / wall : 0.0);
+    if (skipped > 0) {
+        printf("Skipped %llu records that did not apply\n", skipped);
+    }
+    printf("%d intersections, %d sensors: %d green, %d yellow, %d red; %llu signal changes\n", intersection_count,
+           sensor_count, states[GREEN], states[YELLOW], states[RED], changes);
+    printf("Signal digest: %016llx\n", (unsigned long long)digest);
+    
+    free(previous);
+    munmap((void*)map, st.st_size);
+    return 0;
+}
+
+// The median as calculate_median computed it before the heaps: copy, exchange-sort, pick the middle
+int bubble_sort_median(const int* source, int* counts, int n) {
+    memcpy(counts, source, n * sizeof(int));
+    for (int j = 0; j < n - 1; j++) {
+        for (int k = j + 1; k < n; k++) {
+            if (counts[j] > counts[k]) {
+                int temp = counts[j];
+                counts[j] = counts[k];
+                counts[k] = temp;
+            }
+        }
+    }
+    if (n % 2 == 0)
+        return (counts[n/2 - 1] + counts[n/2]) / 2;
+    else
+        return counts[n/2];
+}
+
+int compare_counts(const void* a, const void* b) {
+    int x = *(const int*)a, y = *(const int*)b;
+    return (x > y) - (x < y);
+}
+
+// Compare the median kernels with bubble sort and qsort for 1e3 .. max_n sensors
+int run_median_benchmark(int max_n) {
+    const CountKernels* kernel_sets[] = {
+        &scalar_kernels,
+#ifdef COUNT_KERNELS_X86
+        &sse41_kernels, &avx2_kernels,
+#endif
+    };
+    int kernel_count = (int)(sizeof(kernel_sets) / sizeof(kernel_sets[0]));
+    if (max_n < 1000) {
+        printf("Usage: --bench-median [max sensors, at least 1000]\n");
+        return 1;
+    }
+    int* source = (int*)malloc((size_t)max_n * sizeof(int));
+    int* scratch = (int*)malloc((size_t)max_n * sizeof(int));
+    if (source == NULL || scratch == NULL) {
+        printf("Memory allocation failed for %d counts\n", max_n);
+        free(source);
+        free(scratch);
+        return 1;
+    }
+    
+    printf("Median kernels in use: %s (bubble sort only up to 10000 sensors)\n", count_kernels()->name);
+    printf("%9s %10s %12s %10s", "sensors", "counts", "bubble ms", "qsort ms");
+    for (int k = 0; k < kernel_count; k++) {
+        if (kernels_supported(kernel_sets[k])) printf(" %9s ms", kernel_sets[k]->name);
+    }
+    printf(" %9s\n", "vs bubble");
+    
+    unsigned int x = 12345;
+    for (int wide = 0; wide <= 1; wide++) {
+        for (int n = 1000; n <= max_n; n *= 10) {
+            for (int i = 0; i < n; i++) {
+                x ^= x << 13; x ^= x >> 17; x ^= x << 5;
+                source[i] = wide ? (int)(x >> 1) : (int)(x % 50);
+            }
+            int reps = n <= 100000 ? 5 : 2;
+            
+            long long bubble = -1;
+            int expected;
+            if (n <= 10000) {
+                long long start = now_nanos();
+                expected = bubble_sort_median(source, scratch, n);
+                bubble = now_nanos() - start;
+            }
+            long long sorted = -1;
+            for (int r = 0; r < reps; r++) {
+                long long start = now_nanos();
+                memcpy(scratch, source, n * sizeof(int));
+                qsort(scratch, n, sizeof(int), compare_counts);
+                expected = (int)(n % 2 ? scratch[n / 2] : ((long long)scratch[n / 2 - 1] + scratch[n / 2]) / 2);
+                long long elapsed = now_nanos() - start;
+                if (sorted < 0 || elapsed < sorted) sorted = elapsed;
+            }
+            
+            printf("%9d %10s ", n, wide ? "0-2^31" : "0-49");
+            if (bubble >= 0) printf("%12.3f", bubble / 1e6);
+            else printf("%12s", "-");
+            printf(" %10.3f", sorted / 1e6);
+            
+            long long fastest = -1;
+            for (int k = 0; k < kernel_count; k++) {
+                if (!kernels_supported(kernel_sets[k])) continue;
+                long long best = -1;
+                for (int r = 0; r < reps; r++) {
+                    long long start = now_nanos();
+                    int median = median_with(kernel_sets[k], source, n);
+                    long long elapsed = now_nanos() - start;
+                    if (median != expected) {
+                        printf("\n%s median %d, expected %d\n", kernel_sets[k]->name, median, expected);
+                        free(source);
+                        free(scratch);
+                        return 1;
+                    }
+                    if (best < 0 || elapsed < best) best = elapsed;
+                }
+                printf(" %12.3f", best / 1e6);
+                if (fastest < 0 || best < fastest) fastest = best;
+            }
+            if (bubble >= 0) printf(" %8.0fx\n", (double)bubble / fastest);
+            else printf(" %9s\n", "-");
+        }
     }
+    free(source);
+    free(scratch);
+    return 0;
 }
 
-int main() {
+int main(int argc, char* argv[]) {
+    if (argc > 1 && strcmp(argv[1], "--bench-median") == 0) {
+        return run_median_benchmark(argc > 2 ? atoi(argv[2]) : 10000000);
+    }
+    if (argc > 1 && strcmp(argv[1], "--simulate") == 0) {
+        atexit(cleanup_resources);
+        return run_policy_simulation(argc > 2 ? atoi(argv[2]) : 200, argc > 3 ? atof(argv[3]) : 24,
+                                     argc > 4 ? atoi(argv[4]) : 2);
+    }
+    if (argc > 1 && strcmp(argv[1], "--bench-ingest") == 0) {
+        atexit(cleanup_resources);
+        return run_ingest_benchmark(argc > 2 ? atoi(argv[2]) : 4, argc > 3 ? atoi(argv[3]) : 1000000,
+                                    argc > 4 ? atoi(argv[4]) : 100000);
+    }
+    if (argc > 1 && strcmp(argv[1], "--bench-signals") == 0) {
+        atexit(cleanup_resources);
+        return run_signal_benchmark(argc > 2 ? atoi(argv[2]) : 100000, argc > 3 ? atoi(argv[3]) : 16,
+                                    argc > 4 ? atoi(argv[4]) : 0);
+    }
+    
+    if (argc > 1 && strcmp(argv[1], "--replay") == 0 && argc > 2) {
+        atexit(cleanup_resources);
+        return replay_trace(argv[2], argc > 3 ? atof(argv[3]) : 0);
+    }
+    if (argc > 2 && strcmp(argv[1], "--trace") == 0 && !open_trace(argv[2])) {
+        return 1;
+    }
+    
     printf("Welcome to the Traffic Light Management System\n");
     printf("--------------------------------------------\n");
     
-    // Set up signal handler to ensure cleanup on unexpected termination
+    // Cleanup runs on exit, including after SIGINT/SIGTERM at a prompt, so the trace is closed and trimmed
     atexit(cleanup_resources);
+    install_stop_handler();
     
     menu(); // Start input handling loop
     return 0;